@@ -1,7 +1,137 @@
 #include "pch.h"
 
-#include "../VolumetricFusion/Voxelgrid.hpp"
+#include <random>
 
-TEST(TestCaseName, TestName) {
-	vc::
-}
\ No newline at end of file
+#include "../VolumetricFusion/DepthPyramid.hpp"
+#include "../VolumetricFusion/DepthCodec.hpp"
+
+namespace {
+	// The plane z = PLANE_DEPTH + PLANE_SLOPE * x in camera space, in meters
+	const float PLANE_DEPTH = 1.5f;
+	const float PLANE_SLOPE = 0.3f;
+	// Fine enough that the quantization of the depth stays far below the tolerances
+	const float DEPTH_SCALE = 0.0001f;
+	// Not a multiple of the vector width, so the scalar tails run as well
+	const int WIDTH = 90;
+	const int HEIGHT = 64;
+	// Padding at the end of every row, filled with the largest depth
+	const int ROW_PADDING = 14;
+
+	rs2_intrinsics planeIntrinsics() {
+		rs2_intrinsics intrinsics = {};
+		intrinsics.width = WIDTH;
+		intrinsics.height = HEIGHT;
+		intrinsics.fx = 80.0f;
+		intrinsics.fy = 80.0f;
+		intrinsics.ppx = 44.5f;
+		intrinsics.ppy = 31.5f;
+		return intrinsics;
+	}
+
+	/// <summary>
+	/// The Z16 image of the plane, the ray of pixel (u, v) meets it at z = PLANE_DEPTH / (1 - PLANE_SLOPE * (u - ppx) / fx).
+	/// </summary>
+	std::vector<uint16_t> renderPlane(const rs2_intrinsics& intrinsics, int stride) {
+		std::vector<uint16_t> depth((size_t)stride * intrinsics.height, UINT16_MAX);
+		for (int v = 0; v < intrinsics.height; v++) {
+			for (int u = 0; u < intrinsics.width; u++) {
+				const float z = PLANE_DEPTH / (1 - PLANE_SLOPE * (u - intrinsics.ppx) / intrinsics.fx);
+				depth[(size_t)v * stride + u] = (uint16_t)std::lround(z / DEPTH_SCALE);
+			}
+		}
+		return depth;
+	}
+
+	/// <summary>
+	/// Encodes depth into a buffer of exactly getRVLBound() bytes and expects to decode the same values from it.
+	/// </summary>
+	void expectRVLRoundTrip(const std::vector<uint16_t>& depth) {
+		std::vector<uint8_t> encoded(vc::capture::getRVLBound(depth.size()));
+		const size_t encodedBytes = vc::capture::encodeRVL(depth.data(), depth.size(), encoded.data());
+		ASSERT_LE(encodedBytes, encoded.size()) << depth.size() << " pixels";
+		ASSERT_EQ(encodedBytes % 4, 0u) << depth.size() << " pixels";
+
+		std::vector<uint16_t> decoded(depth.size(), 1);
+		ASSERT_TRUE(vc::capture::decodeRVL(encoded.data(), encodedBytes, decoded.data(), decoded.size())) << depth.size() << " pixels";
+		ASSERT_EQ(decoded, depth) << depth.size() << " pixels";
+
+		// One word short always misses pixels, the last word holds at least one nibble
+		if (encodedBytes > 0) {
+			ASSERT_FALSE(vc::capture::decodeRVL(encoded.data(), encodedBytes - 4, decoded.data(), decoded.size())) << depth.size() << " pixels";
+		}
+	}
+}
+
+TEST(DepthCodec, RVLRoundTrip) {
+	std::mt19937 random(42);
+	std::uniform_int_distribution<int> anyDepth(1, UINT16_MAX);
+	std::uniform_int_distribution<int> runLength(0, 40);
+
+	// Lengths around and not a multiple of the 16 pixels compared at once
+	std::vector<size_t> lengths = { 0, 1, 2, 15, 16, 17, 31, 33, 255, 256, 257, 1001 };
+	for (const size_t length : lengths) {
+		// Only invalid pixels, a single run
+		expectRVLRoundTrip(std::vector<uint16_t>(length, 0));
+		// Only valid pixels, the largest value
+		expectRVLRoundTrip(std::vector<uint16_t>(length, UINT16_MAX));
+
+		// Alternating between 0 and the full range, the largest differences and the shortest runs
+		std::vector<uint16_t> alternating(length);
+		for (size_t i = 0; i < length; i++) {
+			alternating[i] = i % 4 == 0 ? 0 : (i % 2 == 0 ? 1 : UINT16_MAX);
+		}
+		expectRVLRoundTrip(alternating);
+
+		// Single invalid and valid pixels in turn, the most run lengths per pixel
+		std::vector<uint16_t> checkerboard(length);
+		for (size_t i = 0; i < length; i++) {
+			checkerboard[i] = i % 2 == 0 ? 0 : (uint16_t)anyDepth(random);
+		}
+		expectRVLRoundTrip(checkerboard);
+
+		// Random runs of invalid and valid pixels
+		std::vector<uint16_t> runs(length);
+		for (size_t i = 0; i < length;) {
+			const bool valid = random() % 2 == 0;
+			for (size_t end = std::min(length, i + runLength(random)); i < end; i++) {
+				runs[i] = valid ? (uint16_t)anyDepth(random) : 0;
+			}
+		}
+		expectRVLRoundTrip(runs);
+	}
+}
+
+TEST(DepthPyramid, PlaneVerticesAndNormals) {
+	const rs2_intrinsics intrinsics = planeIntrinsics();
+	const int stride = WIDTH + ROW_PADDING;
+	const std::vector<uint16_t> depth = renderPlane(intrinsics, stride);
+
+	vc::processing::DepthPyramid pyramid;
+	pyramid.build(depth.data(), stride, intrinsics, DEPTH_SCALE);
+
+	// Facing the camera, so pointing to -z
+	const Eigen::Vector3f expectedNormal = Eigen::Vector3f(PLANE_SLOPE, 0, -1).normalized();
+
+	for (int index = 0; index < pyramid.getNumLevels(); index++) {
+		const vc::processing::PyramidLevel& level = pyramid.getLevel(index);
+		ASSERT_EQ(level.width, WIDTH >> index);
+		ASSERT_EQ(level.height, HEIGHT >> index);
+
+		// The bilateral filter only sees one side of the plane at the border, and the last row and column have no normals
+		const int border = vc::processing::BILATERAL_RADIUS;
+		for (int y = border; y < level.height - 1 - border; y++) {
+			for (int x = border; x < level.width - 1 - border; x++) {
+				const size_t i = (size_t)y * level.width + x;
+				const Eigen::Vector3f vertex(level.vertexX[i], level.vertexY[i], level.vertexZ[i]);
+				const Eigen::Vector3f normal(level.normalX[i], level.normalY[i], level.normalZ[i]);
+
+				ASSERT_FLOAT_EQ(vertex.z(), level.depth[i]) << "level " << index << " at " << x << ", " << y;
+				const Eigen::Vector3f ray = (level.camera->cam2world.cast<float>() * Eigen::Vector3f((float)x, (float)y, 1));
+				ASSERT_LT((vertex - ray * level.depth[i]).norm(), 1e-5f) << "level " << index << " at " << x << ", " << y;
+				// Rows read without the stride would be shifted against each other and contain the padding
+				ASSERT_NEAR(vertex.z(), PLANE_DEPTH + PLANE_SLOPE * vertex.x(), 1e-3f) << "level " << index << " at " << x << ", " << y;
+				ASSERT_GT(normal.dot(expectedNormal), 0.999f) << "level " << index << " at " << x << ", " << y;
+			}
+		}
+	}
+}
@@ -0,0 +1,381 @@
+#pragma once
+
+#ifndef _CPU_INTEGRATION_HEADER
+#define _CPU_INTEGRATION_HEADER
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include "ceres/ceres.h"
+#include "Structs.hpp"
+#include "Simd.hpp"
+#include "ThreadPool.hpp"
+
+namespace vc::fusion {
+	enum class IntegrationBackend {
+		GPU,
+		CPU
+	};
+
+	/// <summary>
+	/// The geometry of a dense voxelgrid as the integration kernels need it.
+	/// </summary>
+	struct GridDescription {
+		Eigen::Vector3i sizeNormalized;
+		Eigen::Vector3f minCorner;
+		float resolution;
+		float truncationDistance;
+
+		int hashFunc(int x, int y, int z) const {
+			return z * sizeNormalized[1] * sizeNormalized[0] + y * sizeNormalized[0] + x;
+		}
+	};
+
+	/// <summary>
+	/// A depth and color frame together with the camera it was taken with.
+	/// Only raw pointers are kept, the owner of the frames has to keep them alive during the integration.
+	/// </summary>
+	struct IntegrationFrame {
+		const uint16_t* depth = nullptr;
+		int depthWidth = 0;
+		int depthHeight = 0;
+		float depthScale = 0;
+
+		const uint8_t* color = nullptr;
+		int colorWidth = 0;
+		int colorHeight = 0;
+
+		Eigen::Matrix3f world2CameraProjection;
+		Eigen::Matrix4f worldToCamera;
+		// The color pixel of the depth pixel (u, v) at depth z is depthToColorProjection * (u, v, 1) + depthToColorOffset / z,
+		// before the perspective division. The identity for depth that is aligned to the color.
+		Eigen::Matrix3f depthToColorProjection = Eigen::Matrix3f::Identity();
+		Eigen::Vector3f depthToColorOffset = Eigen::Vector3f::Zero();
+
+		// The depth is thresholded at this distance, 0 if it is unbounded
+		float maxDepth = 0;
+
+		bool isValid() const {
+			return depth && color && depthWidth > 0 && depthHeight > 0 && colorWidth > 0 && colorHeight > 0;
+		}
+	};
+
+	/// <summary>
+	/// An axis aligned box of voxel indices, min is inclusive and max is exclusive.
+	/// </summary>
+	struct VoxelRange {
+		Eigen::Vector3i min = Eigen::Vector3i::Zero();
+		Eigen::Vector3i max = Eigen::Vector3i::Zero();
+
+		bool isEmpty() const {
+			return (max.array() <= min.array()).any();
+		}
+
+		int numVoxels() const {
+			return isEmpty() ? 0 : (max - min).prod();
+		}
+
+		bool containsRow(int y, int z) const {
+			return y >= min[1] && y < max[1] && z >= min[2] && z < max[2];
+		}
+
+		void extend(const VoxelRange& other) {
+			if (other.isEmpty()) {
+				return;
+			}
+			if (isEmpty()) {
+				*this = other;
+				return;
+			}
+			min = min.cwiseMin(other.min);
+			max = max.cwiseMax(other.max);
+		}
+	};
+
+	/// <summary>
+	/// The voxels inside the bounding box of the view frustum of the frame, like get_frustum_bounds of tsdf-fusion/old-version/kinfu.cu.
+	/// The frustum reaches up to the maximal depth plus the truncation distance, the only voxels the frame can update.
+	/// </summary>
+	VoxelRange getFrustumBounds(const IntegrationFrame& frame, const GridDescription& grid) {
+		VoxelRange range;
+		range.max = grid.sizeNormalized;
+		if (frame.maxDepth <= 0) {
+			return range;
+		}
+
+		const Eigen::Matrix4f cameraToWorld = frame.worldToCamera.inverse();
+		const Eigen::Matrix3f rotation = cameraToWorld.block<3, 3>(0, 0);
+		const Eigen::Vector3f translation = cameraToWorld.block<3, 1>(0, 3);
+		const Eigen::Matrix3f inverseProjection = frame.world2CameraProjection.inverse();
+		const float farPlane = frame.maxDepth + grid.truncationDistance;
+
+		// The camera center and the four corners of the far plane
+		Eigen::Vector3f lower = translation;
+		Eigen::Vector3f upper = translation;
+		for (int corner = 0; corner < 4; corner++) {
+			const Eigen::Vector3f pixel((corner & 1) * frame.depthWidth, (corner >> 1) * frame.depthHeight, 1);
+			const Eigen::Vector3f point = rotation * (inverseProjection * pixel * farPlane) + translation;
+			lower = lower.cwiseMin(point);
+			upper = upper.cwiseMax(point);
+		}
+
+		for (int i = 0; i < 3; i++) {
+			range.min[i] = std::max(0, (int)std::floor((lower[i] - grid.minCorner[i]) / grid.resolution));
+			range.max[i] = std::min(grid.sizeNormalized[i], (int)std::ceil((upper[i] - grid.minCorner[i]) / grid.resolution) + 1);
+		}
+		return range;
+	}
+
+	/// <summary>
+	/// CPU implementation of shader/voxelgrid.comp.
+	/// Every z-slab is a task on the thread pool and the project/lookup/update loop over x is vectorized.
+	/// </summary>
+	class CPUIntegration {
+	private:
+		vc::utils::ThreadPool* pool;
+
+		// The weighted running average of shader/voxelgrid.comp
+		static void updateVoxel(vc::fusion::Voxel& voxel, float tsdf, float u, float v, float z, const IntegrationFrame& frame, float truncationDistance) {
+			const Eigen::Vector3f colorPixel = frame.depthToColorProjection * Eigen::Vector3f(u, v, 1) + frame.depthToColorOffset / z;
+			const float colorW = std::max(colorPixel[2], 1e-6f);
+			const int colorX = (int)std::clamp(colorPixel[0] / colorW, 0.0f, (float)(frame.colorWidth - 1));
+			const int colorY = (int)std::clamp(colorPixel[1] / colorW, 0.0f, (float)(frame.colorHeight - 1));
+			const uint8_t* rgb = frame.color + 3 * (colorY * frame.colorWidth + colorX);
+			const glm::vec4 color = glm::vec4(rgb[0], rgb[1], rgb[2], 255.0f) * (1.0f / 255.0f);
+
+			const float oldWeight = voxel.weight;
+			const float newWeight = oldWeight + 1;
+
+			voxel.setTsdf((voxel.getTsdf() * oldWeight + tsdf / truncationDistance) / newWeight);
+			voxel.setColor((voxel.getColor() * oldWeight + color) / newWeight);
+			voxel.weight = (uint16_t)std::min((int)newWeight, vc::fusion::Voxel::MAX_WEIGHT);
+		}
+
+		static void integrateVoxel(vc::fusion::Voxel& voxel, float px, float py, float pz, const IntegrationFrame& frame, float truncationDistance) {
+			if (pz <= 0.1f) {
+				return;
+			}
+
+			const float u = px / pz;
+			const float v = py / pz;
+			if (u < 0 || v < 0 || u >= frame.depthWidth || v >= frame.depthHeight) {
+				return;
+			}
+
+			const float realDepth = frame.depth[(int)v * frame.depthWidth + (int)u] * frame.depthScale;
+			if (realDepth <= 0) {
+				return;
+			}
+
+			const float tsdf = pz - realDepth;
+			if (std::abs(tsdf) > truncationDistance) {
+				return;
+			}
+
+			updateVoxel(voxel, tsdf, u, v, pz, frame, truncationDistance);
+		}
+
+	public:
+		CPUIntegration(vc::utils::ThreadPool* pool = &vc::utils::sharedThreadPool()) : pool(pool) {}
+
+		/// <summary>
+		/// Integrates sizeX consecutive voxels along the world x axis, the first one centered at rowStart.
+		/// Used by the dense grid for its rows and by the sparse grid for the rows of its bricks.
+		/// </summary>
+		static void integrateRow(vc::fusion::Voxel* row, int sizeX, const Eigen::Vector3f& rowStart, float resolution, float truncationDistance,
+			const IntegrationFrame& frame, const Eigen::Matrix3f& rotation, const Eigen::Vector3f& translation) {
+			// The voxel positions along x are affine in x, so are their projections.
+			const Eigen::Vector3f p0 = frame.world2CameraProjection * (rotation * rowStart + translation);
+			const Eigen::Vector3f dp = frame.world2CameraProjection * (rotation.col(0) * resolution);
+
+			int x = 0;
+
+#if defined(VC_USE_AVX2)
+			const int lastPixel = frame.depthWidth * frame.depthHeight - 1;
+			const __m256 laneOffsets = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+			const __m256 p0x = _mm256_set1_ps(p0[0]), p0y = _mm256_set1_ps(p0[1]), p0z = _mm256_set1_ps(p0[2]);
+			const __m256 dpx = _mm256_set1_ps(dp[0]), dpy = _mm256_set1_ps(dp[1]), dpz = _mm256_set1_ps(dp[2]);
+			const __m256 minZ = _mm256_set1_ps(0.1f);
+			const __m256 zero = _mm256_setzero_ps();
+			const __m256 width = _mm256_set1_ps((float)frame.depthWidth);
+			const __m256 height = _mm256_set1_ps((float)frame.depthHeight);
+			const __m256i widthInt = _mm256_set1_epi32(frame.depthWidth);
+			const __m256i lastPixelInt = _mm256_set1_epi32(lastPixel);
+			const __m256i lowerHalf = _mm256_set1_epi32(0xFFFF);
+			const __m256 depthScale = _mm256_set1_ps(frame.depthScale);
+			const __m256 truncation = _mm256_set1_ps(truncationDistance);
+			const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+
+			alignas(32) float us[8], vs[8], zs[8], tsdfs[8];
+
+			for (; x + 8 <= sizeX; x += 8) {
+				const __m256 xs = _mm256_add_ps(_mm256_set1_ps((float)x), laneOffsets);
+				const __m256 px = _mm256_add_ps(p0x, _mm256_mul_ps(xs, dpx));
+				const __m256 py = _mm256_add_ps(p0y, _mm256_mul_ps(xs, dpy));
+				const __m256 pz = _mm256_add_ps(p0z, _mm256_mul_ps(xs, dpz));
+
+				__m256 mask = _mm256_cmp_ps(pz, minZ, _CMP_GT_OQ);
+				if (_mm256_movemask_ps(mask) == 0) {
+					continue;
+				}
+
+				const __m256 u = _mm256_div_ps(px, pz);
+				const __m256 v = _mm256_div_ps(py, pz);
+				mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+				mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+				mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, width, _CMP_LT_OQ));
+				mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, height, _CMP_LT_OQ));
+				if (_mm256_movemask_ps(mask) == 0) {
+					continue;
+				}
+
+				const __m256i pixel = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_cvttps_epi32(v), widthInt), _mm256_cvttps_epi32(u));
+
+				// The gather reads 32 bit per lane, which would overrun the buffer for the very last pixel.
+				const __m256 isLastPixel = _mm256_castsi256_ps(_mm256_cmpeq_epi32(pixel, lastPixelInt));
+				const int scalarLanes = _mm256_movemask_ps(_mm256_and_ps(mask, isLastPixel));
+				mask = _mm256_andnot_ps(isLastPixel, mask);
+
+				const __m256i rawDepth = _mm256_and_si256(lowerHalf,
+					_mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*)frame.depth, pixel, _mm256_castps_si256(mask), 2));
+				const __m256 realDepth = _mm256_mul_ps(_mm256_cvtepi32_ps(rawDepth), depthScale);
+				const __m256 tsdf = _mm256_sub_ps(pz, realDepth);
+
+				mask = _mm256_and_ps(mask, _mm256_cmp_ps(realDepth, zero, _CMP_GT_OQ));
+				mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_and_ps(tsdf, absMask), truncation, _CMP_LE_OQ));
+
+				const int lanes = _mm256_movemask_ps(mask);
+				if (lanes == 0 && scalarLanes == 0) {
+					continue;
+				}
+
+				_mm256_store_ps(us, u);
+				_mm256_store_ps(vs, v);
+				_mm256_store_ps(zs, pz);
+				_mm256_store_ps(tsdfs, tsdf);
+
+				for (int lane = 0; lane < 8; lane++) {
+					if (lanes & (1 << lane)) {
+						updateVoxel(row[x + lane], tsdfs[lane], us[lane], vs[lane], zs[lane], frame, truncationDistance);
+					}
+					else if (scalarLanes & (1 << lane)) {
+						const float xf = (float)(x + lane);
+						integrateVoxel(row[x + lane], p0[0] + xf * dp[0], p0[1] + xf * dp[1], p0[2] + xf * dp[2], frame, truncationDistance);
+					}
+				}
+			}
+#elif defined(VC_USE_NEON)
+			const float32x4_t laneOffsets = { 0, 1, 2, 3 };
+			const float32x4_t p0x = vdupq_n_f32(p0[0]), p0y = vdupq_n_f32(p0[1]), p0z = vdupq_n_f32(p0[2]);
+			const float32x4_t dpx = vdupq_n_f32(dp[0]), dpy = vdupq_n_f32(dp[1]), dpz = vdupq_n_f32(dp[2]);
+			const float32x4_t minZ = vdupq_n_f32(0.1f);
+			const float32x4_t zero = vdupq_n_f32(0);
+			const float32x4_t width = vdupq_n_f32((float)frame.depthWidth);
+			const float32x4_t height = vdupq_n_f32((float)frame.depthHeight);
+
+			float us[4], vs[4], zs[4];
+			uint32_t valid[4];
+
+			for (; x + 4 <= sizeX; x += 4) {
+				const float32x4_t xs = vaddq_f32(vdupq_n_f32((float)x), laneOffsets);
+				const float32x4_t px = vmlaq_f32(p0x, xs, dpx);
+				const float32x4_t py = vmlaq_f32(p0y, xs, dpy);
+				const float32x4_t pz = vmlaq_f32(p0z, xs, dpz);
+
+				uint32x4_t mask = vcgtq_f32(pz, minZ);
+				if (vmaxvq_u32(mask) == 0) {
+					continue;
+				}
+
+				const float32x4_t u = vdivq_f32(px, pz);
+				const float32x4_t v = vdivq_f32(py, pz);
+				mask = vandq_u32(mask, vcgeq_f32(u, zero));
+				mask = vandq_u32(mask, vcgeq_f32(v, zero));
+				mask = vandq_u32(mask, vcltq_f32(u, width));
+				mask = vandq_u32(mask, vcltq_f32(v, height));
+				if (vmaxvq_u32(mask) == 0) {
+					continue;
+				}
+
+				vst1q_f32(us, u);
+				vst1q_f32(vs, v);
+				vst1q_f32(zs, pz);
+				vst1q_u32(valid, mask);
+
+				// NEON has no gather, the depth lookup and update stay per lane
+				for (int lane = 0; lane < 4; lane++) {
+					if (!valid[lane]) {
+						continue;
+					}
+					const float realDepth = frame.depth[(int)vs[lane] * frame.depthWidth + (int)us[lane]] * frame.depthScale;
+					const float tsdf = zs[lane] - realDepth;
+					if (realDepth > 0 && std::abs(tsdf) <= truncationDistance) {
+						updateVoxel(row[x + lane], tsdf, us[lane], vs[lane], zs[lane], frame, truncationDistance);
+					}
+				}
+			}
+#endif
+
+			for (; x < sizeX; x++) {
+				const float xf = (float)x;
+				integrateVoxel(row[x], p0[0] + xf * dp[0], p0[1] + xf * dp[1], p0[2] + xf * dp[2], frame, truncationDistance);
+			}
+		}
+
+		void integrate(std::vector<vc::fusion::Voxel>& verts, const GridDescription& grid, const IntegrationFrame& frame, bool clearAsFirstFrame = false) {
+			if (!frame.isValid()) {
+				return;
+			}
+
+			integrate(verts, grid, std::vector<IntegrationFrame>{ frame }, clearAsFirstFrame);
+		}
+
+		/// <summary>
+		/// Fuses the frames of all cameras in a single sweep over the grid, every view only updates the voxels in its frustum bounds.
+		/// Every row is loaded once, updated by all views while it is in the cache and written back once,
+		/// so the memory traffic does not grow with the number of cameras.
+		/// The views are applied in the given order, which gives the same result as integrating them one after another.
+		/// </summary>
+		void integrate(std::vector<vc::fusion::Voxel>& verts, const GridDescription& grid, const std::vector<IntegrationFrame>& frames, bool clearAsFirstFrame = false) {
+			std::vector<const IntegrationFrame*> validFrames;
+			std::vector<Eigen::Matrix3f> rotations;
+			std::vector<Eigen::Vector3f> translations;
+			std::vector<VoxelRange> bounds;
+			for (auto& frame : frames) {
+				if (frame.isValid()) {
+					validFrames.emplace_back(&frame);
+					rotations.emplace_back(frame.worldToCamera.block<3, 3>(0, 0));
+					translations.emplace_back(frame.worldToCamera.block<3, 1>(0, 3));
+					bounds.emplace_back(getFrustumBounds(frame, grid));
+				}
+			}
+
+			if (validFrames.empty() && !clearAsFirstFrame) {
+				return;
+			}
+
+			pool->parallelFor(0, grid.sizeNormalized[2], [&](int z) {
+				for (int y = 0; y < grid.sizeNormalized[1]; y++) {
+					vc::fusion::Voxel* row = verts.data() + grid.hashFunc(0, y, z);
+					if (clearAsFirstFrame) {
+						std::fill(row, row + grid.sizeNormalized[0], vc::fusion::Voxel());
+					}
+
+					for (int i = 0; i < validFrames.size(); i++) {
+						if (bounds[i].isEmpty() || !bounds[i].containsRow(y, z)) {
+							continue;
+						}
+
+						const int minX = bounds[i].min[0];
+						const Eigen::Vector3f rowStart = grid.minCorner + Eigen::Vector3f(minX, y, z) * grid.resolution;
+						integrateRow(row + minX, bounds[i].max[0] - minX, rowStart, grid.resolution, grid.truncationDistance, *validFrames[i], rotations[i], translations[i]);
+					}
+				}
+			});
+		}
+	};
+}
+
+#endif // !_CPU_INTEGRATION_HEADER
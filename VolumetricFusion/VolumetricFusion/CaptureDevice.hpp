@@ -9,17 +9,73 @@
 #include <thread>
 #include <atomic>
 #include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <cmath>
 #include "Data.hpp"
 #include "PinholeCamera.hpp"
 #include "Processing.hpp"
+#include "FilterChain.hpp"
+#include "MultiViewSynchronizer.hpp"
+#include "RGBDRecording.hpp"
+#include "Recorder.h"
+#include "StagePipeline.hpp"
+#include "TSDFFusionDataset.hpp"
 #include "Rendering.hpp"
 #include "Utils.hpp"
 #include <librealsense2/rs_advanced_mode.hpp>
+#include <librealsense2/hpp/rs_internal.hpp>
 
 #include "ceres/problem.h"
 #include "ceres/solver.h"
 
 namespace vc::capture {
+	// Upper bound of a blocking wait for frames, so that stopping or pausing is never delayed longer
+	const unsigned int CAPTURE_WAIT_TIMEOUT_MS = 100;
+	// The statistics cover roughly this long
+	const double CAPTURE_STATISTICS_INTERVAL = 1.0;
+
+	/// <summary>
+	/// How the capture thread of a device spent the last statistics interval.
+	/// Idle is the time blocked on the camera or on a pause, work is the time spent handing the frames to the stages,
+	/// which includes waiting for them while they are full.
+	/// </summary>
+	struct CaptureStatistics {
+		double idleSeconds = 0;
+		double workSeconds = 0;
+		int frames = 0;
+
+		double getBusyFraction() const {
+			const double total = idleSeconds + workSeconds;
+			return total > 0 ? workSeconds / total : 0;
+		}
+
+		double getMillisecondsPerFrame() const {
+			return frames > 0 ? 1000.0 * workSeconds / frames : 0;
+		}
+
+		double getFramesPerSecond() const {
+			const double total = idleSeconds + workSeconds;
+			return total > 0 ? frames / total : 0;
+		}
+	};
+
+	/// <summary>
+	/// A frameset on its way through the stages of a capture device, frames is filled by the filter stage.
+	/// </summary>
+	struct CaptureWork {
+		rs2::frameset frameset;
+		vc::data::Frames frames;
+	};
+
+	// The stages of every capture device, in this order
+	enum class CaptureStage {
+		FILTER,
+		DETECT,
+		PUBLISH,
+		COUNT
+	};
+
 	/// <summary>
 	/// Base class for capturing devices
 	/// </summary>
@@ -40,17 +96,46 @@ namespace vc::capture {
 		std::shared_ptr < std::atomic_bool> stopped;
 		std::shared_ptr < std::atomic_bool> calibrateCameras;
 
+		// Wakes the capture thread on pause, resume and stop, paused and stopped are only written while holding stateMutex
+		std::shared_ptr < std::mutex> stateMutex;
+		std::shared_ptr < std::condition_variable> stateChanged;
+		// Set while the capture thread sleeps in a pause, it won't publish frames before the resume
+		std::shared_ptr < std::atomic_bool> waitingForResume;
+
+		std::shared_ptr < std::mutex> statisticsMutex;
+		std::shared_ptr < CaptureStatistics> statistics;
+
+		// Filter, detect and publish the framesets of the capture thread, see CaptureStage.
+		// The stages work on consecutive framesets at the same time.
+		std::shared_ptr<vc::utils::StagePipeline<CaptureWork>> stages;
+
+		// Started by startPipeline(), once the derived device that implements waitForFrameset() is constructed
 		std::shared_ptr < std::thread> thread;
+
+		// Owned by the filter stage
+		vc::processing::FilterChain filterChain;
+
+		// Receives every published frameset as view synchronizerView, set before the pipeline starts
+		std::shared_ptr<MultiViewSynchronizer> synchronizer;
+		int synchronizerView = -1;
+
+		// Receives every unfiltered frameset as stream recorderStream, set before the pipeline starts
+		std::shared_ptr<Recorder> recorder;
+		int recorderStream = -1;
 		
 		rs2::device device;
 		int masterSlaveId = 0;
 
 		float thresholdDistance = 2.0f;
+		// Read by the filter stage before every frame, maxDistance is taken from thresholdDistance
+		vc::processing::FilterSettings filterSettings;
 
-		bool startPipeline() {
+		virtual bool startPipeline() {
 			try {
 				this->profile = this->pipeline->start(this->cfg);
+				onPipelineStarted();
 				setCameras();
+				startThread();
 				resumeThread();
 
 				//this->data->setIntrinsics(this->pipeline->get_active_profile().get_stream(RS2_STREAM_COLOR).as<rs2::video_stream_profile>().get_intrinsics());
@@ -62,7 +147,7 @@ namespace vc::capture {
 			}
 		}
 
-		bool terminate() { 
+		virtual bool terminate() { 
 			stopThread();
 			try{
 				this->pipeline->stop();
@@ -73,19 +158,54 @@ namespace vc::capture {
 			}
 		}
 
+		/// <summary>
+		/// Starts the capture thread paused, if it is not running yet.
+		/// </summary>
+		void startThread() {
+			if (!thread) {
+				thread = std::make_shared<std::thread>(&vc::capture::CaptureDevice::captureThreadFunction, this);
+			}
+		}
+
 		void pauseThread() {
-			this->paused->store(true);
+			setThreadState(true, stopped->load());
 		}
 
 		void resumeThread() {
-			this->paused->store(false);
+			setThreadState(false, stopped->load());
 		}
 
-		void stopThread() {
-			stopped->store(true);
+		/// <summary>
+		/// Pauses the capture thread and waits until it and the stages are done with the frames they were working on.
+		/// </summary>
+		void pauseThreadAndWait() {
+			pauseThread();
 			if (thread) {
+				std::unique_lock<std::mutex> lock(*stateMutex);
+				stateChanged->wait(lock, [this]() { return waitingForResume->load() || stopped->load() || !paused->load(); });
+			}
+			// The framesets still in the stages are dropped in front of the publish stage
+			stages->waitUntilIdle();
+		}
+
+		/// <summary>
+		/// Stops the capture thread and waits until it and the stages are done, the device does not capture anymore.
+		/// </summary>
+		void stopThread() {
+			setThreadState(paused->load(), true);
+			if (thread && thread->joinable()) {
 				thread->join();
 			}
+			stages->waitUntilIdle();
+		}
+
+		CaptureStatistics getCaptureStatistics() {
+			std::lock_guard<std::mutex> lock(*statisticsMutex);
+			return *statistics;
+		}
+
+		std::vector<vc::utils::StageStatistics> getStageStatistics() {
+			return stages->getStatistics();
 		}
 
 		void calibrate(bool calibrate) {
@@ -93,26 +213,29 @@ namespace vc::capture {
 		}
 
 		void renderColor(int pos_x,  int pos_y, const float aspect, const int viewport_width, const int viewport_height) {
-			if (data->filteredColorFrames) {
-				this->rendering->renderTexture(data->filteredColorFrames, pos_x, pos_y, aspect, viewport_width, viewport_height);
+			const vc::data::Frames& frames = data->getFrames();
+			if (frames.color) {
+				this->rendering->renderTexture(frames.color, pos_x, pos_y, aspect, viewport_width, viewport_height);
 			}
 		}
 
 		void renderDepth(int pos_x, int pos_y, const float aspect, const int viewport_width, const int viewport_height) {
-			if (data->colorizedDepthFrames) {
-				this->rendering->renderTexture(data->colorizedDepthFrames, pos_x, pos_y, aspect, viewport_width, viewport_height);
+			const vc::data::Frames& frames = data->getFrames();
+			if (frames.colorizedDepth) {
+				this->rendering->renderTexture(frames.colorizedDepth, pos_x, pos_y, aspect, viewport_width, viewport_height);
 			}
 		}
 		
 		void renderPointcloud(glm::mat4 model, glm::mat4 view, glm::mat4 projection,
 			Eigen::Matrix4d relativeTransformation, float alpha) {
-			if (data->filteredDepthFrames && data->filteredColorFrames) {
-				rendering->renderPointcloud(data->filteredDepthFrames, data->filteredColorFrames, depth_camera, rgb_camera, model, view, projection,
+			const vc::data::Frames& frames = data->getFrames();
+			if (frames.depth && frames.color) {
+				rendering->renderPointcloud(frames.depth, frames.color, depth_camera, rgb_camera, model, view, projection,
 					relativeTransformation, alpha);
 			}
 		}
 
-		bool setResolutions(const std::vector<int> colorStream, const std::vector<int> depthStream, bool directResume = true) {
+		virtual bool setResolutions(const std::vector<int> colorStream, const std::vector<int> depthStream, bool directResume = true) {
 			pauseThread();
 			try{
 				this->pipeline->stop();
@@ -141,21 +264,9 @@ namespace vc::capture {
 			return true;
 		}
 
-		CaptureDevice(CaptureDevice& other) {
-			this->rendering = other.rendering;
-			this->data = other.data;
-			this->chArUco = other.chArUco;
-			this->edgeEnhancement = other.edgeEnhancement;
-			this->edgeEnhancementOnColor = other.edgeEnhancementOnColor;
-			this->pipeline = other.pipeline;
-			this->cfg = other.cfg;
-			this->rgb_camera = other.rgb_camera;
-			this->depth_camera = other.depth_camera;
-
-			this->paused = other.paused;
-			this->calibrateCameras = other.calibrateCameras;
-			this->thread = other.thread;
-		}
+		// The stages and the capture thread work on this device, a copy would share them
+		CaptureDevice(const CaptureDevice& other) = delete;
+		CaptureDevice& operator=(const CaptureDevice& other) = delete;
 
 		CaptureDevice(rs2::context context) : 
 			rendering(std::make_shared<vc::rendering::Rendering>()),
@@ -164,22 +275,52 @@ namespace vc::capture {
 			paused(std::make_shared<std::atomic_bool>(true)),
 			stopped(std::make_shared<std::atomic_bool>(false)),
 			calibrateCameras(std::make_shared<std::atomic_bool>(false)),
+			stateMutex(std::make_shared<std::mutex>()),
+			stateChanged(std::make_shared<std::condition_variable>()),
+			waitingForResume(std::make_shared<std::atomic_bool>(false)),
+			statisticsMutex(std::make_shared<std::mutex>()),
+			statistics(std::make_shared<CaptureStatistics>()),
 			depth_camera(std::make_shared<vc::camera::MockPinholeCamera>()),
 			rgb_camera(std::make_shared<vc::camera::MockPinholeCamera>()),
 			chArUco(std::make_shared<vc::processing::ChArUco>()),
 			edgeEnhancement(std::make_shared<vc::processing::EdgeEnhancement>()),
 			edgeEnhancementOnColor(std::make_shared<vc::processing::EdgeEnhancementOnColor>()),
-			thread(std::make_shared<std::thread>(&vc::capture::CaptureDevice::captureThreadFunction, this))
+			stages(createStages())
 		{
 			//setCameras();
 		}
 
+		/// <summary>
+		/// Derived devices that override waitForFrameset() call stopThread() in their destructor as well,
+		/// the capture thread must not call into them after they are destroyed.
+		/// </summary>
+		virtual ~CaptureDevice() {
+			stopThread();
+		}
+
+		/// <summary>
+		/// Called after every start of the pipeline, before the cameras are set up.
+		/// </summary>
+		virtual void onPipelineStarted() {}
+
+		/// <summary>
+		/// Blocks up to CAPTURE_WAIT_TIMEOUT_MS for the next frameset, returns false if there is none yet.
+		/// </summary>
+		virtual bool waitForFrameset(rs2::frameset& frameset) {
+			return pipeline->try_wait_for_frames(&frameset, CAPTURE_WAIT_TIMEOUT_MS);
+		}
+
 		void setCameras() {
+			setCameras(this->pipeline->get_active_profile().get_stream(RS2_STREAM_COLOR).as<rs2::video_stream_profile>().get_intrinsics(),
+				this->pipeline->get_active_profile().get_stream(RS2_STREAM_DEPTH).as<rs2::video_stream_profile>().get_intrinsics(),
+				this->pipeline->get_active_profile().get_device().first<rs2::depth_sensor>().get_depth_scale());
+		}
+
+		void setCameras(rs2_intrinsics colorIntrinsics, rs2_intrinsics depthIntrinsics, float depthScale) {
 			bool tmpCalibrate = calibrateCameras->load();
 			calibrateCameras->store(false);
-			this->rgb_camera = std::make_shared<vc::camera::PinholeCamera>(this->pipeline->get_active_profile().get_stream(RS2_STREAM_COLOR).as<rs2::video_stream_profile>().get_intrinsics());
-			this->depth_camera = std::make_shared<vc::camera::PinholeCamera>(this->pipeline->get_active_profile().get_stream(RS2_STREAM_DEPTH).as<rs2::video_stream_profile>().get_intrinsics(),
-			this->pipeline->get_active_profile().get_device().first<rs2::depth_sensor>().get_depth_scale());
+			this->rgb_camera = std::make_shared<vc::camera::PinholeCamera>(colorIntrinsics);
+			this->depth_camera = std::make_shared<vc::camera::PinholeCamera>(depthIntrinsics, depthScale);
 			chArUco->startProcessing();
 			edgeEnhancement->depthScale = depth_camera->depthScale;
 			edgeEnhancement->startProcessing();
@@ -187,73 +328,160 @@ namespace vc::capture {
 			calibrateCameras->store(tmpCalibrate);
 		}
 
+		void setThreadState(bool pause, bool stop) {
+			{
+				std::lock_guard<std::mutex> lock(*stateMutex);
+				paused->store(pause);
+				stopped->store(stop);
+			}
+			stateChanged->notify_all();
+			// The capture thread may be waiting for a free slot in the stages
+			stages->wakeUp();
+		}
+
+		/// <summary>
+		/// Blocks while the device is paused, returns false once it is stopped.
+		/// </summary>
+		bool waitWhilePaused() {
+			std::unique_lock<std::mutex> lock(*stateMutex);
+			if (paused->load() && !stopped->load()) {
+				waitingForResume->store(true);
+				stateChanged->notify_all();
+				stateChanged->wait(lock, [this]() { return !paused->load() || stopped->load(); });
+				waitingForResume->store(false);
+			}
+			return !stopped->load();
+		}
+
 		void captureThreadFunction() {
-			rs2::filter* thresholdFilter;
+			using clock = std::chrono::steady_clock;
+			CaptureStatistics interval;
+			auto intervalStart = clock::now();
+			auto addTime = [](double& seconds, clock::time_point& since) {
+				const auto now = clock::now();
+				seconds += std::chrono::duration<double>(now - since).count();
+				since = now;
+			};
 
 			while (!stopped->load()) //While application is running
 			{
-				while (paused->load()) {
-					continue;
+				auto lap = clock::now();
+				if (!waitWhilePaused()) {
+					break;
 				}
 
 				try {
 					rs2::frameset frameset;
-					if (!pipeline->poll_for_frames(&frameset)) {
-						continue;
-					}
-
-					rs2::align alignToColor(RS2_STREAM_COLOR);
-					frameset = alignToColor.process(frameset);
-
-					rs2::frame depthFrame = frameset.get_depth_frame(); //Take the depth frame from the frameset
-					if (!depthFrame) { // Should not happen but if the pipeline is configured differently
-						return;       //  it might not provide depth and we don't want to crash
-					}
+					const bool hasFrames = waitForFrameset(frameset);
+					addTime(interval.idleSeconds, lap);
 
-					rs2::frame colorFrame = frameset.get_color_frame();
-					if (!colorFrame) { // Should not happen but if the pipeline is configured differently
-						return;       //  it might not provide depth and we don't want to crash
+					if (hasFrames) {
+						CaptureWork work;
+						work.frameset = frameset;
+						// Waits while the stages are full, the camera drops frames meanwhile like it did for a busy thread
+						stages->push(work, [this]() { return paused->load() || stopped->load(); });
+						addTime(interval.workSeconds, lap);
+						interval.frames++;
 					}
-
-					if (calibrateCameras->load()) {
-						// Send color frame for processing
-						chArUco->processingBlock->invoke(colorFrame);
-						// Wait for results
-						colorFrame = chArUco->processingQueues.wait_for_frame();
-					}
-
-					//edgeEnhancementOnColor->processingBlock->invoke(colorFrame);
-					//colorFrame = edgeEnhancementOnColor->processingQueues.wait_for_frame();
-					//else {
-						//edgeEnhancement->processingBlock->invoke(depthFrame);
-						//depthFrame = edgeEnhancement->processingQueues.wait_for_frame();
-					//}
-
-					data->frameId = frameset.get_color_frame().get_frame_number();
-					data->filteredColorFrames = colorFrame;
-					
-					thresholdFilter = new rs2::threshold_filter(0.2, thresholdDistance);
-					depthFrame = thresholdFilter->process(depthFrame);
-					delete thresholdFilter;
-
-					// Push filtered & original data to their respective queues
-					data->filteredDepthFrames = depthFrame;
-
-					rs2::colorizer colorizer;
-					data->colorizedDepthFrames = colorizer.process(depthFrame);		// Colorize the depth frame with a color map
-
-					//data->points = data->pointclouds.calculate(depthFrame);  // Generate pointcloud from the depth data
-					//data->pointclouds.map_to(data->colorizedDepthFrames);      // Map the colored depth to the point cloud
 				}
 				catch (const rs2::error & e) {
+					// Also thrown while the pipeline is stopped for a resolution change, don't spin on it
+					addTime(interval.idleSeconds, lap);
 					std::cerr << vc::utils::asHeader("RS2 - Thread error") << e.what() << std::endl;
+					if (!paused->load()) {
+						std::this_thread::sleep_for(std::chrono::milliseconds(CAPTURE_WAIT_TIMEOUT_MS));
+					}
 				}
 				catch (const std::exception & e) {
 					std::cerr << vc::utils::asHeader("Thread error") << e.what() << std::endl;
 				}
+
+				if (std::chrono::duration<double>(clock::now() - intervalStart).count() >= CAPTURE_STATISTICS_INTERVAL) {
+					{
+						std::lock_guard<std::mutex> lock(*statisticsMutex);
+						*statistics = interval;
+					}
+					interval = CaptureStatistics();
+					intervalStart = clock::now();
+				}
 			}
 			//terminate();
 		}
+
+		std::shared_ptr<vc::utils::StagePipeline<CaptureWork>> createStages() {
+			auto stages = std::make_shared<vc::utils::StagePipeline<CaptureWork>>();
+			stages->addStage("Filter", [this](CaptureWork& work) { return filterFrameset(work); });
+			vc::utils::StageSettings detectSettings;
+			detectSettings.canDisable = true;
+			stages->addStage("Detect", [this](CaptureWork& work) { return detectMarkers(work); }, detectSettings);
+			vc::utils::StageSettings publishSettings;
+			// Waits for the fusion while the synchronizer blocks, which must not hold a worker of the pool
+			publishSettings.dedicatedThread = true;
+			stages->addStage("Publish", [this](CaptureWork& work) { return publishFrames(work); }, publishSettings);
+			return stages;
+		}
+
+		/// <summary>
+		/// Filter stage: records and filters the frameset.
+		/// </summary>
+		bool filterFrameset(CaptureWork& work) {
+			if (recorder) {
+				recorder->addFrames(recorderStream, work.frameset);
+			}
+
+			vc::processing::FilterSettings settings = filterSettings;
+			settings.maxDistance = thresholdDistance;
+			filterChain.configure(settings);
+
+			if (!filterChain.process(work.frameset)) { // Should not happen but if the pipeline is configured differently
+				return false;                          //  it might not provide depth or color and we don't want to crash
+			}
+			work.frames.depth = filterChain.depth;
+			work.frames.color = filterChain.color;
+			work.frames.colorizedDepth = filterChain.colorizedDepth;
+			work.frames.frameId = filterChain.color.get_frame_number();
+			work.frames.timestamp = filterChain.color.get_timestamp();
+			// The unfiltered frames go back to librealsense
+			work.frameset = rs2::frameset();
+			return true;
+		}
+
+		/// <summary>
+		/// Detect stage: finds the markers while the cameras are calibrated.
+		/// </summary>
+		bool detectMarkers(CaptureWork& work) {
+			if (calibrateCameras->load()) {
+				// The frame is only copied if the markers are drawn into it
+				work.frames.color = chArUco->processFrame(work.frames.color);
+				// Published with the frames, so the calibration gets the markers of the depth and color it reads
+				work.frames.markerIds = chArUco->ids;
+				work.frames.markerCorners = chArUco->markerCorners;
+			}
+
+			//work.frames.color = edgeEnhancementOnColor->processFrame(work.frames.color);
+			//else {
+				//work.frames.depth = edgeEnhancement->processFrame(work.frames.depth);
+			//}
+			return true;
+		}
+
+		/// <summary>
+		/// Publish stage: publishes the frames to data and the synchronizer.
+		/// </summary>
+		bool publishFrames(CaptureWork& work) {
+			// Frames that were in the stages when the device was paused would e.g. show up after a seek
+			if (paused->load() || stopped->load()) {
+				return false;
+			}
+			data->publishFrames(work.frames);
+			if (synchronizer) {
+				synchronizer->addFrames(synchronizerView, work.frames);
+			}
+
+			//data->points = data->pointclouds.calculate(depthFrame);  // Generate pointcloud from the depth data
+			//data->pointclouds.map_to(frames.colorizedDepth);      // Map the colored depth to the point cloud
+			return true;
+		}
 	};
 
 	/// <summary>
@@ -294,19 +522,554 @@ namespace vc::capture {
 	};
 
 	/// <summary>
-	///  A capture device for streaming the RGB-D data from a file.
+	/// Controls of a capture device that plays a recording.
+	/// In real time the recording loops and frames are dropped whenever the consumer falls behind.
+	/// Otherwise the recording is played once, every frame in order and only as fast as it is consumed.
+	/// </summary>
+	class PlaybackControl {
+	public:
+		virtual ~PlaybackControl() {}
+
+		virtual void setRealTime(bool realTime) = 0;
+
+		virtual bool isRealTime() = 0;
+
+		/// <summary>
+		/// Continues the playback at position from the start of the recording, frames queued before are discarded.
+		/// Pause the capture thread with pauseThreadAndWait() before, so no frame from before the seek is published.
+		/// </summary>
+		virtual bool seek(std::chrono::nanoseconds position) = 0;
+
+		virtual std::chrono::nanoseconds getPosition() = 0;
+
+		virtual std::chrono::nanoseconds getDuration() = 0;
+
+		/// <summary>
+		/// Whether a playback that does not loop reached the end of the recording.
+		/// </summary>
+		virtual bool hasFinished() = 0;
+	};
+
+	/// <summary>
+	/// Implemented by devices whose frames come with the ground truth pose of the camera.
+	/// </summary>
+	class GroundTruthPoses {
+	public:
+		virtual ~GroundTruthPoses() {}
+
+		/// <summary>
+		/// The camera to world transformation when the frame was taken, false if it has none.
+		/// </summary>
+		virtual bool getPose(unsigned long long frameId, Eigen::Matrix4d& pose) = 0;
+	};
+
+	/// <summary>
+	///  A capture device for streaming the RGB-D data from a .bag file.
 	/// </summary>
 	/// <seealso cref="CaptureDevice" />
-	class PlayingCaptureDevice : public CaptureDevice {
+	class PlayingCaptureDevice : public CaptureDevice, public PlaybackControl {
+	private:
+		bool realTime;
+
+		rs2::playback getPlayback() {
+			return profile.get_device().as<rs2::playback>();
+		}
+
 	public:
-		PlayingCaptureDevice(rs2::context context, std::string filename) :
-			CaptureDevice(context)
+		PlayingCaptureDevice(rs2::context context, std::string filename, bool realTime = true) :
+			CaptureDevice(context),
+			realTime(realTime)
 		{
 			data->deviceName = filename;
 
-			this->cfg.enable_device_from_file(data->deviceName);
+			this->cfg.enable_device_from_file(data->deviceName, realTime);
 			this->cfg.enable_all_streams();
 		}
+
+		void onPipelineStarted() override {
+			getPlayback().set_real_time(realTime);
+		}
+
+		void setRealTime(bool realTime) override {
+			this->realTime = realTime;
+			try {
+				getPlayback().set_real_time(realTime);
+			}
+			catch (rs2::error & e) {
+				// Applied on the next start
+			}
+		}
+
+		bool isRealTime() override {
+			return realTime;
+		}
+
+		bool seek(std::chrono::nanoseconds position) override {
+			try {
+				if (hasFinished()) {
+					// A playback that does not loop stops the pipeline at the end
+					pipeline->stop();
+					profile = pipeline->start(cfg);
+					onPipelineStarted();
+				}
+
+				rs2::playback playback = getPlayback();
+				playback.seek(std::min(position, playback.get_duration()));
+
+				rs2::frameset stale;
+				while (pipeline->poll_for_frames(&stale)) {
+				}
+				return true;
+			}
+			catch (rs2::error & e) {
+				std::cerr << vc::utils::asHeader("RS2 - Seek error") << e.what() << std::endl;
+				return false;
+			}
+		}
+
+		std::chrono::nanoseconds getPosition() override {
+			try {
+				return std::chrono::nanoseconds(getPlayback().get_position());
+			}
+			catch (rs2::error & e) {
+				return std::chrono::nanoseconds(0);
+			}
+		}
+
+		std::chrono::nanoseconds getDuration() override {
+			try {
+				return getPlayback().get_duration();
+			}
+			catch (rs2::error & e) {
+				return std::chrono::nanoseconds(0);
+			}
+		}
+
+		bool hasFinished() override {
+			try {
+				return getPlayback().current_status() == RS2_PLAYBACK_STATUS_STOPPED;
+			}
+			catch (rs2::error & e) {
+				return false;
+			}
+		}
+	};
+
+	/// <summary>
+	/// Base class for devices whose frames come from memory instead of a librealsense pipeline.
+	/// A software device turns the pixels into rs2 frames, so they run through the same filters as those of a camera.
+	/// Derived classes set up the streams in their constructor and implement waitForFrameset() with createFrameset().
+	/// </summary>
+	/// <seealso cref="CaptureDevice" />
+	class SoftwareCaptureDevice : public CaptureDevice {
+	private:
+		rs2::software_device softwareDevice;
+		rs2::software_sensor depthSensor;
+		rs2::software_sensor colorSensor;
+		rs2::stream_profile depthProfile;
+		rs2::stream_profile colorProfile;
+		rs2::frame_queue depthQueue = rs2::frame_queue(1);
+		rs2::frame_queue colorQueue = rs2::frame_queue(1);
+		rs2::frame_queue framesetQueue = rs2::frame_queue(1);
+
+		// Joins the depth frame given to it with pendingDepth into a frameset
+		rs2::frame pendingDepth;
+		rs2::processing_block combiner;
+
+		rs2_intrinsics depthIntrinsics = {};
+		rs2_intrinsics colorIntrinsics = {};
+		float depthScale = 0;
+		bool hasStreams = false;
+
+	protected:
+		/// <summary>
+		/// Creates the Z16 depth and RGB8 color stream, call once before the pipeline is started.
+		/// </summary>
+		void setupStreams(const rs2_intrinsics& depthIntrinsics, const rs2_intrinsics& colorIntrinsics, const rs2_extrinsics& depthToColor, float depthScale, int fps) {
+			try {
+				depthProfile = depthSensor.add_video_stream({ RS2_STREAM_DEPTH, 0, 0, depthIntrinsics.width, depthIntrinsics.height, fps, sizeof(uint16_t), RS2_FORMAT_Z16, depthIntrinsics });
+				colorProfile = colorSensor.add_video_stream({ RS2_STREAM_COLOR, 0, 1, colorIntrinsics.width, colorIntrinsics.height, fps, 3, RS2_FORMAT_RGB8, colorIntrinsics });
+				depthProfile.register_extrinsics_to(colorProfile, depthToColor);
+				// The threshold filter reads the depth scale from the sensor
+				depthSensor.add_read_only_option(RS2_OPTION_DEPTH_UNITS, depthScale);
+
+				depthSensor.open(depthProfile);
+				colorSensor.open(colorProfile);
+				depthSensor.start(depthQueue);
+				colorSensor.start(colorQueue);
+				combiner.start(framesetQueue);
+
+				this->depthIntrinsics = depthIntrinsics;
+				this->colorIntrinsics = colorIntrinsics;
+				this->depthScale = depthScale;
+				hasStreams = true;
+			}
+			catch (const rs2::error & e) {
+				std::cerr << vc::utils::asHeader("RS2 - Software device error") << e.what() << std::endl;
+			}
+		}
+
+		/// <summary>
+		/// Wraps the pixels without copying them, the deleters are called with them once librealsense releases the frames.
+		/// </summary>
+		bool createFrameset(const void* depth, void(*depthDeleter)(void*), const void* color, void(*colorDeleter)(void*),
+			double timestamp, rs2_timestamp_domain domain, int frameNumber, rs2::frameset& frameset) {
+			if (!hasStreams) {
+				depthDeleter(const_cast<void*>(depth));
+				colorDeleter(const_cast<void*>(color));
+				return false;
+			}
+			depthSensor.on_video_frame({ const_cast<void*>(depth), depthDeleter, depthIntrinsics.width * (int)sizeof(uint16_t), sizeof(uint16_t), timestamp, domain, frameNumber, depthProfile.get() });
+			colorSensor.on_video_frame({ const_cast<void*>(color), colorDeleter, colorIntrinsics.width * 3, 3, timestamp, domain, frameNumber, colorProfile.get() });
+
+			rs2::frame depthFrame;
+			rs2::frame colorFrame;
+			if (!depthQueue.try_wait_for_frame(&depthFrame, CAPTURE_WAIT_TIMEOUT_MS) || !colorQueue.try_wait_for_frame(&colorFrame, CAPTURE_WAIT_TIMEOUT_MS)) {
+				return false;
+			}
+			pendingDepth = depthFrame;
+			combiner.invoke(colorFrame);
+			pendingDepth = rs2::frame();
+
+			rs2::frame combined;
+			if (!framesetQueue.try_wait_for_frame(&combined, CAPTURE_WAIT_TIMEOUT_MS)) {
+				return false;
+			}
+			frameset = combined;
+			return true;
+		}
+
+	public:
+		SoftwareCaptureDevice(rs2::context context) :
+			CaptureDevice(context),
+			depthSensor(softwareDevice.add_sensor("Depth")),
+			colorSensor(softwareDevice.add_sensor("Color")),
+			combiner([this](rs2::frame color, rs2::frame_source& source) {
+				source.frame_ready(source.allocate_composite_frame({ pendingDepth, color }));
+			})
+		{
+		}
+
+		~SoftwareCaptureDevice() {
+			// The sensors are used by createFrameset() on the capture thread
+			stopThread();
+		}
+
+		bool startPipeline() override {
+			if (!hasStreams) {
+				std::cerr << data->deviceName << " has no streams to start" << std::endl;
+				return false;
+			}
+			setCameras(colorIntrinsics, depthIntrinsics, depthScale);
+			startThread();
+			resumeThread();
+			return true;
+		}
+
+		bool terminate() override {
+			stopThread();
+			return true;
+		}
+
+		/// <summary>
+		/// The streams are fixed by the source, only restarts.
+		/// </summary>
+		bool setResolutions(const std::vector<int> colorStream, const std::vector<int> depthStream, bool directResume = true) override {
+			pauseThread();
+			return directResume ? startPipeline() : true;
+		}
+	};
+
+	/// <summary>
+	/// A capture device for streaming the RGB-D data from a recording in the format of RGBDRecording.hpp.
+	/// The color and raw depth are used in place from the mapped file, coded depth is decoded by the capture thread.
+	/// Seeking is a binary search in the index.
+	/// </summary>
+	/// <seealso cref="SoftwareCaptureDevice" />
+	class RGBDRecordingCaptureDevice : public SoftwareCaptureDevice, public PlaybackControl {
+	private:
+		using clock = std::chrono::steady_clock;
+
+		RGBDRecording recording;
+		std::atomic<uint64_t> nextFrame = 0;
+		std::atomic_bool realTime;
+		// Cleared to place the next frame at the current time
+		std::atomic_bool anchored = false;
+		// When the first frame would have been played, only used by the capture thread
+		clock::time_point anchor;
+
+		// The pixels belong to the mapping, which stays open as long as the device
+		static void keepMapped(void*) {}
+
+		static void deleteDecoded(void* pixels) {
+			delete[] (uint16_t*)pixels;
+		}
+
+		double getRelativeTimestamp(uint64_t frame) {
+			return recording.getFrame(frame).timestamp - recording.getFrame(0).timestamp;
+		}
+
+		clock::duration toDuration(double milliseconds) {
+			return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(milliseconds));
+		}
+
+	public:
+		RGBDRecordingCaptureDevice(rs2::context context, std::string filename, bool realTime = true) :
+			SoftwareCaptureDevice(context),
+			realTime(realTime)
+		{
+			data->deviceName = filename;
+
+			if (recording.open(filename)) {
+				const RGBDRecordingHeader& header = recording.getHeader();
+				setupStreams(header.depthIntrinsics, header.colorIntrinsics, header.depthToColor, header.depthScale, header.fps);
+			}
+		}
+
+		~RGBDRecordingCaptureDevice() {
+			// The capture thread reads the mapped recording
+			stopThread();
+		}
+
+		bool waitForFrameset(rs2::frameset& frameset) override {
+			const uint64_t numFrames = recording.getNumFrames();
+			uint64_t frame = nextFrame.load();
+
+			if (realTime.load() && numFrames > 0) {
+				if (frame >= numFrames) {
+					// Loops like a real time playback of a .bag
+					frame = 0;
+					anchored = false;
+				}
+				if (!anchored.exchange(true)) {
+					anchor = clock::now() - toDuration(getRelativeTimestamp(frame));
+				}
+
+				const auto due = anchor + toDuration(getRelativeTimestamp(frame));
+				if (due > clock::now() + std::chrono::milliseconds(CAPTURE_WAIT_TIMEOUT_MS)) {
+					nextFrame = frame;
+					std::this_thread::sleep_for(std::chrono::milliseconds(CAPTURE_WAIT_TIMEOUT_MS));
+					return false;
+				}
+				std::this_thread::sleep_until(due);
+
+				// Frames whose time passed meanwhile are dropped like in a real time playback
+				const double elapsed = std::chrono::duration<double, std::milli>(clock::now() - anchor).count() + recording.getFrame(0).timestamp;
+				uint64_t latest = recording.findFrame(elapsed);
+				if (latest == numFrames || recording.getFrame(latest).timestamp > elapsed) {
+					latest--;
+				}
+				frame = std::max(frame, latest);
+			}
+			else if (frame >= numFrames) {
+				// Finished, like a .bag played without real time
+				anchored = false;
+				std::this_thread::sleep_for(std::chrono::milliseconds(CAPTURE_WAIT_TIMEOUT_MS));
+				return false;
+			}
+			else {
+				anchored = false;
+			}
+
+			nextFrame = frame + 1;
+			recording.prefetch(frame + 1);
+			const uint16_t* depth = recording.getRawDepth(frame);
+			void(*depthDeleter)(void*) = keepMapped;
+			if (!depth) {
+				uint16_t* decoded = new uint16_t[getDepthPixels(recording.getHeader())];
+				if (!recording.readDepth(frame, decoded)) {
+					delete[] decoded;
+					return false;
+				}
+				depth = decoded;
+				depthDeleter = deleteDecoded;
+			}
+
+			const RGBDRecordingFrame& entry = recording.getFrame(frame);
+			return createFrameset(depth, depthDeleter, recording.getColor(frame), keepMapped, entry.timestamp,
+				(rs2_timestamp_domain)recording.getHeader().timestampDomain, (int)entry.frameNumber, frameset);
+		}
+
+		void setRealTime(bool realTime) override {
+			this->realTime = realTime;
+			anchored = false;
+		}
+
+		bool isRealTime() override {
+			return realTime;
+		}
+
+		bool seek(std::chrono::nanoseconds position) override {
+			if (recording.getNumFrames() == 0) {
+				return false;
+			}
+			nextFrame = recording.findFrame(recording.getFrame(0).timestamp + std::chrono::duration<double, std::milli>(position).count());
+			anchored = false;
+			return true;
+		}
+
+		std::chrono::nanoseconds getPosition() override {
+			const uint64_t frame = nextFrame.load();
+			if (frame == 0 || frame > recording.getNumFrames()) {
+				return std::chrono::nanoseconds(0);
+			}
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double, std::milli>(getRelativeTimestamp(frame - 1)));
+		}
+
+		std::chrono::nanoseconds getDuration() override {
+			if (recording.getNumFrames() == 0) {
+				return std::chrono::nanoseconds(0);
+			}
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double, std::milli>(getRelativeTimestamp(recording.getNumFrames() - 1)));
+		}
+
+		bool hasFinished() override {
+			return !realTime && nextFrame.load() >= recording.getNumFrames();
+		}
+	};
+
+	/// <summary>
+	/// A capture device for streaming the frames of the tsdf-fusion demo dataset, see TSDFFusionDataset.
+	/// The decoded frames are handed to librealsense without copying. Each frame comes with its ground truth pose,
+	/// so the fusion can integrate a moving camera without calibration.
+	/// In real time the frames are paced to TSDF_FUSION_FPS and loop, but none are dropped, decoding is cheaper than that.
+	/// </summary>
+	/// <seealso cref="SoftwareCaptureDevice" />
+	class TSDFFusionCaptureDevice : public SoftwareCaptureDevice, public PlaybackControl, public GroundTruthPoses {
+	private:
+		using clock = std::chrono::steady_clock;
+
+		TSDFFusionDataset dataset;
+		std::atomic_int nextFrame = 0;
+		std::atomic_bool realTime;
+		// Cleared to place the next frame at the current time
+		std::atomic_bool anchored = false;
+		// When the first frame would have been played, only used by the capture thread
+		clock::time_point anchor;
+
+		template <typename T>
+		static void deleteArray(void* pixels) {
+			delete[] (T*)pixels;
+		}
+
+		static double getTimestamp(int frame) {
+			return frame * 1000.0 / TSDF_FUSION_FPS;
+		}
+
+	public:
+		TSDFFusionCaptureDevice(rs2::context context, std::string folder, bool realTime = true) :
+			SoftwareCaptureDevice(context),
+			realTime(realTime)
+		{
+			data->deviceName = folder;
+
+			if (dataset.open(folder)) {
+				const Eigen::Matrix3d& intrinsics = dataset.getIntrinsics();
+				rs2_intrinsics cameraIntrinsics = {};
+				cameraIntrinsics.width = dataset.getWidth();
+				cameraIntrinsics.height = dataset.getHeight();
+				cameraIntrinsics.fx = (float)intrinsics(0, 0);
+				cameraIntrinsics.fy = (float)intrinsics(1, 1);
+				cameraIntrinsics.ppx = (float)intrinsics(0, 2);
+				cameraIntrinsics.ppy = (float)intrinsics(1, 2);
+				cameraIntrinsics.model = RS2_DISTORTION_NONE;
+				// The color images are registered to the depth images
+				const rs2_extrinsics identity = { { 1, 0, 0, 0, 1, 0, 0, 0, 1 }, { 0, 0, 0 } };
+				setupStreams(cameraIntrinsics, cameraIntrinsics, identity, TSDF_FUSION_DEPTH_SCALE, TSDF_FUSION_FPS);
+			}
+		}
+
+		~TSDFFusionCaptureDevice() {
+			// The capture thread reads the dataset
+			stopThread();
+		}
+
+		bool waitForFrameset(rs2::frameset& frameset) override {
+			const int numFrames = dataset.getNumFrames();
+			int frame = nextFrame.load();
+
+			if (frame >= numFrames) {
+				if (!realTime.load() || numFrames == 0) {
+					// Finished, like a .bag played without real time
+					std::this_thread::sleep_for(std::chrono::milliseconds(CAPTURE_WAIT_TIMEOUT_MS));
+					return false;
+				}
+				frame = 0;
+				anchored = false;
+			}
+
+			if (realTime.load()) {
+				if (!anchored.exchange(true)) {
+					anchor = clock::now() - std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(getTimestamp(frame)));
+				}
+				const auto due = anchor + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(getTimestamp(frame)));
+				if (due > clock::now() + std::chrono::milliseconds(CAPTURE_WAIT_TIMEOUT_MS)) {
+					nextFrame = frame;
+					std::this_thread::sleep_for(std::chrono::milliseconds(CAPTURE_WAIT_TIMEOUT_MS));
+					return false;
+				}
+				std::this_thread::sleep_until(due);
+			}
+			else {
+				anchored = false;
+			}
+
+			nextFrame = frame + 1;
+			std::unique_ptr<DatasetFrame> decoded = dataset.readFrame(frame);
+			if (!decoded) {
+				return false;
+			}
+			// librealsense owns the pixels from here on
+			return createFrameset(decoded->depth.release(), deleteArray<uint16_t>, decoded->color.release(), deleteArray<uint8_t>,
+				getTimestamp(frame), RS2_TIMESTAMP_DOMAIN_HARDWARE_CLOCK, decoded->frameNumber, frameset);
+		}
+
+		bool getPose(unsigned long long frameId, Eigen::Matrix4d& pose) override {
+			const int frame = dataset.findFrame((int)frameId);
+			if (frame >= dataset.getNumFrames() || dataset.getFrameNumber(frame) != (int)frameId) {
+				return false;
+			}
+			pose = dataset.getPose(frame);
+			return true;
+		}
+
+		void setRealTime(bool realTime) override {
+			this->realTime = realTime;
+			anchored = false;
+		}
+
+		bool isRealTime() override {
+			return realTime;
+		}
+
+		bool seek(std::chrono::nanoseconds position) override {
+			if (dataset.getNumFrames() == 0) {
+				return false;
+			}
+			const double frame = std::chrono::duration<double>(position).count() * TSDF_FUSION_FPS;
+			nextFrame = std::max(0, std::min((int)std::ceil(frame), dataset.getNumFrames()));
+			anchored = false;
+			return true;
+		}
+
+		std::chrono::nanoseconds getPosition() override {
+			const int frame = nextFrame.load();
+			if (frame == 0 || frame > dataset.getNumFrames()) {
+				return std::chrono::nanoseconds(0);
+			}
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double, std::milli>(getTimestamp(frame - 1)));
+		}
+
+		std::chrono::nanoseconds getDuration() override {
+			if (dataset.getNumFrames() == 0) {
+				return std::chrono::nanoseconds(0);
+			}
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double, std::milli>(getTimestamp(dataset.getNumFrames() - 1)));
+		}
+
+		bool hasFinished() override {
+			return !realTime && nextFrame.load() >= dataset.getNumFrames();
+		}
 	};
 }
 
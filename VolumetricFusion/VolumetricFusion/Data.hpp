@@ -16,7 +16,10 @@
 #include <functional>
 #include <vector>
 
+#include <opencv2/core/core.hpp>
+
 #include "Processing.hpp"
+#include "TripleBuffer.hpp"
 
 #include "ceres/ceres.h"
 
@@ -29,22 +32,66 @@ namespace vc::processing {
 }
 
 namespace vc::data {
+	/// <summary>
+	/// The filtered frames of one frameset, published together so that depth and color always match.
+	/// </summary>
+	struct Frames {
+		rs2::frame depth;
+		rs2::frame color;
+		// Empty while no colorized depth view is shown
+		rs2::frame colorizedDepth;
+		unsigned long long frameId = 0;
+		// Milliseconds, as reported by the device
+		double timestamp = 0;
+		// The markers the detect stage found in color, empty while the cameras are not calibrated
+		std::vector<int> markerIds;
+		std::vector<std::vector<cv::Point2f>> markerCorners;
+	};
+
+	/// <summary>
+	/// The threads that read frames, each one takes them from its own triple buffer.
+	/// </summary>
+	enum class FrameConsumer {
+		MAIN_LOOP,
+		CALIBRATION,
+		COUNT
+	};
+
 	class Data {
-	public:
+	private:
+		vc::utils::TripleBuffer<Frames> frames[(int)FrameConsumer::COUNT];
 
-		unsigned long long frameId;
+	public:
 		std::string deviceName;
 
-		//texture tex;
-		rs2::frame  filteredColorFrames;
-		rs2::frame  filteredDepthFrames;
-
 		rs2::pointcloud pointclouds;
-		rs2::frame colorizedDepthFrames;
 		rs2::points points;
 		
 		vc::processing::ChArUco* processing;
 
+		/// <summary>
+		/// Capture thread: hands the frames to every consumer, never blocks.
+		/// </summary>
+		void publishFrames(const Frames& newFrames) {
+			for (auto& buffer : frames) {
+				buffer.getBack() = newFrames;
+				buffer.publish();
+			}
+		}
+
+		/// <summary>
+		/// Consumer thread: switches to the newest published frames, returns false if there are none since the last call.
+		/// </summary>
+		bool updateFrames(FrameConsumer consumer = FrameConsumer::MAIN_LOOP) {
+			return frames[(int)consumer].update();
+		}
+
+		/// <summary>
+		/// Consumer thread: the frames taken by the last updateFrames(), they stay unchanged until the next call.
+		/// </summary>
+		const Frames& getFrames(FrameConsumer consumer = FrameConsumer::MAIN_LOOP) const {
+			return frames[(int)consumer].getFront();
+		}
 	};
 }
 #endif // !_DATA_HEADER_
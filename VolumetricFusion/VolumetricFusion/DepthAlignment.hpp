@@ -0,0 +1,268 @@
+#pragma once
+
+#ifndef _DEPTH_ALIGNMENT_HEADER
+#define _DEPTH_ALIGNMENT_HEADER
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <Eigen/Dense>
+#include <librealsense2/rs.hpp>
+#include "Simd.hpp"
+
+namespace vc::processing {
+	/// <summary>
+	/// The reprojection of depth pixels into a color image, precomputed per pixel corner.
+	/// A depth pixel at z meters covers the color pixels between its corners rays[corner] * z + offset, after the perspective division.
+	/// The corners of neighboring pixels are shared, so the table has (width + 1) * (height + 1) entries.
+	/// Both cameras are treated as pinholes, the depth streams of the RealSense cameras are undistorted and
+	/// the distortion coefficients of their color streams are zero.
+	/// </summary>
+	class DepthToColorLUT {
+	private:
+		int depthWidth = 0;
+		int depthHeight = 0;
+		int colorWidth = 0;
+		int colorHeight = 0;
+
+		// K_color * R * K_depth^-1 * (x - 0.5, y - 0.5, 1) of every corner, one array per component
+		std::vector<float> rayX;
+		std::vector<float> rayY;
+		std::vector<float> rayZ;
+		// K_color * t
+		Eigen::Vector3f offset = Eigen::Vector3f::Zero();
+
+		// Per pixel of the current depth row: the covered color pixels, u0 > u1 for none
+		std::vector<int> u0s, v0s, u1s, v1s;
+
+		// Projections far outside of the image are clamped before the conversion to int
+		static constexpr float PIXEL_LIMIT = 65536.0f;
+
+		static int toPixel(float coordinate) {
+			return (int)std::floor(std::min(std::max(coordinate + 0.5f, -PIXEL_LIMIT), PIXEL_LIMIT));
+		}
+
+		/// <summary>
+		/// The color pixels covered by the depth pixels [x, x + count) of row y.
+		/// </summary>
+		void computeFootprints(const uint16_t* depth, float depthScale, int y, int x, int count) {
+			for (int i = x; i < x + count; i++) {
+				const float z = depth[i] * depthScale;
+				const int low = y * (depthWidth + 1) + i;
+				const int high = low + depthWidth + 2;
+				if (z <= 0) {
+					u0s[i] = 1;
+					u1s[i] = 0;
+					continue;
+				}
+				const float lowW = rayZ[low] * z + offset[2];
+				const float highW = rayZ[high] * z + offset[2];
+				// Behind the color camera, nothing to cover
+				if (lowW <= 0 || highW <= 0) {
+					u0s[i] = 1;
+					u1s[i] = 0;
+					continue;
+				}
+				u0s[i] = toPixel((rayX[low] * z + offset[0]) / lowW);
+				v0s[i] = toPixel((rayY[low] * z + offset[1]) / lowW);
+				u1s[i] = toPixel((rayX[high] * z + offset[0]) / highW);
+				v1s[i] = toPixel((rayY[high] * z + offset[1]) / highW);
+			}
+		}
+
+	public:
+		/// <summary>
+		/// Precomputes the table, only needed again when one of the streams changes.
+		/// </summary>
+		void build(const rs2_intrinsics& depthIntrinsics, const rs2_intrinsics& colorIntrinsics, const rs2_extrinsics& depthToColor) {
+			depthWidth = depthIntrinsics.width;
+			depthHeight = depthIntrinsics.height;
+			colorWidth = colorIntrinsics.width;
+			colorHeight = colorIntrinsics.height;
+
+			Eigen::Matrix3f colorProjection;
+			colorProjection <<
+				colorIntrinsics.fx, 0, colorIntrinsics.ppx,
+				0, colorIntrinsics.fy, colorIntrinsics.ppy,
+				0, 0, 1;
+			// Column major like Eigen
+			const Eigen::Matrix3f rotation = Eigen::Map<const Eigen::Matrix3f>(depthToColor.rotation);
+			const Eigen::Matrix3f projectedRotation = colorProjection * rotation;
+			offset = colorProjection * Eigen::Map<const Eigen::Vector3f>(depthToColor.translation);
+
+			const size_t numCorners = (size_t)(depthWidth + 1) * (depthHeight + 1);
+			rayX.resize(numCorners);
+			rayY.resize(numCorners);
+			rayZ.resize(numCorners);
+			for (int y = 0; y <= depthHeight; y++) {
+				for (int x = 0; x <= depthWidth; x++) {
+					const Eigen::Vector3f ray((x - 0.5f - depthIntrinsics.ppx) / depthIntrinsics.fx, (y - 0.5f - depthIntrinsics.ppy) / depthIntrinsics.fy, 1);
+					const Eigen::Vector3f projected = projectedRotation * ray;
+					const size_t corner = (size_t)y * (depthWidth + 1) + x;
+					rayX[corner] = projected[0];
+					rayY[corner] = projected[1];
+					rayZ[corner] = projected[2];
+				}
+			}
+
+			u0s.resize(depthWidth);
+			v0s.resize(depthWidth);
+			u1s.resize(depthWidth);
+			v1s.resize(depthWidth);
+		}
+
+		bool matches(int depthWidth, int depthHeight, int colorWidth, int colorHeight) const {
+			return depthWidth == this->depthWidth && depthHeight == this->depthHeight && colorWidth == this->colorWidth && colorHeight == this->colorHeight;
+		}
+
+		/// <summary>
+		/// Splats every depth pixel onto the color pixels it covers, the nearest depth wins.
+		/// aligned has the size of the color image, its pixels without depth are zero.
+		/// </summary>
+		void align(const uint16_t* depth, float depthScale, uint16_t* aligned) {
+			std::memset(aligned, 0, sizeof(uint16_t) * colorWidth * colorHeight);
+
+			for (int y = 0; y < depthHeight; y++) {
+				const uint16_t* row = depth + (size_t)y * depthWidth;
+				int x = 0;
+
+#if defined(VC_USE_AVX2)
+				const __m256 scale = _mm256_set1_ps(depthScale);
+				const __m256 zero = _mm256_setzero_ps();
+				const __m256 half = _mm256_set1_ps(0.5f);
+				const __m256 lowerLimit = _mm256_set1_ps(-PIXEL_LIMIT);
+				const __m256 upperLimit = _mm256_set1_ps(PIXEL_LIMIT);
+				const __m256 offsetX = _mm256_set1_ps(offset[0]);
+				const __m256 offsetY = _mm256_set1_ps(offset[1]);
+				const __m256 offsetZ = _mm256_set1_ps(offset[2]);
+				// Marks pixels without footprint, u0 > u1
+				const __m256i none = _mm256_set1_epi32(1);
+
+				for (; x + 8 <= depthWidth; x += 8) {
+					const __m256 z = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(row + x)))), scale);
+					const size_t low = (size_t)y * (depthWidth + 1) + x;
+					const size_t high = low + depthWidth + 2;
+
+					const __m256 lowW = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&rayZ[low]), z), offsetZ);
+					const __m256 highW = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&rayZ[high]), z), offsetZ);
+					const __m256 valid = _mm256_and_ps(_mm256_cmp_ps(z, zero, _CMP_GT_OQ),
+						_mm256_and_ps(_mm256_cmp_ps(lowW, zero, _CMP_GT_OQ), _mm256_cmp_ps(highW, zero, _CMP_GT_OQ)));
+					if (_mm256_movemask_ps(valid) == 0) {
+						_mm256_storeu_si256((__m256i*)&u0s[x], none);
+						_mm256_storeu_si256((__m256i*)&u1s[x], _mm256_setzero_si256());
+						continue;
+					}
+
+					const __m256 lowInverse = _mm256_div_ps(_mm256_set1_ps(1.0f), lowW);
+					const __m256 highInverse = _mm256_div_ps(_mm256_set1_ps(1.0f), highW);
+					auto round = [&](__m256 value) {
+						return _mm256_cvtps_epi32(_mm256_floor_ps(_mm256_min_ps(_mm256_max_ps(_mm256_add_ps(value, half), lowerLimit), upperLimit)));
+					};
+					const __m256i u0 = round(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&rayX[low]), z), offsetX), lowInverse));
+					const __m256i v0 = round(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&rayY[low]), z), offsetY), lowInverse));
+					const __m256i u1 = round(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&rayX[high]), z), offsetX), highInverse));
+					const __m256i v1 = round(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&rayY[high]), z), offsetY), highInverse));
+
+					const __m256i validInt = _mm256_castps_si256(valid);
+					_mm256_storeu_si256((__m256i*)&u0s[x], _mm256_blendv_epi8(none, u0, validInt));
+					_mm256_storeu_si256((__m256i*)&v0s[x], v0);
+					_mm256_storeu_si256((__m256i*)&u1s[x], _mm256_and_si256(u1, validInt));
+					_mm256_storeu_si256((__m256i*)&v1s[x], v1);
+				}
+#endif
+				computeFootprints(row, depthScale, y, x, depthWidth - x);
+
+				// The footprints of neighbors overlap in the color image, so the splatting stays sequential
+				for (x = 0; x < depthWidth; x++) {
+					const int u0 = std::max(u0s[x], 0);
+					const int u1 = std::min(u1s[x], colorWidth - 1);
+					const int v0 = std::max(v0s[x], 0);
+					const int v1 = std::min(v1s[x], colorHeight - 1);
+					if (u0 > u1 || v0 > v1) {
+						continue;
+					}
+					// Zero wraps around to the largest value, so it never wins against a depth
+					const uint16_t value = row[x] - 1;
+					for (int v = v0; v <= v1; v++) {
+						uint16_t* target = aligned + (size_t)v * colorWidth;
+						for (int u = u0; u <= u1; u++) {
+							target[u] = std::min((uint16_t)(target[u] - 1), value) + 1;
+						}
+					}
+				}
+			}
+		}
+	};
+
+	/// <summary>
+	/// Replacement of rs2::align(RS2_STREAM_COLOR) with a DepthToColorLUT, so the reprojection rays are not recomputed for every frame.
+	/// The table is rebuilt from the stream profiles of the frames whenever they change, e.g. when the decimation does.
+	/// The aligned depth has the resolution and intrinsics of the color stream, like the one of rs2::align.
+	/// Not thread safe, process from the capture thread only.
+	/// </summary>
+	class DepthToColorAlignment {
+	private:
+		DepthToColorLUT lut;
+		rs2::stream_profile depthProfile;
+		rs2::stream_profile colorProfile;
+		rs2::stream_profile alignedProfile;
+		float depthScale = 0;
+
+		rs2::filter filter;
+
+		void update(const rs2::video_frame& depth, const rs2::video_frame& color) {
+			if (depthProfile && colorProfile && depth.get_profile().get() == depthProfile.get() && color.get_profile().get() == colorProfile.get() &&
+				lut.matches(depth.get_width(), depth.get_height(), color.get_width(), color.get_height())) {
+				return;
+			}
+			depthProfile = depth.get_profile();
+			colorProfile = color.get_profile();
+			// Like the threshold filter, from the option of the sensor
+			depthScale = rs2::sensor_from_frame(depth)->get_option(RS2_OPTION_DEPTH_UNITS);
+
+			const rs2_intrinsics colorIntrinsics = colorProfile.as<rs2::video_stream_profile>().get_intrinsics();
+			lut.build(depthProfile.as<rs2::video_stream_profile>().get_intrinsics(), colorIntrinsics, depthProfile.get_extrinsics_to(colorProfile));
+
+			alignedProfile = depthProfile.as<rs2::video_stream_profile>().clone(RS2_STREAM_DEPTH, depthProfile.stream_index(), RS2_FORMAT_Z16,
+				colorIntrinsics.width, colorIntrinsics.height, colorIntrinsics);
+			// The aligned depth is seen by the color camera
+			const rs2_extrinsics identity = { { 1, 0, 0, 0, 1, 0, 0, 0, 1 }, { 0, 0, 0 } };
+			alignedProfile.register_extrinsics_to(colorProfile, identity);
+		}
+
+		void alignFrameset(rs2::frame frame, const rs2::frame_source& source) {
+			rs2::frameset frameset = frame.as<rs2::frameset>();
+			rs2::depth_frame depth = frameset ? frameset.get_depth_frame() : rs2::depth_frame(rs2::frame());
+			rs2::video_frame color = frameset ? frameset.get_color_frame() : rs2::video_frame(rs2::frame());
+			if (!depth || !color || depth.get_profile().format() != RS2_FORMAT_Z16) {
+				source.frame_ready(frame);
+				return;
+			}
+
+			update(depth, color);
+			rs2::frame aligned = source.allocate_video_frame(alignedProfile, depth, sizeof(uint16_t), color.get_width(), color.get_height(),
+				color.get_width() * (int)sizeof(uint16_t), RS2_EXTENSION_DEPTH_FRAME);
+			lut.align((const uint16_t*)depth.get_data(), depthScale, (uint16_t*)aligned.get_data());
+			source.frame_ready(source.allocate_composite_frame({ aligned, color }));
+		}
+
+	public:
+		DepthToColorAlignment() :
+			filter([this](rs2::frame frame, rs2::frame_source& source) { alignFrameset(frame, source); })
+		{}
+
+		DepthToColorAlignment(const DepthToColorAlignment&) = delete;
+		DepthToColorAlignment& operator=(const DepthToColorAlignment&) = delete;
+
+		/// <summary>
+		/// The frameset with the depth replaced by the aligned depth, unchanged if it lacks depth or color.
+		/// </summary>
+		rs2::frameset process(rs2::frameset frameset) {
+			return filter.process(frameset);
+		}
+	};
+}
+
+#endif // !_DEPTH_ALIGNMENT_HEADER
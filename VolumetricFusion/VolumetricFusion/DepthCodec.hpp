@@ -0,0 +1,259 @@
+#pragma once
+
+#ifndef _DEPTH_CODEC_HEADER
+#define _DEPTH_CODEC_HEADER
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include "Simd.hpp"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace vc::capture {
+	/// <summary>
+	/// Lossless run length variable length (RVL) coding of Z16 depth images, after A. Wilson, "Fast Lossless Depth Image Compression", 2017.
+	/// The image alternates between runs of invalid (zero) and valid pixels. Each run length and each valid pixel,
+	/// as zigzag coded difference to the previous valid pixel, is written as 3 bit groups with a continuation bit,
+	/// one nibble each. Eight nibbles form a 32 bit word, the first nibble in the highest bits.
+	/// Finding the runs and computing the differences is vectorized, writing the nibbles is inherently sequential.
+	/// </summary>
+	namespace rvl {
+		// Valid pixels converted to differences at once
+		const size_t DELTA_CHUNK = 256;
+
+		inline uint32_t countTrailingZeros(uint32_t mask) {
+#ifdef _MSC_VER
+			unsigned long index;
+			_BitScanForward(&index, mask);
+			return index;
+#else
+			return __builtin_ctz(mask);
+#endif
+		}
+
+		/// <summary>
+		/// The first pixel from begin on whose validity differs from valid, end if there is none.
+		/// </summary>
+		inline size_t findRunEnd(const uint16_t* depth, size_t begin, size_t end, bool valid) {
+			size_t i = begin;
+#if defined(VC_USE_AVX2)
+			const __m256i zero = _mm256_setzero_si256();
+			// Two mask bits per pixel, set for zero pixels
+			const uint32_t runMask = valid ? 0u : 0xFFFFFFFFu;
+			for (; i + 16 <= end; i += 16) {
+				const __m256i pixels = _mm256_loadu_si256((const __m256i*)(depth + i));
+				const uint32_t differs = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi16(pixels, zero)) ^ runMask;
+				if (differs) {
+					return i + countTrailingZeros(differs) / 2;
+				}
+			}
+#endif
+			for (; i < end && (depth[i] != 0) == valid; i++) {
+			}
+			return i;
+		}
+
+		/// <summary>
+		/// Zigzag coded differences of count valid pixels to their predecessor, previous precedes the first one.
+		/// </summary>
+		inline void computeDeltas(const uint16_t* depth, size_t count, int previous, uint32_t* deltas) {
+			auto zigzag = [](int delta) {
+				return ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+			};
+
+			deltas[0] = zigzag((int)depth[0] - previous);
+			size_t i = 1;
+#if defined(VC_USE_AVX2)
+			for (; i + 8 <= count; i += 8) {
+				const __m256i current = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(depth + i)));
+				const __m256i before = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(depth + i - 1)));
+				const __m256i delta = _mm256_sub_epi32(current, before);
+				_mm256_storeu_si256((__m256i*)(deltas + i), _mm256_xor_si256(_mm256_slli_epi32(delta, 1), _mm256_srai_epi32(delta, 31)));
+			}
+#endif
+			for (; i < count; i++) {
+				deltas[i] = zigzag((int)depth[i] - (int)depth[i - 1]);
+			}
+		}
+
+		class NibbleWriter {
+		private:
+			uint8_t* output;
+			uint8_t* next;
+			// Nibbles not written yet, the oldest in the highest used bits
+			uint64_t pending = 0;
+			int nibbles = 0;
+
+			void flush() {
+				const uint32_t word = (uint32_t)(pending >> (4 * (nibbles - 8)));
+				std::memcpy(next, &word, sizeof(word));
+				next += sizeof(word);
+				nibbles -= 8;
+			}
+
+		public:
+			NibbleWriter(uint8_t* output) : output(output), next(output) {}
+
+			void write(uint32_t value) {
+				// Most differences fit a single nibble
+				if (value < 0x8) {
+					pending = (pending << 4) | value;
+					nibbles++;
+				}
+				else if (value < (1u << 21)) {
+					// Up to 7 nibbles, so pending never holds more than 14
+					int count = 1;
+					while (value >> (3 * count)) {
+						count++;
+					}
+					uint64_t packed = 0;
+					for (int i = 0; i < count; i++) {
+						packed = (packed << 4) | ((value >> (3 * i)) & 0x7) | (i + 1 < count ? 0x8 : 0);
+					}
+					pending = (pending << (4 * count)) | packed;
+					nibbles += count;
+				}
+				else {
+					do {
+						uint32_t nibble = value & 0x7;
+						value >>= 3;
+						if (value) {
+							nibble |= 0x8;
+						}
+						pending = (pending << 4) | nibble;
+						if (++nibbles == 8) {
+							flush();
+						}
+					} while (value);
+				}
+				if (nibbles >= 8) {
+					flush();
+				}
+			}
+
+			/// <summary>
+			/// Pads the last word and returns the bytes written.
+			/// </summary>
+			size_t finish() {
+				if (nibbles) {
+					pending <<= 4 * (8 - nibbles);
+					nibbles = 8;
+					flush();
+				}
+				return next - output;
+			}
+		};
+
+		class NibbleReader {
+		private:
+			const uint8_t* next;
+			const uint8_t* end;
+			uint32_t word = 0;
+			int nibbles = 0;
+
+		public:
+			NibbleReader(const uint8_t* input, size_t inputBytes) : next(input), end(input + inputBytes) {}
+
+			/// <summary>
+			/// Returns false if the input ends early or the value does not fit 32 bits.
+			/// </summary>
+			bool read(uint32_t& value) {
+				value = 0;
+				for (int shift = 0; shift < 32; shift += 3) {
+					if (nibbles == 0) {
+						if (end - next < (ptrdiff_t)sizeof(word)) {
+							return false;
+						}
+						std::memcpy(&word, next, sizeof(word));
+						next += sizeof(word);
+						nibbles = 8;
+					}
+					const uint32_t nibble = word >> 28;
+					word <<= 4;
+					nibbles--;
+
+					value |= (nibble & 0x7) << shift;
+					if (!(nibble & 0x8)) {
+						return true;
+					}
+				}
+				return false;
+			}
+		};
+	}
+
+	/// <summary>
+	/// Upper bound of the encoded size of numPixels pixels: at most 6 nibbles per valid pixel,
+	/// the run lengths at most one nibble per pixel and two more, plus the padding of the last word.
+	/// </summary>
+	inline size_t getRVLBound(size_t numPixels) {
+		return numPixels * 4 + 8;
+	}
+
+	/// <summary>
+	/// Encodes numPixels depth values into output, which has to hold getRVLBound(numPixels) bytes.
+	/// Returns the bytes written, always a multiple of 4.
+	/// </summary>
+	inline size_t encodeRVL(const uint16_t* depth, size_t numPixels, uint8_t* output) {
+		rvl::NibbleWriter writer(output);
+		uint32_t deltas[rvl::DELTA_CHUNK];
+		int previous = 0;
+
+		size_t i = 0;
+		while (i < numPixels) {
+			const size_t validBegin = rvl::findRunEnd(depth, i, numPixels, false);
+			const size_t validEnd = rvl::findRunEnd(depth, validBegin, numPixels, true);
+			writer.write((uint32_t)(validBegin - i));
+			writer.write((uint32_t)(validEnd - validBegin));
+
+			for (size_t chunk = validBegin; chunk < validEnd; chunk += rvl::DELTA_CHUNK) {
+				const size_t count = std::min(rvl::DELTA_CHUNK, validEnd - chunk);
+				rvl::computeDeltas(depth + chunk, count, previous, deltas);
+				previous = depth[chunk + count - 1];
+				for (size_t j = 0; j < count; j++) {
+					writer.write(deltas[j]);
+				}
+			}
+			i = validEnd;
+		}
+		return writer.finish();
+	}
+
+	/// <summary>
+	/// Decodes exactly numPixels depth values, returns false if the input is corrupt or too short.
+	/// </summary>
+	inline bool decodeRVL(const uint8_t* input, size_t inputBytes, uint16_t* depth, size_t numPixels) {
+		rvl::NibbleReader reader(input, inputBytes);
+		int previous = 0;
+
+		size_t i = 0;
+		while (i < numPixels) {
+			uint32_t invalid;
+			uint32_t valid;
+			if (!reader.read(invalid) || invalid > numPixels - i) {
+				return false;
+			}
+			std::memset(depth + i, 0, sizeof(uint16_t) * invalid);
+			i += invalid;
+
+			if (!reader.read(valid) || valid > numPixels - i) {
+				return false;
+			}
+			for (uint32_t j = 0; j < valid; j++) {
+				uint32_t zigzag;
+				if (!reader.read(zigzag)) {
+					return false;
+				}
+				previous += (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+				depth[i++] = (uint16_t)previous;
+			}
+		}
+		return true;
+	}
+}
+
+#endif // !_DEPTH_CODEC_HEADER
@@ -0,0 +1,422 @@
+#pragma once
+
+#ifndef _DEPTH_PYRAMID_HEADER
+#define _DEPTH_PYRAMID_HEADER
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+#include <librealsense2/rs.hpp>
+#include "PinholeCamera.hpp"
+#include "HighConfidenceFilter.hpp"
+#include "Simd.hpp"
+#include "ThreadPool.hpp"
+
+namespace vc::processing {
+	// Levels of the pyramid, each one has half the width and height of the one before
+	const int DEFAULT_PYRAMID_LEVELS = 3;
+	// The bilateral filter averages the (2 * radius + 1)^2 neighbors of a pixel
+	const int BILATERAL_RADIUS = 2;
+	// Standard deviation of the spatial weights of the bilateral filter in pixels
+	const float DEFAULT_SIGMA_SPACE = 1.5f;
+	// Standard deviation of the depth weights of the bilateral filter in meters, depths further apart are not smoothed together
+	const float DEFAULT_SIGMA_RANGE = 0.03f;
+
+	/// <summary>
+	/// One level of a DepthPyramid, all maps have width * height pixels in rows.
+	/// The vertex and normal maps are stored per component, which is what the vectorized consumers want.
+	/// Invalid pixels have depth zero, a vertex with z zero and the normal (0, 0, 0).
+	/// </summary>
+	struct PyramidLevel {
+		int width = 0;
+		int height = 0;
+		// Intrinsics of the level, the blocks of the downsampling are seen from their centers
+		std::shared_ptr<vc::camera::PinholeCamera> camera;
+
+		// Meters
+		std::vector<float> depth;
+		// Camera space, through camera->cam2world
+		std::vector<float> vertexX;
+		std::vector<float> vertexY;
+		std::vector<float> vertexZ;
+		// Unit length, facing the camera
+		std::vector<float> normalX;
+		std::vector<float> normalY;
+		std::vector<float> normalZ;
+
+		void resize(int width, int height) {
+			this->width = width;
+			this->height = height;
+			const size_t size = (size_t)width * height;
+			for (auto* map : { &depth, &vertexX, &vertexY, &vertexZ, &normalX, &normalY, &normalZ }) {
+				map->resize(size);
+			}
+		}
+	};
+
+	/// <summary>
+	/// Smoothed depth, vertex and normal maps of a depth frame at several resolutions, the input of a projective ICP.
+	/// The first level is the bilateral filtered frame, every further level averages 2x2 blocks of the level before,
+	/// skipping depths that differ too much from the top left one, so no surfaces get mixed at depth discontinuities.
+	/// The vertices are back-projected with the camera of their level, the normals are the cross products of the differences
+	/// to the right and lower neighbor. The kernels are vectorized and run in strips of rows on the shared thread pool.
+	/// The maps are kept between frames and only reallocated when the resolution changes.
+	/// Not thread safe, build from one thread at a time.
+	/// </summary>
+	class DepthPyramid {
+	private:
+		int numLevels;
+		float sigmaSpace;
+		float sigmaRange;
+
+		std::vector<PyramidLevel> levels;
+		rs2_intrinsics intrinsics = {};
+
+		// The depth in meters with a border of BILATERAL_RADIUS zeros, so the filter needs no bounds checks
+		std::vector<float> padded;
+		int paddedWidth = 0;
+		// -d^2 / (2 sigmaSpace^2) of the neighbors, row by row
+		std::vector<float> spatialExponents;
+		float rangeFactor = 0;
+
+		static bool sameIntrinsics(const rs2_intrinsics& a, const rs2_intrinsics& b) {
+			return a.width == b.width && a.height == b.height && a.fx == b.fx && a.fy == b.fy && a.ppx == b.ppx && a.ppy == b.ppy;
+		}
+
+		void update(const rs2_intrinsics& intrinsics) {
+			if (!levels.empty() && sameIntrinsics(intrinsics, this->intrinsics)) {
+				return;
+			}
+			this->intrinsics = intrinsics;
+
+			levels.resize(numLevels);
+			for (int level = 0; level < numLevels; level++) {
+				const rs2_intrinsics levelIntrinsics = level == 0 ? intrinsics : downsampleIntrinsics(intrinsics, 1 << level);
+				levels[level].resize(levelIntrinsics.width, levelIntrinsics.height);
+				levels[level].camera = std::make_shared<vc::camera::PinholeCamera>(levelIntrinsics);
+			}
+
+			paddedWidth = intrinsics.width + 2 * BILATERAL_RADIUS;
+			// Only the border stays zero, the inside is overwritten by every frame
+			padded.assign((size_t)paddedWidth * (intrinsics.height + 2 * BILATERAL_RADIUS), 0.0f);
+		}
+
+#if defined(VC_USE_AVX2)
+		/// <summary>
+		/// e^x for x <= 0, to about 1e-4 relative which is plenty for weights.
+		/// 2^(x log2(e)) split into the exponent bits and a cubic polynomial of the fraction.
+		/// </summary>
+		static __m256 exp(__m256 x) {
+			x = _mm256_max_ps(x, _mm256_set1_ps(-87.0f));
+			const __m256 t = _mm256_mul_ps(x, _mm256_set1_ps(1.44269504f));
+			const __m256 integer = _mm256_floor_ps(t);
+			const __m256 fraction = _mm256_sub_ps(t, integer);
+			__m256 p = _mm256_set1_ps(7.9204240e-2f);
+			p = _mm256_add_ps(_mm256_mul_ps(p, fraction), _mm256_set1_ps(2.2433836e-1f));
+			p = _mm256_add_ps(_mm256_mul_ps(p, fraction), _mm256_set1_ps(6.9645720e-1f));
+			p = _mm256_add_ps(_mm256_mul_ps(p, fraction), _mm256_set1_ps(9.9989200e-1f));
+			const __m256i exponent = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(integer), _mm256_set1_epi32(127)), 23);
+			return _mm256_mul_ps(p, _mm256_castsi256_ps(exponent));
+		}
+#endif
+
+		/// <summary>
+		/// Rows [beginRow, endRow) of the Z16 depth in meters into padded, depthStride is the row length of depth in pixels.
+		/// </summary>
+		void convert(const uint16_t* depth, int depthStride, float depthScale, int beginRow, int endRow) {
+			const int width = intrinsics.width;
+			for (int y = beginRow; y < endRow; y++) {
+				const uint16_t* source = depth + (size_t)y * depthStride;
+				float* target = &padded[(size_t)(y + BILATERAL_RADIUS) * paddedWidth + BILATERAL_RADIUS];
+				int x = 0;
+#if defined(VC_USE_AVX2)
+				const __m256 scale = _mm256_set1_ps(depthScale);
+				for (; x + 8 <= width; x += 8) {
+					const __m256i values = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(source + x)));
+					_mm256_storeu_ps(target + x, _mm256_mul_ps(_mm256_cvtepi32_ps(values), scale));
+				}
+#endif
+				for (; x < width; x++) {
+					target[x] = source[x] * depthScale;
+				}
+			}
+		}
+
+		/// <summary>
+		/// Rows [beginRow, endRow) of the first level, the weight of a neighbor is e^(-d^2 / (2 sigmaSpace^2) - dz^2 / (2 sigmaRange^2)).
+		/// Pixels without depth stay empty and don't contribute, so holes are not filled and edges not smeared into them.
+		/// </summary>
+		void bilateral(int beginRow, int endRow) {
+			PyramidLevel& level = levels[0];
+			const int width = level.width;
+			const int diameter = 2 * BILATERAL_RADIUS + 1;
+
+			for (int y = beginRow; y < endRow; y++) {
+				const float* center = &padded[(size_t)(y + BILATERAL_RADIUS) * paddedWidth + BILATERAL_RADIUS];
+				const float* window = &padded[(size_t)y * paddedWidth];
+				float* target = &level.depth[(size_t)y * width];
+				int x = 0;
+#if defined(VC_USE_AVX2)
+				const __m256 zero = _mm256_setzero_ps();
+				const __m256 range = _mm256_set1_ps(rangeFactor);
+				for (; x + 8 <= width; x += 8) {
+					const __m256 depth = _mm256_loadu_ps(center + x);
+					const __m256 valid = _mm256_cmp_ps(depth, zero, _CMP_GT_OQ);
+					if (_mm256_movemask_ps(valid) == 0) {
+						_mm256_storeu_ps(target + x, zero);
+						continue;
+					}
+					__m256 sum = zero;
+					__m256 weights = zero;
+					for (int dy = 0; dy < diameter; dy++) {
+						const float* row = window + (size_t)dy * paddedWidth + x;
+						for (int dx = 0; dx < diameter; dx++) {
+							const __m256 neighbor = _mm256_loadu_ps(row + dx);
+							const __m256 difference = _mm256_sub_ps(neighbor, depth);
+							const __m256 exponent = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(difference, difference), range),
+								_mm256_set1_ps(spatialExponents[dy * diameter + dx]));
+							const __m256 weight = _mm256_and_ps(exp(exponent), _mm256_cmp_ps(neighbor, zero, _CMP_GT_OQ));
+							sum = _mm256_add_ps(sum, _mm256_mul_ps(weight, neighbor));
+							weights = _mm256_add_ps(weights, weight);
+						}
+					}
+					// A valid center has the weight one, so only the invalid ones divide by zero and are masked
+					const __m256 filtered = _mm256_and_ps(_mm256_div_ps(sum, weights), valid);
+					_mm256_storeu_ps(target + x, filtered);
+				}
+#endif
+				for (; x < width; x++) {
+					const float depth = center[x];
+					if (depth <= 0) {
+						target[x] = 0;
+						continue;
+					}
+					float sum = 0;
+					float weights = 0;
+					for (int dy = 0; dy < diameter; dy++) {
+						const float* row = window + (size_t)dy * paddedWidth + x;
+						for (int dx = 0; dx < diameter; dx++) {
+							const float neighbor = row[dx];
+							if (neighbor > 0) {
+								const float difference = neighbor - depth;
+								const float weight = std::exp(difference * difference * rangeFactor + spatialExponents[dy * diameter + dx]);
+								sum += weight * neighbor;
+								weights += weight;
+							}
+						}
+					}
+					target[x] = sum / weights;
+				}
+			}
+		}
+
+		/// <summary>
+		/// Rows [beginRow, endRow) of the level from the one before. Only a quarter of the pixels of the level before, so no vector kernel.
+		/// </summary>
+		void downsample(int index, int beginRow, int endRow) {
+			const PyramidLevel& source = levels[index - 1];
+			PyramidLevel& level = levels[index];
+			// Three standard deviations, the rest belongs to another surface
+			const float maxDifference = 3 * sigmaRange;
+
+			for (int y = beginRow; y < endRow; y++) {
+				const float* row0 = &source.depth[(size_t)2 * y * source.width];
+				const float* row1 = row0 + source.width;
+				float* target = &level.depth[(size_t)y * level.width];
+				for (int x = 0; x < level.width; x++) {
+					const float depth = row0[2 * x];
+					if (depth <= 0) {
+						target[x] = 0;
+						continue;
+					}
+					float sum = 0;
+					int count = 0;
+					for (float neighbor : { row0[2 * x], row0[2 * x + 1], row1[2 * x], row1[2 * x + 1] }) {
+						if (neighbor > 0 && std::abs(neighbor - depth) < maxDifference) {
+							sum += neighbor;
+							count++;
+						}
+					}
+					target[x] = sum / count;
+				}
+			}
+		}
+
+		/// <summary>
+		/// Rows [beginRow, endRow) of the vertex map of the level, vertex = depth * cam2world * (x, y, 1).
+		/// </summary>
+		void backProject(int index, int beginRow, int endRow) {
+			PyramidLevel& level = levels[index];
+			const Eigen::Matrix3f cam2world = level.camera->cam2world.cast<float>();
+
+			for (int y = beginRow; y < endRow; y++) {
+				const size_t offset = (size_t)y * level.width;
+				const float* depth = &level.depth[offset];
+				float* vertexX = &level.vertexX[offset];
+				float* vertexY = &level.vertexY[offset];
+				float* vertexZ = &level.vertexZ[offset];
+				// The ray of the first pixel of the row and the step to the next one
+				const Eigen::Vector3f start = cam2world * Eigen::Vector3f(0, (float)y, 1);
+				const Eigen::Vector3f step = cam2world.col(0);
+				int x = 0;
+#if defined(VC_USE_AVX2)
+				const __m256 laneOffsets = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+				const __m256 startX = _mm256_set1_ps(start[0]), startY = _mm256_set1_ps(start[1]), startZ = _mm256_set1_ps(start[2]);
+				const __m256 stepX = _mm256_set1_ps(step[0]), stepY = _mm256_set1_ps(step[1]), stepZ = _mm256_set1_ps(step[2]);
+				for (; x + 8 <= level.width; x += 8) {
+					const __m256 xs = _mm256_add_ps(_mm256_set1_ps((float)x), laneOffsets);
+					const __m256 z = _mm256_loadu_ps(depth + x);
+					_mm256_storeu_ps(vertexX + x, _mm256_mul_ps(_mm256_add_ps(startX, _mm256_mul_ps(xs, stepX)), z));
+					_mm256_storeu_ps(vertexY + x, _mm256_mul_ps(_mm256_add_ps(startY, _mm256_mul_ps(xs, stepY)), z));
+					_mm256_storeu_ps(vertexZ + x, _mm256_mul_ps(_mm256_add_ps(startZ, _mm256_mul_ps(xs, stepZ)), z));
+				}
+#endif
+				for (; x < level.width; x++) {
+					const Eigen::Vector3f vertex = (start + (float)x * step) * depth[x];
+					vertexX[x] = vertex[0];
+					vertexY[x] = vertex[1];
+					vertexZ[x] = vertex[2];
+				}
+			}
+		}
+
+		/// <summary>
+		/// Rows [beginRow, endRow) of the normal map of the level, (down - vertex) x (right - vertex), normalized.
+		/// Needs the vertices of the row below, so it runs after the whole vertex map. The last row and column have no normals.
+		/// </summary>
+		void computeNormals(int index, int beginRow, int endRow) {
+			PyramidLevel& level = levels[index];
+			const int width = level.width;
+
+			for (int y = beginRow; y < endRow; y++) {
+				const size_t offset = (size_t)y * width;
+				float* normalX = &level.normalX[offset];
+				float* normalY = &level.normalY[offset];
+				float* normalZ = &level.normalZ[offset];
+				if (y == level.height - 1) {
+					std::fill(normalX, normalX + width, 0.0f);
+					std::fill(normalY, normalY + width, 0.0f);
+					std::fill(normalZ, normalZ + width, 0.0f);
+					continue;
+				}
+				const float* vertexX = &level.vertexX[offset];
+				const float* vertexY = &level.vertexY[offset];
+				const float* vertexZ = &level.vertexZ[offset];
+				int x = 0;
+#if defined(VC_USE_AVX2)
+				const __m256 zero = _mm256_setzero_ps();
+				for (; x + 8 < width; x += 8) {
+					const __m256 x0 = _mm256_loadu_ps(vertexX + x), y0 = _mm256_loadu_ps(vertexY + x), z0 = _mm256_loadu_ps(vertexZ + x);
+					const __m256 zRight = _mm256_loadu_ps(vertexZ + x + 1);
+					const __m256 zDown = _mm256_loadu_ps(vertexZ + x + width);
+					const __m256 rightX = _mm256_sub_ps(_mm256_loadu_ps(vertexX + x + 1), x0);
+					const __m256 rightY = _mm256_sub_ps(_mm256_loadu_ps(vertexY + x + 1), y0);
+					const __m256 rightZ = _mm256_sub_ps(zRight, z0);
+					const __m256 downX = _mm256_sub_ps(_mm256_loadu_ps(vertexX + x + width), x0);
+					const __m256 downY = _mm256_sub_ps(_mm256_loadu_ps(vertexY + x + width), y0);
+					const __m256 downZ = _mm256_sub_ps(zDown, z0);
+
+					const __m256 nx = _mm256_sub_ps(_mm256_mul_ps(downY, rightZ), _mm256_mul_ps(downZ, rightY));
+					const __m256 ny = _mm256_sub_ps(_mm256_mul_ps(downZ, rightX), _mm256_mul_ps(downX, rightZ));
+					const __m256 nz = _mm256_sub_ps(_mm256_mul_ps(downX, rightY), _mm256_mul_ps(downY, rightX));
+					const __m256 length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny)), _mm256_mul_ps(nz, nz)));
+
+					__m256 valid = _mm256_and_ps(_mm256_cmp_ps(z0, zero, _CMP_GT_OQ), _mm256_cmp_ps(zRight, zero, _CMP_GT_OQ));
+					valid = _mm256_and_ps(valid, _mm256_cmp_ps(zDown, zero, _CMP_GT_OQ));
+					valid = _mm256_and_ps(valid, _mm256_cmp_ps(length, zero, _CMP_GT_OQ));
+					// The masked lanes may be inf or nan, the mask clears all their bits
+					const __m256 inverse = _mm256_div_ps(_mm256_set1_ps(1.0f), length);
+					_mm256_storeu_ps(normalX + x, _mm256_and_ps(_mm256_mul_ps(nx, inverse), valid));
+					_mm256_storeu_ps(normalY + x, _mm256_and_ps(_mm256_mul_ps(ny, inverse), valid));
+					_mm256_storeu_ps(normalZ + x, _mm256_and_ps(_mm256_mul_ps(nz, inverse), valid));
+				}
+#endif
+				for (; x < width; x++) {
+					normalX[x] = normalY[x] = normalZ[x] = 0;
+					if (x == width - 1 || vertexZ[x] <= 0 || vertexZ[x + 1] <= 0 || vertexZ[x + width] <= 0) {
+						continue;
+					}
+					const Eigen::Vector3f vertex(vertexX[x], vertexY[x], vertexZ[x]);
+					const Eigen::Vector3f right = Eigen::Vector3f(vertexX[x + 1], vertexY[x + 1], vertexZ[x + 1]) - vertex;
+					const Eigen::Vector3f down = Eigen::Vector3f(vertexX[x + width], vertexY[x + width], vertexZ[x + width]) - vertex;
+					const Eigen::Vector3f normal = down.cross(right);
+					const float length = normal.norm();
+					if (length > 0) {
+						normalX[x] = normal[0] / length;
+						normalY[x] = normal[1] / length;
+						normalZ[x] = normal[2] / length;
+					}
+				}
+			}
+		}
+
+	public:
+		DepthPyramid(int numLevels = DEFAULT_PYRAMID_LEVELS, float sigmaSpace = DEFAULT_SIGMA_SPACE, float sigmaRange = DEFAULT_SIGMA_RANGE) :
+			numLevels(std::max(1, numLevels)),
+			sigmaSpace(sigmaSpace),
+			sigmaRange(sigmaRange)
+		{
+			for (int dy = -BILATERAL_RADIUS; dy <= BILATERAL_RADIUS; dy++) {
+				for (int dx = -BILATERAL_RADIUS; dx <= BILATERAL_RADIUS; dx++) {
+					spatialExponents.emplace_back(-(dx * dx + dy * dy) / (2 * sigmaSpace * sigmaSpace));
+				}
+			}
+			rangeFactor = -1.0f / (2 * sigmaRange * sigmaRange);
+		}
+
+		DepthPyramid(const DepthPyramid&) = delete;
+		DepthPyramid& operator=(const DepthPyramid&) = delete;
+
+		/// <summary>
+		/// Builds all levels from a Z16 image of intrinsics.width x intrinsics.height pixels, depthScale converts it to meters.
+		/// depthStride is the row length of depth in pixels, at least intrinsics.width.
+		/// </summary>
+		void build(const uint16_t* depth, int depthStride, const rs2_intrinsics& intrinsics, float depthScale) {
+			update(intrinsics);
+			vc::utils::ThreadPool& pool = vc::utils::sharedThreadPool();
+
+			// Every pass reads rows of the neighboring strips, so it waits for the one before
+			pool.parallelForRanges(0, intrinsics.height, [&](int begin, int end) {
+				convert(depth, depthStride, depthScale, begin, end);
+			});
+			pool.parallelForRanges(0, levels[0].height, [&](int begin, int end) {
+				bilateral(begin, end);
+				backProject(0, begin, end);
+			});
+			for (int level = 1; level < numLevels; level++) {
+				pool.parallelForRanges(0, levels[level].height, [&](int begin, int end) {
+					downsample(level, begin, end);
+					backProject(level, begin, end);
+				});
+			}
+			for (int level = 0; level < numLevels; level++) {
+				pool.parallelForRanges(0, levels[level].height, [&](int begin, int end) {
+					computeNormals(level, begin, end);
+				});
+			}
+		}
+
+		/// <summary>
+		/// Builds all levels from a Z16 depth frame with the intrinsics of its profile.
+		/// </summary>
+		void build(const rs2::depth_frame& depth, float depthScale) {
+			build((const uint16_t*)depth.get_data(), depth.get_stride_in_bytes() / (int)sizeof(uint16_t),
+				depth.get_profile().as<rs2::video_stream_profile>().get_intrinsics(), depthScale);
+		}
+
+		int getNumLevels() const {
+			return numLevels;
+		}
+
+		/// <summary>
+		/// Level 0 has the resolution of the frame, valid until the next build.
+		/// </summary>
+		const PyramidLevel& getLevel(int level) const {
+			return levels[level];
+		}
+	};
+}
+
+#endif // !_DEPTH_PYRAMID_HEADER
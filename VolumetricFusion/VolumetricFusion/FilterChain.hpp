@@ -0,0 +1,150 @@
+#pragma once
+
+#ifndef _FILTER_CHAIN_HEADER
+#define _FILTER_CHAIN_HEADER
+
+#include <librealsense2/rs.hpp>
+#include "DepthAlignment.hpp"
+#include "HighConfidenceFilter.hpp"
+
+namespace vc::processing {
+	/// <summary>
+	/// How the depth is mapped to the color image.
+	/// </summary>
+	enum class AlignmentMode {
+		// The depth stays in its own image, the integration projects into both images
+		NONE,
+		// rs2::align, which reprojects every pixel from scratch
+		LIBREALSENSE,
+		// DepthToColorAlignment with its precomputed reprojection
+		LUT,
+		COUNT
+	};
+
+	/// <summary>
+	/// How far the HighConfidenceFilter reduces the depth.
+	/// </summary>
+	enum class HighConfidenceMode {
+		// Full resolution
+		NONE,
+		// Nearest depth of every 4x4 block, a sixteenth of the pixels to integrate
+		DOWNSAMPLE,
+		// Only the downsampled depth at edges and corners of the color, needs an alignment
+		TEXTURED,
+		COUNT
+	};
+
+	/// <summary>
+	/// Which filters of a FilterChain run and how they are configured.
+	/// </summary>
+	struct FilterSettings {
+		// 1 disables the decimation, otherwise the depth is downsampled by this factor before the alignment
+		int decimation = 1;
+		float minDistance = 0.2f;
+		float maxDistance = 2.0f;
+		bool spatial = false;
+		bool temporal = false;
+		// LUT is opt-in until it is compared against rs2::align on recordings
+		AlignmentMode alignment = AlignmentMode::LIBREALSENSE;
+		HighConfidenceMode highConfidence = HighConfidenceMode::NONE;
+		// Only needed while a colorized depth view is shown
+		bool colorize = true;
+
+		bool operator==(const FilterSettings& other) const {
+			return decimation == other.decimation && minDistance == other.minDistance && maxDistance == other.maxDistance &&
+				spatial == other.spatial && temporal == other.temporal && alignment == other.alignment && highConfidence == other.highConfidence && colorize == other.colorize;
+		}
+
+		bool operator!=(const FilterSettings& other) const {
+			return !(*this == other);
+		}
+	};
+
+	/// <summary>
+	/// The filters between the pipeline of a device and its frames, created once per device.
+	/// Each filter keeps its own frame pool, so after the first frames no filter allocates anymore.
+	/// Order: decimation, threshold, spatial and temporal on the raw depth, then the alignment to the color,
+	/// the high confidence filter and the colorizer.
+	/// Not thread safe, configure and process from the capture thread only.
+	/// </summary>
+	class FilterChain {
+	private:
+		FilterSettings settings;
+
+		rs2::decimation_filter decimationFilter;
+		rs2::threshold_filter thresholdFilter;
+		rs2::spatial_filter spatialFilter;
+		rs2::temporal_filter temporalFilter;
+		rs2::align alignToColor = rs2::align(RS2_STREAM_COLOR);
+		DepthToColorAlignment lutAlignment;
+		HighConfidenceFilter highConfidenceFilter;
+		rs2::colorizer colorizer;
+
+		void applySettings() {
+			if (settings.decimation > 1) {
+				decimationFilter.set_option(RS2_OPTION_FILTER_MAGNITUDE, (float)settings.decimation);
+			}
+			thresholdFilter.set_option(RS2_OPTION_MIN_DISTANCE, settings.minDistance);
+			thresholdFilter.set_option(RS2_OPTION_MAX_DISTANCE, settings.maxDistance);
+		}
+
+	public:
+		rs2::frame depth;
+		rs2::frame color;
+		// Empty unless FilterSettings::colorize is set
+		rs2::frame colorizedDepth;
+
+		FilterChain() {
+			applySettings();
+		}
+
+		/// <summary>
+		/// Reconfigures the existing filters, the options are only written when the settings changed.
+		/// </summary>
+		void configure(const FilterSettings& settings) {
+			if (settings == this->settings) {
+				return;
+			}
+			this->settings = settings;
+			applySettings();
+		}
+
+		const FilterSettings& getSettings() const {
+			return settings;
+		}
+
+		/// <summary>
+		/// Runs the frameset through the chain, the results are in depth, color and colorizedDepth.
+		/// Returns false if the frameset lacks depth or color.
+		/// </summary>
+		bool process(rs2::frameset frameset) {
+			if (settings.decimation > 1) {
+				frameset = decimationFilter.process(frameset);
+			}
+			frameset = thresholdFilter.process(frameset);
+			if (settings.spatial) {
+				frameset = spatialFilter.process(frameset);
+			}
+			if (settings.temporal) {
+				frameset = temporalFilter.process(frameset);
+			}
+			if (settings.alignment == AlignmentMode::LIBREALSENSE) {
+				frameset = alignToColor.process(frameset);
+			}
+			else if (settings.alignment == AlignmentMode::LUT) {
+				frameset = lutAlignment.process(frameset);
+			}
+			if (settings.highConfidence != HighConfidenceMode::NONE) {
+				frameset = highConfidenceFilter.process(frameset,
+					settings.highConfidence == HighConfidenceMode::TEXTURED && settings.alignment != AlignmentMode::NONE);
+			}
+
+			depth = frameset.get_depth_frame();
+			color = frameset.get_color_frame();
+			colorizedDepth = settings.colorize && depth ? colorizer.process(depth) : rs2::frame();
+			return depth && color;
+		}
+	};
+}
+
+#endif // !_FILTER_CHAIN_HEADER
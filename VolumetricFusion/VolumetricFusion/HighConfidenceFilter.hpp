@@ -1,238 +1,302 @@
+// Based on the high confidence filter of the librealsense depth-filter example.
 // License: Apache 2.0. See LICENSE file in root directory.
 // Copyright(c) 2019 Intel Corporation. All Rights Reserved.
 
-#include <librealsense2/rs.hpp> // Include RealSense Cross Platform API
-#include <librealsense2/rs_advanced_mode.hpp>
-#include <opencv2/opencv.hpp>   // Include OpenCV API
-
-#include <fstream>
-
-rs2_intrinsics operator/(const rs2_intrinsics& i, float f)
-{
-    rs2_intrinsics  res = i;
-    res.width /= f; res.height /= f;
-    res.fx /= f;    res.fy /= f;
-    res.ppx /= f;   res.ppy /= f;
-    return res;
+#pragma once
+
+#ifndef _HIGH_CONFIDENCE_FILTER_HEADER
+#define _HIGH_CONFIDENCE_FILTER_HEADER
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <librealsense2/rs.hpp>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include "Simd.hpp"
+#include "ThreadPool.hpp"
+
+namespace vc::processing {
+	// Width and height of the depth pixels that are reduced to one
+	const int HIGH_CONFIDENCE_DOWNSAMPLING = 4;
+	// Gradient magnitude of the guide above which a pixel counts as edge
+	const double EDGE_THRESHOLD = 192;
+	// Harris response of the guide above which a pixel counts as corner
+	const double HARRIS_THRESHOLD = 300;
+	// Neighborhood and Sobel aperture of the Harris detector
+	const int HARRIS_BLOCK_SIZE = 2;
+	const int HARRIS_APERTURE_SIZE = 3;
+	// Rows a strip of the Harris response reads around it, the box filter over the block reads the derivatives the aperture reads
+	const int HARRIS_STRIP_PADDING = HARRIS_BLOCK_SIZE + HARRIS_APERTURE_SIZE / 2;
+
+	/// <summary>
+	/// Reduces every 4x4 block of a depth image to the nearest valid depth of the block, zero stays invalid.
+	/// The rows [beginRow, endRow) of destination are computed, sourceStride is the row length of source in pixels.
+	/// </summary>
+	void downsampleMin4x4(const uint16_t* source, int sourceStride, uint16_t* destination, int width, int beginRow, int endRow) {
+		for (int y = beginRow; y < endRow; y++) {
+			const uint16_t* row0 = source + (size_t)4 * y * sourceStride;
+			const uint16_t* row1 = row0 + sourceStride;
+			const uint16_t* row2 = row1 + sourceStride;
+			const uint16_t* row3 = row2 + sourceStride;
+			uint16_t* target = destination + (size_t)y * width;
+			int x = 0;
+
+			// Zero wraps around to the largest value by subtracting one, so the unsigned minimum skips it
+#if defined(VC_USE_AVX2)
+			const __m256i ones = _mm256_set1_epi16(1);
+			const __m256i lowWords = _mm256_set1_epi64x(0xFFFF);
+			// The packs interleave the 128 bit lanes, this puts the pairs of results back in order
+			const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+			for (; x + 16 <= width; x += 16) {
+				__m256i blocks[4];
+				for (int i = 0; i < 4; i++) {
+					const int offset = 4 * x + 16 * i;
+					__m256i minimum = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(row0 + offset)), ones);
+					minimum = _mm256_min_epu16(minimum, _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(row1 + offset)), ones));
+					minimum = _mm256_min_epu16(minimum, _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(row2 + offset)), ones));
+					minimum = _mm256_min_epu16(minimum, _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(row3 + offset)), ones));
+					// Minimum of each 4 neighbors in the lowest word of its 64 bits
+					minimum = _mm256_min_epu16(minimum, _mm256_srli_epi32(minimum, 16));
+					minimum = _mm256_min_epu16(minimum, _mm256_srli_epi64(minimum, 32));
+					blocks[i] = _mm256_and_si256(minimum, lowWords);
+				}
+				__m256i packed = _mm256_packus_epi32(_mm256_packus_epi32(blocks[0], blocks[1]), _mm256_packus_epi32(blocks[2], blocks[3]));
+				packed = _mm256_permutevar8x32_epi32(packed, order);
+				_mm256_storeu_si256((__m256i*)(target + x), _mm256_add_epi16(packed, ones));
+			}
+#elif defined(VC_USE_NEON)
+			const uint16x8_t ones = vdupq_n_u16(1);
+
+			for (; x + 8 <= width; x += 8) {
+				// Deinterleaved, lane j of column i holds the pixel 4 * j + i of the row
+				auto minimumOfRow = [&](const uint16_t* row) {
+					const uint16x8x4_t columns = vld4q_u16(row + 4 * x);
+					return vminq_u16(vminq_u16(vsubq_u16(columns.val[0], ones), vsubq_u16(columns.val[1], ones)),
+						vminq_u16(vsubq_u16(columns.val[2], ones), vsubq_u16(columns.val[3], ones)));
+				};
+				const uint16x8_t minimum = vminq_u16(vminq_u16(minimumOfRow(row0), minimumOfRow(row1)), vminq_u16(minimumOfRow(row2), minimumOfRow(row3)));
+				vst1q_u16(target + x, vaddq_u16(minimum, ones));
+			}
+#endif
+
+			for (; x < width; x++) {
+				uint16_t minimum = 0xFFFF;
+				for (int i = 4 * x; i < 4 * x + 4; i++) {
+					minimum = std::min(minimum, (uint16_t)(row0[i] - 1));
+					minimum = std::min(minimum, (uint16_t)(row1[i] - 1));
+					minimum = std::min(minimum, (uint16_t)(row2[i] - 1));
+					minimum = std::min(minimum, (uint16_t)(row3[i] - 1));
+				}
+				target[x] = minimum + 1;
+			}
+		}
+	}
+
+	/// <summary>
+	/// The intrinsics of an image downsampled by blocks of factor x factor pixels.
+	/// A block is seen from its center, so the principal point moves by half a pixel less than one block.
+	/// </summary>
+	rs2_intrinsics downsampleIntrinsics(const rs2_intrinsics& intrinsics, int factor) {
+		rs2_intrinsics downsampled = intrinsics;
+		downsampled.width = intrinsics.width / factor;
+		downsampled.height = intrinsics.height / factor;
+		downsampled.fx = intrinsics.fx / factor;
+		downsampled.fy = intrinsics.fy / factor;
+		downsampled.ppx = (intrinsics.ppx + 0.5f) / factor - 0.5f;
+		downsampled.ppy = (intrinsics.ppy + 0.5f) / factor - 0.5f;
+		return downsampled;
+	}
+
+	/// <summary>
+	/// Reduces the depth to a quarter of its width and height with the nearest depth of every 4x4 block,
+	/// the output has the matching intrinsics and the extrinsics of the input depth to the color.
+	/// With a mask, only the depth at edges and corners of the color image is kept, where the stereo matching is reliable.
+	/// The mask needs the depth aligned to the color, the original filter used the infrared image that the cameras don't stream here.
+	/// The image is processed in horizontal strips on the shared thread pool, one per worker.
+	/// Not thread safe, process from the capture thread only.
+	/// </summary>
+	class HighConfidenceFilter {
+	private:
+		rs2::stream_profile depthProfile;
+		rs2::stream_profile colorProfile;
+		rs2::stream_profile outputProfile;
+		bool masked = false;
+
+		// Allocated once per resolution, the strips are views into them
+		cv::Mat decimatedDepth;
+		cv::Mat decimatedColor;
+		cv::Mat gray;
+		cv::Mat floatGray;
+		cv::Mat scharrX;
+		cv::Mat scharrY;
+		cv::Mat absScharrX;
+		cv::Mat absScharrY;
+		cv::Mat edgeMask;
+		cv::Mat corners;
+		cv::Mat harrisMask;
+		cv::Mat combinedMask;
+		cv::Mat erodedMask;
+		cv::Mat openedMask;
+
+		rs2::filter filter;
+
+		void update(const rs2::video_frame& depth, const rs2::video_frame& color) {
+			if (depthProfile && colorProfile && depth.get_profile().get() == depthProfile.get() && color.get_profile().get() == colorProfile.get()) {
+				return;
+			}
+			depthProfile = depth.get_profile();
+			colorProfile = color.get_profile();
+
+			const rs2_intrinsics intrinsics = downsampleIntrinsics(depthProfile.as<rs2::video_stream_profile>().get_intrinsics(), HIGH_CONFIDENCE_DOWNSAMPLING);
+			outputProfile = depthProfile.as<rs2::video_stream_profile>().clone(RS2_STREAM_DEPTH, depthProfile.stream_index(), RS2_FORMAT_Z16,
+				intrinsics.width, intrinsics.height, intrinsics);
+			// Downsampling keeps the camera where it is
+			outputProfile.register_extrinsics_to(colorProfile, depthProfile.get_extrinsics_to(colorProfile));
+		}
+
+		/// <summary>
+		/// Calls lambda(rows) for horizontal strips of the downsampled image in parallel, one per thread of the shared pool.
+		/// Every call of this method is one pass, the filters of a pass may read the neighbors of their strip written by the previous one.
+		/// </summary>
+		template<typename F>
+		void forEachStrip(int height, F&& lambda) {
+			vc::utils::sharedThreadPool().parallelForRanges(0, height, [&](int begin, int end) {
+				lambda(cv::Range(begin, end));
+			});
+		}
+
+		/// <summary>
+		/// Keeps the decimated depth at the edges and corners of the downsampled color, output must be zeroed.
+		/// </summary>
+		void mask(const rs2::video_frame& color, cv::Mat& output) {
+			const cv::Size size = decimatedDepth.size();
+			decimatedColor.create(size, CV_8UC3);
+			gray.create(size, CV_8U);
+			floatGray.create(size, CV_32F);
+			scharrX.create(size, CV_16S);
+			scharrY.create(size, CV_16S);
+			absScharrX.create(size, CV_8U);
+			absScharrY.create(size, CV_8U);
+			edgeMask.create(size, CV_8U);
+			corners.create(size, CV_32F);
+			harrisMask.create(size, CV_8U);
+			combinedMask.create(size, CV_8U);
+			erodedMask.create(size, CV_8U);
+			openedMask.create(size, CV_8U);
+
+			const cv::Mat colorImage(cv::Size(color.get_width(), color.get_height()), CV_8UC3, (void*)color.get_data(), color.get_stride_in_bytes());
+			const cv::Mat element = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(3, 3));
+
+			forEachStrip(size.height, [&](cv::Range rows) {
+				const cv::Rect source(0, rows.start * HIGH_CONFIDENCE_DOWNSAMPLING, size.width * HIGH_CONFIDENCE_DOWNSAMPLING, rows.size() * HIGH_CONFIDENCE_DOWNSAMPLING);
+				cv::Mat colorStrip = decimatedColor.rowRange(rows);
+				cv::resize(colorImage(source), colorStrip, colorStrip.size(), 0, 0, cv::INTER_NEAREST);
+				cv::Mat grayStrip = gray.rowRange(rows);
+				cv::cvtColor(colorStrip, grayStrip, cv::COLOR_RGB2GRAY);
+				cv::Mat floatStrip = floatGray.rowRange(rows);
+				grayStrip.convertTo(floatStrip, CV_32F);
+			});
+
+			// The filters of a strip read the rows around it, so every pass waits for the previous one
+			forEachStrip(size.height, [&](cv::Range rows) {
+				cv::Mat xStrip = scharrX.rowRange(rows);
+				cv::Mat yStrip = scharrY.rowRange(rows);
+				cv::Mat absXStrip = absScharrX.rowRange(rows);
+				cv::Mat absYStrip = absScharrY.rowRange(rows);
+				cv::Mat edgeStrip = edgeMask.rowRange(rows);
+				cv::Scharr(gray.rowRange(rows), xStrip, CV_16S, 1, 0);
+				cv::convertScaleAbs(xStrip, absXStrip);
+				cv::Scharr(gray.rowRange(rows), yStrip, CV_16S, 0, 1);
+				cv::convertScaleAbs(yStrip, absYStrip);
+				cv::addWeighted(absXStrip, 0.5, absYStrip, 0.5, 0, edgeStrip);
+				cv::threshold(edgeStrip, edgeStrip, EDGE_THRESHOLD, 255, cv::THRESH_BINARY);
+
+				// Unlike the other filters, cornerHarris filters an intermediate image of its own and can't read the rows around
+				// the strip, so it runs on a padded strip and only the inner rows are kept. This matches the result on the whole image.
+				const cv::Range padded(std::max(0, rows.start - HARRIS_STRIP_PADDING), std::min(size.height, rows.end + HARRIS_STRIP_PADDING));
+				cv::Mat paddedCorners;
+				cv::cornerHarris(floatGray.rowRange(padded), paddedCorners, HARRIS_BLOCK_SIZE, HARRIS_APERTURE_SIZE, 0.04);
+				cv::Mat cornerStrip = corners.rowRange(rows);
+				paddedCorners.rowRange(rows.start - padded.start, rows.end - padded.start).copyTo(cornerStrip);
+				cv::Mat harrisStrip = harrisMask.rowRange(rows);
+				cv::threshold(cornerStrip, cornerStrip, HARRIS_THRESHOLD, 255, cv::THRESH_BINARY);
+				cornerStrip.convertTo(harrisStrip, CV_8U);
+
+				cv::Mat combinedStrip = combinedMask.rowRange(rows);
+				cv::bitwise_or(edgeStrip, harrisStrip, combinedStrip);
+			});
+
+			// Opening, erode and dilate in two passes, removes the isolated pixels of the mask
+			forEachStrip(size.height, [&](cv::Range rows) {
+				cv::Mat erodedStrip = erodedMask.rowRange(rows);
+				cv::erode(combinedMask.rowRange(rows), erodedStrip, element);
+			});
+			forEachStrip(size.height, [&](cv::Range rows) {
+				cv::Mat openedStrip = openedMask.rowRange(rows);
+				cv::dilate(erodedMask.rowRange(rows), openedStrip, element);
+				cv::Mat outputStrip = output.rowRange(rows);
+				decimatedDepth.rowRange(rows).copyTo(outputStrip, openedStrip);
+			});
+		}
+
+		void filterFrameset(rs2::frame frame, const rs2::frame_source& source) {
+			rs2::frameset frameset = frame.as<rs2::frameset>();
+			rs2::depth_frame depth = frameset ? frameset.get_depth_frame() : rs2::depth_frame(rs2::frame());
+			rs2::video_frame color = frameset ? frameset.get_color_frame() : rs2::video_frame(rs2::frame());
+			if (!depth || !color || depth.get_profile().format() != RS2_FORMAT_Z16 ||
+				depth.get_width() < HIGH_CONFIDENCE_DOWNSAMPLING || depth.get_height() < HIGH_CONFIDENCE_DOWNSAMPLING) {
+				source.frame_ready(frame);
+				return;
+			}
+
+			update(depth, color);
+			const int width = depth.get_width() / HIGH_CONFIDENCE_DOWNSAMPLING;
+			const int height = depth.get_height() / HIGH_CONFIDENCE_DOWNSAMPLING;
+			rs2::frame filtered = source.allocate_video_frame(outputProfile, depth, sizeof(uint16_t), width, height,
+				width * (int)sizeof(uint16_t), RS2_EXTENSION_DEPTH_FRAME);
+			cv::Mat output(cv::Size(width, height), CV_16U, (void*)filtered.get_data());
+
+			// The mask compares the pixels of both images, they have to be the same ones
+			const bool canMask = masked && color.get_profile().format() == RS2_FORMAT_RGB8 &&
+				color.get_width() == depth.get_width() && color.get_height() == depth.get_height();
+			uint16_t* decimated = (uint16_t*)output.data;
+			if (canMask) {
+				decimatedDepth.create(cv::Size(width, height), CV_16U);
+				decimated = (uint16_t*)decimatedDepth.data;
+			}
+
+			const uint16_t* input = (const uint16_t*)depth.get_data();
+			forEachStrip(height, [&](cv::Range rows) {
+				downsampleMin4x4(input, depth.get_stride_in_bytes() / (int)sizeof(uint16_t), decimated, width, rows.start, rows.end);
+			});
+
+			if (canMask) {
+				output.setTo(0);
+				mask(color, output);
+			}
+			source.frame_ready(source.allocate_composite_frame({ filtered, color }));
+		}
+
+	public:
+		HighConfidenceFilter() :
+			filter([this](rs2::frame frame, rs2::frame_source& source) { filterFrameset(frame, source); })
+		{}
+
+		HighConfidenceFilter(const HighConfidenceFilter&) = delete;
+		HighConfidenceFilter& operator=(const HighConfidenceFilter&) = delete;
+
+		/// <summary>
+		/// The frameset with the depth replaced by the downsampled depth, masked if masked is set and the depth is aligned to the color.
+		/// Unchanged if it lacks depth or color.
+		/// </summary>
+		rs2::frameset process(rs2::frameset frameset, bool masked) {
+			this->masked = masked;
+			return filter.process(frameset);
+		}
+	};
 }
 
-class high_confidence_filter : public rs2::filter
-{
-public:
-    high_confidence_filter()
-        : filter([this](rs2::frame f, rs2::frame_source& src) {
-        scoped_timer t("collision_avoidance_filter");
-        sdk_handle(f, src);
-    })
-    {
-    }
-
-private:
-    void downsample(const cv::Mat& depth, const cv::Mat& ir)
-    {
-        scoped_timer t("Depth and IR Downsample");
-
-        constexpr float DOWNSAMPLE_FRACTION = 1.0f / DOWNSAMPLE_FACTOR;
-
-        if (_decimated_depth.cols != depth.cols / DOWNSAMPLE_FACTOR ||
-            _decimated_depth.rows != depth.rows / DOWNSAMPLE_FACTOR)
-        {
-            _decimated_depth = cv::Mat(depth.rows / DOWNSAMPLE_FACTOR, depth.cols / DOWNSAMPLE_FACTOR, CV_16U);
-        }
-
-        downsample_min_4x4(depth, &_decimated_depth);
-        cv::resize(ir, _decimated_ir, cv::Size(), DOWNSAMPLE_FRACTION, DOWNSAMPLE_FRACTION, cv::INTER_NEAREST);
-    }
-
-    void main_filter()
-    {
-        scoped_timer t("Main Filter");
-
-        const auto num_sub_images = sub_areas.size();
-
-#pragma omp parallel for
-        for (int i = 0; i < num_sub_images; i++)
-        {
-            filter_edges(&sub_areas[i]);
-            filter_harris(&sub_areas[i]);
-            cv::bitwise_or(sub_areas[i].edge_mask, sub_areas[i].harris_mask, sub_areas[i].combined_mask);
-
-            // morphology: open(src, element) = dilate(erode(src,element))
-            cv::morphologyEx(sub_areas[i].combined_mask, sub_areas[i].combined_mask,
-                cv::MORPH_OPEN, cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(3, 3)));
-            sub_areas[i].decimated_depth.copyTo(sub_areas[i].output_depth, sub_areas[i].combined_mask);
-        }
-    }
-
-    void sdk_handle(rs2::frame& f, rs2::frame_source& src)
-    {
-        auto frames = f.as<rs2::frameset>();
-        assert(frames);
-
-        auto depth_frame = frames.get_depth_frame();
-        assert(depth_frame);
-
-        auto ir_frame = frames.get_infrared_frame();
-        assert(ir_frame);
-
-        if (!_output_ir_profile || _input_ir_profile.get() != ir_frame.get_profile().get())
-        {
-            auto p = ir_frame.get_profile().as<rs2::video_stream_profile>();
-            auto intr = p.get_intrinsics() / DOWNSAMPLE_FACTOR;
-            _input_ir_profile = p;
-            _output_ir_profile = p.clone(p.stream_type(), p.stream_index(), p.format(),
-                p.width() / DOWNSAMPLE_FACTOR, p.height() / DOWNSAMPLE_FACTOR, intr);
-        }
-
-        if (!_output_depth_profile || _input_depth_profile.get() != depth_frame.get_profile().get())
-        {
-            auto p = depth_frame.get_profile().as<rs2::video_stream_profile>();
-            auto intr = p.get_intrinsics() / DOWNSAMPLE_FACTOR;
-            _input_depth_profile = p;
-            _output_depth_profile = p.clone(p.stream_type(), p.stream_index(), p.format(),
-                p.width() / DOWNSAMPLE_FACTOR, p.height() / DOWNSAMPLE_FACTOR, intr);
-        }
-
-        cv::Mat matDepth(cv::Size(depth_frame.get_width(), depth_frame.get_height()), CV_16U, (void*)depth_frame.get_data(), cv::Mat::AUTO_STEP);
-        cv::Mat matGray(cv::Size(ir_frame.get_width(), ir_frame.get_height()), CV_8U, (void*)ir_frame.get_data(), cv::Mat::AUTO_STEP);
-
-        downsample(matDepth, matGray);
-
-        init_matrices(_decimated_ir);
-
-        main_filter();
-
-        auto newW = ir_frame.get_width() / DOWNSAMPLE_FACTOR;
-        auto newH = ir_frame.get_height() / DOWNSAMPLE_FACTOR;
-
-        auto res_ir = src.allocate_video_frame(_output_ir_profile, ir_frame, 0,
-            newW, newH, ir_frame.get_bytes_per_pixel() * newW);
-        memcpy((void*)res_ir.get_data(), _decimated_ir.data, newW * newH);
-
-        auto res_depth = src.allocate_video_frame(_output_depth_profile, depth_frame, 0,
-            newW, newH, depth_frame.get_bytes_per_pixel() * newW, RS2_EXTENSION_DEPTH_FRAME);
-        memcpy((void*)res_depth.get_data(), _depth_output.data, newW * newH * 2);
-
-        std::vector<rs2::frame> fs{ res_ir, res_depth };
-        auto cmp = src.allocate_composite_frame(fs);
-        src.frame_ready(cmp);
-    }
-
-    static constexpr auto DOWNSAMPLE_FACTOR = 4;
-    static constexpr size_t NUM_SUB_IMAGES = 4; // this number directly relates to how many threads are used
-
-    struct sub_area
-    {
-        cv::Mat decimated_depth;
-        cv::Mat decimated_ir;
-        cv::Mat edge_mask;
-        cv::Mat harris_mask;
-        cv::Mat combined_mask;
-        cv::Mat output_depth;
-        cv::Mat float_ir;
-        cv::Mat corners;
-        cv::Mat scharr_x;
-        cv::Mat scharr_y;
-        cv::Mat abs_scharr_x;
-        cv::Mat abs_scharr_y;
-    };
-
-    std::vector<sub_area> sub_areas;
-
-    // To avoid re-allocation every cycle some matrices are members
-    cv::Mat _decimated_depth;
-    cv::Mat _decimated_ir;
-    cv::Mat _mask_edge;
-    cv::Mat _mask_harris;
-    cv::Mat _mask_combined;
-    cv::Mat _depth_output;
-    cv::Mat _ir_float;
-    cv::Mat _corners;
-    cv::Mat _scharr_x;
-    cv::Mat _scharr_y;
-    cv::Mat _abs_scharr_x;
-    cv::Mat _abs_scharr_y;
-
-    rs2::stream_profile _output_ir_profile;
-    rs2::stream_profile _output_depth_profile;
-
-    rs2::stream_profile _input_ir_profile;
-    rs2::stream_profile _input_depth_profile;
-
-    void filter_harris(sub_area* area)
-    {
-        area->decimated_ir.convertTo(area->float_ir, CV_32F);
-        cv::cornerHarris(area->float_ir, area->corners, 2, 3, 0.04);
-        cv::threshold(area->corners, area->corners, 300, 255, cv::THRESH_BINARY);
-        area->corners.convertTo(area->harris_mask, CV_8U);
-    }
-
-    void filter_edges(sub_area* area)
-    {
-        cv::Scharr(area->decimated_ir, area->scharr_x, CV_16S, 1, 0);
-        cv::convertScaleAbs(area->scharr_x, area->abs_scharr_x);
-        cv::Scharr(area->decimated_ir, area->scharr_y, CV_16S, 0, 1);
-        cv::convertScaleAbs(area->scharr_y, area->abs_scharr_y);
-        cv::addWeighted(area->abs_scharr_y, 0.5, area->abs_scharr_y, 0.5, 0, area->edge_mask);
-        cv::threshold(area->edge_mask, area->edge_mask, 192, 255, cv::THRESH_BINARY);
-    }
-
-    void init_matrices(const cv::Mat& ir_resized)
-    {
-        const int sizeX = ir_resized.cols;
-        const int sizeY = ir_resized.rows;
-        const int sizeYperSubImage = sizeY / NUM_SUB_IMAGES;
-        const int sizeXtimesSizeY = sizeX * sizeY;
-
-        // test on one case if something has changed - this would then apply to all other image matrices as well
-        bool needToReinitialize = _mask_edge.size() != ir_resized.size() || _mask_edge.type() != CV_8U;
-
-        if (!needToReinitialize)
-        {
-            // this needs resetting every frame
-            memset(_depth_output.data, 0, 2 * sizeXtimesSizeY);
-            return;
-        }
-
-        static_assert(NUM_SUB_IMAGES >= 1 && NUM_SUB_IMAGES < 64, "NUM_SUB_IMAGES value might be wrong");
-
-        _mask_edge = cv::Mat(ir_resized.size(), CV_8U);
-        _mask_harris = cv::Mat(ir_resized.size(), CV_8U);
-        _mask_combined = cv::Mat(ir_resized.size(), CV_8U);
-        _depth_output = cv::Mat(ir_resized.size(), CV_16U);
-        _ir_float = cv::Mat(ir_resized.size(), CV_32F);
-        _corners = cv::Mat(ir_resized.size(), CV_32F);
-        _scharr_x = cv::Mat(ir_resized.size(), CV_16S);
-        _scharr_y = cv::Mat(ir_resized.size(), CV_16S);
-        _abs_scharr_x = cv::Mat(ir_resized.size(), CV_8U);
-        _abs_scharr_y = cv::Mat(ir_resized.size(), CV_8U);
-
-        // this needs to be cleared out, as we only copy to it with a mask later
-        memset(_depth_output.data, 0, 2 * sizeXtimesSizeY);
-
-        std::vector<cv::Rect> rects;
-        for (int i = 0; i < NUM_SUB_IMAGES; i++)
-        {
-            cv::Rect rect(0, i * sizeYperSubImage, sizeX, sizeYperSubImage);
-            rects.push_back(rect);
-        }
-
-        for (auto&& rect : rects)
-        {
-            sub_area si;
-            si.decimated_depth = _decimated_depth(rect);
-            si.decimated_ir = _decimated_ir(rect);
-            si.edge_mask = _mask_edge(rect);
-            si.harris_mask = _mask_harris(rect);
-            si.combined_mask = _mask_combined(rect);
-            si.output_depth = _depth_output(rect);
-            si.float_ir = _ir_float(rect);
-            si.corners = _corners(rect);
-            si.scharr_x = _scharr_x(rect);
-            si.scharr_y = _scharr_y(rect);
-            si.abs_scharr_x = _abs_scharr_x(rect);
-            si.abs_scharr_y = _abs_scharr_y(rect);
-            sub_areas.push_back(si);
-        }
-    }
-};
\ No newline at end of file
+#endif // !_HIGH_CONFIDENCE_FILTER_HEADER
@@ -6,6 +6,8 @@
 #include <string>
 #include <memory>
 #include <thread>
+#include <filesystem>
+#include <ctime>
 #include "CaptureDevice.hpp"
 #include "Data.hpp"
 #include "optimization/OptimizationProblem.hpp"
@@ -118,6 +120,30 @@ namespace vc::imgui {
 		}
 	};
 
+	/// <summary>
+	/// One line per stage with its throughput, a checkbox switches the stages on and off that may be.
+	/// </summary>
+	template <typename T>
+	void renderStages(vc::utils::StagePipeline<T>& stages, const std::string& id) {
+		auto statistics = stages.getStatistics();
+		for (int i = 0; i < (int)statistics.size(); i++) {
+			const vc::utils::StageStatistics& stage = statistics[i];
+			if (stage.canDisable) {
+				bool enabled = stage.enabled;
+				if (ImGui::Checkbox((stage.name + "##" + id).c_str(), &enabled)) {
+					stages.setEnabled(i, enabled);
+				}
+				ImGui::SameLine();
+			}
+			else {
+				ImGui::Text("%s", stage.name.c_str());
+				ImGui::SameLine();
+			}
+			ImGui::Text("%.1f/s, %.2f ms, busy %.0f%%, queued %d/%d, dropped %d", stage.itemsPerSecond, stage.millisecondsPerItem,
+				100.0 * stage.busyFraction, (int)stage.queued, (int)stage.capacity, (int)stage.dropped);
+		}
+	}
+
 	class PipelineGUI {
 	private:
 		std::shared_ptr<vc::capture::CaptureDevice> pipeline;
@@ -132,7 +158,10 @@ namespace vc::imgui {
 			ImGui::Text("Editable settings of pointclouds.");
 
 			ImGui::SliderFloat("Alpha", &alpha, 0.0f, 1.0f);
-			
+
+			auto statistics = pipeline->getCaptureStatistics();
+			ImGui::Text("Capture %.1f FPS, %.2f ms/frame, busy %.0f%%", statistics.getFramesPerSecond(), statistics.getMillisecondsPerFrame(), 100.0 * statistics.getBusyFraction());
+
 			ImGui::End();
 		}
 	};
@@ -178,6 +207,32 @@ namespace vc::imgui {
 				ss = std::stringstream();
 				ss << "Max distance" << "##" << i;
 				ImGui::SliderFloat(ss.str().c_str(), &(*pipelines)[i]->thresholdDistance, 0.2f, 10.0f);
+
+				auto& filterSettings = (*pipelines)[i]->filterSettings;
+				ss = std::stringstream();
+				ss << "Decimation" << "##" << i;
+				ImGui::SliderInt(ss.str().c_str(), &filterSettings.decimation, 1, 8);
+				ss = std::stringstream();
+				ss << "Spatial filter" << "##" << i;
+				ImGui::Checkbox(ss.str().c_str(), &filterSettings.spatial);
+				ImGui::SameLine();
+				ss = std::stringstream();
+				ss << "Temporal filter" << "##" << i;
+				ImGui::Checkbox(ss.str().c_str(), &filterSettings.temporal);
+				ss = std::stringstream();
+				ss << "Alignment" << "##" << i;
+				int alignment = (int)filterSettings.alignment;
+				if (ImGui::Combo(ss.str().c_str(), &alignment, "None\0librealsense\0LUT\0")) {
+					filterSettings.alignment = (vc::processing::AlignmentMode)alignment;
+				}
+				ss = std::stringstream();
+				ss << "High confidence" << "##" << i;
+				int highConfidence = (int)filterSettings.highConfidence;
+				if (ImGui::Combo(ss.str().c_str(), &highConfidence, "Full resolution\0Downsample 4x4\0Textured only\0")) {
+					filterSettings.highConfidence = (vc::processing::HighConfidenceMode)highConfidence;
+				}
+
+				renderStages(*(*pipelines)[i]->stages, std::to_string(i));
 			}
 
 			//ImGui::Separator();
@@ -187,6 +242,73 @@ namespace vc::imgui {
 		}
 	};
 
+	class PlaybackGUI {
+	private:
+		std::vector<std::shared_ptr<vc::capture::CaptureDevice>>* pipelines;
+		void (*seekCallback)(double seconds);
+		void (*offlineCallback)(bool offline);
+
+	public:
+		bool offline;
+
+		PlaybackGUI(std::vector<std::shared_ptr<vc::capture::CaptureDevice>>* pipelines, void (*seekCallback)(double seconds), void (*offlineCallback)(bool offline), bool offline) :
+			pipelines(pipelines), seekCallback(seekCallback), offlineCallback(offlineCallback), offline(offline) {}
+
+		void render() {
+			ImGui::Begin("Playback", nullptr, WINDOW_FLAGS);
+
+			if (ImGui::Checkbox("Offline (every frame, as fast as possible)", &offline)) {
+				offlineCallback(offline);
+			}
+
+			// The recordings play in lockstep, the first one stands for all
+			std::shared_ptr<vc::capture::PlaybackControl> playing;
+			if (!pipelines->empty()) {
+				playing = std::dynamic_pointer_cast<vc::capture::PlaybackControl>((*pipelines)[0]);
+			}
+			if (playing) {
+				float position = std::chrono::duration<float>(playing->getPosition()).count();
+				const float duration = std::chrono::duration<float>(playing->getDuration()).count();
+				if (ImGui::SliderFloat("Position", &position, 0.0f, duration, "%.3f s")) {
+					seekCallback(position);
+				}
+				if (ImGui::Button("Restart")) {
+					seekCallback(0);
+				}
+				if (playing->hasFinished()) {
+					ImGui::SameLine();
+					ImGui::Text("Finished");
+				}
+			}
+
+			ImGui::End();
+		}
+	};
+
+	class RecorderGUI {
+	private:
+		std::shared_ptr<vc::capture::Recorder> recorder;
+		std::vector<std::string> names;
+
+	public:
+		RecorderGUI(std::shared_ptr<vc::capture::Recorder> recorder, std::vector<std::string> names) :
+			recorder(recorder), names(names) {}
+
+		void render() {
+			ImGui::Begin("Recorder", nullptr, WINDOW_FLAGS);
+
+			auto statistics = recorder->getStatistics();
+			for (int i = 0; i < statistics.size() && i < names.size(); i++) {
+				const auto& stream = statistics[i];
+				ImGui::Text("%s: queued %zu/%zu (max %zu)", names[i].c_str(), stream.queued, stream.capacity, stream.maxQueued);
+				ImGui::Text("  recorded %llu, dropped %llu, failed %llu, %.1f MB", (unsigned long long)stream.recorded, (unsigned long long)stream.dropped,
+					(unsigned long long)stream.failed, stream.bytes / (1024.0 * 1024.0));
+			}
+
+			ImGui::End();
+		}
+	};
+
 	class OptimizationProblemGUI {
 	private:
 		vc::optimization::OptimizationProblem* optimizationProblem;
@@ -214,6 +336,7 @@ namespace vc::imgui {
 	private:
 		vc::fusion::Voxelgrid* voxelgrid;
 		const float truncationDistanceRange = 1.0f;
+		const std::string VOLUME_DIRECTORY = "volumes/";
 	public:
 		bool renderVoxelgrid = true;
 		bool fuse = true;
@@ -226,9 +349,12 @@ namespace vc::imgui {
 		float truncationDistance;
 		bool wireframeMode = false;
 		bool useNormals = true;
+		// Integrate only frames of all cameras matched by their timestamps
+		bool synchronizeViews = true;
+		std::shared_ptr<vc::capture::MultiViewSynchronizer> synchronizer;
+		// Work on the voxels on other threads, every change of the grid waits for them
+		std::shared_ptr<vc::utils::StagePipeline<vc::fusion::FusionWork>> fusionStages;
 
-		bool isSaving = false;
-		
 		FusionGUI(vc::fusion::Voxelgrid* voxelgrid) :
 			voxelgrid(voxelgrid),
 			resolution(voxelgrid->resolution),
@@ -238,6 +364,7 @@ namespace vc::imgui {
 		{}
 
 		void resetVoxelgrid() {
+			std::lock_guard<std::mutex> lock(voxelgrid->voxelMutex);
 			voxelgrid->reset(resolution, Eigen::Vector3f(size[0], size[1], size[2]).cast<double>(), Eigen::Vector3f(origin[0], -origin[1], origin[2]).cast<double>());
 		}
 
@@ -262,15 +389,37 @@ namespace vc::imgui {
 
 			ImGui::Checkbox("Render voxelgrid", &renderVoxelgrid);
 			ImGui::Checkbox("Fuse", &fuse);
+			ImGui::Checkbox("Synchronize views", &synchronizeViews);
+			if (synchronizer) {
+				auto statistics = synchronizer->getStatistics();
+				int droppedFrames = 0;
+				for (int dropped : statistics.droppedFrames) {
+					droppedFrames += dropped;
+				}
+				ImGui::Text("%d bundles, skew %.1f ms, latency %.1f ms", statistics.takenBundles, statistics.averageSkewMs, statistics.averageLatencyMs);
+				ImGui::Text("Dropped %d frames, %d bundles", droppedFrames, statistics.droppedBundles);
+			}
+
+			bool integrateOnCPU = voxelgrid->integrationBackend == vc::fusion::IntegrationBackend::CPU;
+			if (ImGui::Checkbox("Integrate on CPU", &integrateOnCPU)) {
+				std::lock_guard<std::mutex> lock(voxelgrid->voxelMutex);
+				voxelgrid->setIntegrationBackend(integrateOnCPU ? vc::fusion::IntegrationBackend::CPU : vc::fusion::IntegrationBackend::GPU);
+			}
 
 			if (ImGui::SliderFloat("Truncation distance", &truncationDistance, resolution * 2, resolution * 50)) {
+				std::lock_guard<std::mutex> lock(voxelgrid->voxelMutex);
 				voxelgrid->setTruncationDistance(truncationDistance);
 			}
 
 			if (ImGui::Button("Clear")) {
+				std::lock_guard<std::mutex> lock(voxelgrid->voxelMutex);
 				voxelgrid->resetVoxelgridBuffer();
 			}
 
+			if (fusionStages && voxelgrid->canFuseAsynchronously()) {
+				renderStages(*fusionStages, "Fusion");
+			}
+
 			ImGui::Separator();
 
 			ImGui::Checkbox("Marching cubes", &marchingCubes);
@@ -280,20 +429,49 @@ namespace vc::imgui {
 
 			ImGui::Separator();
 			
-			if (!isSaving) {
-				if (ImGui::Button("Save PLY")) {
-					isSaving = true;
-					voxelgrid->copyTrianglesToCPU();
-					auto saveThread = std::thread([this]() {
-						voxelgrid->exportToPly();
-						isSaving = false;
-					});
-					saveThread.detach();
+			if (ImGui::Button("Save PLY")) {
+				voxelgrid->copyMeshToCPU();
+				if (!voxelgrid->exportToPly()) {
+					std::cout << "Too many PLY exports running, skipped the snapshot." << std::endl;
 				}
 			}
-			else {
-				ImGui::Text("Saving to PLY.");
-				ImGui::Text("This may take a moment!");
+
+			const int pendingExports = voxelgrid->getPendingExports();
+			if (pendingExports > 0) {
+				ImGui::Text("Saving %d PLY files.", pendingExports);
+			}
+
+			ImGui::Separator();
+
+			if (ImGui::Button("Save volume")) {
+				char timestamp[100];
+				std::time_t t = std::time(NULL);
+				std::strftime(timestamp, 100, "%F-%H-%M-%S", std::localtime(&t));
+				std::filesystem::create_directories(VOLUME_DIRECTORY);
+				std::lock_guard<std::mutex> lock(voxelgrid->voxelMutex);
+				voxelgrid->saveSnapshot(VOLUME_DIRECTORY + timestamp + ".tsdf");
+			}
+			ImGui::SameLine();
+			if (ImGui::Button("Load last volume")) {
+				// The timestamps sort by time
+				std::string last;
+				if (std::filesystem::is_directory(VOLUME_DIRECTORY)) {
+					for (auto& entry : std::filesystem::directory_iterator(VOLUME_DIRECTORY)) {
+						if (entry.path().extension() == ".tsdf" && entry.path().string() > last) {
+							last = entry.path().string();
+						}
+					}
+				}
+				std::unique_lock<std::mutex> lock(voxelgrid->voxelMutex);
+				if (!last.empty() && voxelgrid->loadSnapshot(last)) {
+					resolution = voxelgrid->resolution;
+					truncationDistance = voxelgrid->truncationDistance;
+					for (int i = 0; i < 3; i++) {
+						size[i] = (float)voxelgrid->size[i];
+						origin[i] = (float)voxelgrid->origin[i];
+					}
+					origin[1] = -origin[1];
+				}
 			}
 			
 			ImGui::End();
@@ -0,0 +1,164 @@
+#pragma once
+
+#ifndef _MAPPED_FILE_HEADER
+#define _MAPPED_FILE_HEADER
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace vc::utils {
+	/// <summary>
+	/// A whole file mapped read only into memory, the pages are loaded by the OS on first access.
+	/// </summary>
+	class MappedFile {
+	private:
+		const uint8_t* mapped = nullptr;
+		size_t mappedSize = 0;
+
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+#else
+		int file = -1;
+#endif
+
+	public:
+		MappedFile() {}
+
+		explicit MappedFile(const std::string& filename) {
+			open(filename);
+		}
+
+		~MappedFile() {
+			close();
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool open(const std::string& filename) {
+			close();
+
+#ifdef _WIN32
+			file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			if (file == INVALID_HANDLE_VALUE) {
+				return false;
+			}
+
+			LARGE_INTEGER fileSize;
+			if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+				close();
+				return false;
+			}
+			mappedSize = (size_t)fileSize.QuadPart;
+
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (!mapping) {
+				close();
+				return false;
+			}
+
+			mapped = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+			file = ::open(filename.c_str(), O_RDONLY);
+			if (file < 0) {
+				return false;
+			}
+
+			struct stat status;
+			if (fstat(file, &status) != 0 || status.st_size == 0) {
+				close();
+				return false;
+			}
+			mappedSize = (size_t)status.st_size;
+
+			void* address = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE, file, 0);
+			mapped = address == MAP_FAILED ? nullptr : (const uint8_t*)address;
+#endif
+
+			if (!mapped) {
+				close();
+				return false;
+			}
+			return true;
+		}
+
+		void close() {
+#ifdef _WIN32
+			if (mapped) {
+				UnmapViewOfFile(mapped);
+			}
+			if (mapping) {
+				CloseHandle(mapping);
+			}
+			if (file != INVALID_HANDLE_VALUE) {
+				CloseHandle(file);
+			}
+			mapping = nullptr;
+			file = INVALID_HANDLE_VALUE;
+#else
+			if (mapped) {
+				munmap((void*)mapped, mappedSize);
+			}
+			if (file >= 0) {
+				::close(file);
+			}
+			file = -1;
+#endif
+			mapped = nullptr;
+			mappedSize = 0;
+		}
+
+		bool isOpen() const {
+			return mapped != nullptr;
+		}
+
+		const uint8_t* data() const {
+			return mapped;
+		}
+
+		size_t size() const {
+			return mappedSize;
+		}
+
+		/// <summary>
+		/// Asks the OS to load a range in the background, so a later access does not wait for the disk.
+		/// </summary>
+		void prefetch(size_t offset, size_t size) const {
+			if (!mapped || offset >= mappedSize) {
+				return;
+			}
+			size = std::min(size, mappedSize - offset);
+#ifdef _WIN32
+#if _WIN32_WINNT >= 0x0602
+			WIN32_MEMORY_RANGE_ENTRY range = { (PVOID)(mapped + offset), size };
+			PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#endif
+#else
+			// madvise wants a page aligned start
+			const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+			const size_t start = offset / pageSize * pageSize;
+			madvise((void*)(mapped + start), size + offset - start, MADV_WILLNEED);
+#endif
+		}
+	};
+}
+
+#endif // !_MAPPED_FILE_HEADER
@@ -5,401 +5,282 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
-#include "Voxelgrid.hpp"
+#include <Eigen/Dense>
 
-#include "Utils.hpp"
 #include "Tables.hpp"
 #include "Structs.hpp"
-#include "ceres/ceres.h"
+#include "Mesh.hpp"
+#include "ThreadPool.hpp"
 
 #include <iostream>
 #include <fstream>
+#include <vector>
 
 #include <math.h>
 
 namespace vc::fusion {
-    class Voxelgrid;
-
-    void exportToPly(std::vector<vc::fusion::Triangle> triangles);
-    glm::vec4 VertexInterp(double isolevel, vc::fusion::Vertex _p1, vc::fusion::Vertex _p2);
-    std::vector< vc::fusion::Triangle> Polygonise(vc::fusion::GridCell grid, double isolevel);
-
-    class MarchingCubes {
-    private:
-        GLuint vertexBuffer;
-        GLuint triangleBuffer;
-        GLuint triangleVertexArray;
-
-        //vc::fusion::Vertex* verts;
-        std::vector<vc::fusion::Triangle> triangles;
-        GLuint triangleCount = 0;
-
-        GLuint edgeTable;
-        GLuint triTable;
-        GLuint atomicCounter;
-
-        vc::rendering::ComputeShader* marchingCubesComputeShader;
-        vc::rendering::ComputeShader* countTrianglesComputeShader;
-        vc::rendering::VertexFragmentShader* triangleShader;
-
-    public:
-        MarchingCubes() {
-            marchingCubesComputeShader = new vc::rendering::ComputeShader("shader/marchingCubes.comp");
-            countTrianglesComputeShader = new vc::rendering::ComputeShader("shader/countTriangles.comp");
-            triangleShader = new vc::rendering::VertexFragmentShader("shader/mesh.vert", "shader/mesh.frag");
-
-            glGenVertexArrays(1, &triangleVertexArray);
-            glGenBuffers(1, &vertexBuffer);
-            glGenBuffers(1, &triangleBuffer);
-            glGenBuffers(1, &edgeTable);
-            glGenBuffers(1, &triTable);
-            glGenBuffers(1, &atomicCounter);
-        }
-
-        void zeroTriangleCounter() {
-            GLuint tmp_numTriangles[1] = { 0 };
-            glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, atomicCounter);
-            glBufferData(GL_ATOMIC_COUNTER_BUFFER, sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
-            glBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(GLuint), tmp_numTriangles);
-            glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 4, atomicCounter);
-            glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
-        }
-
-        void compute(Eigen::Vector3i size, std::vector<vc::fusion::Vertex> verts) {
-            int snx = size[0];
-            int sny = size[1];
-            int snz = size[2];
-
-            int num_verts = snx * sny * snz;
-
-            marchingCubesComputeShader->use();
-            marchingCubesComputeShader->setVec3i("sizeNormalized", size);
-            marchingCubesComputeShader->setFloat("isolevel", 0.0f);
-            marchingCubesComputeShader->setInt("INVALID_TSDF_VALUE", vc::fusion::INVALID_TSDF_VALUE);
-            marchingCubesComputeShader->setBool("onlyCount", true);
-
-            glBindBuffer(GL_SHADER_STORAGE_BUFFER, vertexBuffer);
-            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Vertex) * num_verts, verts.data(), GL_DYNAMIC_COPY);
-            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, vertexBuffer);
-
-            glBindBuffer(GL_SHADER_STORAGE_BUFFER, edgeTable);
-            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(vc::fusion::edgeTable), vc::fusion::edgeTable, GL_DYNAMIC_COPY);
-            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, edgeTable);
-
-            glBindBuffer(GL_SHADER_STORAGE_BUFFER, triTable);
-            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(vc::fusion::triTable), vc::fusion::triTable, GL_DYNAMIC_COPY);
-            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, triTable);
-
-            zeroTriangleCounter();
-
-            glDispatchCompute(num_verts, 1, 1);
-            glMemoryBarrier(GL_ALL_BARRIER_BITS);
-
-            GLuint userCounters[1];
-            glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, atomicCounter);
-            glGetBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(GLuint), userCounters);
-            glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
-            GLuint numTriangles = userCounters[0];
-
-            std::cout << vc::utils::toString("Calculated numTriangles", numTriangles);
-
-            marchingCubesComputeShader->setBool("onlyCount", false);
-            triangles = std::vector<vc::fusion::Triangle>(numTriangles);
-            zeroTriangleCounter();
-
-            glBindBuffer(GL_SHADER_STORAGE_BUFFER, triangleBuffer);
-            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Triangle) * numTriangles, triangles.data(), GL_DYNAMIC_COPY);
-            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, triangleBuffer);
-
-            glDispatchCompute(num_verts, 1, 1);
-            glMemoryBarrier(GL_ALL_BARRIER_BITS);
-
-            glBindBuffer(GL_SHADER_STORAGE_BUFFER, triangleBuffer);
-            glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(Triangle) * numTriangles, triangles.data());
-
-            //for (int i = 0; i < 100 && i < numTriangles; i++)
-            //{
-            //    std::cout << vc::utils::toString(std::to_string(i), &triangles[i]);
-            //    for (int j = 0; j < 100 && j < numTriangles; j++)
-            //    {
-            //        if (i != j && vc::utils::areEqual(&triangles[i], &triangles[j])) {
-            //            std::cout << vc::utils::asHeader("Overlap detected");
-            //            std::cout << vc::utils::toString(std::to_string(i), &triangles[i]);
-            //            std::cout << vc::utils::toString(std::to_string(j), &triangles[j]);
-            //        }
-            //    }
-            //}
-
-            std::cout << std::endl;
+    // The corners of a marching cubes cell in the order of Tables.hpp, same as CORNERS in shader/marchingCubes.comp
+    const int CELL_CORNERS[8][3] = {
+        { 0, 0, 1 }, { 1, 0, 1 }, { 1, 0, 0 }, { 0, 0, 0 },
+        { 0, 1, 1 }, { 1, 1, 1 }, { 1, 1, 0 }, { 0, 1, 0 }
+    };
 
-            //exportToPly();
-        }
+    // The two corners every edge of the cell connects
+    const int CELL_EDGES[12][2] = {
+        { 0, 1 }, { 1, 2 }, { 2, 3 }, { 3, 0 },
+        { 4, 5 }, { 5, 6 }, { 6, 7 }, { 7, 4 },
+        { 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 }
+    };
 
-        void exportToPly() {
-            vc::fusion::exportToPly(triangles);
-        }
+    // Every voxel owns the three edges towards its upper neighbours in x, y and z.
+    // For every edge of the cell: the offset of the owning voxel and the axis of the edge.
+    const int EDGE_OWNERS[12][4] = {
+        { 0, 0, 1, 0 }, { 1, 0, 0, 2 }, { 0, 0, 0, 0 }, { 0, 0, 0, 2 },
+        { 0, 1, 1, 0 }, { 1, 1, 0, 2 }, { 0, 1, 0, 0 }, { 0, 1, 0, 2 },
+        { 0, 0, 1, 1 }, { 1, 0, 1, 1 }, { 1, 0, 0, 1 }, { 0, 0, 0, 1 }
+    };
 
-        void render(glm::mat4 model, glm::mat4 view, glm::mat4 projection) {
-            glBindVertexArray(triangleVertexArray);
-            glBindBuffer(GL_ARRAY_BUFFER, triangleBuffer);
-            glBufferData(GL_ARRAY_BUFFER, sizeof(Triangle) * triangles.size(), triangles.data(), GL_DYNAMIC_DRAW);
-            glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
-            glEnableVertexAttribArray(0);
-            glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(4 * sizeof(float)));
-            glEnableVertexAttribArray(1);
-
-            triangleShader->use();
-            triangleShader->setMat4("model", model);
-            triangleShader->setMat4("view", view);
-            triangleShader->setMat4("projection", projection);
-            triangleShader->setMat4("coordinate_correction", vc::rendering::COORDINATE_CORRECTION);
-            glDrawArrays(GL_TRIANGLES, 0, triangles.size() * 3);
-            glBindVertexArray(0);
+    /// <summary>
+    /// The classification of the cell with its lower corner at a voxel and of the three edges the voxel owns.
+    /// After the scan firstVertex and firstTriangle are the offsets of its vertices and triangles in the mesh.
+    /// </summary>
+    struct MarchingCubesCell {
+        uint32_t firstVertex = 0;
+        uint32_t firstTriangle = 0;
+        uint8_t cubeIndex = 0;
+        // The owned edges (x, y, z) that carry a vertex
+        uint8_t edgeMask = 0;
+        uint8_t numTriangles = 0;
+
+        int numVertices() const {
+            return (edgeMask & 1) + ((edgeMask >> 1) & 1) + ((edgeMask >> 2) & 1);
         }
     };
 
-        void marchingCubes(vc::fusion::Voxelgrid * voxelgrid) {
-            int snx = voxelgrid->sizeNormalized[0];
-            int sny = voxelgrid->sizeNormalized[1];
-            int snz = voxelgrid->sizeNormalized[2];
-
-            std::vector<vc::fusion::Triangle> triangles(snx * sny * snz * 5);
-
-            std::vector<std::thread> threads;
-            int i = 0;
-            int yy = 0;
-            for (int z = 0; z < snz - 1; z++)
-            {
-                for (int y = 0; y < sny - 1; y++)
-                {
-                    threads.emplace_back(std::thread([&, y, z]() {
-                        for (int x = 0; x < snx - 1; x++)
-                        {
-                            std::stringstream ss;
-
-                            vc::fusion::GridCell cell;
-                            if (!voxelgrid->getGridCell(x, y, z, &cell)) {
-                                continue;
-                            }
+    /// <summary>
+    /// Marching cubes over cells[0] * cells[1] * cells[2] cells into an indexed mesh, appended to mesh.
+    /// Every vertex is created once, by the voxel that owns its edge, and shared by all faces of the neighbouring cells.
+    /// The normals are the interpolated TSDF gradients at the two ends of the edge.
+    ///
+    /// Runs as a stream compaction in three passes over the z slices: classify every cell and edge once,
+    /// an exclusive scan of the vertex and triangle counts, then only the active cells write their vertices and
+    /// triangles at the scanned offsets. The slices of a pass run in parallel on the pool if one is given,
+    /// the result does not depend on it.
+    ///
+    /// getVoxel(x, y, z) returns the observed voxel at the local index or nullptr,
+    /// it is called for -1 <= index <= cells + 1 as the gradients need one voxel around the cells.
+    /// The voxel with the local index (x, y, z) is centered at firstVoxelPosition + (x, y, z) * resolution.
+    /// </summary>
+    template<typename VoxelAccessor>
+    void polygonise(const VoxelAccessor& getVoxel, const Eigen::Vector3i& cells, const glm::vec3& firstVoxelPosition, float resolution, Mesh& mesh, float isolevel = 0.0f, vc::utils::ThreadPool* pool = nullptr) {
+        // The voxels on the upper border own edges of the cells as well
+        const Eigen::Vector3i owners = cells + Eigen::Vector3i::Ones();
+        std::vector<MarchingCubesCell> classification((size_t)owners.prod());
+
+        auto index = [&](int x, int y, int z) {
+            return ((size_t)z * owners[1] + y) * owners[0] + x;
+        };
+
+        auto forEachSlice = [&](auto&& function) {
+            if (pool) {
+                pool->parallelFor(0, owners[2], function);
+            }
+            else {
+                for (int z = 0; z < owners[2]; z++) {
+                    function(z);
+                }
+            }
+        };
+
+        // Pass 1: classification, the only pass that reads every voxel
+        std::vector<uint32_t> sliceVertices(owners[2], 0);
+        std::vector<uint32_t> sliceTriangles(owners[2], 0);
+        forEachSlice([&](int z) {
+            const vc::fusion::Voxel* cell[8];
+            for (int y = 0; y < owners[1]; y++) {
+                for (int x = 0; x < owners[0]; x++) {
+                    const vc::fusion::Voxel* voxel = getVoxel(x, y, z);
+                    if (!voxel) {
+                        continue;
+                    }
 
-                            //std::cout << x + y * snx + z * snx * sny << ":: ";
-                            std::vector<vc::fusion::Triangle> new_triangles = Polygonise(cell, 0.0);
+                    MarchingCubesCell& result = classification[index(x, y, z)];
+                    const int position[3] = { x, y, z };
+                    for (int axis = 0; axis < 3; axis++) {
+                        // Edges leaving the cells are owned here but belong to no cell
+                        if (position[axis] >= cells[axis]) {
+                            continue;
+                        }
+                        const vc::fusion::Voxel* other = getVoxel(x + (axis == 0), y + (axis == 1), z + (axis == 2));
+                        if (other && (voxel->getTsdf() < isolevel) != (other->getTsdf() < isolevel)) {
+                            result.edgeMask |= 1 << axis;
+                        }
+                    }
 
-                            for (auto& triangle : new_triangles)
-                            {
-                                    triangles[i++] = triangle;
+                    if (x < cells[0] && y < cells[1] && z < cells[2]) {
+                        int cubeindex = 0;
+                        int observed = 0;
+                        for (int i = 0; i < 8; i++) {
+                            cell[i] = getVoxel(x + CELL_CORNERS[i][0], y + CELL_CORNERS[i][1], z + CELL_CORNERS[i][2]);
+                            if (cell[i]) {
+                                observed |= 1 << i;
+                                if (cell[i]->getTsdf() < isolevel) {
+                                    cubeindex |= 1 << i;
+                                }
                             }
                         }
-                    }));
-                    if (yy++ >= vc::utils::NUM_THREADS) {
-                        for (auto& thread : threads)
-                        {
-                            thread.join();
+
+                        // A triangle needs both corners of its three edges, the same edges carry a vertex
+                        auto hasVertex = [&](int edge) {
+                            return (observed & (1 << CELL_EDGES[edge][0])) && (observed & (1 << CELL_EDGES[edge][1]));
+                        };
+
+                        result.cubeIndex = (uint8_t)cubeindex;
+                        if (edgeTable[cubeindex] != 0) {
+                            for (int i = 0; triTable[cubeindex][i] != -1; i += 3) {
+                                if (hasVertex(triTable[cubeindex][i]) && hasVertex(triTable[cubeindex][i + 1]) && hasVertex(triTable[cubeindex][i + 2])) {
+                                    result.numTriangles++;
+                                }
+                            }
                         }
-                        threads = std::vector<std::thread>();
-                        yy = 0;
                     }
-                }
-                std::cout << "Calculated Marching Cubes layer " << z << std::endl;
-            }
 
-            for (auto& thread : threads)
-            {
-                thread.join();
+                    sliceVertices[z] += result.numVertices();
+                    sliceTriangles[z] += result.numTriangles;
+                }
             }
-
-            std::vector<vc::fusion::Triangle> finalTriangles(0);
-            finalTriangles.insert(finalTriangles.end(), triangles.begin(), triangles.begin() + i);
-            exportToPly(finalTriangles);
+        });
+
+        // Pass 2: exclusive scan, the slices in order and within every slice in parallel
+        const uint32_t firstVertex = (uint32_t)mesh.vertices.size();
+        const uint32_t firstTriangle = (uint32_t)mesh.numTriangles();
+        uint32_t numVertices = 0;
+        uint32_t numTriangles = 0;
+        for (int z = 0; z < owners[2]; z++) {
+            const uint32_t vertices = sliceVertices[z];
+            const uint32_t triangles = sliceTriangles[z];
+            sliceVertices[z] = firstVertex + numVertices;
+            sliceTriangles[z] = firstTriangle + numTriangles;
+            numVertices += vertices;
+            numTriangles += triangles;
         }
 
+        if (numTriangles == 0) {
+            return;
+        }
 
-        std::vector< vc::fusion::Triangle> Polygonise(vc::fusion::GridCell grid, double isolevel) {
-            std::vector<vc::fusion::Triangle> triangles;
-
-            int i, ntriang;
-            int cubeindex;
-            glm::vec4 vertlist[12];
-
-            /*
-              Determine the index into the edge table which
-              tells us which vertices are inside of the surface
-           */
-            cubeindex = 0;
-            if (grid.verts[0].tsdf[1] < isolevel) cubeindex |= 1;
-            if (grid.verts[1].tsdf[1] < isolevel) cubeindex |= 2;
-            if (grid.verts[2].tsdf[1] < isolevel) cubeindex |= 4;
-            if (grid.verts[3].tsdf[1] < isolevel) cubeindex |= 8;
-            if (grid.verts[4].tsdf[1] < isolevel) cubeindex |= 16;
-            if (grid.verts[5].tsdf[1] < isolevel) cubeindex |= 32;
-            if (grid.verts[6].tsdf[1] < isolevel) cubeindex |= 64;
-            if (grid.verts[7].tsdf[1] < isolevel) cubeindex |= 128;
-
-            //std::cout << cubeindex << std::endl;
-
-            /* Cube is entirely in/out of the surface */
-            if (edgeTable[cubeindex] == 0) {
-                return triangles;
+        forEachSlice([&](int z) {
+            uint32_t vertex = sliceVertices[z];
+            uint32_t triangle = sliceTriangles[z];
+            for (size_t i = index(0, 0, z); i < index(0, 0, z + 1); i++) {
+                classification[i].firstVertex = vertex;
+                classification[i].firstTriangle = triangle;
+                vertex += classification[i].numVertices();
+                triangle += classification[i].numTriangles;
             }
-
-            /* Find the vertices where the surface intersects the cube */
-            if (edgeTable[cubeindex] & 1 && grid.verts[0].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE && grid.verts[1].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE)
-                vertlist[0] =
-                VertexInterp(isolevel, grid.verts[0], grid.verts[1]);
-            if (edgeTable[cubeindex] & 2 && grid.verts[1].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE && grid.verts[2].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE)
-                vertlist[1] =
-                VertexInterp(isolevel, grid.verts[1], grid.verts[2]);
-            if (edgeTable[cubeindex] & 4 && grid.verts[2].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE && grid.verts[3].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE)
-                vertlist[2] =
-                VertexInterp(isolevel, grid.verts[2], grid.verts[3]);
-            if (edgeTable[cubeindex] & 8 && grid.verts[3].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE && grid.verts[0].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE)
-                vertlist[3] =
-                VertexInterp(isolevel, grid.verts[3], grid.verts[0]);
-            if (edgeTable[cubeindex] & 16 && grid.verts[4].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE && grid.verts[5].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE)
-                vertlist[4] =
-                VertexInterp(isolevel, grid.verts[4], grid.verts[5]);
-            if (edgeTable[cubeindex] & 32 && grid.verts[5].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE && grid.verts[6].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE)
-                vertlist[5] =
-                VertexInterp(isolevel, grid.verts[5], grid.verts[6]);
-            if (edgeTable[cubeindex] & 64 && grid.verts[6].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE && grid.verts[7].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE)
-                vertlist[6] =
-                VertexInterp(isolevel, grid.verts[6], grid.verts[7]);
-            if (edgeTable[cubeindex] & 128 && grid.verts[7].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE && grid.verts[4].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE)
-                vertlist[7] =
-                VertexInterp(isolevel, grid.verts[7], grid.verts[4]);
-            if (edgeTable[cubeindex] & 256 && grid.verts[0].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE && grid.verts[4].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE)
-                vertlist[8] =
-                VertexInterp(isolevel, grid.verts[0], grid.verts[4]);
-            if (edgeTable[cubeindex] & 512 && grid.verts[1].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE && grid.verts[5].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE)
-                vertlist[9] =
-                VertexInterp(isolevel, grid.verts[1], grid.verts[5]);
-            if (edgeTable[cubeindex] & 1024 && grid.verts[2].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE && grid.verts[6].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE)
-                vertlist[10] =
-                VertexInterp(isolevel, grid.verts[2], grid.verts[6]);
-            if (edgeTable[cubeindex] & 2048 && grid.verts[3].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE && grid.verts[7].tsdf[1] != vc::fusion::INVALID_TSDF_VALUE)
-                vertlist[11] =
-                VertexInterp(isolevel, grid.verts[3], grid.verts[7]);
-
-            //for (int i = 0; i < 12; i++)
-            //{
-            //    std::cout << vc::utils::toString(vertlist[i]);
-            //}
-
-            /* Create the triangle */
-            for (i = 0; triTable[cubeindex][i] != -1; i += 3) {
-                auto a = vertlist[triTable[cubeindex][i]];
-                auto b = vertlist[triTable[cubeindex][i + 1]];
-                auto c = vertlist[triTable[cubeindex][i + 2]];
-                auto triangle = new vc::fusion::Triangle();
-
-                if (vc::utils::isValid(a) && vc::utils::isValid(b) && vc::utils::isValid(c)) {
-                    auto triangle = vc::fusion::Triangle();
-                    triangle.pos0 = a;
-                    triangle.pos1 = b;
-                    triangle.pos2 = c;
-                    triangles.emplace_back(triangle);
+        });
+
+        mesh.vertices.resize((size_t)firstVertex + numVertices);
+        mesh.indices.resize(((size_t)firstTriangle + numTriangles) * 3);
+
+        // Central differences, one-sided where a neighbour is missing
+        auto gradient = [&](int x, int y, int z, const vc::fusion::Voxel* center) {
+            glm::vec3 result(0.0f, 0.0f, 0.0f);
+            for (int axis = 0; axis < 3; axis++) {
+                const int d[3] = { axis == 0, axis == 1, axis == 2 };
+                const vc::fusion::Voxel* upper = getVoxel(x + d[0], y + d[1], z + d[2]);
+                const vc::fusion::Voxel* lower = getVoxel(x - d[0], y - d[1], z - d[2]);
+                if (upper && lower) {
+                    result[axis] = 0.5f * (upper->getTsdf() - lower->getTsdf());
+                }
+                else if (upper) {
+                    result[axis] = upper->getTsdf() - center->getTsdf();
+                }
+                else if (lower) {
+                    result[axis] = center->getTsdf() - lower->getTsdf();
                 }
             }
+            return result;
+        };
+
+        auto createVertex = [&](int x, int y, int z, int axis) {
+            const int d[3] = { axis == 0, axis == 1, axis == 2 };
+            const vc::fusion::Voxel* a = getVoxel(x, y, z);
+            const vc::fusion::Voxel* b = getVoxel(x + d[0], y + d[1], z + d[2]);
+
+            const float ta = a->getTsdf();
+            const float tb = b->getTsdf();
+            float mu = 0.0f;
+            if (std::abs(isolevel - ta) < 0.00001f || std::abs(ta - tb) < 0.00001f) {
+                mu = 0.0f;
+            }
+            else if (std::abs(isolevel - tb) < 0.00001f) {
+                mu = 1.0f;
+            }
+            else {
+                mu = (isolevel - ta) / (tb - ta);
+            }
 
-            return triangles;
-        }
-
-        /*
-           Linearly interpolate the position where an isosurface cuts
-           an edge between two vertices, each with their own scalar value
-        */
-        glm::vec4 VertexInterp(double isolevel, vc::fusion::Vertex _p1, vc::fusion::Vertex _p2)
-        {
-            glm::vec4 p1 = glm::vec4(_p1.pos[0], _p1.pos[1], _p1.pos[2], 1.0f);
-            glm::vec4 p2 = glm::vec4(_p2.pos[0], _p2.pos[1], _p2.pos[2], 1.0f);
-
-            double mu;
-            glm::vec4 p;
-
-            if (std::abs(isolevel - _p1.tsdf[1]) < 0.00001)
-                return(p1);
-            if (std::abs(isolevel - _p2.tsdf[1]) < 0.00001)
-                return(p2);
-            if (std::abs(_p1.tsdf[1] - _p2.tsdf[1]) < 0.00001)
-                return(p1);
-            mu = (isolevel - _p1.tsdf[1]) / (_p2.tsdf[1] - _p1.tsdf[1]);
-            p[0] = p1[0] + mu * (p2[0] - p1[0]);
-            p[1] = p1[1] + mu * (p2[1] - p1[1]);
-            p[2] = p1[2] + mu * (p2[2] - p1[2]);
-            p[3] = 1.0f;
-
-            return(p);
-        }
-
-        void exportToPly(std::vector<vc::fusion::Triangle> triangles) {
-            std::ofstream ply_file;
-            ply_file.open("plys/marching_cube.ply");
-
-            ply_file << "ply\n";
-            ply_file << "format ascii 1.0\n";
-
-            ply_file << "comment Test comment\n";
-
-            ply_file << "element vertex " << triangles.size() * 3 << "\n";
-            ply_file << "property float x\n";
-            ply_file << "property float y\n";
-            ply_file << "property float z\n";
+            const glm::vec3 direction((float)d[0], (float)d[1], (float)d[2]);
 
-            ply_file << "property uchar red\n";
-            ply_file << "property uchar green\n";
-            ply_file << "property uchar blue\n";
+            MeshVertex meshVertex;
+            meshVertex.pos = firstVoxelPosition + (glm::vec3((float)x, (float)y, (float)z) + mu * direction) * resolution;
+            meshVertex.setColor(a->getColor() + mu * (b->getColor() - a->getColor()));
 
+            // The TSDF grows away from the cameras, the normal points towards the observed free space
+            const glm::vec3 g = gradient(x, y, z, a) + mu * (gradient(x + d[0], y + d[1], z + d[2], b) - gradient(x, y, z, a));
+            meshVertex.normal = glm::length(g) > 0.000001f ? -glm::normalize(g) : direction * (tb > ta ? -1.0f : 1.0f);
+            return meshVertex;
+        };
 
-            ply_file << "element face " << triangles.size() << "\n";
-            ply_file << "property list uchar int vertex_indices\n";
-            ply_file << "end_header\n";
+        // The index of the vertex on an owned edge or -1 if the edge has none
+        auto getVertex = [&](int x, int y, int z, int axis) {
+            const MarchingCubesCell& owner = classification[index(x, y, z)];
+            if (!(owner.edgeMask & (1 << axis))) {
+                return -1;
+            }
+            // The vertices of a voxel are stored in the order x, y, z
+            const int lowerEdges = owner.edgeMask & ((1 << axis) - 1);
+            return (int)owner.firstVertex + (lowerEdges & 1) + ((lowerEdges >> 1) & 1);
+        };
+
+        // Pass 3: only the active cells write, each at its own offsets
+        forEachSlice([&](int z) {
+            for (int y = 0; y < owners[1]; y++) {
+                for (int x = 0; x < owners[0]; x++) {
+                    const MarchingCubesCell& cell = classification[index(x, y, z)];
+                    if (cell.edgeMask == 0 && cell.numTriangles == 0) {
+                        continue;
+                    }
 
-            int i = 0;
-            for (auto triangle : triangles) {
-                    if (vc::utils::isValid(triangle.pos0)&& vc::utils::isValid(triangle.pos1)&& vc::utils::isValid(triangle.pos2)) {
-                        for (int i = 0; i < 3; i++)
-                        {
-                            ply_file << triangle.pos0[i] << " ";
-                        }
-                        for (int i = 0; i < 3; i++)
-                        {
-                            ply_file << int(triangle.color0[i] * 255) << " ";
-                        }
-                        ply_file << "\n";
-                        for (int i = 0; i < 3; i++)
-                        {
-                            ply_file << triangle.pos1[i] << " ";
-                        }
-                        for (int i = 0; i < 3; i++)
-                        {
-                            ply_file << int(triangle.color1[i] * 255) << " ";
+                    uint32_t vertex = cell.firstVertex;
+                    for (int axis = 0; axis < 3; axis++) {
+                        if (cell.edgeMask & (1 << axis)) {
+                            mesh.vertices[vertex++] = createVertex(x, y, z, axis);
                         }
-                        ply_file << "\n";
-                        for (int i = 0; i < 3; i++)
-                        {
-                            ply_file << triangle.pos2[i] << " ";
-                        }
-                        for (int i = 0; i < 3; i++)
-                        {
-                            ply_file << int(triangle.color2[i] * 255) << " ";
-                        }
-                        ply_file << "\n";
                     }
-                    else {
-                        std::cout << "error with triangle " << i << std::endl;
-                    }
-                i++;
 
-            }
+                    uint32_t triangle = cell.firstTriangle;
+                    const uint32_t lastTriangle = cell.firstTriangle + cell.numTriangles;
+                    for (int i = 0; triTable[cell.cubeIndex][i] != -1 && triangle < lastTriangle; i += 3) {
+                        int vertices[3];
+                        bool isValid = true;
+                        for (int j = 0; j < 3 && isValid; j++) {
+                            const int* owner = EDGE_OWNERS[triTable[cell.cubeIndex][i + j]];
+                            vertices[j] = getVertex(x + owner[0], y + owner[1], z + owner[2], owner[3]);
+                            isValid = vertices[j] >= 0;
+                        }
 
-            for (int i = 0; i < triangles.size(); i++) {
-                ply_file << 3 << " " << i * 3 + 0 << " " << i * 3 + 1 << " " << i * 3 + 2 << "\n";
+                        if (isValid) {
+                            for (int j = 0; j < 3; j++) {
+                                mesh.indices[(size_t)triangle * 3 + j] = (uint32_t)vertices[j];
+                            }
+                            triangle++;
+                        }
+                    }
+                }
             }
-
-            ply_file.close();
-
-            std::cout << "Written ply" << std::endl;
-        }
-    
+        });
+    }
 }
-#endif
\ No newline at end of file
+#endif
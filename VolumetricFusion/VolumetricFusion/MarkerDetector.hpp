@@ -0,0 +1,247 @@
+#pragma once
+
+#ifndef _MARKER_DETECTOR_HEADER
+#define _MARKER_DETECTOR_HEADER
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/aruco.hpp>
+#include "ThreadPool.hpp"
+
+namespace vc::processing {
+	// Frames between two searches of the whole frame, in between only the regions of the tracked markers are searched
+	const int DEFAULT_FULL_SEARCH_INTERVAL = 15;
+	// The whole frame is searched at 1 / decimation of its resolution, the corners are detected in the found regions at full resolution
+	const int DEFAULT_SEARCH_DECIMATION = 2;
+	// Tiles per row and column of the full search, each one is searched on a worker thread
+	const int SEARCH_TILES = 2;
+	// Overlap of neighbouring tiles relative to the tile size, markers up to about this size lie completely in one tile
+	const float SEARCH_TILE_OVERLAP = 0.5f;
+	// Region searched around the predicted corners of a tracked marker, relative to its size ...
+	const float ROI_MARGIN = 0.5f;
+	// ... but at least this many pixels, so the subpixel refinement window and fast small markers fit
+	const int ROI_MIN_MARGIN = 16;
+
+	/// <summary>
+	/// Detects ArUco markers in a sequence of frames of one camera.
+	/// The dictionary and the detector parameters are created once.
+	/// Markers found in a frame are tracked: the next frame is only searched in the regions predicted from their last motion.
+	/// Every fullSearchInterval frames, or when no marker is tracked, the decimated frame is searched in tiles on the shared
+	/// thread pool for markers that appeared. All corners are detected and refined at full resolution in the regions.
+	/// </summary>
+	class MarkerDetector {
+	private:
+		cv::Ptr<cv::aruco::Dictionary> dictionary;
+		// Subpixel refinement, for the regions at full resolution
+		cv::Ptr<cv::aruco::DetectorParameters> parameters;
+		// No refinement, the decimated search only locates the markers
+		cv::Ptr<cv::aruco::DetectorParameters> searchParameters;
+		int fullSearchInterval;
+		int decimation;
+		int framesSinceSearch;
+
+		cv::Mat gray;
+		cv::Mat decimated;
+
+		// Corners and per frame motion of the markers of the last frame by id
+		std::map<int, std::vector<cv::Point2f>> tracked;
+		std::map<int, cv::Point2f> motion;
+
+		/// <summary>
+		/// The perimeter limits of the parameters are relative to the image size.
+		/// Scales them, so a marker in a part of the frame is accepted exactly like in the whole frame.
+		/// </summary>
+		static cv::Ptr<cv::aruco::DetectorParameters> scaleParameters(const cv::aruco::DetectorParameters& parameters, cv::Size frame, cv::Size part) {
+			auto scaled = cv::makePtr<cv::aruco::DetectorParameters>(parameters);
+			const double factor = (double)std::max(frame.width, frame.height) / std::max(part.width, part.height);
+			scaled->minMarkerPerimeterRate *= factor;
+			scaled->maxMarkerPerimeterRate *= factor;
+			return scaled;
+		}
+
+		static cv::Rect boundingRect(const std::vector<cv::Point2f>& corners, cv::Point2f offset) {
+			cv::Point2f min = corners[0];
+			cv::Point2f max = corners[0];
+			for (auto& corner : corners) {
+				min.x = std::min(min.x, corner.x);
+				min.y = std::min(min.y, corner.y);
+				max.x = std::max(max.x, corner.x);
+				max.y = std::max(max.y, corner.y);
+			}
+			const int margin = std::max(ROI_MIN_MARGIN, (int)(std::max(max.x - min.x, max.y - min.y) * ROI_MARGIN));
+			return cv::Rect(cv::Point((int)(min.x + offset.x) - margin, (int)(min.y + offset.y) - margin),
+				cv::Point((int)(max.x + offset.x) + margin + 1, (int)(max.y + offset.y) + margin + 1));
+		}
+
+		/// <summary>
+		/// Clips the regions to the frame and merges overlapping ones until all are disjoint, so every marker is detected once.
+		/// </summary>
+		static std::vector<cv::Rect> mergeRegions(std::vector<cv::Rect> regions, cv::Size frame) {
+			const cv::Rect bounds(cv::Point(0, 0), frame);
+			std::vector<cv::Rect> merged;
+			for (auto& region : regions) {
+				region &= bounds;
+				if (region.area() > 0) {
+					merged.emplace_back(region);
+				}
+			}
+
+			bool changed = true;
+			while (changed) {
+				changed = false;
+				for (size_t i = 0; i < merged.size() && !changed; i++) {
+					for (size_t j = i + 1; j < merged.size() && !changed; j++) {
+						if ((merged[i] & merged[j]).area() > 0) {
+							merged[i] |= merged[j];
+							merged.erase(merged.begin() + j);
+							changed = true;
+						}
+					}
+				}
+			}
+			return merged;
+		}
+
+		/// <summary>
+		/// Searches the decimated frame in overlapping tiles and returns the regions of the found markers at full resolution.
+		/// </summary>
+		std::vector<cv::Rect> search() {
+			cv::resize(gray, decimated, cv::Size(gray.cols / decimation, gray.rows / decimation), 0, 0, cv::INTER_AREA);
+
+			const cv::Size size = decimated.size();
+			const cv::Size tile((int)(size.width / (SEARCH_TILES - (SEARCH_TILES - 1) * SEARCH_TILE_OVERLAP)),
+				(int)(size.height / (SEARCH_TILES - (SEARCH_TILES - 1) * SEARCH_TILE_OVERLAP)));
+			const cv::Size stride((int)(tile.width * (1 - SEARCH_TILE_OVERLAP)), (int)(tile.height * (1 - SEARCH_TILE_OVERLAP)));
+			auto tileParameters = scaleParameters(*searchParameters, size, tile);
+
+			std::vector<std::vector<cv::Rect>> tileRegions(SEARCH_TILES * SEARCH_TILES);
+			vc::utils::sharedThreadPool().parallelFor(0, SEARCH_TILES * SEARCH_TILES, [&](int i) {
+				const int column = i % SEARCH_TILES;
+				const int row = i / SEARCH_TILES;
+				// The last tiles end at the border, even if the size is not divisible
+				const cv::Point begin(column * stride.width, row * stride.height);
+				const cv::Point end(column == SEARCH_TILES - 1 ? size.width : std::min(size.width, begin.x + tile.width),
+					row == SEARCH_TILES - 1 ? size.height : std::min(size.height, begin.y + tile.height));
+				const cv::Rect roi(begin, end);
+				std::vector<int> ids;
+				std::vector<std::vector<cv::Point2f>> corners;
+				cv::aruco::detectMarkers(decimated(roi), dictionary, corners, ids, tileParameters);
+				for (auto& marker : corners) {
+					for (auto& corner : marker) {
+						corner = (corner + cv::Point2f((float)roi.x, (float)roi.y)) * (float)decimation;
+					}
+					tileRegions[i].emplace_back(boundingRect(marker, cv::Point2f(0, 0)));
+				}
+			});
+
+			std::vector<cv::Rect> regions;
+			for (auto& found : tileRegions) {
+				regions.insert(regions.end(), found.begin(), found.end());
+			}
+
+			// Nothing tracked and nothing in the tiles, a marker larger than the overlap may lie on the border of two
+			if (regions.empty() && tracked.empty()) {
+				std::vector<int> ids;
+				std::vector<std::vector<cv::Point2f>> corners;
+				cv::aruco::detectMarkers(decimated, dictionary, corners, ids, searchParameters);
+				for (auto& marker : corners) {
+					for (auto& corner : marker) {
+						corner *= (float)decimation;
+					}
+					regions.emplace_back(boundingRect(marker, cv::Point2f(0, 0)));
+				}
+			}
+			return regions;
+		}
+
+	public:
+		MarkerDetector(int fullSearchInterval = DEFAULT_FULL_SEARCH_INTERVAL, int decimation = DEFAULT_SEARCH_DECIMATION) :
+			dictionary(cv::aruco::getPredefinedDictionary(cv::aruco::DICT_6X6_250)),
+			parameters(cv::aruco::DetectorParameters::create()),
+			searchParameters(cv::aruco::DetectorParameters::create()),
+			fullSearchInterval(std::max(1, fullSearchInterval)),
+			decimation(std::max(1, decimation)),
+			framesSinceSearch(this->fullSearchInterval)
+		{
+			parameters->cornerRefinementMethod = cv::aruco::CORNER_REFINE_SUBPIX;
+			searchParameters->cornerRefinementMethod = cv::aruco::CORNER_REFINE_NONE;
+		}
+
+		MarkerDetector(const MarkerDetector&) = delete;
+		MarkerDetector& operator=(const MarkerDetector&) = delete;
+
+		const cv::Ptr<cv::aruco::Dictionary>& getDictionary() const {
+			return dictionary;
+		}
+
+		/// <summary>
+		/// Forgets the tracked markers, the next frame is searched completely.
+		/// </summary>
+		void reset() {
+			tracked.clear();
+			motion.clear();
+			framesSinceSearch = fullSearchInterval;
+		}
+
+		/// <summary>
+		/// Detects the markers in the next RGB8 frame of the camera.
+		/// </summary>
+		void detect(const cv::Mat& image, std::vector<std::vector<cv::Point2f>>& corners, std::vector<int>& ids) {
+			if (image.channels() == 3) {
+				cv::cvtColor(image, gray, cv::COLOR_RGB2GRAY);
+			}
+			else {
+				image.copyTo(gray);
+			}
+
+			std::vector<cv::Rect> regions;
+			for (auto& marker : tracked) {
+				regions.emplace_back(boundingRect(marker.second, motion[marker.first]));
+			}
+			if (++framesSinceSearch >= fullSearchInterval || tracked.empty()) {
+				auto found = search();
+				regions.insert(regions.end(), found.begin(), found.end());
+				framesSinceSearch = 0;
+			}
+			regions = mergeRegions(regions, gray.size());
+
+			std::vector<std::vector<int>> regionIds(regions.size());
+			std::vector<std::vector<std::vector<cv::Point2f>>> regionCorners(regions.size());
+			vc::utils::sharedThreadPool().parallelFor(0, (int)regions.size(), [&](int i) {
+				const cv::Rect& roi = regions[i];
+				cv::aruco::detectMarkers(gray(roi), dictionary, regionCorners[i], regionIds[i], scaleParameters(*parameters, gray.size(), roi.size()));
+				for (auto& marker : regionCorners[i]) {
+					for (auto& corner : marker) {
+						corner += cv::Point2f((float)roi.x, (float)roi.y);
+					}
+				}
+			});
+
+			ids.clear();
+			corners.clear();
+			std::map<int, std::vector<cv::Point2f>> previous;
+			previous.swap(tracked);
+			motion.clear();
+			for (size_t i = 0; i < regions.size(); i++) {
+				for (size_t j = 0; j < regionIds[i].size(); j++) {
+					const int id = regionIds[i][j];
+					const auto& marker = regionCorners[i][j];
+					ids.emplace_back(id);
+					corners.emplace_back(marker);
+
+					auto last = previous.find(id);
+					if (last != previous.end()) {
+						// The first corner moves like the marker, unless it rotates fast
+						motion[id] = marker[0] - last->second[0];
+					}
+					tracked[id] = marker;
+				}
+			}
+		}
+	};
+}
+
+#endif // !_MARKER_DETECTOR_HEADER
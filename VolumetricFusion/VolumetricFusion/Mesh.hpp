@@ -1,83 +1,222 @@
-#ifndef MESH_H
-#define MESH_H
+#pragma once
 
-#include <glad/glad.h>
-
-#include <glm/glm.hpp>
-#include <glm/gtc/matrix_transform.hpp>
-#include <glm/gtc/type_ptr.hpp>
+#ifndef _MESH_HEADER
+#define _MESH_HEADER
 
 #include <vector>
+#include <string>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <glm/glm.hpp>
 
-#include <VolumetricFusion\shader.hpp>
-
-namespace vc::fusion{
-
-	struct Vertex {
-		glm::vec3 Position;
+namespace vc::fusion {
+	/// <summary>
+	/// A vertex of the indexed marching cubes mesh, 32 bytes.
+	/// The layout is mirrored by shader/marchingCubes.comp as std430 struct { vec3 pos; uint color; vec3 normal; float unused; }
+	/// and read by shader/mesh.vert with the color as normalized unsigned bytes.
+	/// </summary>
+	struct MeshVertex {
+		glm::vec3 pos;
+		uint8_t color[4] = { 0, 0, 0, 255 };
+		glm::vec3 normal;
+		float unused = 0;
+
+		void setColor(glm::vec4 value) {
+			for (int i = 0; i < 3; i++) {
+				color[i] = (uint8_t)std::round(std::min(std::max(value[i], 0.0f), 1.0f) * 255.0f);
+			}
+			color[3] = 255;
+		}
+	};
+	static_assert(sizeof(MeshVertex) == 32, "MeshVertex has to match the VertexData layout of shader/marchingCubes.comp");
+
+	/// <summary>
+	/// A triangle mesh whose vertices are shared between the faces, three indices per face.
+	/// </summary>
+	struct Mesh {
+		std::vector<MeshVertex> vertices;
+		std::vector<uint32_t> indices;
+
+		int numTriangles() const {
+			return (int)indices.size() / 3;
+		}
+
+		void clear() {
+			vertices.clear();
+			indices.clear();
+		}
 	};
 
-	class Mesh {
-		public:
-			/*  Mesh Data  */
-			std::vector<Vertex> vertices;
-			std::vector<unsigned int> indices;
-
-			vc::rendering::Shader* meshShader;
-
-			/*  Functions  */
-			Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices) {
-				this->vertices = vertices;
-				this->indices = indices;
-				setupMesh();
+	/// <summary>
+	/// Writes the mesh as binary little endian PLY with positions, normals and colors per vertex and indexed faces.
+	/// The elements are packed into large chunks that go to the file in one write each.
+	/// </summary>
+	bool exportToPly(const Mesh& mesh, const std::string& filename) {
+		std::ofstream ply_file(filename, std::ios::binary);
+		if (!ply_file) {
+			std::cerr << "Could not open " << filename << std::endl;
+			return false;
+		}
+
+		ply_file << "ply\n";
+		// MeshVertex is copied as is, which needs a little endian machine like every platform we build for
+		ply_file << "format binary_little_endian 1.0\n";
+
+		ply_file << "comment Marching cubes of the voxelgrid\n";
+
+		ply_file << "element vertex " << mesh.vertices.size() << "\n";
+		ply_file << "property float x\n";
+		ply_file << "property float y\n";
+		ply_file << "property float z\n";
+
+		ply_file << "property float nx\n";
+		ply_file << "property float ny\n";
+		ply_file << "property float nz\n";
+
+		ply_file << "property uchar red\n";
+		ply_file << "property uchar green\n";
+		ply_file << "property uchar blue\n";
+
+		ply_file << "element face " << mesh.numTriangles() << "\n";
+		ply_file << "property list uchar uint vertex_indices\n";
+		ply_file << "end_header\n";
+
+		const size_t CHUNK_SIZE = 1 << 20;
+		std::vector<char> chunk;
+		chunk.reserve(CHUNK_SIZE + 64);
+
+		auto append = [&chunk](const void* data, size_t size) {
+			const char* bytes = (const char*)data;
+			chunk.insert(chunk.end(), bytes, bytes + size);
+		};
+
+		auto flushIfFull = [&]() {
+			if (chunk.size() >= CHUNK_SIZE) {
+				ply_file.write(chunk.data(), chunk.size());
+				chunk.clear();
 			}
-
-			void renderMesh(glm::mat4 model, glm::mat4 view, glm::mat4 projection) {
-
-				meshShader->use();
-				//meshShader->setVec3("size", size);
-				meshShader->setMat4("model", model);
-				meshShader->setMat4("view", view);
-				meshShader->setMat4("projection", projection);
-
-				// draw mesh
-				glBindVertexArray(VAO);
-				glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
-				glBindVertexArray(0);
+		};
+
+		for (auto& vertex : mesh.vertices) {
+			append(&vertex.pos, sizeof(float) * 3);
+			append(&vertex.normal, sizeof(float) * 3);
+			append(vertex.color, 3);
+			flushIfFull();
+		}
+
+		const uint8_t verticesPerFace = 3;
+		for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+			append(&verticesPerFace, 1);
+			append(&mesh.indices[i], sizeof(uint32_t) * 3);
+			flushIfFull();
+		}
+
+		ply_file.write(chunk.data(), chunk.size());
+		ply_file.close();
+
+		if (!ply_file) {
+			std::cerr << "Could not write " << filename << std::endl;
+			return false;
+		}
+
+		std::cout << "Written ply " << filename << std::endl;
+		return true;
+	}
+
+	/// <summary>
+	/// Writes meshes to PLY on a background thread, so the render loop only pays for taking the snapshot.
+	/// At most maxQueued meshes wait or are being written, further snapshots are rejected until one is done.
+	/// The destructor finishes all queued meshes.
+	/// </summary>
+	class MeshExporter {
+	private:
+		struct Job {
+			std::shared_ptr<const Mesh> mesh;
+			std::string filename;
+		};
+
+		const int maxQueued;
+		std::queue<Job> jobs;
+		// Queued plus the one being written
+		int pending = 0;
+		bool stopped = false;
+
+		mutable std::mutex mutex;
+		std::condition_variable jobAvailable;
+		std::thread writer;
+
+		void writerFunction() {
+			while (true) {
+				Job job;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					jobAvailable.wait(lock, [this]() { return stopped || !jobs.empty(); });
+					if (jobs.empty()) {
+						return;
+					}
+					job = std::move(jobs.front());
+					jobs.pop();
+				}
+
+				exportToPly(*job.mesh, job.filename);
+
+				std::lock_guard<std::mutex> lock(mutex);
+				pending--;
 			}
-
-		private:
-			/*  Render data  */
-			unsigned int VAO, VBO, EBO;
-			/*  Functions    */
-			void setupMesh() {
-
-				meshShader = new vc::rendering::VertexFragmentShader("shader/mesh.vs", "shader/mesh.fs");
-
-				// create buffers/arrays
-				glGenVertexArrays(1, &VAO);
-				glGenBuffers(1, &VBO);
-				glGenBuffers(1, &EBO);
-
-				glBindVertexArray(VAO);
-				// load data into vertex buffers
-				glBindBuffer(GL_ARRAY_BUFFER, VBO);
-				// A great thing about structs is that their memory layout is sequential for all its items.
-				// The effect is that we can simply pass a pointer to the struct and it translates perfectly to a glm::vec3/2 array which
-				// again translates to 3/2 floats which translates to a byte array.
-				glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
-
-				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-				glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
-
-				// set the vertex attribute pointers
-				// vertex Positions
-				glEnableVertexAttribArray(0);
-				glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
-
-				glBindVertexArray(0);
+		}
+
+	public:
+		explicit MeshExporter(int maxQueued = 4) :
+			maxQueued(maxQueued)
+		{
+			writer = std::thread(&MeshExporter::writerFunction, this);
+		}
+
+		~MeshExporter() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopped = true;
+			}
+			jobAvailable.notify_all();
+			writer.join();
+		}
+
+		MeshExporter(const MeshExporter&) = delete;
+		MeshExporter& operator=(const MeshExporter&) = delete;
+
+		/// <summary>
+		/// Queues the mesh for writing, false if the queue is full.
+		/// The mesh must not change anymore, the writer reads it without a lock.
+		/// </summary>
+		bool enqueue(std::shared_ptr<const Mesh> mesh, const std::string& filename) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (pending >= maxQueued) {
+					return false;
+				}
+				jobs.push({ std::move(mesh), filename });
+				pending++;
 			}
+			jobAvailable.notify_one();
+			return true;
+		}
+
+		/// <summary>
+		/// The number of meshes that are queued or being written.
+		/// </summary>
+		int getPending() const {
+			std::lock_guard<std::mutex> lock(mutex);
+			return pending;
+		}
 	};
 }
 
-#endif
\ No newline at end of file
+#endif // !_MESH_HEADER
@@ -45,6 +45,7 @@ using namespace vc::enums;
 #include "camera.hpp"
 #include "shader.hpp"
 #include "MarchingCubes.hpp"
+#include "SparseVoxelgrid.hpp"
 
 #include "Processing.hpp"
 
@@ -66,6 +67,12 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 void processInput(GLFWwindow* window);
 void setCalibration();
 void addPipeline(std::shared_ptr<  vc::capture::CaptureDevice> pipeline);
+bool integrateBundle(const std::vector<vc::data::Frames>& bundle);
+void createFusionStages();
+void takeFusionResults();
+Eigen::Matrix4d getCameraTransformation(int pipeline, const vc::data::Frames& frames);
+void seekPlayback(double seconds);
+void setOfflinePlayback(bool offline);
 GLFWwindow* setupWindow();
 GLFWwindow* setupComputeWindow();
 
@@ -96,12 +103,36 @@ vc::settings::State state = vc::settings::State(CaptureState::PLAYING, RenderSta
 //std::vector<vc::imgui::PipelineGUI> pipelineGuis;
 vc::imgui::AllPipelinesGUI* allPipelinesGui;
 std::vector<std::shared_ptr<  vc::capture::CaptureDevice>> pipelines;
+std::shared_ptr<vc::capture::MultiViewSynchronizer> synchronizer;
 
 bool visualizeCharucoResults = true;
 bool overlayCharacteristicPoints = true;
 
+// Allocates voxels only close to observed surfaces instead of a dense box
+bool useSparseVoxelgrid = false;
+
+// Plays every frame of the recordings once and as fast as the fusion takes them, instead of looping in real time
+bool offlinePlayback = false;
+// Seconds per main loop iteration spent on fusing in offline playback
+const double OFFLINE_FUSION_BUDGET = 0.1;
+vc::imgui::PlaybackGUI* playbackGUI = nullptr;
+// Records the cameras into librealsense's .bag, which the playback and other tools expect.
+// Off records them with the asynchronous Recorder into the project format instead, played back by RGBDRecordingCaptureDevice.
+bool recordToBag = true;
+std::shared_ptr<vc::capture::Recorder> recorder;
+vc::imgui::RecorderGUI* recorderGUI = nullptr;
+// Converts the .bag recordings on startup and plays the converted files, which are mapped instead of decoded.
+// Off by default, the conversion takes a while for long recordings and doubles their size on disk.
+// A .bag is played directly unless a converted file next to it exists.
+bool convertBagRecordings = false;
+// Plays the frames of the tsdf-fusion demo with their ground truth poses instead of the recordings, e.g. "../tsdf-fusion/data/"
+std::string datasetFolder = "";
 vc::fusion::Voxelgrid* voxelgrid;
 vc::imgui::FusionGUI* fusionGUI;
+// Integrate and polygonise the bundles on the thread pool while the main loop renders, if the voxelgrid can do that
+std::shared_ptr<vc::utils::StagePipeline<vc::fusion::FusionWork>> fusionStages;
+// Set by the integration stage, the main loop uploads the voxels for rendering afterwards
+std::atomic_bool voxelsIntegrated = false;
 //vc::fusion::MarchingCubes* marchingCubes;
 
 vc::rendering::CoordinateSystem* coordinateSystem;
@@ -129,13 +160,41 @@ int main(int argc, char* argv[]) try {
 	//vc::processing::ChArUco::generateMarkers(markerIds);
 	//return 0;
 
+	// --dataset <folder> plays the tsdf-fusion demo, --offline fuses every frame once as fast as possible,
+	// e.g. "--dataset ../tsdf-fusion/data/ --offline" measures the fusion on the same frames every run
+	for (int i = 1; i < argc; i++) {
+		const std::string argument = argv[i];
+		if (argument == "--dataset" && i + 1 < argc) {
+			datasetFolder = argv[++i];
+			if (!datasetFolder.empty() && datasetFolder.back() != '/' && datasetFolder.back() != '\\') {
+				datasetFolder += "/";
+			}
+		}
+		else if (argument == "--offline") {
+			offlinePlayback = true;
+		}
+		else {
+			std::cerr << "Unknown argument " << argument << ", usage: " << argv[0] << " [--dataset <folder>] [--offline]" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	if (!datasetFolder.empty()) {
+		// The dataset comes with the poses, fusing it needs no calibration
+		state.renderState = RenderState::VOLUMETRIC_FUSION;
+	}
+
 	google::InitGoogleLogging("Bundle Adjustment");
 	ceres::Solver::Summary summary;
 	folderSettings.recordingsFolder = "recordings/low_resolution_topdown/";
 
 	GLFWwindow* window = setupWindow();
 	   
-	voxelgrid = new vc::fusion::Voxelgrid();
+	if (useSparseVoxelgrid) {
+		voxelgrid = new vc::fusion::SparseVoxelgrid();
+	}
+	else {
+		voxelgrid = new vc::fusion::Voxelgrid();
+	}
 
 	coordinateSystem = new vc::rendering::CoordinateSystem();
 	optimizationProblem->setupOpenGL();
@@ -158,22 +217,55 @@ int main(int argc, char* argv[]) try {
 		int i = 0;
 		for (auto&& device : ctx.query_devices())
 		{
-			if (state.captureState == CaptureState::RECORDING) {
+			if (state.captureState == CaptureState::RECORDING && recordToBag) {
 				addPipeline(std::make_shared < vc::capture::RecordingCaptureDevice>(ctx, device, DEFAULT_COLOR_STREAM, DEFAULT_DEPTH_STREAM, folderSettings.recordingsFolder));
 			}
+			else if (state.captureState == CaptureState::RECORDING) {
+				addPipeline(std::make_shared < vc::capture::StreamingCaptureDevice>(ctx, device, DEFAULT_COLOR_STREAM, DEFAULT_DEPTH_STREAM));
+			}
 			else if (state.captureState == CaptureState::STREAMING) {
 				addPipeline(std::make_shared < vc::capture::StreamingCaptureDevice>(ctx, device, DEFAULT_COLOR_STREAM, DEFAULT_DEPTH_STREAM, i == 0 ? 1 : 2));
 			}
 			i++;
 		}
 	}
+	else if (state.captureState == CaptureState::PLAYING && !datasetFolder.empty()) {
+		addPipeline(std::make_shared<vc::capture::TSDFFusionCaptureDevice>(ctx, datasetFolder, !offlinePlayback));
+		playbackGUI = new vc::imgui::PlaybackGUI(&pipelines, seekPlayback, setOfflinePlayback, offlinePlayback);
+	}
 	else if (state.captureState == CaptureState::PLAYING) {
-		std::vector<std::string> filenames = vc::file_access::listFilesInFolder(folderSettings.recordingsFolder);
+		if (convertBagRecordings) {
+			for (auto& bagFilename : vc::file_access::listFilesInFolder(folderSettings.recordingsFolder)) {
+				const std::string filename = bagFilename.substr(0, bagFilename.size() - std::string(".bag").size()) + vc::capture::RGBD_RECORDING_EXTENSION;
+				if (!vc::file_access::exists(filename)) {
+					std::cout << "Converting " << bagFilename << std::endl;
+					vc::capture::convertBagToRGBDRecording(bagFilename, filename);
+				}
+			}
+		}
 
-		for (int i = 0; i < filenames.size() && i < 4; i++)
-		{
-			addPipeline(std::make_shared < vc::capture::PlayingCaptureDevice>(ctx, filenames[i]));
+		std::vector<std::string> filenames = vc::file_access::listFilesInFolder(folderSettings.recordingsFolder);
+		if (!filenames.empty()) {
+			for (int i = 0; i < filenames.size() && i < 4; i++)
+			{
+				const std::string converted = filenames[i].substr(0, filenames[i].size() - std::string(".bag").size()) + vc::capture::RGBD_RECORDING_EXTENSION;
+				if (vc::file_access::exists(converted)) {
+					addPipeline(std::make_shared < vc::capture::RGBDRecordingCaptureDevice>(ctx, converted, !offlinePlayback));
+				}
+				else {
+					addPipeline(std::make_shared < vc::capture::PlayingCaptureDevice>(ctx, filenames[i], !offlinePlayback));
+				}
+			}
 		}
+		else {
+			// Recorded by the Recorder, there is no .bag
+			filenames = vc::file_access::listFilesInFolder(folderSettings.recordingsFolder, vc::capture::RGBD_RECORDING_EXTENSION);
+			for (int i = 0; i < filenames.size() && i < 4; i++)
+			{
+				addPipeline(std::make_shared < vc::capture::RGBDRecordingCaptureDevice>(ctx, filenames[i], !offlinePlayback));
+			}
+		}
+		playbackGUI = new vc::imgui::PlaybackGUI(&pipelines, seekPlayback, setOfflinePlayback, offlinePlayback);
 	}
 
 	allPipelinesGui = new vc::imgui::AllPipelinesGUI(&pipelines);
@@ -194,6 +286,31 @@ int main(int argc, char* argv[]) try {
 	std::thread calibrationThread;
 	std::thread fusionThread;
 		
+	// Fusion only integrates frames of all cameras taken at the same time
+	synchronizer = std::make_shared<vc::capture::MultiViewSynchronizer>(pipelines.size());
+	for (int i = 0; i < pipelines.size(); i++) {
+		pipelines[i]->synchronizer = synchronizer;
+		pipelines[i]->synchronizerView = i;
+	}
+	fusionGUI->synchronizer = synchronizer;
+	createFusionStages();
+	fusionGUI->fusionStages = fusionStages;
+	setOfflinePlayback(offlinePlayback);
+
+	if (state.captureState == CaptureState::RECORDING && !recordToBag) {
+		std::vector<std::string> deviceNames;
+		for (auto& pipeline : pipelines) {
+			deviceNames.emplace_back(pipeline->data->deviceName);
+		}
+		recorder = std::make_shared<vc::capture::Recorder>(folderSettings.recordingsFolder, deviceNames);
+		recorder->start();
+		for (int i = 0; i < pipelines.size(); i++) {
+			pipelines[i]->recorder = recorder;
+			pipelines[i]->recorderStream = i;
+		}
+		recorderGUI = new vc::imgui::RecorderGUI(recorder, deviceNames);
+	}
+
 	for (int i = 0; i < pipelines.size(); i++) {
 		pipelines[i]->chArUco->visualize = visualizeCharucoResults;
 		pipelines[i]->setResolutions(DEFAULT_COLOR_STREAM, DEFAULT_DEPTH_STREAM);
@@ -227,6 +344,8 @@ int main(int argc, char* argv[]) try {
 #pragma region Main loop
 
 	int frameNumberForVoxelgrid = 0;
+	const double playbackStart = glfwGetTime();
+	bool playbackFinishedReported = false;
 	while (!glfwWindowShouldClose(window))
 	{
 		// per-frame time logic
@@ -248,6 +367,12 @@ int main(int argc, char* argv[]) try {
 		// -------------------------------------------------------------------------------
 		processInput(window);
 
+		// Fusion and rendering of this iteration see the same frames per device
+		for (int i = 0; i < pipelines.size(); i++) {
+			pipelines[i]->data->updateFrames();
+			synchronizer->setActive(i, i < 4 && programGui->activeCameras[i]);
+		}
+
 		glm::mat4 model = glm::mat4(1.0f);
 		glm::mat4 view = camera.GetViewMatrix();
 		glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
@@ -261,6 +386,58 @@ int main(int argc, char* argv[]) try {
 		vc::imgui::startFrame(&io, SCR_WIDTH, SCR_HEIGHT);
 
 		programGui->render();
+		if (playbackGUI) {
+			playbackGUI->render();
+		}
+		if (recorderGUI) {
+			recorderGUI->render();
+		}
+
+		// Bundles are taken even without fusion, in offline playback the recordings wait for that
+		const bool fusing = state.renderState == RenderState::VOLUMETRIC_FUSION && fusionGUI->fuse;
+		const bool fusingAsynchronously = fusing && voxelgrid->canFuseAsynchronously();
+		fusionStages->setEnabled((int)vc::fusion::FusionStage::MESH, fusionGUI->marchingCubes);
+		std::vector<vc::data::Frames> bundle;
+		// Decided before the bundles are taken, the frames of finished playbacks are all in the synchronizer then
+		bool playbackFinished = offlinePlayback && !pipelines.empty();
+		for (auto& pipeline : pipelines) {
+			auto playing = std::dynamic_pointer_cast<vc::capture::PlaybackControl>(pipeline);
+			playbackFinished = playbackFinished && playing && playing->hasFinished() && pipeline->stages->isIdle();
+		}
+		bool bundlesDrained = false;
+		if (offlinePlayback) {
+			// As many bundles as fit into the budget, each one waits at most until the recordings delivered it.
+			// Full fusion stages hold the recordings back like the integration on this thread does.
+			const double start = glfwGetTime();
+			while (!fusingAsynchronously || fusionStages->canPush()) {
+				if (!synchronizer->waitForBundle(bundle, std::chrono::milliseconds(10))) {
+					bundlesDrained = true;
+					break;
+				}
+				if (!fusing) {
+					break;
+				}
+				integrateBundle(bundle);
+				if (glfwGetTime() - start > OFFLINE_FUSION_BUDGET) {
+					break;
+				}
+			}
+		}
+		else if (synchronizer->takeBundle(bundle) || !fusionGUI->synchronizeViews) {
+			if (fusing) {
+				// Without synchronization the newest frames every iteration
+				integrateBundle(fusionGUI->synchronizeViews ? bundle : std::vector<vc::data::Frames>());
+			}
+		}
+		takeFusionResults();
+
+		if (playbackFinished && !playbackFinishedReported && bundlesDrained) {
+			// Every frame is integrated once the stages ran empty
+			fusionStages->waitUntilIdle();
+			takeFusionResults();
+			std::cout << "Offline playback finished after " << (glfwGetTime() - playbackStart) << " s" << std::endl;
+			playbackFinishedReported = true;
+		}
 
 		if (state.renderState == RenderState::VOLUMETRIC_FUSION) {
 			fusionGUI->render();
@@ -268,18 +445,9 @@ int main(int argc, char* argv[]) try {
 			//if (vc::imgui::getFrameRate() > 20) 
 			{
 				//blockInput = true;
-				if (fusionGUI->fuse) {
-					bool cleared = false;
-					for (int i = 0; i < pipelines.size() && i < 4; i++)
-					{
-						if (programGui->activeCameras[i]) {
-							voxelgrid->integrateFrameGPU(pipelines[i], optimizationProblem->getBestTransformation(i), !cleared);
-							cleared = true;
-						}
-					}
-				}
-
-				if (fusionGUI->marchingCubes) {
+				// The fusion stages polygonise after every integration, else nothing changes the voxels meanwhile
+				if (fusionGUI->marchingCubes && !fusingAsynchronously) {
+					std::lock_guard<std::mutex> lock(voxelgrid->voxelMutex);
 					voxelgrid->computeMarchingCubes(camera.Position);
 				}
 				frameNumberForVoxelgrid = 0;
@@ -304,6 +472,9 @@ int main(int argc, char* argv[]) try {
 		
 		for (int i = 0; i < pipelines.size() && i < 4; ++i)
 		{
+			// The colorizer only runs while its output is shown
+			pipelines[i]->filterSettings.colorize = state.renderState == RenderState::ONLY_DEPTH;
+
 			if (!programGui->activeCameras[i]) {
 				continue;
 			}
@@ -327,7 +498,7 @@ int main(int argc, char* argv[]) try {
 				if (programGui->showCoordinateSystem) {
 					coordinateSystem->render(model, view, projection);
 				}
-				pipelines[i]->renderPointcloud(model, view, projection, optimizationProblem->getBestTransformation(i), allPipelinesGui->alphas[i]);
+				pipelines[i]->renderPointcloud(model, view, projection, getCameraTransformation(i, pipelines[i]->data->getFrames()), allPipelinesGui->alphas[i]);
 				
 				if (calibrateCameras && optimizationProblemGUI->highlightMarkerCorners) {
 					optimizationProblem->render(model, view, projection, i);
@@ -344,9 +515,17 @@ int main(int argc, char* argv[]) try {
 #pragma region Final cleanup
 
 	stopped.store(true);
+	// Capture threads waiting for the fusion would never return
+	synchronizer->setBlocking(false);
 	for (int i = 0; i < pipelines.size(); i++) {
 		pipelines[i]->terminate();
 	}
+	// Waits for the running stages, the bundles still queued are dropped
+	fusionStages.reset();
+	if (recorder) {
+		// Writes what is still queued and completes the recordings
+		recorder->stop();
+	}
 	calibrationThread.join();
 	fusionThread.join();
 #pragma endregion
@@ -388,6 +567,134 @@ void addPipeline(std::shared_ptr<vc::capture::CaptureDevice> pipeline)
 	pipelines.emplace_back(pipeline);
 }
 
+/// <summary>
+/// Integrates bundle[i] of every active pipeline i, the newest frames of the pipelines if bundle is empty.
+/// The fusion stages integrate it if the voxelgrid can fuse asynchronously, false if they are full.
+/// </summary>
+bool integrateBundle(const std::vector<vc::data::Frames>& bundle) {
+	vc::fusion::FusionWork work;
+	for (int i = 0; i < pipelines.size() && i < 4; i++)
+	{
+		if (programGui->activeCameras[i]) {
+			work.pipelines.emplace_back(pipelines[i]);
+			work.frames.emplace_back(bundle.empty() ? pipelines[i]->data->getFrames() : bundle[i]);
+			work.relativeTransformations.emplace_back(getCameraTransformation(i, work.frames.back()));
+		}
+	}
+	if (work.pipelines.empty()) {
+		return true;
+	}
+	if (voxelgrid->canFuseAsynchronously()) {
+		return fusionStages->push(work);
+	}
+	voxelgrid->integrateFrames(work.pipelines, work.frames, work.relativeTransformations);
+	return true;
+}
+
+/// <summary>
+/// Integrates the bundles and polygonises the voxels afterwards on the thread pool, while the main loop renders.
+/// A bundle arriving while the last mesh is still extracted is only integrated.
+/// Both stages hold the voxelMutex, so they don't overlap each other but the rendering and the capture stages.
+/// </summary>
+void createFusionStages() {
+	fusionStages = std::make_shared<vc::utils::StagePipeline<vc::fusion::FusionWork>>(&vc::utils::sharedThreadPool(), 2);
+	fusionStages->addStage("Integrate", [](vc::fusion::FusionWork& work) {
+		std::lock_guard<std::mutex> lock(voxelgrid->voxelMutex);
+		// The backend may have changed since the bundle was queued
+		if (!voxelgrid->canFuseAsynchronously()) {
+			return false;
+		}
+		voxelgrid->integrateVoxelsCPU(work.pipelines, work.frames, work.relativeTransformations);
+		voxelsIntegrated = true;
+		return true;
+	});
+
+	vc::utils::StageSettings meshSettings;
+	meshSettings.capacity = 1;
+	meshSettings.dropWhenFull = true;
+	fusionStages->addStage("Mesh", [](vc::fusion::FusionWork& work) {
+		std::lock_guard<std::mutex> lock(voxelgrid->voxelMutex);
+		if (!voxelgrid->canFuseAsynchronously()) {
+			return false;
+		}
+		work.mesh = voxelgrid->polygoniseCPU();
+		return true;
+	}, meshSettings);
+}
+
+/// <summary>
+/// Uploads what the fusion stages finished since the last call, OpenGL is only used on the main thread.
+/// </summary>
+void takeFusionResults() {
+	vc::fusion::FusionWork done;
+	std::shared_ptr<vc::fusion::Mesh> newestMesh;
+	while (fusionStages->pop(done)) {
+		if (done.mesh) {
+			newestMesh = done.mesh;
+		}
+	}
+	if (newestMesh) {
+		voxelgrid->uploadMeshCPU(newestMesh);
+	}
+
+	// Skipped while a stage works on the voxels, the next iteration tries again
+	if (voxelsIntegrated.load() && fusionGUI->renderVoxelgrid) {
+		std::unique_lock<std::mutex> lock(voxelgrid->voxelMutex, std::try_to_lock);
+		if (lock.owns_lock()) {
+			voxelsIntegrated = false;
+			voxelgrid->uploadVoxelgridBuffer();
+		}
+	}
+}
+
+/// <summary>
+/// The ground truth pose of the frames if the device has one, the calibrated transformation otherwise.
+/// </summary>
+Eigen::Matrix4d getCameraTransformation(int pipeline, const vc::data::Frames& frames) {
+	Eigen::Matrix4d pose;
+	if (auto groundTruth = std::dynamic_pointer_cast<vc::capture::GroundTruthPoses>(pipelines[pipeline])) {
+		if (groundTruth->getPose(frames.frameId, pose)) {
+			return pose;
+		}
+	}
+	return optimizationProblem->getBestTransformation(pipeline);
+}
+
+/// <summary>
+/// Moves all recordings to the same position, the first bundle afterwards is the first one at or after it.
+/// </summary>
+void seekPlayback(double seconds) {
+	for (auto& pipeline : pipelines) {
+		pipeline->pauseThread();
+	}
+	// Capture threads waiting for space in the synchronizer get it and see the pause
+	synchronizer->clear();
+	for (auto& pipeline : pipelines) {
+		pipeline->pauseThreadAndWait();
+	}
+	synchronizer->clear();
+
+	const auto position = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(seconds));
+	for (auto& pipeline : pipelines) {
+		if (auto playing = std::dynamic_pointer_cast<vc::capture::PlaybackControl>(pipeline)) {
+			playing->seek(position);
+		}
+	}
+	for (auto& pipeline : pipelines) {
+		pipeline->resumeThread();
+	}
+}
+
+void setOfflinePlayback(bool offline) {
+	offlinePlayback = offline && state.captureState == CaptureState::PLAYING;
+	for (auto& pipeline : pipelines) {
+		if (auto playing = std::dynamic_pointer_cast<vc::capture::PlaybackControl>(pipeline)) {
+			playing->setRealTime(!offlinePlayback);
+		}
+	}
+	synchronizer->setBlocking(offlinePlayback);
+}
+
 bool isKeyPressed(GLFWwindow* window, int key) {
 	return glfwGetKey(window, key) == GLFW_PRESS;
 }
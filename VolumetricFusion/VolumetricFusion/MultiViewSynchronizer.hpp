@@ -0,0 +1,260 @@
+#pragma once
+
+#ifndef _MULTI_VIEW_SYNCHRONIZER_HEADER
+#define _MULTI_VIEW_SYNCHRONIZER_HEADER
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include "Data.hpp"
+
+namespace vc::capture {
+	// Half a frame at 30 Hz, frames of different cameras further apart than this are never fused together
+	const double DEFAULT_SYNCHRONIZATION_TOLERANCE_MS = 16.0;
+	// Frames per view waiting for their partners, a view that runs ahead loses its oldest frames beyond this or waits in blocking mode
+	const int DEFAULT_SYNCHRONIZATION_WINDOW = 8;
+
+	struct SynchronizerStatistics {
+		// Complete bundles matched and taken by the consumer
+		int matchedBundles = 0;
+		int takenBundles = 0;
+		// Bundles replaced by a newer one before they were taken
+		int droppedBundles = 0;
+		// Per view, frames that left the window without being part of a bundle
+		std::vector<int> droppedFrames;
+		// Difference of the newest and the oldest timestamp within a bundle
+		double averageSkewMs = 0;
+		// Host time from the arrival of the oldest frame of a bundle until the bundle is taken
+		double averageLatencyMs = 0;
+	};
+
+	/// <summary>
+	/// Matches the frames of several cameras by their device timestamps and hands out complete bundles with one frameset per view.
+	/// The capture threads add their frames, the fusion takes each bundle at most once, always the newest one.
+	/// In blocking mode nothing is dropped for lack of time: a capture thread waits while its window is full
+	/// and no bundle is matched before the last one was taken, so every bundle is taken in order.
+	/// Views can be deactivated, the bundles then leave them empty.
+	/// The timestamps have to share a time base, which the global time of librealsense or recordings of it provide.
+	/// </summary>
+	class MultiViewSynchronizer {
+	private:
+		using clock = std::chrono::steady_clock;
+
+		struct PendingFrames {
+			vc::data::Frames frames;
+			clock::time_point arrival;
+		};
+
+		std::mutex mutex;
+		// Signals taken bundles, new bundles and space in the windows
+		std::condition_variable changed;
+		bool blocking = false;
+
+		std::vector<std::deque<PendingFrames>> windows;
+		std::vector<bool> active;
+
+		std::vector<vc::data::Frames> bundle;
+		clock::time_point bundleArrival;
+		bool hasBundle = false;
+
+		double skewSumMs = 0;
+		double latencySumMs = 0;
+		SynchronizerStatistics statistics;
+
+		void dropFront(int view) {
+			windows[view].pop_front();
+			statistics.droppedFrames[view]++;
+		}
+
+		/// <summary>
+		/// Emits bundles as long as the oldest frames of all active views lie within the tolerance.
+		/// Any future bundle contains a frame at least as new as the newest of these oldest frames,
+		/// so frames more than the tolerance before it can never be matched and are dropped.
+		/// Only the timestamps decide, not when the frames arrived.
+		/// </summary>
+		void match() {
+			while (!(blocking && hasBundle)) {
+				double newestFront = -INFINITY;
+				int numActive = 0;
+				for (int view = 0; view < windows.size(); view++) {
+					if (!active[view]) {
+						continue;
+					}
+					if (windows[view].empty()) {
+						return;
+					}
+					newestFront = std::max(newestFront, windows[view].front().frames.timestamp);
+					numActive++;
+				}
+				if (numActive == 0) {
+					return;
+				}
+
+				bool isComplete = true;
+				for (int view = 0; view < windows.size(); view++) {
+					if (!active[view]) {
+						continue;
+					}
+					while (!windows[view].empty() && windows[view].front().frames.timestamp < newestFront - tolerance) {
+						dropFront(view);
+					}
+					// Dropping moved the front past newestFront, compare again
+					isComplete = isComplete && !windows[view].empty() && windows[view].front().frames.timestamp <= newestFront;
+				}
+				if (!isComplete) {
+					continue;
+				}
+
+				if (hasBundle) {
+					statistics.droppedBundles++;
+				}
+				bundle.assign(windows.size(), vc::data::Frames());
+				bundleArrival = clock::time_point::max();
+				double oldestFront = INFINITY;
+				for (int view = 0; view < windows.size(); view++) {
+					if (!active[view]) {
+						continue;
+					}
+					const PendingFrames& front = windows[view].front();
+					bundle[view] = front.frames;
+					bundleArrival = std::min(bundleArrival, front.arrival);
+					oldestFront = std::min(oldestFront, front.frames.timestamp);
+					windows[view].pop_front();
+				}
+				hasBundle = true;
+
+				statistics.matchedBundles++;
+				skewSumMs += newestFront - oldestFront;
+				statistics.averageSkewMs = skewSumMs / statistics.matchedBundles;
+			}
+		}
+
+		void moveBundle(std::vector<vc::data::Frames>& frames) {
+			frames.swap(bundle);
+			bundle.clear();
+			hasBundle = false;
+
+			statistics.takenBundles++;
+			latencySumMs += std::chrono::duration<double, std::milli>(clock::now() - bundleArrival).count();
+			statistics.averageLatencyMs = latencySumMs / statistics.takenBundles;
+
+			// In blocking mode the windows may hold the next bundle already
+			match();
+			changed.notify_all();
+		}
+
+	public:
+		const double tolerance;
+		const int windowSize;
+
+		MultiViewSynchronizer(int numViews, double tolerance = DEFAULT_SYNCHRONIZATION_TOLERANCE_MS, int windowSize = DEFAULT_SYNCHRONIZATION_WINDOW) :
+			windows(numViews), active(numViews, true), tolerance(tolerance), windowSize(windowSize)
+		{
+			statistics.droppedFrames.resize(numViews, 0);
+		}
+
+		/// <summary>
+		/// Capture thread: adds the newest frames of a view and matches them.
+		/// In blocking mode this waits until the window of the view has space.
+		/// </summary>
+		void addFrames(int view, const vc::data::Frames& frames) {
+			std::unique_lock<std::mutex> lock(mutex);
+			if (view < 0 || view >= windows.size()) {
+				return;
+			}
+			changed.wait(lock, [&]() { return !blocking || !active[view] || windows[view].size() < windowSize; });
+			if (!active[view]) {
+				return;
+			}
+
+			auto& window = windows[view];
+			if (!window.empty() && frames.timestamp <= window.back().frames.timestamp) {
+				// Playback restarted or the device clock was reset, the old frames can't match anymore
+				statistics.droppedFrames[view] += (int)window.size();
+				window.clear();
+			}
+			if (window.size() >= windowSize) {
+				dropFront(view);
+			}
+			window.push_back({ frames, clock::now() });
+
+			match();
+			changed.notify_all();
+		}
+
+		/// <summary>
+		/// Switches between dropping frames when the consumer is too slow and making the capture threads wait for it.
+		/// Turn blocking off before stopping the capture threads, else they may wait forever.
+		/// </summary>
+		void setBlocking(bool isBlocking) {
+			std::lock_guard<std::mutex> lock(mutex);
+			blocking = isBlocking;
+			match();
+			changed.notify_all();
+		}
+
+		/// <summary>
+		/// Forgets all pending frames and the bundle not taken yet, e.g. after a seek.
+		/// </summary>
+		void clear() {
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& window : windows) {
+				window.clear();
+			}
+			bundle.clear();
+			hasBundle = false;
+			changed.notify_all();
+		}
+
+		/// <summary>
+		/// Inactive views are not waited for and get empty frames in the bundles.
+		/// </summary>
+		void setActive(int view, bool isActive) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (view < 0 || view >= windows.size() || active[view] == isActive) {
+				return;
+			}
+			active[view] = isActive;
+			windows[view].clear();
+			// Views that were waiting for this one may be complete now
+			match();
+			changed.notify_all();
+		}
+
+		/// <summary>
+		/// Consumer: moves the newest bundle not taken yet into frames, one entry per view.
+		/// Returns false if there is none.
+		/// </summary>
+		bool takeBundle(std::vector<vc::data::Frames>& frames) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!hasBundle) {
+				return false;
+			}
+			moveBundle(frames);
+			return true;
+		}
+
+		/// <summary>
+		/// Consumer: like takeBundle, but waits up to timeout for the next bundle.
+		/// </summary>
+		bool waitForBundle(std::vector<vc::data::Frames>& frames, std::chrono::milliseconds timeout) {
+			std::unique_lock<std::mutex> lock(mutex);
+			if (!changed.wait_for(lock, timeout, [this]() { return hasBundle; })) {
+				return false;
+			}
+			moveBundle(frames);
+			return true;
+		}
+
+		SynchronizerStatistics getStatistics() {
+			std::lock_guard<std::mutex> lock(mutex);
+			return statistics;
+		}
+	};
+}
+
+#endif // !_MULTI_VIEW_SYNCHRONIZER_HEADER
@@ -20,6 +20,7 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include "Utils.hpp"
+#include "MarkerDetector.hpp"
 #include <stdarg.h>
 
 #define _USE_MATH_DEFINES
@@ -30,65 +31,87 @@ namespace vc::data {
 
 namespace vc::processing {
 
+	/// <summary>
+	/// Wraps the pixels of a video frame without copying them.
+	/// </summary>
+	cv::Mat wrapFrame(const rs2::video_frame& frame, int imageDescriptor) {
+		return cv::Mat(frame.get_height(), frame.get_width(), imageDescriptor, const_cast<void*>(frame.get_data()), frame.get_stride_in_bytes());
+	}
+
 	class Processing {
 	public:
-		rs2::frame_queue processingQueues;
-		std::shared_ptr<rs2::processing_block > processingBlock;
+		std::shared_ptr<rs2::filter> processingBlock;
 
 		virtual void process(cv::Mat& image, unsigned long long frameId) = 0;
 		virtual void startProcessing() = 0;
+
+		/// <summary>
+		/// Writes the processed input to output, which has the same size and type.
+		/// Copies the input and processes it in place, override it if the block can write its result directly.
+		/// </summary>
+		virtual void process(const cv::Mat& input, cv::Mat& output, unsigned long long frameId) {
+			input.copyTo(output);
+			process(output, frameId);
+		}
+
+		/// <summary>
+		/// Whether process() writes to the image. The image of a block that only reads it is the input frame itself.
+		/// </summary>
+		virtual bool modifiesImage() const {
+			return true;
+		}
+
+		/// <summary>
+		/// Runs the block on the calling thread. A block that modifies the image returns a new frame,
+		/// otherwise the input frame is returned as it is.
+		/// </summary>
+		rs2::frame processFrame(rs2::frame frame) {
+			if (!modifiesImage()) {
+				cv::Mat image = wrapFrame(frame, getImageDescriptor());
+				process(image, frame.get_frame_number());
+				return frame;
+			}
+			return processingBlock->process(frame);
+		}
+
+	protected:
+		virtual int getImageDescriptor() const = 0;
 	};
 
 	/**
 	Creates a processing block for our OpenCV needs.
+	The output frame is allocated first and the processing writes to the image that wraps it.
+	The input frame is only read, it may be shared with other consumers.
 
-	@param lambda a function that takes a reference to a cv::Mat as parameter:
-			basic lambda syntax: processing_blocks::createProcessingBlock([](cv::Mat &image){...})
+	@param lambda the processing, its process() gets the image and may modify it
 	*/
-	rs2::processing_block createProcessingBlock(vc::processing::Processing* lambda, int imageDescriptor, int factor, bool depthFrame) {
-		return rs2::processing_block(
+	rs2::filter createProcessingBlock(vc::processing::Processing* lambda, int imageDescriptor) {
+		return rs2::filter(
 			[=](rs2::frame f, rs2::frame_source& src)
 		{
-			// For each input frame f, do:
-
-			const int w = f.as<rs2::video_frame>().get_width();
-			const int h = f.as<rs2::video_frame>().get_height();
-
-			// frame --> cv
-			cv::Mat image;
-			if (depthFrame) {
-				image = cv::Mat(cv::Size(w, h), imageDescriptor, (void*)f.as<rs2::depth_frame>().get_data(), cv::Mat::AUTO_STEP);
-			}
-			else {
-				image = cv::Mat(cv::Size(w, h), imageDescriptor, (void*)f.get_data(), cv::Mat::AUTO_STEP);
-			}
-			// do some (silly) processing
+			// Same resolution, format and stride as the input
+			rs2::video_frame output = src.allocate_video_frame(f.get_profile(), f, 0, 0, 0, 0,
+				f.is<rs2::depth_frame>() ? RS2_EXTENSION_DEPTH_FRAME : RS2_EXTENSION_VIDEO_FRAME);
 
+			cv::Mat image = wrapFrame(output, imageDescriptor);
 
 			// Here the magic happens
-			lambda->process(image, f.get_frame_number());
+			lambda->process(wrapFrame(f, imageDescriptor), image, f.get_frame_number());
 
-			// Allocate new frame. Copy all missing data from f.
-			// This assumes the output is same resolution and format
-			// if not true, need to specify parameters explicitly
-			auto res = src.allocate_video_frame(f.get_profile(), f);
-
-			// copy from cv --> frame
-			memcpy((void*)res.get_data(), image.data, (size_t)(w) * (size_t)(h) * (size_t)(factor));
-
-			// Send the resulting frame to the output queue
-			src.frame_ready(res);
+			// A processing that replaced the image instead of writing to it
+			if (image.data != output.get_data()) {
+				image.copyTo(wrapFrame(output, imageDescriptor));
+			}
+			src.frame_ready(output);
 		});
 	}
 
-	rs2::processing_block createColorProcessingBlock(vc::processing::Processing* lambda) {
-		// Don't bother the magic numbers, they describe the image channels
-		return createProcessingBlock(lambda, CV_8UC3, 3, false);
+	rs2::filter createColorProcessingBlock(vc::processing::Processing* lambda) {
+		return createProcessingBlock(lambda, CV_8UC3);
 	}
 
-	rs2::processing_block createDepthProcessingBlock(vc::processing::Processing* lambda) {
-		// Don't bother the magic numbers, they describe the image channels
-		return createProcessingBlock(lambda, CV_16U, 2, true);
+	rs2::filter createDepthProcessingBlock(vc::processing::Processing* lambda) {
+		return createProcessingBlock(lambda, CV_16U);
 	}
 
 	rs2::processing_block createEmpty()
@@ -109,17 +132,26 @@ namespace vc::processing {
 	class ColorProcessing : public Processing {
 	public:
 		void startProcessing() {
-			processingBlock = std::make_shared<rs2::processing_block>(vc::processing::createColorProcessingBlock(this));
-			processingBlock->start(processingQueues); // Bind output of the processing block to be enqueued into the queue
+			// A filter returns its output to the caller, without a queue to wait on
+			processingBlock = std::make_shared<rs2::filter>(vc::processing::createColorProcessingBlock(this));
 		};
+
+	protected:
+		int getImageDescriptor() const {
+			return CV_8UC3;
+		}
 	};
 
 	class DepthProcessing : public Processing {
 	public:
 		void startProcessing() {
-			processingBlock = std::make_shared<rs2::processing_block>(vc::processing::createDepthProcessingBlock(this));
-			processingBlock->start(processingQueues); // Bind output of the processing block to be enqueued into the queue
+			processingBlock = std::make_shared<rs2::filter>(vc::processing::createDepthProcessingBlock(this));
 		};
+
+	protected:
+		int getImageDescriptor() const {
+			return CV_16U;
+		}
 	};
 
 	class ChArUco : public ColorProcessing {
@@ -127,23 +159,29 @@ namespace vc::processing {
 		// Pose estimation buffers
 		// buffer <frame_id, value>
 		bool visualize = false;
-		bool hasMarkersDetected = false;
 
+		// Of the last processed frame, the detect stage hands them on with the frames
 		std::vector<int> ids;
 		std::vector<std::vector<cv::Point2f>> markerCorners;
+
+	private:
+		// Keeps the dictionary, the parameters and the tracked markers between the frames
+		MarkerDetector detector;
+
+	public:
+
+		/// <summary>
+		/// The detection only reads the image, it is only drawn into for the visualization.
+		/// </summary>
+		bool modifiesImage() const {
+			return visualize;
+		}
 		
 		void process(cv::Mat& image, unsigned long long frameId) {
 			try {
-				std::vector<std::vector<cv::Point2f>> rejectedCandidates;
-				cv::Ptr<cv::aruco::DetectorParameters> parameters = cv::aruco::DetectorParameters::create();
-				parameters->cornerRefinementMethod = cv::aruco::CORNER_REFINE_SUBPIX;
-				cv::Ptr<cv::aruco::Dictionary> dictionary = cv::aruco::getPredefinedDictionary(cv::aruco::DICT_6X6_250);
-				cv::aruco::detectMarkers(image, dictionary, markerCorners, ids, parameters, rejectedCandidates);
-				if (ids.size() > 0) {
-					if (visualize) {
-						cv::aruco::drawDetectedMarkers(image, markerCorners, ids);
-					}
-					hasMarkersDetected = true;
+				detector.detect(image, markerCorners, ids);
+				if (ids.size() > 0 && visualize) {
+					cv::aruco::drawDetectedMarkers(image, markerCorners, ids);
 				}
 			}
 			catch (const cv::Exception & e) {
@@ -197,6 +235,13 @@ namespace vc::processing {
 
 		// Inherited via DepthProcessing
 		void process(cv::Mat& image, unsigned long long frameId) {
+			process(image, image, frameId);
+		}
+
+		/// <summary>
+		/// Reads only the input, the output is written by the last operation.
+		/// </summary>
+		void process(const cv::Mat& image, cv::Mat& output, unsigned long long frameId) {
 			//std::cout << vc::utils::asHeader("Edge Enhancement") << std::endl;
 
 			cv::Mat buf;
@@ -217,7 +262,7 @@ namespace vc::processing {
 
 			cv::cvtColor(buf, buf, cv::COLOR_GRAY2BGR);
 			cv::bitwise_and(image, buf, buf);
-			cv::bitwise_xor(image, buf, image);
+			cv::bitwise_xor(image, buf, output);
 			
 			//std::cout << image << std::endl;
 			//image = buf;
@@ -0,0 +1,453 @@
+#pragma once
+
+#ifndef _RGBD_RECORDING_HEADER
+#define _RGBD_RECORDING_HEADER
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <filesystem>
+#include <librealsense2/rs.hpp>
+#include "MappedFile.hpp"
+#include "DepthCodec.hpp"
+
+namespace vc::capture {
+	const std::string RGBD_RECORDING_EXTENSION = ".vfrec";
+	const char RGBD_RECORDING_MAGIC[8] = { 'V', 'F', 'R', 'E', 'C', 'O', 'R', 'D' };
+	// Increase on every change of RGBDRecordingHeader, RGBDRecordingFrame or the frame layout
+	const uint32_t RGBD_RECORDING_VERSION = 2;
+	// Every depth and color block starts at a multiple of this, so the pixels can be used in place from the mapping
+	const uint64_t RGBD_RECORDING_ALIGNMENT = 64;
+
+	enum class DepthEncoding : uint32_t {
+		// Z16 pixels as they are
+		RAW = 0,
+		// Z16 pixels coded with encodeRVL, lossless and about a third of the size
+		RVL = 1
+	};
+
+	static_assert(sizeof(rs2_intrinsics) == 48 && sizeof(rs2_extrinsics) == 48, "The librealsense structs are part of the file format");
+
+	/// <summary>
+	/// The first 256 bytes of a recording of one device. The frames follow, each as Z16 depth block coded with depthEncoding
+	/// and RGB8 color block of the size given by the intrinsics without padding between the rows, and the index of all frames ends the file.
+	/// All little endian.
+	/// </summary>
+	struct RGBDRecordingHeader {
+		char magic[8] = { 'V', 'F', 'R', 'E', 'C', 'O', 'R', 'D' };
+		uint32_t version = RGBD_RECORDING_VERSION;
+		// rs2_timestamp_domain of the timestamps in the index
+		uint32_t timestampDomain = RS2_TIMESTAMP_DOMAIN_HARDWARE_CLOCK;
+		rs2_intrinsics depthIntrinsics = {};
+		rs2_intrinsics colorIntrinsics = {};
+		rs2_extrinsics depthToColor = {};
+		float depthScale = 0;
+		uint32_t fps = 30;
+		uint64_t numFrames = 0;
+		// Byte offset of numFrames RGBDRecordingFrame from the start of the file, 0 while the recording is written
+		uint64_t indexOffset = 0;
+		DepthEncoding depthEncoding = DepthEncoding::RVL;
+		uint32_t reserved = 0;
+		// Serial number of the recorded device
+		char deviceName[64] = {};
+	};
+	static_assert(sizeof(RGBDRecordingHeader) == 256, "The header is part of the file format");
+
+	/// <summary>
+	/// One entry of the index, the color block starts at the first aligned offset after the depth block.
+	/// </summary>
+	struct RGBDRecordingFrame {
+		uint64_t offset;
+		// Milliseconds, like rs2::frame::get_timestamp() of the color frame
+		double timestamp;
+		uint64_t frameNumber;
+		// Size of the coded depth block
+		uint64_t depthBytes;
+	};
+	static_assert(sizeof(RGBDRecordingFrame) == 32, "The index is part of the file format");
+
+	uint64_t alignRGBDRecordingOffset(uint64_t offset) {
+		return (offset + RGBD_RECORDING_ALIGNMENT - 1) / RGBD_RECORDING_ALIGNMENT * RGBD_RECORDING_ALIGNMENT;
+	}
+
+	uint64_t getDepthPixels(const RGBDRecordingHeader& header) {
+		return (uint64_t)header.depthIntrinsics.width * header.depthIntrinsics.height;
+	}
+
+	uint64_t getColorBytes(const RGBDRecordingHeader& header) {
+		return (uint64_t)header.colorIntrinsics.width * header.colorIntrinsics.height * 3;
+	}
+
+	/// <summary>
+	/// Appends frames to a recording, the index and the final header are written by close().
+	/// </summary>
+	class RGBDRecordingWriter {
+	private:
+		std::ofstream file;
+		std::string filename;
+		RGBDRecordingHeader header;
+		std::vector<RGBDRecordingFrame> index;
+		uint64_t offset = 0;
+
+		// Reused for every frame
+		std::vector<uint16_t> depthRows;
+		std::vector<uint8_t> encodedDepth;
+
+		void pad() {
+			const char padding[RGBD_RECORDING_ALIGNMENT] = {};
+			const uint64_t aligned = alignRGBDRecordingOffset(offset);
+			file.write(padding, aligned - offset);
+			offset = aligned;
+		}
+
+		bool matches(const rs2::video_frame& frame, rs2_format format, const rs2_intrinsics& intrinsics) {
+			if (frame.get_profile().format() != format || frame.get_width() != intrinsics.width || frame.get_height() != intrinsics.height) {
+				std::cerr << "Frame does not match the streams of " << filename << std::endl;
+				return false;
+			}
+			return true;
+		}
+
+		/// <summary>
+		/// Writes the rows of frame without the padding rs2 may add to them.
+		/// </summary>
+		void writePixels(const rs2::video_frame& frame, int bytesPerPixel) {
+			const int rowBytes = frame.get_width() * bytesPerPixel;
+			const char* pixels = (const char*)frame.get_data();
+			if (frame.get_stride_in_bytes() == rowBytes) {
+				file.write(pixels, (std::streamsize)rowBytes * frame.get_height());
+			}
+			else {
+				for (int y = 0; y < frame.get_height(); y++) {
+					file.write(pixels + (size_t)y * frame.get_stride_in_bytes(), rowBytes);
+				}
+			}
+			offset += (uint64_t)rowBytes * frame.get_height();
+		}
+
+		/// <summary>
+		/// Codes the depth into encodedDepth and writes it, returns the bytes written.
+		/// </summary>
+		uint64_t writeRVL(const rs2::video_frame& depth) {
+			const size_t numPixels = getDepthPixels(header);
+			const uint16_t* pixels = (const uint16_t*)depth.get_data();
+			if (depth.get_stride_in_bytes() != depth.get_width() * (int)sizeof(uint16_t)) {
+				depthRows.resize(numPixels);
+				for (int y = 0; y < depth.get_height(); y++) {
+					std::memcpy(depthRows.data() + (size_t)y * depth.get_width(), (const uint8_t*)pixels + (size_t)y * depth.get_stride_in_bytes(), depth.get_width() * sizeof(uint16_t));
+				}
+				pixels = depthRows.data();
+			}
+
+			encodedDepth.resize(getRVLBound(numPixels));
+			const uint64_t depthBytes = encodeRVL(pixels, numPixels, encodedDepth.data());
+			file.write((const char*)encodedDepth.data(), depthBytes);
+			offset += depthBytes;
+			return depthBytes;
+		}
+
+	public:
+		~RGBDRecordingWriter() {
+			if (file.is_open()) {
+				close();
+			}
+		}
+
+		/// <summary>
+		/// Starts a new recording, numFrames and indexOffset of header are filled in here.
+		/// </summary>
+		bool open(const std::string& filename, const RGBDRecordingHeader& header) {
+			this->filename = filename;
+			this->header = header;
+			this->header.numFrames = 0;
+			this->header.indexOffset = 0;
+			index.clear();
+
+			file.open(filename, std::ios::binary | std::ios::trunc);
+			if (!file) {
+				std::cerr << "Could not open " << filename << std::endl;
+				return false;
+			}
+			// Rewritten by close(), a recording that was never closed has no index and is rejected
+			file.write((const char*)&this->header, sizeof(this->header));
+			offset = sizeof(this->header);
+			return (bool)file;
+		}
+
+		bool isOpen() const {
+			return file.is_open();
+		}
+
+		uint64_t getBytesWritten() const {
+			return offset;
+		}
+
+		/// <summary>
+		/// Appends a Z16 depth and an RGB8 color frame of the sizes given to open(), the depth is coded as the header says.
+		/// </summary>
+		bool write(const rs2::video_frame& depth, const rs2::video_frame& color, double timestamp, uint64_t frameNumber) {
+			if (!file.is_open() || !matches(depth, RS2_FORMAT_Z16, header.depthIntrinsics) || !matches(color, RS2_FORMAT_RGB8, header.colorIntrinsics)) {
+				return false;
+			}
+
+			pad();
+			RGBDRecordingFrame frame = { offset, timestamp, frameNumber, 0 };
+			if (header.depthEncoding == DepthEncoding::RVL) {
+				frame.depthBytes = writeRVL(depth);
+			}
+			else {
+				writePixels(depth, sizeof(uint16_t));
+				frame.depthBytes = getDepthPixels(header) * sizeof(uint16_t);
+			}
+			pad();
+			writePixels(color, 3);
+
+			if (!file) {
+				std::cerr << "Could not write " << filename << std::endl;
+				return false;
+			}
+			index.emplace_back(frame);
+			return true;
+		}
+
+		/// <summary>
+		/// Writes the index and the header, only a closed recording can be read.
+		/// </summary>
+		bool close() {
+			if (!file.is_open()) {
+				return false;
+			}
+
+			pad();
+			header.numFrames = index.size();
+			header.indexOffset = offset;
+			file.write((const char*)index.data(), sizeof(RGBDRecordingFrame) * index.size());
+			file.seekp(0);
+			file.write((const char*)&header, sizeof(header));
+			file.close();
+
+			if (!file) {
+				std::cerr << "Could not write " << filename << std::endl;
+				return false;
+			}
+			return true;
+		}
+	};
+
+	/// <summary>
+	/// A recording mapped into memory, the index and the pixels point straight into the mapping.
+	/// Nothing is parsed, finding a frame is a binary search in the index and only coded depth is decoded.
+	/// </summary>
+	class RGBDRecording {
+	private:
+		vc::utils::MappedFile file;
+		const RGBDRecordingHeader* header = nullptr;
+		const RGBDRecordingFrame* index = nullptr;
+
+	public:
+		bool open(const std::string& filename) {
+			header = nullptr;
+			index = nullptr;
+			if (!file.open(filename)) {
+				std::cerr << "Could not map " << filename << std::endl;
+				return false;
+			}
+
+			const RGBDRecordingHeader* candidate = (const RGBDRecordingHeader*)file.data();
+			if (file.size() < sizeof(RGBDRecordingHeader) || std::memcmp(candidate->magic, RGBD_RECORDING_MAGIC, sizeof(RGBD_RECORDING_MAGIC)) != 0) {
+				std::cerr << filename << " is no RGB-D recording" << std::endl;
+				return false;
+			}
+
+			if (candidate->version != RGBD_RECORDING_VERSION || (candidate->depthEncoding != DepthEncoding::RAW && candidate->depthEncoding != DepthEncoding::RVL)) {
+				std::cerr << filename << " has version " << candidate->version << ", expected " << RGBD_RECORDING_VERSION << std::endl;
+				return false;
+			}
+
+			// Divided and subtracted instead of multiplied and added, so huge values of a damaged file can't wrap around
+			if (candidate->indexOffset == 0 || candidate->indexOffset > file.size() ||
+				candidate->numFrames > (file.size() - candidate->indexOffset) / sizeof(RGBDRecordingFrame)) {
+				std::cerr << filename << " is truncated or was not closed" << std::endl;
+				return false;
+			}
+
+			if (candidate->depthIntrinsics.width <= 0 || candidate->depthIntrinsics.height <= 0 ||
+				candidate->colorIntrinsics.width <= 0 || candidate->colorIntrinsics.height <= 0) {
+				std::cerr << filename << " has no valid frame size" << std::endl;
+				return false;
+			}
+
+			// Checking every frame touches the whole index once, but none of the pixels
+			const RGBDRecordingFrame* frames = (const RGBDRecordingFrame*)(file.data() + candidate->indexOffset);
+			const uint64_t rawDepthBytes = getDepthPixels(*candidate) * sizeof(uint16_t);
+			const uint64_t colorBytes = getColorBytes(*candidate);
+			for (uint64_t i = 0; i < candidate->numFrames; i++) {
+				// Space between the start of the frame and the index, the depth block is only aligned once it is known to be small
+				const uint64_t available = frames[i].offset <= candidate->indexOffset ? candidate->indexOffset - frames[i].offset : 0;
+				const bool fits = frames[i].offset % RGBD_RECORDING_ALIGNMENT == 0 &&
+					frames[i].offset <= candidate->indexOffset &&
+					colorBytes <= available &&
+					frames[i].depthBytes <= available - colorBytes &&
+					alignRGBDRecordingOffset(frames[i].depthBytes) <= available - colorBytes &&
+					(candidate->depthEncoding != DepthEncoding::RAW || frames[i].depthBytes == rawDepthBytes) &&
+					(i == 0 || frames[i].timestamp >= frames[i - 1].timestamp);
+				if (!fits) {
+					std::cerr << filename << " is corrupt at frame " << i << std::endl;
+					return false;
+				}
+			}
+
+			header = candidate;
+			index = frames;
+			return true;
+		}
+
+		bool isOpen() const {
+			return header != nullptr;
+		}
+
+		const RGBDRecordingHeader& getHeader() const {
+			return *header;
+		}
+
+		uint64_t getNumFrames() const {
+			return header ? header->numFrames : 0;
+		}
+
+		const RGBDRecordingFrame& getFrame(uint64_t frame) const {
+			return index[frame];
+		}
+
+		/// <summary>
+		/// The depth pixels in place, null if they are coded, use readDepth() then.
+		/// </summary>
+		const uint16_t* getRawDepth(uint64_t frame) const {
+			return header->depthEncoding == DepthEncoding::RAW ? (const uint16_t*)(file.data() + index[frame].offset) : nullptr;
+		}
+
+		/// <summary>
+		/// Decodes or copies the depth of a frame into depth, which holds width * height pixels.
+		/// </summary>
+		bool readDepth(uint64_t frame, uint16_t* depth) const {
+			const uint8_t* block = file.data() + index[frame].offset;
+			if (header->depthEncoding == DepthEncoding::RAW) {
+				std::memcpy(depth, block, index[frame].depthBytes);
+				return true;
+			}
+			if (!decodeRVL(block, index[frame].depthBytes, depth, getDepthPixels(*header))) {
+				std::cerr << "Depth of frame " << frame << " is corrupt" << std::endl;
+				return false;
+			}
+			return true;
+		}
+
+		const uint8_t* getColor(uint64_t frame) const {
+			return file.data() + index[frame].offset + alignRGBDRecordingOffset(index[frame].depthBytes);
+		}
+
+		/// <summary>
+		/// The first frame at or after timestamp, getNumFrames() if there is none.
+		/// </summary>
+		uint64_t findFrame(double timestamp) const {
+			const RGBDRecordingFrame* end = index + getNumFrames();
+			return std::lower_bound(index, end, timestamp, [](const RGBDRecordingFrame& frame, double timestamp) { return frame.timestamp < timestamp; }) - index;
+		}
+
+		/// <summary>
+		/// Lets the OS read the pixels of a frame in the background.
+		/// </summary>
+		void prefetch(uint64_t frame) const {
+			if (frame < getNumFrames()) {
+				file.prefetch(index[frame].offset, alignRGBDRecordingOffset(index[frame].depthBytes) + getColorBytes(*header));
+			}
+		}
+	};
+
+	/// <summary>
+	/// The header of a recording of the streams of depth and color, taken from librealsense.
+	/// </summary>
+	RGBDRecordingHeader createRGBDRecordingHeader(const rs2::video_frame& depth, const rs2::video_frame& color, DepthEncoding depthEncoding, const std::string& deviceName) {
+		const auto depthProfile = depth.get_profile().as<rs2::video_stream_profile>();
+		const auto colorProfile = color.get_profile().as<rs2::video_stream_profile>();
+
+		RGBDRecordingHeader header;
+		header.timestampDomain = color.get_frame_timestamp_domain();
+		header.depthIntrinsics = depthProfile.get_intrinsics();
+		header.colorIntrinsics = colorProfile.get_intrinsics();
+		header.depthToColor = depthProfile.get_extrinsics_to(colorProfile);
+		header.depthScale = rs2::sensor_from_frame(depth)->as<rs2::depth_sensor>().get_depth_scale();
+		header.fps = colorProfile.fps();
+		header.depthEncoding = depthEncoding;
+		std::strncpy(header.deviceName, deviceName.c_str(), sizeof(header.deviceName) - 1);
+		return header;
+	}
+
+	/// <summary>
+	/// Converts the depth and color of a .bag recording, every frameset in order.
+	/// The result is written next to it first and only renamed to filename when complete.
+	/// </summary>
+	bool convertBagToRGBDRecording(const std::string& bagFilename, const std::string& filename, DepthEncoding depthEncoding = DepthEncoding::RVL) {
+		const std::string partialFilename = filename + ".part";
+		try {
+			rs2::config cfg;
+			cfg.enable_device_from_file(bagFilename, false);
+			cfg.enable_stream(RS2_STREAM_DEPTH, RS2_FORMAT_Z16);
+			cfg.enable_stream(RS2_STREAM_COLOR, RS2_FORMAT_RGB8);
+
+			rs2::pipeline pipeline;
+			rs2::pipeline_profile profile = pipeline.start(cfg);
+			// Without real time the playback waits for every frameset to be taken
+			profile.get_device().as<rs2::playback>().set_real_time(false);
+
+			std::string deviceName;
+			if (profile.get_device().supports(RS2_CAMERA_INFO_SERIAL_NUMBER)) {
+				deviceName = profile.get_device().get_info(RS2_CAMERA_INFO_SERIAL_NUMBER);
+			}
+
+			RGBDRecordingWriter writer;
+			bool hasFrames = false;
+			bool success = true;
+			rs2::frameset frameset;
+			// A playback without real time stops after the last frame
+			while (success && pipeline.try_wait_for_frames(&frameset, 1000)) {
+				rs2::video_frame depth = frameset.get_depth_frame();
+				rs2::video_frame color = frameset.get_color_frame();
+				if (!depth || !color) {
+					continue;
+				}
+				if (!hasFrames) {
+					success = writer.open(partialFilename, createRGBDRecordingHeader(depth, color, depthEncoding, deviceName));
+					hasFrames = true;
+				}
+				success = success && writer.write(depth, color, color.get_timestamp(), color.get_frame_number());
+			}
+			pipeline.stop();
+
+			if (!hasFrames) {
+				std::cerr << bagFilename << " has no frames with depth and color" << std::endl;
+				return false;
+			}
+			if (!writer.close() || !success) {
+				std::filesystem::remove(partialFilename);
+				return false;
+			}
+			std::filesystem::rename(partialFilename, filename);
+			return true;
+		}
+		catch (const rs2::error & e) {
+			std::cerr << "Could not convert " << bagFilename << std::endl << e.what() << std::endl;
+		}
+		catch (const std::filesystem::filesystem_error & e) {
+			std::cerr << e.what() << std::endl;
+		}
+		std::error_code ignored;
+		std::filesystem::remove(partialFilename, ignored);
+		return false;
+	}
+}
+
+#endif // !_RGBD_RECORDING_HEADER
@@ -1,46 +1,271 @@
 #pragma once
-#define _SILENCE_EXPERIMENTAL_FILESYSTEM_DEPRECATION_WARNING
+
+#ifndef _RECORDER_HEADER
+#define _RECORDER_HEADER
 
 #include <string>
 #include <vector>
-#include "CaptureDevice.hpp"
-#include <filesystem>
-#include <cstdio>
-#include <experimental/filesystem>
-#include <queue>
+#include <memory>
+#include <atomic>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <librealsense2/rs.hpp>
+#include "RGBDRecording.hpp"
+#include "RingBuffer.hpp"
+
+namespace vc::capture {
+	// Framesets per stream waiting for the disk. The frames are ref-counted, not copied, so they stay in the
+	// frame pool of librealsense while queued, which only holds a few per stream before the camera drops frames.
+	const int DEFAULT_RECORDER_QUEUE_CAPACITY = 8;
+	// Framesets a writer takes from one stream before it looks at the next, so a busy stream can't starve the others
+	const int RECORDER_BATCH_SIZE = 4;
+	// Upper bound of the sleep of an idle writer, a wakeup lost to the lock-free queues is never delayed longer
+	const int RECORDER_IDLE_WAIT_MS = 10;
+
+	enum class RecorderPolicy {
+		// A full queue drops the new frameset, the capture thread never waits
+		DROP,
+		// A full queue makes the capture thread wait for the writer, nothing is lost but the camera may drop frames instead
+		BLOCK
+	};
+
+	/// <summary>
+	/// The state of one recorded stream.
+	/// </summary>
+	struct RecorderStatistics {
+		size_t queued = 0;
+		size_t capacity = 0;
+		// Deepest the queue has been since the start
+		size_t maxQueued = 0;
+		uint64_t recorded = 0;
+		// Rejected because the queue was full
+		uint64_t dropped = 0;
+		// Lacking depth or color or not written because of an error
+		uint64_t failed = 0;
+		uint64_t bytes = 0;
+	};
+
+	/// <summary>
+	/// Records the unfiltered framesets of several devices asynchronously into one RGBDRecording per device.
+	/// Every capture thread adds its framesets to a bounded lock-free queue of its stream, which costs a reference, not a copy.
+	/// Writer threads take the framesets in batches, code the depth and write them to disk.
+	/// Each stream is written by exactly one writer, so the queues have a single producer and a single consumer.
+	/// The files are written as filename.part and only renamed when the recording was stopped and completed.
+	/// </summary>
+	class Recorder {
+	private:
+		struct Stream {
+			std::string filename;
+			vc::utils::RingBuffer<rs2::frameset> queue;
+			// Only touched by the writer of the stream
+			RGBDRecordingWriter writer;
+			bool broken = false;
+
+			std::atomic<size_t> maxQueued = 0;
+			std::atomic<uint64_t> recorded = 0;
+			std::atomic<uint64_t> dropped = 0;
+			std::atomic<uint64_t> failed = 0;
+			std::atomic<uint64_t> bytes = 0;
+
+			Stream(const std::string& filename, int capacity) : filename(filename), queue(capacity) {}
+		};
+
+		const RecorderPolicy policy;
+		const DepthEncoding depthEncoding;
+		const int numWriters;
+		std::vector<std::unique_ptr<Stream>> streams;
+
+		std::atomic_bool running = false;
+		std::mutex wakeMutex;
+		std::condition_variable framesQueued;
+		std::vector<std::thread> writers;
+
+		void writeFrameset(Stream& stream, const rs2::frameset& frameset) {
+			try {
+				rs2::video_frame depth = frameset.get_depth_frame();
+				rs2::video_frame color = frameset.get_color_frame();
+				if (!depth || !color || stream.broken) {
+					stream.failed++;
+					return;
+				}
+
+				if (!stream.writer.isOpen()) {
+					const std::string deviceName = std::filesystem::path(stream.filename).stem().string();
+					if (!stream.writer.open(stream.filename + ".part", createRGBDRecordingHeader(depth, color, depthEncoding, deviceName))) {
+						// Don't retry on every frame
+						stream.broken = true;
+						stream.failed++;
+						return;
+					}
+				}
+
+				if (stream.writer.write(depth, color, color.get_timestamp(), color.get_frame_number())) {
+					stream.recorded++;
+				}
+				else {
+					stream.failed++;
+				}
+				stream.bytes = stream.writer.getBytesWritten();
+			}
+			catch (const rs2::error & e) {
+				std::cerr << "Could not record to " << stream.filename << std::endl << e.what() << std::endl;
+				stream.failed++;
+			}
+		}
+
+		/// <summary>
+		/// Writes at most one batch of the queued framesets, returns how many.
+		/// </summary>
+		int writeBatch(Stream& stream) {
+			int written = 0;
+			rs2::frameset frameset;
+			while (written < RECORDER_BATCH_SIZE && stream.queue.pop(frameset)) {
+				writeFrameset(stream, frameset);
+				// Back to librealsense before the next one is written
+				frameset = rs2::frameset();
+				written++;
+			}
+			return written;
+		}
+
+		void finish(Stream& stream) {
+			if (!stream.writer.isOpen()) {
+				return;
+			}
+			if (!stream.writer.close()) {
+				return;
+			}
+			std::error_code error;
+			std::filesystem::rename(stream.filename + ".part", stream.filename, error);
+			if (error) {
+				std::cerr << "Could not rename " << stream.filename << ".part" << std::endl << error.message() << std::endl;
+			}
+		}
+
+		void writerFunction(int writer) {
+			while (true) {
+				// Checked before taking the frames, so everything added before stop() is written
+				const bool draining = !running.load();
+				int written = 0;
+				for (size_t i = writer; i < streams.size(); i += numWriters) {
+					written += writeBatch(*streams[i]);
+				}
+
+				if (written == 0) {
+					if (draining) {
+						break;
+					}
+					std::unique_lock<std::mutex> lock(wakeMutex);
+					framesQueued.wait_for(lock, std::chrono::milliseconds(RECORDER_IDLE_WAIT_MS));
+				}
+			}
+
+			for (size_t i = writer; i < streams.size(); i += numWriters) {
+				finish(*streams[i]);
+			}
+		}
+
+	public:
+		/// <summary>
+		/// One stream per device, recorded to folder + deviceName + RGBD_RECORDING_EXTENSION.
+		/// </summary>
+		Recorder(const std::string& folder, const std::vector<std::string>& deviceNames, RecorderPolicy policy = RecorderPolicy::DROP,
+			int queueCapacity = DEFAULT_RECORDER_QUEUE_CAPACITY, int numWriters = 1, DepthEncoding depthEncoding = DepthEncoding::RVL) :
+			policy(policy),
+			depthEncoding(depthEncoding),
+			numWriters(std::max(1, std::min(numWriters, (int)deviceNames.size())))
+		{
+			for (auto& deviceName : deviceNames) {
+				streams.emplace_back(std::make_unique<Stream>(folder + deviceName + RGBD_RECORDING_EXTENSION, queueCapacity));
+			}
+		}
+
+		~Recorder() {
+			stop();
+		}
+
+		Recorder(const Recorder&) = delete;
+		Recorder& operator=(const Recorder&) = delete;
+
+		/// <summary>
+		/// Starts the writers, framesets added before are rejected.
+		/// </summary>
+		void start() {
+			if (running.exchange(true)) {
+				return;
+			}
+			for (int writer = 0; writer < numWriters; writer++) {
+				writers.emplace_back(&Recorder::writerFunction, this, writer);
+			}
+		}
+
+		/// <summary>
+		/// Writes everything that was queued, closes the recordings and stops the writers.
+		/// A capture thread waiting in BLOCK mode returns without adding its frameset.
+		/// </summary>
+		void stop() {
+			running = false;
+			framesQueued.notify_all();
+			for (auto& writer : writers) {
+				if (writer.joinable()) {
+					writer.join();
+				}
+			}
+			writers.clear();
+		}
+
+		bool isRunning() const {
+			return running.load();
+		}
+
+		/// <summary>
+		/// Capture thread of the stream: queues the frameset for writing, false if it was dropped.
+		/// Only one thread may add to a stream.
+		/// </summary>
+		bool addFrames(int stream, rs2::frameset frameset) {
+			if (stream < 0 || stream >= streams.size() || !running.load()) {
+				return false;
+			}
+
+			Stream& target = *streams[stream];
+			while (!target.queue.push(frameset)) {
+				if (policy == RecorderPolicy::DROP || !running.load()) {
+					target.dropped++;
+					return false;
+				}
+				framesQueued.notify_all();
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
 
+			const size_t queued = target.queue.size();
+			size_t maxQueued = target.maxQueued.load();
+			while (queued > maxQueued && !target.maxQueued.compare_exchange_weak(maxQueued, queued)) {
+			}
+			framesQueued.notify_all();
+			return true;
+		}
 
-class PointsQueueInstance {
-public:
-	rs2::points* points;
-	std::string filename;
-	rs2::video_frame* texture;
-
-	PointsQueueInstance(rs2::points* points, std::string filename, rs2::video_frame* texture) {
-		this->points = points;
-		this->filename = filename;
-		this->texture = texture;
-	}
-};
-
-class Recorder
-{
-private:	
-	std::string baseDir;
-	std::vector<CaptureDevice*> devices;
-	std::queue<PointsQueueInstance> queue;
-	std::thread persistThread;
-	bool isRecording = false;
-	void test();
-	void persist();
-
-public:
-	Recorder(std::vector<CaptureDevice*> devices, std::string baseDir = "C:\\Users\\Marcel Bruckner\\Documents\\Volumetric-Fusion\\points");
-	~Recorder();
-	void addToQueue();
-	void clearPersistentPointsFolder();
-	void start();
-	void stop();
-};
+		std::vector<RecorderStatistics> getStatistics() const {
+			std::vector<RecorderStatistics> statistics;
+			for (auto& stream : streams) {
+				RecorderStatistics streamStatistics;
+				streamStatistics.queued = stream->queue.size();
+				streamStatistics.capacity = stream->queue.capacity();
+				streamStatistics.maxQueued = stream->maxQueued.load();
+				streamStatistics.recorded = stream->recorded.load();
+				streamStatistics.dropped = stream->dropped.load();
+				streamStatistics.failed = stream->failed.load();
+				streamStatistics.bytes = stream->bytes.load();
+				statistics.emplace_back(streamStatistics);
+			}
+			return statistics;
+		}
+	};
+}
 
+#endif // !_RECORDER_HEADER
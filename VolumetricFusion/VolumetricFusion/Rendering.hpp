@@ -200,11 +200,11 @@ namespace vc::rendering {
                 num_vertices = current_num_vertices;
                 delete[] vertices;
                 vertices = new glm::vec2[num_vertices];
-                for (int y = 0; y < height; y++)
+                for (int y = 0; y < depth_height; y++)
                 {
-                    for (int x = 0; x < width; x++)
+                    for (int x = 0; x < depth_width; x++)
                     {
-                        vertices[y * width + x] = glm::vec2(x, y);
+                        vertices[y * depth_width + x] = glm::vec2(x, y);
                     }
                 }
             }
@@ -219,7 +219,9 @@ namespace vc::rendering {
 
             //POINTCLOUD_new_shader->set
 
-            POINTCLOUD_new_shader->setMat3("cam2World", depth_camera->cam2world_glm);
+            // The filters may have aligned or downsampled the depth, so the intrinsics of the device don't fit it anymore
+            const vc::camera::PinholeCamera depth_frame_camera(depth_frame.get_profile().as<rs2::video_stream_profile>().get_intrinsics());
+            POINTCLOUD_new_shader->setMat3("cam2World", depth_frame_camera.cam2world_glm);
             POINTCLOUD_new_shader->setFloat("depth_scale", depth_camera->depthScale);
             POINTCLOUD_new_shader->setFloat("alpha", alpha);
             POINTCLOUD_new_shader->setVec2("depth_resolution", (float)depth_width, (float)depth_height);
@@ -0,0 +1,76 @@
+#pragma once
+
+#ifndef _RING_BUFFER_HEADER
+#define _RING_BUFFER_HEADER
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+namespace vc::utils {
+	/// <summary>
+	/// A bounded FIFO queue from one producer thread to one consumer thread without locks.
+	/// Neither side ever waits, push fails while the queue is full and pop while it is empty.
+	/// A popped slot is reset, so values like frames are released as soon as the consumer is done with them.
+	/// </summary>
+	template <typename T>
+	class RingBuffer {
+	private:
+		std::vector<T> slots;
+		// Both only grow, the slot of an index is index % capacity
+		// Written by the consumer, on its own cache line so both sides don't invalidate each other
+		alignas(64) std::atomic<size_t> head = 0;
+		// Written by the producer
+		alignas(64) std::atomic<size_t> tail = 0;
+
+	public:
+		explicit RingBuffer(size_t capacity) :
+			slots(capacity > 0 ? capacity : 1)
+		{}
+
+		RingBuffer(const RingBuffer&) = delete;
+		RingBuffer& operator=(const RingBuffer&) = delete;
+
+		/// <summary>
+		/// Producer: appends value, returns false and leaves value untouched if the queue is full.
+		/// </summary>
+		bool push(T& value) {
+			const size_t index = tail.load(std::memory_order_relaxed);
+			if (index - head.load(std::memory_order_acquire) >= slots.size()) {
+				return false;
+			}
+			slots[index % slots.size()] = std::move(value);
+			tail.store(index + 1, std::memory_order_release);
+			return true;
+		}
+
+		/// <summary>
+		/// Consumer: takes the oldest value, returns false if the queue is empty.
+		/// </summary>
+		bool pop(T& value) {
+			const size_t index = head.load(std::memory_order_relaxed);
+			if (index == tail.load(std::memory_order_acquire)) {
+				return false;
+			}
+			T& slot = slots[index % slots.size()];
+			value = std::move(slot);
+			slot = T();
+			head.store(index + 1, std::memory_order_release);
+			return true;
+		}
+
+		/// <summary>
+		/// The number of queued values, exact only on the producer or consumer thread.
+		/// </summary>
+		size_t size() const {
+			const size_t consumed = head.load(std::memory_order_acquire);
+			return tail.load(std::memory_order_acquire) - consumed;
+		}
+
+		size_t capacity() const {
+			return slots.size();
+		}
+	};
+}
+
+#endif // !_RING_BUFFER_HEADER
@@ -0,0 +1,36 @@
+#pragma once
+
+#ifndef _SIMD_HEADER
+#define _SIMD_HEADER
+
+// Selects the vector instruction set the CPU kernels are compiled for.
+// MSVC defines __AVX2__ with /arch:AVX2, GCC and Clang with -mavx2.
+#if defined(__AVX2__)
+#define VC_USE_AVX2 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define VC_USE_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace vc::simd {
+#if defined(VC_USE_AVX2)
+	const int LANES = 8;
+#elif defined(VC_USE_NEON)
+	const int LANES = 4;
+#else
+	const int LANES = 1;
+#endif
+
+	const char* instructionSetName() {
+#if defined(VC_USE_AVX2)
+		return "AVX2";
+#elif defined(VC_USE_NEON)
+		return "NEON";
+#else
+		return "Scalar";
+#endif
+	}
+}
+
+#endif // !_SIMD_HEADER
@@ -0,0 +1,667 @@
+#pragma once
+
+#ifndef _SPARSE_VOXELGRID_HEADER_
+#define _SPARSE_VOXELGRID_HEADER_
+
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <unordered_map>
+#include <unordered_set>
+#include <iostream>
+#include "Voxelgrid.hpp"
+#include "CPUIntegration.hpp"
+#include "ThreadPool.hpp"
+#include "MarchingCubes.hpp"
+#include "Mesh.hpp"
+
+namespace vc::fusion {
+	const int BRICK_SIZE = 8;
+	const int BRICK_VOLUME = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+	// Bricks the pool holds before the first growth, it doubles whenever they are used up
+	const int INITIAL_POOL_BRICKS = 1 << 10;
+
+	/// <summary>
+	/// Spatial hash of integer brick coordinates.
+	/// Teschner et al., Optimized Spatial Hashing for Collision Detection of Deformable Objects
+	/// </summary>
+	struct BrickCoordinateHash {
+		size_t operator()(const Eigen::Vector3i& coordinate) const {
+			return ((size_t)coordinate[0] * 73856093) ^ ((size_t)coordinate[1] * 19349669) ^ ((size_t)coordinate[2] * 83492791);
+		}
+	};
+
+	/// <summary>
+	/// A TSDF that only stores the 8x8x8 voxel bricks close to observed surfaces.
+	/// The bricks come from a pool that grows on demand up to maxBricks and are looked up by their coordinate in a spatial hash.
+	/// Bricks are allocated along the truncation band of the depth rays, so memory and integration time
+	/// scale with the observed surface instead of the bounding volume.
+	/// The voxel with index (x, y, z) is centered at (x, y, z) * resolution in world space.
+	/// Integration and marching cubes run on the CPU thread pool, marching cubes only re-extracts the bricks that changed.
+	/// </summary>
+	class SparseVoxelgrid : public Voxelgrid {
+	protected:
+		int maxBricks;
+		int numBricks = 0;
+		bool warnedPoolExhausted = false;
+
+		// At least numBricks * BRICK_VOLUME voxels, brick i occupies [i * BRICK_VOLUME, (i + 1) * BRICK_VOLUME)
+		std::vector<Voxel> brickPool;
+		std::vector<Eigen::Vector3i> brickCoordinates;
+		std::unordered_map<Eigen::Vector3i, int, BrickCoordinateHash> brickTable;
+
+		GLuint brickCoordinateBuffer;
+		GLuint brickCoordinateTexture;
+
+		/// <summary>
+		/// The vertices and triangles of a brick in brickMesh. [offset, offset + count) are live,
+		/// the rest of the capacity is unreferenced vertices and degenerate triangles.
+		/// </summary>
+		struct MeshRange {
+			int vertexOffset = 0;
+			int vertexCount = 0;
+			int vertexCapacity = 0;
+			int triangleOffset = 0;
+			int triangleCount = 0;
+			int triangleCapacity = 0;
+		};
+
+		// Bricks whose TSDF changed since the last marching cubes pass
+		std::unordered_set<Eigen::Vector3i, BrickCoordinateHash> dirtyBricks;
+		std::unordered_map<Eigen::Vector3i, MeshRange, BrickCoordinateHash> brickMeshRanges;
+		// Vertices and triangles in brickMesh that are not live in any range
+		int wastedVertices = 0;
+		int wastedTriangles = 0;
+		// Sizes the GL buffers were last allocated with
+		int uploadedVertices = 0;
+		int uploadedTriangles = 0;
+
+		vc::utils::ThreadPool* pool;
+
+		Eigen::Vector3i toBrickCoordinate(const Eigen::Vector3f& position) {
+			const float brickSide = BRICK_SIZE * resolution;
+			return Eigen::Vector3i(
+				(int)std::floor(position[0] / brickSide + 0.5f / BRICK_SIZE),
+				(int)std::floor(position[1] / brickSide + 0.5f / BRICK_SIZE),
+				(int)std::floor(position[2] / brickSide + 0.5f / BRICK_SIZE)
+			);
+		}
+
+		/// <summary>
+		/// Grows the pool to hold at least the given number of bricks, by doubling but not beyond maxBricks.
+		/// Moves the voxels, so no pointer into the pool may be held meanwhile.
+		/// </summary>
+		void reserveBricks(int bricks) {
+			const size_t capacity = brickPool.size() / BRICK_VOLUME;
+			if ((size_t)bricks <= capacity) {
+				return;
+			}
+			const size_t grown = std::max({ capacity * 2, (size_t)INITIAL_POOL_BRICKS, (size_t)bricks });
+			brickPool.resize(std::min(grown, (size_t)maxBricks) * BRICK_VOLUME);
+		}
+
+		int findBrick(const Eigen::Vector3i& coordinate) {
+			auto brick = brickTable.find(coordinate);
+			return brick == brickTable.end() ? -1 : brick->second;
+		}
+
+		/// <summary>
+		/// Collects the bricks hit by the truncation band of every allocationPixelStride-th depth ray,
+		/// allocates the missing ones and adds the ones not yet in visited to visibleBricks.
+		/// </summary>
+		void allocateBricks(const IntegrationFrame& frame, std::vector<int>& visibleBricks, std::unordered_set<int>& visited) {
+			const Eigen::Matrix4f cameraToWorld = frame.worldToCamera.inverse();
+			const Eigen::Matrix3f rotation = cameraToWorld.block<3, 3>(0, 0);
+			const Eigen::Vector3f translation = cameraToWorld.block<3, 1>(0, 3);
+			const Eigen::Matrix3f inverseProjection = frame.world2CameraProjection.inverse();
+			const float step = 0.5f * BRICK_SIZE * resolution;
+
+			const int numRows = (frame.depthHeight + allocationPixelStride - 1) / allocationPixelStride;
+			const int numChunks = std::min(numRows, 4 * pool->size());
+			std::vector<std::unordered_set<Eigen::Vector3i, BrickCoordinateHash>> chunkBricks(numChunks);
+
+			pool->parallelFor(0, numChunks, [&](int chunk) {
+				auto& bricks = chunkBricks[chunk];
+				for (int row = chunk; row < numRows; row += numChunks) {
+					const int v = row * allocationPixelStride;
+					for (int u = 0; u < frame.depthWidth; u += allocationPixelStride) {
+						const float depth = frame.depth[v * frame.depthWidth + u] * frame.depthScale;
+						if (depth <= 0) {
+							continue;
+						}
+
+						const Eigen::Vector3f ray = inverseProjection * Eigen::Vector3f(u, v, 1);
+						const float end = depth + truncationDistance;
+						for (float z = std::max(0.1f, depth - truncationDistance); ; z = std::min(z + step, end)) {
+							bricks.insert(toBrickCoordinate(rotation * (ray * z) + translation));
+							if (z >= end) {
+								break;
+							}
+						}
+					}
+				}
+			});
+
+			for (auto& bricks : chunkBricks) {
+				for (auto& coordinate : bricks) {
+					int brick = findBrick(coordinate);
+					if (brick < 0) {
+						if (numBricks >= maxBricks) {
+							if (!warnedPoolExhausted) {
+								std::cout << "Sparse voxelgrid: all " << maxBricks << " bricks are in use, the surface is cut off." << std::endl;
+								warnedPoolExhausted = true;
+							}
+							continue;
+						}
+						reserveBricks(numBricks + 1);
+						brick = numBricks++;
+						brickTable[coordinate] = brick;
+						brickCoordinates.emplace_back(coordinate);
+					}
+					if (visited.insert(brick).second) {
+						visibleBricks.emplace_back(brick);
+					}
+				}
+			}
+		}
+
+		/// <summary>
+		/// Updates every brick once with all frames, the brick stays in the cache while the views are folded in.
+		/// With clearAsFirstFrame the bricks are integrated from scratch.
+		/// Bricks whose TSDF moved by more than remeshThreshold or whose voxels changed validity are marked dirty.
+		/// </summary>
+		void integrateBricks(const std::vector<int>& bricks, const std::vector<IntegrationFrame>& frames, bool clearAsFirstFrame) {
+			std::vector<Eigen::Matrix3f> rotations;
+			std::vector<Eigen::Vector3f> translations;
+			for (auto& frame : frames) {
+				rotations.emplace_back(frame.worldToCamera.block<3, 3>(0, 0));
+				translations.emplace_back(frame.worldToCamera.block<3, 1>(0, 3));
+			}
+
+			const int threshold = (int)(remeshThreshold * Voxel::TSDF_SCALE);
+			std::vector<char> changed(bricks.size(), false);
+
+			pool->parallelFor(0, (int)bricks.size(), [&](int i) {
+				const int brick = bricks[i];
+				Voxel* voxels = brickPool.data() + brick * BRICK_VOLUME;
+				Voxel previous[BRICK_VOLUME];
+				std::copy(voxels, voxels + BRICK_VOLUME, previous);
+				if (clearAsFirstFrame) {
+					std::fill(voxels, voxels + BRICK_VOLUME, Voxel());
+				}
+
+				const Eigen::Vector3i firstVoxel = brickCoordinates[brick] * BRICK_SIZE;
+				for (int z = 0; z < BRICK_SIZE; z++) {
+					for (int y = 0; y < BRICK_SIZE; y++) {
+						Voxel* row = brickPool.data() + brick * BRICK_VOLUME + (z * BRICK_SIZE + y) * BRICK_SIZE;
+						const Eigen::Vector3f rowStart = (firstVoxel + Eigen::Vector3i(0, y, z)).cast<float>() * resolution;
+						for (int f = 0; f < frames.size(); f++) {
+							CPUIntegration::integrateRow(row, BRICK_SIZE, rowStart, resolution, truncationDistance, frames[f], rotations[f], translations[f]);
+						}
+					}
+				}
+
+				for (int v = 0; v < BRICK_VOLUME; v++) {
+					if (voxels[v].isValid() != previous[v].isValid() || (voxels[v].isValid() && std::abs(voxels[v].tsdf - previous[v].tsdf) > threshold)) {
+						changed[i] = true;
+						break;
+					}
+				}
+			});
+
+			for (int i = 0; i < bricks.size(); i++) {
+				if (changed[i]) {
+					dirtyBricks.insert(brickCoordinates[bricks[i]]);
+				}
+			}
+		}
+
+		/// <summary>
+		/// Returns the bricks that are not in keep to the pool, the last brick of the pool is moved into every hole.
+		/// </summary>
+		void releaseBricks(const std::unordered_set<int>& keep) {
+			for (int brick = numBricks - 1; brick >= 0; brick--) {
+				if (keep.count(brick)) {
+					continue;
+				}
+
+				// Everything above brick was kept, so the moved brick does not have to be checked again
+				const int last = numBricks - 1;
+				dirtyBricks.insert(brickCoordinates[brick]);
+				brickTable.erase(brickCoordinates[brick]);
+				if (brick != last) {
+					std::copy(brickPool.begin() + (size_t)last * BRICK_VOLUME, brickPool.begin() + (size_t)(last + 1) * BRICK_VOLUME, brickPool.begin() + (size_t)brick * BRICK_VOLUME);
+					brickCoordinates[brick] = brickCoordinates[last];
+					brickTable[brickCoordinates[brick]] = brick;
+				}
+				std::fill(brickPool.begin() + (size_t)last * BRICK_VOLUME, brickPool.begin() + (size_t)(last + 1) * BRICK_VOLUME, Voxel());
+				brickCoordinates.pop_back();
+				numBricks--;
+			}
+		}
+
+		/// <summary>
+		/// Writes the mesh of a brick into its range, a range that became too small is moved to the end of brickMesh.
+		/// The indices of brickMesh are global, the indices of the brick mesh are local to it.
+		/// The overwritten regions are added to updatedVertices and updatedTriangles as (offset, count).
+		/// </summary>
+		void spliceBrickMesh(const Eigen::Vector3i& coordinate, const Mesh& mesh, std::vector<std::pair<int, int>>& updatedVertices, std::vector<std::pair<int, int>>& updatedTriangles) {
+			auto range = brickMeshRanges.find(coordinate);
+			const int newVertices = (int)mesh.vertices.size();
+			const int newTriangles = mesh.numTriangles();
+
+			auto writeIndices = [&](const MeshRange& target) {
+				for (int i = 0; i < (int)mesh.indices.size(); i++) {
+					brickMesh.indices[(size_t)target.triangleOffset * 3 + i] = mesh.indices[i] + target.vertexOffset;
+				}
+			};
+
+			if (range != brickMeshRanges.end() && range->second.vertexCapacity >= newVertices && range->second.triangleCapacity >= newTriangles) {
+				MeshRange& oldRange = range->second;
+				std::copy(mesh.vertices.begin(), mesh.vertices.end(), brickMesh.vertices.begin() + oldRange.vertexOffset);
+				writeIndices(oldRange);
+				if (newTriangles < oldRange.triangleCount) {
+					std::fill(brickMesh.indices.begin() + ((size_t)oldRange.triangleOffset + newTriangles) * 3, brickMesh.indices.begin() + ((size_t)oldRange.triangleOffset + oldRange.triangleCount) * 3, 0);
+				}
+				updatedVertices.emplace_back(oldRange.vertexOffset, newVertices);
+				updatedTriangles.emplace_back(oldRange.triangleOffset, std::max(oldRange.triangleCount, newTriangles));
+				wastedVertices += oldRange.vertexCount - newVertices;
+				wastedTriangles += oldRange.triangleCount - newTriangles;
+				oldRange.vertexCount = newVertices;
+				oldRange.triangleCount = newTriangles;
+
+				if (newTriangles == 0) {
+					// The padding stays until the next compaction
+					brickMeshRanges.erase(range);
+				}
+				return;
+			}
+
+			if (range != brickMeshRanges.end()) {
+				std::fill(brickMesh.indices.begin() + (size_t)range->second.triangleOffset * 3, brickMesh.indices.begin() + ((size_t)range->second.triangleOffset + range->second.triangleCount) * 3, 0);
+				updatedTriangles.emplace_back(range->second.triangleOffset, range->second.triangleCount);
+				wastedVertices += range->second.vertexCount;
+				wastedTriangles += range->second.triangleCount;
+			}
+
+			if (newTriangles == 0) {
+				if (range != brickMeshRanges.end()) {
+					brickMeshRanges.erase(range);
+				}
+				return;
+			}
+
+			MeshRange& newRange = brickMeshRanges[coordinate];
+			newRange.vertexOffset = (int)brickMesh.vertices.size();
+			newRange.vertexCount = newRange.vertexCapacity = newVertices;
+			newRange.triangleOffset = brickMesh.numTriangles();
+			newRange.triangleCount = newRange.triangleCapacity = newTriangles;
+			brickMesh.vertices.insert(brickMesh.vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+			brickMesh.indices.resize(brickMesh.indices.size() + mesh.indices.size());
+			writeIndices(newRange);
+			updatedVertices.emplace_back(newRange.vertexOffset, newVertices);
+			updatedTriangles.emplace_back(newRange.triangleOffset, newTriangles);
+		}
+
+		/// <summary>
+		/// Appends the live ranges to target with the indices rebased to their new offsets.
+		/// With updateRanges the ranges are moved to target and lose their padding.
+		/// </summary>
+		void gatherBrickMesh(Mesh& target, bool updateRanges) {
+			target.vertices.reserve(brickMesh.vertices.size() - wastedVertices);
+			target.indices.reserve(brickMesh.indices.size() - (size_t)wastedTriangles * 3);
+			for (auto& range : brickMeshRanges) {
+				MeshRange& r = range.second;
+				const int vertexOffset = (int)target.vertices.size();
+				const int triangleOffset = target.numTriangles();
+				target.vertices.insert(target.vertices.end(), brickMesh.vertices.begin() + r.vertexOffset, brickMesh.vertices.begin() + r.vertexOffset + r.vertexCount);
+				for (size_t i = (size_t)r.triangleOffset * 3; i < ((size_t)r.triangleOffset + r.triangleCount) * 3; i++) {
+					target.indices.emplace_back(brickMesh.indices[i] - r.vertexOffset + vertexOffset);
+				}
+
+				if (updateRanges) {
+					r.vertexOffset = vertexOffset;
+					r.vertexCapacity = r.vertexCount;
+					r.triangleOffset = triangleOffset;
+					r.triangleCapacity = r.triangleCount;
+				}
+			}
+		}
+
+		/// <summary>
+		/// Packs the live ranges to the front of brickMesh and drops the padding.
+		/// </summary>
+		void compactMesh() {
+			Mesh compacted;
+			gatherBrickMesh(compacted, true);
+			brickMesh = std::move(compacted);
+			wastedVertices = 0;
+			wastedTriangles = 0;
+		}
+
+		/// <summary>
+		/// Marching cubes over the cells whose lower corner lies in the brick, with indices local to the brick.
+		/// Cells on the upper border and the gradients on all borders read from the neighbouring bricks,
+		/// vertices on the upper border are duplicated in the mesh of the neighbour.
+		/// </summary>
+		void polygoniseBrick(int brick, Mesh& result) {
+			const Eigen::Vector3i coordinate = brickCoordinates[brick];
+
+			// Index 0 in a dimension selects the lower, 1 the own and 2 the upper neighbour
+			const Voxel* neighbours[3][3][3];
+			for (int i = 0; i < 27; i++) {
+				const int neighbour = findBrick(coordinate + Eigen::Vector3i(i % 3 - 1, (i / 3) % 3 - 1, i / 9 - 1));
+				neighbours[i % 3][(i / 3) % 3][i / 9] = neighbour < 0 ? nullptr : brickPool.data() + neighbour * BRICK_VOLUME;
+			}
+
+			auto getVoxel = [&](int x, int y, int z) -> const Voxel* {
+				x += BRICK_SIZE;
+				y += BRICK_SIZE;
+				z += BRICK_SIZE;
+				const Voxel* voxels = neighbours[x / BRICK_SIZE][y / BRICK_SIZE][z / BRICK_SIZE];
+				if (!voxels) {
+					return nullptr;
+				}
+				const Voxel* voxel = voxels + ((z % BRICK_SIZE) * BRICK_SIZE + (y % BRICK_SIZE)) * BRICK_SIZE + (x % BRICK_SIZE);
+				return voxel->isValid() ? voxel : nullptr;
+			};
+
+			const Eigen::Vector3i firstVoxel = coordinate * BRICK_SIZE;
+			polygonise(getVoxel, Eigen::Vector3i::Constant(BRICK_SIZE), glm::vec3(firstVoxel[0], firstVoxel[1], firstVoxel[2]) * resolution, resolution, result);
+		}
+
+	public:
+		// Only every n-th pixel in both directions allocates bricks, a brick covers way more pixels at usual distances
+		int allocationPixelStride = 2;
+
+		// Bricks are only re-meshed if a voxel moved by more than this fraction of the truncation distance
+		float remeshThreshold = 0.01f;
+
+		// The meshes of all bricks, see MeshRange
+		Mesh brickMesh;
+
+		SparseVoxelgrid(const float resolution = 0.005f, const int maxBricks = 1 << 16, bool initializeShader = true, vc::utils::ThreadPool* pool = &vc::utils::sharedThreadPool()) :
+			Voxelgrid(initializeShader),
+			maxBricks(maxBricks),
+			pool(pool)
+		{
+			integrationBackend = IntegrationBackend::CPU;
+			// Only the bricks of the observed surfaces are allocated, maxBricks may be far more than that
+			reserveBricks(std::min(maxBricks, INITIAL_POOL_BRICKS));
+
+			if (hasOpenGL) {
+				glGenBuffers(1, &brickCoordinateBuffer);
+				glGenTextures(1, &brickCoordinateTexture);
+			}
+
+			reset(resolution, Eigen::Vector3d(1.0, 1.0, 1.0), Eigen::Vector3d(0.0, 0.0, 1.7));
+		}
+
+		/// <summary>
+		/// The budget of the pool, it grows to at most maxBricks * BRICK_VOLUME voxels.
+		/// </summary>
+		int getMaxBricks() const {
+			return maxBricks;
+		}
+
+		/// <summary>
+		/// Changes the budget for the bricks allocated from now on, the bricks in use are kept.
+		/// </summary>
+		void setMaxBricks(int maxBricks) {
+			this->maxBricks = std::max(maxBricks, numBricks);
+			warnedPoolExhausted = false;
+		}
+
+		/// <summary>
+		/// Size and origin are kept for the GUI only, the sparse grid is unbounded.
+		/// </summary>
+		void reset(const float resolution, const Eigen::Vector3d size, const Eigen::Vector3d origin) override {
+			this->resolution = resolution;
+			this->origin = origin;
+			this->size = size;
+			this->sizeHalf = size / 2.0f;
+			this->sizeNormalized = Eigen::Vector3i::Zero();
+			this->truncationDistance = resolution * 10;
+			this->num_gridPoints = 0;
+
+			resetVoxelgridBuffer();
+		}
+
+		void resetVoxelgridBuffer() override {
+			std::fill(brickPool.begin(), brickPool.begin() + (size_t)numBricks * BRICK_VOLUME, Voxel());
+			brickTable.clear();
+			brickCoordinates.clear();
+			numBricks = 0;
+			warnedPoolExhausted = false;
+
+			dirtyBricks.clear();
+			brickMeshRanges.clear();
+			brickMesh.clear();
+			wastedVertices = 0;
+			wastedTriangles = 0;
+			numVertices = 0;
+			numTriangles = 0;
+			uploadedVertices = 0;
+			uploadedTriangles = 0;
+			if (hasOpenGL) {
+				writeMeshCounters(0, 0);
+			}
+		}
+
+		void setIntegrationBackend(IntegrationBackend backend) override {
+			// There is no compute shader for the brick pool yet
+			integrationBackend = IntegrationBackend::CPU;
+		}
+
+		bool canFuseAsynchronously() override {
+			// The rendering reads the bricks and the incremental marching cubes uploads as it splices
+			return false;
+		}
+
+		void integrateFrameGPU(const std::shared_ptr<vc::capture::CaptureDevice> pipeline, Eigen::Matrix4d relativeTransformation, bool clearAsFirstFrame = false) override {
+			integrateFrameCPU(pipeline, relativeTransformation, clearAsFirstFrame);
+		}
+
+		void integrateFrameCPU(const std::shared_ptr<vc::capture::CaptureDevice> pipeline, Eigen::Matrix4d relativeTransformation, bool clearAsFirstFrame = false) override {
+			integrateFramesCPU({ pipeline }, { pipeline->data->getFrames() }, { relativeTransformation }, clearAsFirstFrame);
+		}
+
+		void integrateFramesGPU(const std::vector<std::shared_ptr<vc::capture::CaptureDevice>>& pipelines, const std::vector<vc::data::Frames>& frames, const std::vector<Eigen::Matrix4d>& relativeTransformations, bool clearAsFirstFrame = true) override {
+			integrateFramesCPU(pipelines, frames, relativeTransformations, clearAsFirstFrame);
+		}
+
+		void integrateFramesCPU(const std::vector<std::shared_ptr<vc::capture::CaptureDevice>>& pipelines, const std::vector<vc::data::Frames>& frames, const std::vector<Eigen::Matrix4d>& relativeTransformations, bool clearAsFirstFrame = true) override {
+			integrateFrames(getIntegrationFrames(pipelines, frames, relativeTransformations), clearAsFirstFrame);
+		}
+
+		using Voxelgrid::integrateFrame;
+		using Voxelgrid::integrateFrames;
+
+		void integrateFrame(const IntegrationFrame& frame, bool clearAsFirstFrame = false) {
+			integrateFrames(std::vector<IntegrationFrame>{ frame }, clearAsFirstFrame);
+		}
+
+		/// <summary>
+		/// Allocates the bricks seen by any of the frames and integrates all frames into them in a single pass.
+		/// </summary>
+		void integrateFrames(const std::vector<IntegrationFrame>& frames, bool clearAsFirstFrame = true) {
+			std::vector<IntegrationFrame> validFrames;
+			std::copy_if(frames.begin(), frames.end(), std::back_inserter(validFrames), [](const IntegrationFrame& frame) { return frame.isValid(); });
+
+			std::vector<int> visibleBricks;
+			std::unordered_set<int> visited;
+			for (auto& frame : validFrames) {
+				allocateBricks(frame, visibleBricks, visited);
+			}
+
+			integrateBricks(visibleBricks, validFrames, clearAsFirstFrame);
+
+			// Starting from scratch keeps the bricks that are seen again, so unchanged parts of the mesh survive the clear
+			if (clearAsFirstFrame) {
+				releaseBricks(visited);
+			}
+		}
+
+		/// <summary>
+		/// Re-extracts only the bricks affected by dirty bricks and splices their meshes into the persistent mesh.
+		/// </summary>
+		void computeMarchingCubes(glm::vec3 cameraPos) override {
+			// The cells and gradients of a brick read the voxels of all its neighbours, so a change affects all of them
+			std::unordered_set<Eigen::Vector3i, BrickCoordinateHash> remesh;
+			for (auto& coordinate : dirtyBricks) {
+				for (int i = 0; i < 27; i++) {
+					remesh.insert(coordinate + Eigen::Vector3i(i % 3 - 1, (i / 3) % 3 - 1, i / 9 - 1));
+				}
+			}
+			dirtyBricks.clear();
+
+			if (remesh.empty()) {
+				return;
+			}
+
+			const std::vector<Eigen::Vector3i> coordinates(remesh.begin(), remesh.end());
+			std::vector<Mesh> brickMeshes(coordinates.size());
+
+			pool->parallelFor(0, (int)coordinates.size(), [&](int i) {
+				const int brick = findBrick(coordinates[i]);
+				if (brick >= 0) {
+					polygoniseBrick(brick, brickMeshes[i]);
+				}
+			});
+
+			std::vector<std::pair<int, int>> updatedVertices;
+			std::vector<std::pair<int, int>> updatedTriangles;
+			for (int i = 0; i < coordinates.size(); i++) {
+				spliceBrickMesh(coordinates[i], brickMeshes[i], updatedVertices, updatedTriangles);
+			}
+
+			bool reallocate = (int)brickMesh.vertices.size() != uploadedVertices || brickMesh.numTriangles() != uploadedTriangles;
+			if (wastedTriangles > 1024 && wastedTriangles * 2 > brickMesh.numTriangles()) {
+				compactMesh();
+				reallocate = true;
+			}
+			numVertices = (GLuint)brickMesh.vertices.size();
+			numTriangles = (GLuint)brickMesh.numTriangles();
+
+			if (!hasOpenGL) {
+				return;
+			}
+
+			// The element array buffer binding is part of the vertex array
+			glBindVertexArray(meshVertexArray);
+			glBindBuffer(GL_ARRAY_BUFFER, meshVertexBuffer);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIndexBuffer);
+			if (reallocate) {
+				glBufferData(GL_ARRAY_BUFFER, sizeof(MeshVertex) * numVertices, brickMesh.vertices.data(), GL_DYNAMIC_DRAW);
+				glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * brickMesh.indices.size(), brickMesh.indices.data(), GL_DYNAMIC_DRAW);
+				uploadedVertices = numVertices;
+				uploadedTriangles = numTriangles;
+			}
+			else {
+				for (auto& region : updatedVertices) {
+					glBufferSubData(GL_ARRAY_BUFFER, sizeof(MeshVertex) * region.first, sizeof(MeshVertex) * region.second, brickMesh.vertices.data() + region.first);
+				}
+				for (auto& region : updatedTriangles) {
+					glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * 3 * region.first, sizeof(GLuint) * 3 * region.second, brickMesh.indices.data() + (size_t)region.first * 3);
+				}
+			}
+			glBindVertexArray(0);
+
+			writeMeshCounters(numVertices, numTriangles);
+		}
+
+		bool saveSnapshot(const std::string& filename) override {
+			VolumeSnapshotHeader header = getSnapshotHeader();
+			header.layout = VolumeLayout::BRICKS;
+			header.brickSize = BRICK_SIZE;
+			header.numBricks = numBricks;
+			// The used bricks are the front of the pool
+			return writeVolumeSnapshot(filename, header, brickCoordinates.data(), brickPool.data(), (uint64_t)numBricks * BRICK_VOLUME);
+		}
+
+		/// <summary>
+		/// Replaces all bricks with the ones of the snapshot, each brick is copied in one piece from the mapped file.
+		/// The whole mesh is extracted again on the next marching cubes pass.
+		/// </summary>
+		bool loadSnapshot(const std::string& filename) override {
+			VolumeSnapshot snapshot;
+			if (!snapshot.open(filename)) {
+				return false;
+			}
+
+			const VolumeSnapshotHeader& header = snapshot.getHeader();
+			if (header.layout != VolumeLayout::BRICKS || header.brickSize != BRICK_SIZE) {
+				std::cerr << filename << " holds no bricks of size " << BRICK_SIZE << std::endl;
+				return false;
+			}
+			if (header.numBricks > (uint64_t)maxBricks) {
+				std::cerr << filename << " holds " << header.numBricks << " bricks, the pool has " << maxBricks << std::endl;
+				return false;
+			}
+
+			resetVoxelgridBuffer();
+			setSnapshotGrid(header);
+
+			const int32_t* coordinates = snapshot.getBrickCoordinates();
+			reserveBricks((int)header.numBricks);
+			std::memcpy(brickPool.data(), snapshot.getVoxels(), sizeof(Voxel) * header.numVoxels);
+			for (int brick = 0; brick < (int)header.numBricks; brick++) {
+				const Eigen::Vector3i coordinate(coordinates[brick * 4 + 0], coordinates[brick * 4 + 1], coordinates[brick * 4 + 2]);
+				brickTable[coordinate] = brick;
+				brickCoordinates.emplace_back(coordinate);
+				dirtyBricks.insert(coordinate);
+			}
+			numBricks = (int)header.numBricks;
+			return true;
+		}
+
+		void copyMeshToCPU() override {
+			// Copy the live ranges so that the export thread does not race the next marching cubes pass
+			auto snapshot = std::make_shared<Mesh>();
+			gatherBrickMesh(*snapshot, false);
+			mesh = snapshot;
+		}
+
+		void renderGrid(glm::mat4 model, glm::mat4 view, glm::mat4 projection) override {
+			if (numBricks == 0) {
+				return;
+			}
+
+			std::vector<GLint> coordinates;
+			coordinates.reserve(4 * numBricks);
+			for (auto& coordinate : brickCoordinates) {
+				coordinates.insert(coordinates.end(), { coordinate[0], coordinate[1], coordinate[2], 0 });
+			}
+
+			glBindBuffer(GL_TEXTURE_BUFFER, brickCoordinateBuffer);
+			glBufferData(GL_TEXTURE_BUFFER, sizeof(GLint) * coordinates.size(), coordinates.data(), GL_STREAM_DRAW);
+			glActiveTexture(GL_TEXTURE2);
+			glBindTexture(GL_TEXTURE_BUFFER, brickCoordinateTexture);
+			glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32I, brickCoordinateBuffer);
+
+			setGridShaderUniforms(model, view, projection);
+			gridShader->setBool("sparse", true);
+			gridShader->setInt("brickCoordinates", 2);
+
+			glBindVertexArray(vertexVertexArray);
+			glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(Voxel) * numBricks * BRICK_VOLUME, brickPool.data(), GL_STREAM_DRAW);
+
+			glVertexAttribIPointer(0, 2, GL_UNSIGNED_INT, sizeof(Voxel), (void*)0);
+			glEnableVertexAttribArray(0);
+
+			glDrawArrays(GL_POINTS, 0, numBricks * BRICK_VOLUME);
+			glBindVertexArray(0);
+			glActiveTexture(GL_TEXTURE0);
+		}
+
+		int getNumberOfBricks() {
+			return numBricks;
+		}
+
+		int getMaxNumberOfBricks() {
+			return maxBricks;
+		}
+	};
+}
+#endif
@@ -0,0 +1,418 @@
+#pragma once
+
+#ifndef _STAGE_PIPELINE_HEADER
+#define _STAGE_PIPELINE_HEADER
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include "ThreadPool.hpp"
+#include "RingBuffer.hpp"
+
+namespace vc::utils {
+	// Items waiting in front of a stage, a full queue holds the stage before it back
+	const int DEFAULT_STAGE_CAPACITY = 2;
+	// Items a stage processes before it hands its worker back to the pool, so one busy stage can't starve the others
+	const int STAGE_BATCH_SIZE = 4;
+	// Seconds the throughput of the stages is averaged over
+	const double STAGE_STATISTICS_INTERVAL = 1.0;
+
+	struct StageSettings {
+		// Items waiting in front of the stage
+		int capacity = DEFAULT_STAGE_CAPACITY;
+		// A full queue drops new items instead of holding the stage before it back
+		bool dropWhenFull = false;
+		// Runs on its own thread instead of the shared pool, for stages that may wait for something else than the CPU
+		bool dedicatedThread = false;
+		// Whether the user may switch the stage off, the stages after it must cope with the items it did not process
+		bool canDisable = false;
+	};
+
+	/// <summary>
+	/// The state of one stage, the rates over the last STAGE_STATISTICS_INTERVAL.
+	/// </summary>
+	struct StageStatistics {
+		std::string name;
+		bool enabled = true;
+		bool canDisable = false;
+		size_t queued = 0;
+		size_t capacity = 0;
+		uint64_t processed = 0;
+		// Dropped in front of the stage or rejected by it
+		uint64_t dropped = 0;
+		double itemsPerSecond = 0;
+		double millisecondsPerItem = 0;
+		// Fraction of the interval the stage was working
+		double busyFraction = 0;
+	};
+
+	/// <summary>
+	/// Runs items of type T through a chain of stages, every stage in its own bounded queue in front of it.
+	/// A stage processes its items one after the other and in order, but different stages work at the same time,
+	/// so item N + 1 is in the first stage while item N is in the second one.
+	/// The stages run as tasks on a thread pool, a stage only occupies a worker while it has queued items.
+	/// A stage that finds the next queue full keeps its item and is continued once the next stage took one.
+	/// One thread pushes the items, one other thread may pop the items that passed all stages.
+	/// </summary>
+	template <typename T>
+	class StagePipeline {
+	public:
+		// Processes the item in place, false drops it
+		using StageFunction = std::function<bool(T&)>;
+
+	private:
+		using clock = std::chrono::steady_clock;
+
+		struct Stage {
+			std::string name;
+			StageFunction function;
+			StageSettings settings;
+			RingBuffer<T> input;
+			// A disabled stage passes the items on untouched
+			std::atomic_bool enabled = true;
+
+			// Set while a task of the stage is queued or running, so at most one processes its items
+			std::atomic_bool scheduled = false;
+			// The next queue was full, set by the task of the stage and read by the next stage
+			std::atomic_bool stalled = false;
+			// Only touched by the task of the stage
+			T stalledItem;
+
+			ThreadPool* executor;
+			std::unique_ptr<ThreadPool> dedicatedThread;
+
+			std::atomic<uint64_t> processed = 0;
+			std::atomic<uint64_t> dropped = 0;
+			std::atomic<uint64_t> busyNanoseconds = 0;
+
+			Stage(const std::string& name, StageFunction function, StageSettings settings, ThreadPool* pool) :
+				name(name),
+				function(function),
+				settings(settings),
+				input(std::max(1, settings.capacity)),
+				executor(pool)
+			{
+				if (settings.dedicatedThread) {
+					dedicatedThread = std::make_unique<ThreadPool>(1);
+					executor = dedicatedThread.get();
+				}
+			}
+		};
+
+		ThreadPool* pool;
+		std::vector<std::unique_ptr<Stage>> stages;
+		std::unique_ptr<RingBuffer<T>> output;
+		// Pushed but not yet popped, dropped or through all stages without output
+		std::atomic<size_t> inFlight = 0;
+		// Tasks queued or running, a task counts the ones it schedules before it stops counting itself
+		std::atomic<int> activeTasks = 0;
+
+		// Signalled when the first stage took an item and when inFlight or activeTasks reach 0, see push(item, stop) and waitUntilIdle
+		std::mutex waitMutex;
+		std::condition_variable changed;
+
+		struct StageCounts {
+			uint64_t processed = 0;
+			uint64_t busyNanoseconds = 0;
+		};
+
+		std::mutex statisticsMutex;
+		clock::time_point intervalStart = clock::now();
+		// The counters at the start of the interval and the rates of the last one
+		std::vector<StageCounts> intervalCounts;
+		std::vector<StageStatistics> lastRates;
+
+		/// <summary>
+		/// Taking the lock orders the notification after the check of a waiter that is about to sleep.
+		/// </summary>
+		void notifyWaiters() {
+			{
+				std::lock_guard<std::mutex> lock(waitMutex);
+			}
+			changed.notify_all();
+		}
+
+		void finishItem() {
+			if (--inFlight == 0) {
+				notifyWaiters();
+			}
+		}
+
+		void schedule(int index) {
+			Stage& stage = *stages[index];
+			if (!stage.scheduled.exchange(true)) {
+				activeTasks++;
+				stage.executor->enqueue([this, index]() { run(index); });
+			}
+		}
+
+		/// <summary>
+		/// The previous stage or the consumer of the output may be waiting for the slot just freed.
+		/// </summary>
+		void wakeProducer(int index) {
+			// Pairs with the fence in run(), either this sees the stall or the stalled stage sees the free slot
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (index > 0 && stages[index - 1]->stalled.load()) {
+				schedule(index - 1);
+			}
+			if (index == 0) {
+				notifyWaiters();
+			}
+		}
+
+		/// <summary>
+		/// Hands item to the stage after index, false if it has to wait for a free slot.
+		/// </summary>
+		bool forward(int index, T& item) {
+			if (index + 1 < (int)stages.size()) {
+				Stage& next = *stages[index + 1];
+				if (next.input.push(item)) {
+					schedule(index + 1);
+					return true;
+				}
+				if (next.settings.dropWhenFull) {
+					next.dropped++;
+					item = T();
+					finishItem();
+					return true;
+				}
+				return false;
+			}
+
+			if (!output) {
+				item = T();
+				finishItem();
+				return true;
+			}
+			return output->push(item);
+		}
+
+		bool hasFreeSlot(int index) const {
+			if (index + 1 < (int)stages.size()) {
+				const Stage& next = *stages[index + 1];
+				return next.input.size() < next.input.capacity();
+			}
+			return !output || output->size() < output->capacity();
+		}
+
+		void run(int index) {
+			Stage& stage = *stages[index];
+			for (int i = 0; i < STAGE_BATCH_SIZE; i++) {
+				if (stage.stalled.load()) {
+					if (!forward(index, stage.stalledItem)) {
+						break;
+					}
+					stage.stalled = false;
+					continue;
+				}
+
+				T item;
+				if (!stage.input.pop(item)) {
+					break;
+				}
+				wakeProducer(index);
+
+				bool keep = true;
+				if (stage.enabled.load()) {
+					const auto start = clock::now();
+					try {
+						keep = stage.function(item);
+					}
+					catch (const std::exception & e) {
+						std::cerr << "Error in stage " << stage.name << std::endl << e.what() << std::endl;
+						keep = false;
+					}
+					stage.busyNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+					stage.processed++;
+				}
+				if (!keep) {
+					stage.dropped++;
+					finishItem();
+					continue;
+				}
+
+				if (!forward(index, item)) {
+					stage.stalledItem = std::move(item);
+					stage.stalled = true;
+					break;
+				}
+			}
+
+			stage.scheduled = false;
+			// Items or a free slot that arrived after the last look, nobody else would schedule the stage for them
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (stage.stalled.load() ? hasFreeSlot(index) : stage.input.size() > 0) {
+				schedule(index);
+			}
+			// The last access to the pipeline, it may be destroyed right after.
+			// Counting down under the lock keeps the destructor from returning before the notification went out.
+			std::lock_guard<std::mutex> lock(waitMutex);
+			if (--activeTasks == 0) {
+				changed.notify_all();
+			}
+		}
+
+	public:
+		/// <summary>
+		/// Runs the stages on pool, the output of the last stage is queued for pop() if outputCapacity is positive.
+		/// </summary>
+		StagePipeline(ThreadPool* pool = &sharedThreadPool(), int outputCapacity = 0) :
+			pool(pool)
+		{
+			if (outputCapacity > 0) {
+				output = std::make_unique<RingBuffer<T>>(outputCapacity);
+			}
+		}
+
+		~StagePipeline() {
+			// The running tasks use the stages, the items still queued are dropped
+			std::unique_lock<std::mutex> lock(waitMutex);
+			changed.wait(lock, [this]() { return activeTasks.load() == 0; });
+		}
+
+		StagePipeline(const StagePipeline&) = delete;
+		StagePipeline& operator=(const StagePipeline&) = delete;
+
+		/// <summary>
+		/// Appends a stage, all stages have to be added before the first item is pushed.
+		/// </summary>
+		void addStage(const std::string& name, StageFunction function, StageSettings settings = StageSettings()) {
+			stages.emplace_back(std::make_unique<Stage>(name, function, settings, pool));
+			intervalStart = clock::now();
+		}
+
+		/// <summary>
+		/// Producer: queues item in front of the first stage, false and item untouched if that queue is full.
+		/// </summary>
+		bool push(T& item) {
+			if (stages.empty() || !stages[0]->input.push(item)) {
+				return false;
+			}
+			inFlight++;
+			schedule(0);
+			return true;
+		}
+
+		/// <summary>
+		/// Producer: like push(item), but waits for a free slot in front of the first stage.
+		/// Gives up and returns false once stop returns true, call wakeUp() after changing what stop checks.
+		/// </summary>
+		bool push(T& item, const std::function<bool()>& stop) {
+			while (!push(item)) {
+				std::unique_lock<std::mutex> lock(waitMutex);
+				if (stop()) {
+					return false;
+				}
+				changed.wait(lock, [this, &stop]() { return canPush() || stop(); });
+			}
+			return true;
+		}
+
+		/// <summary>
+		/// Lets a push(item, stop) that waits for a free slot check stop again.
+		/// </summary>
+		void wakeUp() {
+			notifyWaiters();
+		}
+
+		/// <summary>
+		/// Whether push() would currently accept an item.
+		/// </summary>
+		bool canPush() const {
+			return !stages.empty() && stages[0]->input.size() < stages[0]->input.capacity();
+		}
+
+		/// <summary>
+		/// Consumer: takes the oldest item that passed all stages, false if there is none.
+		/// </summary>
+		bool pop(T& item) {
+			if (!output || !output->pop(item)) {
+				return false;
+			}
+			finishItem();
+			wakeProducer((int)stages.size());
+			return true;
+		}
+
+		/// <summary>
+		/// Blocks until every pushed item was popped, dropped or passed the stages without output.
+		/// Items in the output count as well, so pop them on another thread meanwhile or don't wait with an output.
+		/// </summary>
+		void waitUntilIdle() {
+			std::unique_lock<std::mutex> lock(waitMutex);
+			changed.wait(lock, [this]() { return isIdle(); });
+		}
+
+		/// <summary>
+		/// Whether every pushed item was popped, dropped or passed the stages without output, see waitUntilIdle.
+		/// </summary>
+		bool isIdle() const {
+			return inFlight.load() == 0 && activeTasks.load() == 0;
+		}
+
+		/// <summary>
+		/// Size of the pipeline, the stages are addressed by index in the order they were added.
+		/// </summary>
+		int getNumStages() const {
+			return (int)stages.size();
+		}
+
+		void setEnabled(int stage, bool enabled) {
+			stages[stage]->enabled = enabled;
+		}
+
+		bool isEnabled(int stage) const {
+			return stages[stage]->enabled.load();
+		}
+
+		/// <summary>
+		/// The statistics of every stage, the rates are updated once per STAGE_STATISTICS_INTERVAL.
+		/// </summary>
+		std::vector<StageStatistics> getStatistics() {
+			std::lock_guard<std::mutex> lock(statisticsMutex);
+			const auto now = clock::now();
+			const double seconds = std::chrono::duration<double>(now - intervalStart).count();
+			if (seconds >= STAGE_STATISTICS_INTERVAL || intervalCounts.size() != stages.size()) {
+				intervalCounts.resize(stages.size());
+				lastRates.resize(stages.size());
+				for (size_t i = 0; i < stages.size(); i++) {
+					StageCounts counts;
+					counts.processed = stages[i]->processed.load();
+					counts.busyNanoseconds = stages[i]->busyNanoseconds.load();
+					const uint64_t items = counts.processed - intervalCounts[i].processed;
+					const double busySeconds = (counts.busyNanoseconds - intervalCounts[i].busyNanoseconds) * 1e-9;
+					lastRates[i].itemsPerSecond = seconds > 0 ? items / seconds : 0;
+					lastRates[i].millisecondsPerItem = items > 0 ? 1000.0 * busySeconds / items : 0;
+					lastRates[i].busyFraction = seconds > 0 ? std::min(1.0, busySeconds / seconds) : 0;
+					intervalCounts[i] = counts;
+				}
+				intervalStart = now;
+			}
+
+			std::vector<StageStatistics> statistics;
+			for (size_t i = 0; i < stages.size(); i++) {
+				const Stage& stage = *stages[i];
+				StageStatistics current = lastRates[i];
+				current.name = stage.name;
+				current.enabled = stage.enabled.load();
+				current.canDisable = stage.settings.canDisable;
+				current.queued = stage.input.size();
+				current.capacity = stage.input.capacity();
+				current.processed = stage.processed.load();
+				current.dropped = stage.dropped.load();
+				statistics.emplace_back(current);
+			}
+			return statistics;
+		}
+	};
+}
+
+#endif // !_STAGE_PIPELINE_HEADER
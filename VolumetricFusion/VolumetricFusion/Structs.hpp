@@ -2,6 +2,9 @@
 #ifndef _MARCHING_CUBES_STRUCTS
 #define _MARCHING_CUBES_STRUCTS
 
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -9,11 +12,48 @@
 #include "Utils.hpp"
 
 namespace vc::fusion {
-    struct Vertex {
-        glm::vec4 pos;
-        glm::vec4 tsdf;
-        glm::vec4 color;
+    /// <summary>
+    /// A single voxel of the TSDF, packed into 8 bytes.
+    /// The position is not stored, it follows from the index of the voxel in the grid.
+    /// The layout is mirrored by the shaders as two uints:
+    /// [tsdf (int16) | weight (uint16)] [red | green | blue | unused (uint8 each)]
+    /// </summary>
+    struct Voxel {
+        // The TSDF in units of the truncation distance, scaled to the int16 range
+        int16_t tsdf = 0;
+        // The number of integrated observations, 0 marks a voxel that has never been seen
+        uint16_t weight = 0;
+        uint8_t color[4] = { 0, 0, 0, 0 };
+
+        static constexpr float TSDF_SCALE = 32767.0f;
+        static constexpr int MAX_WEIGHT = 65535;
+
+        bool isValid() const {
+            return weight > 0;
+        }
+
+        /// <summary>
+        /// The TSDF normalized to [-1, 1].
+        /// </summary>
+        float getTsdf() const {
+            return tsdf / TSDF_SCALE;
+        }
+
+        void setTsdf(float normalizedTsdf) {
+            tsdf = (int16_t)std::lround(std::max(-1.0f, std::min(1.0f, normalizedTsdf)) * TSDF_SCALE);
+        }
+
+        glm::vec4 getColor() const {
+            return glm::vec4(color[0], color[1], color[2], 255.0f) * (1.0f / 255.0f);
+        }
+
+        void setColor(glm::vec4 rgb) {
+            for (int i = 0; i < 3; i++) {
+                color[i] = (uint8_t)std::lround(std::max(0.0f, std::min(1.0f, rgb[i])) * 255.0f);
+            }
+        }
     };
+    static_assert(sizeof(Voxel) == 8, "The shaders expect 8 byte voxels");
 
     struct Triangle {
         glm::vec4 pos0;
@@ -29,7 +69,8 @@ namespace vc::fusion {
     
     class GridCell {
     public:
-        vc::fusion::Vertex verts[8];
+        vc::fusion::Voxel verts[8];
+        glm::vec4 pos[8];
     };
 }
 
@@ -0,0 +1,330 @@
+#pragma once
+
+#ifndef _TSDF_FUSION_DATASET_HEADER
+#define _TSDF_FUSION_DATASET_HEADER
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <Eigen/Dense>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include "Simd.hpp"
+#include "ThreadPool.hpp"
+
+namespace vc::capture {
+	// The depth images store millimeters
+	const float TSDF_FUSION_DEPTH_SCALE = 0.001f;
+	// Farther depth is too noisy and dropped, like demo.cu does
+	const float TSDF_FUSION_MAX_DEPTH = 6.0f;
+	// The frames have no timestamps, they were captured at the usual 30 Hz
+	const int TSDF_FUSION_FPS = 30;
+	// Frames decoded ahead of the one read, enough to hide the PNG decoding behind the fusion of a few frames
+	const int DEFAULT_DATASET_PREFETCH = 8;
+	// Decoding one frame is two PNGs, more threads than prefetched frames would idle
+	const int DEFAULT_DATASET_THREADS = 4;
+
+	/// <summary>
+	/// Masks depth beyond maxRaw in place and optionally converts it to meters.
+	/// </summary>
+	inline void convertDepth(uint16_t* depth, float* meters, size_t numPixels, float depthScale, uint16_t maxRaw) {
+		size_t i = 0;
+#if defined(VC_USE_AVX2)
+		const __m256i max = _mm256_set1_epi16((short)maxRaw);
+		const __m256 scale = _mm256_set1_ps(depthScale);
+		for (; i + 16 <= numPixels; i += 16) {
+			__m256i pixels = _mm256_loadu_si256((const __m256i*)(depth + i));
+			// Unsigned pixels <= maxRaw are those equal to their minimum with it
+			pixels = _mm256_and_si256(pixels, _mm256_cmpeq_epi16(_mm256_min_epu16(pixels, max), pixels));
+			_mm256_storeu_si256((__m256i*)(depth + i), pixels);
+			if (meters) {
+				const __m256 low = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(pixels)));
+				const __m256 high = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(pixels, 1)));
+				_mm256_storeu_ps(meters + i, _mm256_mul_ps(low, scale));
+				_mm256_storeu_ps(meters + i + 8, _mm256_mul_ps(high, scale));
+			}
+		}
+#endif
+		for (; i < numPixels; i++) {
+			if (depth[i] > maxRaw) {
+				depth[i] = 0;
+			}
+			if (meters) {
+				meters[i] = depth[i] * depthScale;
+			}
+		}
+	}
+
+	/// <summary>
+	/// Reads a row-major matrix of whitespace separated values, false if the file has fewer.
+	/// </summary>
+	template <int Rows, int Cols>
+	bool readMatrix(const std::string& filename, Eigen::Matrix<double, Rows, Cols>& matrix) {
+		std::ifstream file(filename);
+		for (int row = 0; row < Rows; row++) {
+			for (int col = 0; col < Cols; col++) {
+				if (!(file >> matrix(row, col))) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	/// <summary>
+	/// One decoded frame of a dataset. The buffers are allocated with new[], so they can be handed to librealsense.
+	/// </summary>
+	struct DatasetFrame {
+		int frameNumber = -1;
+		// Z16 in TSDF_FUSION_DEPTH_SCALE, zero beyond TSDF_FUSION_MAX_DEPTH
+		std::unique_ptr<uint16_t[]> depth;
+		// Only if the dataset was opened with metric depth
+		std::unique_ptr<float[]> meters;
+		// RGB8
+		std::unique_ptr<uint8_t[]> color;
+		// Camera to world
+		Eigen::Matrix4d pose = Eigen::Matrix4d::Identity();
+	};
+
+	/// <summary>
+	/// Reads the RGB-D frames of the tsdf-fusion demo, a camera-intrinsics.txt and a folder rgbd-frames with
+	/// frame-XXXXXX.color.png, frame-XXXXXX.depth.png and frame-XXXXXX.pose.txt per frame.
+	/// The frames after the one read are decoded on a thread pool meanwhile, so reading in order rarely waits for a decoder.
+	/// The poses are read once when opening, they are small.
+	/// Frames are read by a single thread, which owns them afterwards.
+	/// </summary>
+	class TSDFFusionDataset {
+	private:
+		std::string framesFolder;
+		std::vector<int> frameNumbers;
+		std::vector<Eigen::Matrix4d> poses;
+		Eigen::Matrix3d intrinsics = Eigen::Matrix3d::Identity();
+		int width = 0;
+		int height = 0;
+		bool metric;
+		int prefetch;
+
+		// Decoding or decoded frames by index
+		std::map<int, std::future<std::unique_ptr<DatasetFrame>>> pending;
+		// The first index of [index, index + prefetch) last scheduled, queued decoders of frames outside are skipped
+		std::atomic<int> windowBegin = 0;
+		// Decoders queued or running, also those whose future was dropped from pending
+		int decoding = 0;
+		std::mutex decodingMutex;
+		std::condition_variable decodingFinished;
+		// Declared last, so it is destroyed first and finishes the decoding while the rest is still there
+		std::unique_ptr<vc::utils::ThreadPool> pool;
+
+		std::string getFilename(int frameNumber, const std::string& suffix) const {
+			char name[32];
+			snprintf(name, sizeof(name), "frame-%06d", frameNumber);
+			return framesFolder + name + suffix;
+		}
+
+		std::unique_ptr<DatasetFrame> decodeFrame(int index) const {
+			auto frame = std::make_unique<DatasetFrame>();
+			frame->frameNumber = frameNumbers[index];
+			frame->pose = poses[index];
+
+			const std::string depthFilename = getFilename(frame->frameNumber, ".depth.png");
+			const std::string colorFilename = getFilename(frame->frameNumber, ".color.png");
+			cv::Mat depth = cv::imread(depthFilename, cv::IMREAD_ANYDEPTH);
+			cv::Mat color = cv::imread(colorFilename, cv::IMREAD_COLOR);
+			if (depth.type() != CV_16UC1 || depth.cols != width || depth.rows != height) {
+				std::cerr << "Could not read the 16 bit depth of " << depthFilename << std::endl;
+				return nullptr;
+			}
+			if (color.cols != width || color.rows != height) {
+				std::cerr << "Could not read the color of " << colorFilename << std::endl;
+				return nullptr;
+			}
+
+			const size_t numPixels = (size_t)width * height;
+			frame->depth.reset(new uint16_t[numPixels]);
+			frame->color.reset(new uint8_t[numPixels * 3]);
+			// Both write into the buffers of the frame, which have the right size and type
+			depth.copyTo(cv::Mat(height, width, CV_16UC1, frame->depth.get()));
+			cv::cvtColor(color, cv::Mat(height, width, CV_8UC3, frame->color.get()), cv::COLOR_BGR2RGB);
+
+			if (metric) {
+				frame->meters.reset(new float[numPixels]);
+			}
+			convertDepth(frame->depth.get(), frame->meters.get(), numPixels, TSDF_FUSION_DEPTH_SCALE, (uint16_t)(TSDF_FUSION_MAX_DEPTH / TSDF_FUSION_DEPTH_SCALE));
+			return frame;
+		}
+
+		/// <summary>
+		/// Starts decoding the frames [index, index + prefetch) that are not yet and drops those before.
+		/// </summary>
+		void schedule(int index) {
+			// Set before the frames outside are dropped, a decoder that sees the window skips its frame only after its future is gone
+			windowBegin = index;
+			pending.erase(pending.begin(), pending.lower_bound(index));
+			pending.erase(pending.lower_bound(index + prefetch), pending.end());
+
+			for (int i = index; i < index + prefetch && i < getNumFrames(); i++) {
+				if (pending.count(i)) {
+					continue;
+				}
+				auto task = std::make_shared<std::packaged_task<std::unique_ptr<DatasetFrame>()>>([this, i]() {
+					const int begin = windowBegin.load();
+					if (i < begin || i >= begin + prefetch) {
+						return std::unique_ptr<DatasetFrame>();
+					}
+					return decodeFrame(i);
+				});
+				pending[i] = task->get_future();
+				{
+					std::lock_guard<std::mutex> lock(decodingMutex);
+					decoding++;
+				}
+				pool->enqueue([this, task]() {
+					(*task)();
+					std::lock_guard<std::mutex> lock(decodingMutex);
+					if (--decoding == 0) {
+						decodingFinished.notify_all();
+					}
+				});
+			}
+		}
+
+	public:
+		/// <summary>
+		/// Metric also converts the depth to meters as floats, which only benchmarks and custom integrations need.
+		/// </summary>
+		TSDFFusionDataset(bool metric = false, int prefetch = DEFAULT_DATASET_PREFETCH, int numThreads = DEFAULT_DATASET_THREADS) :
+			metric(metric),
+			prefetch(std::max(1, prefetch)),
+			pool(std::make_unique<vc::utils::ThreadPool>(std::max(1, numThreads)))
+		{}
+
+		~TSDFFusionDataset() {
+			// The decoders still running use the members
+			pool.reset();
+		}
+
+		TSDFFusionDataset(const TSDFFusionDataset&) = delete;
+		TSDFFusionDataset& operator=(const TSDFFusionDataset&) = delete;
+
+		/// <summary>
+		/// Opens the dataset in folder, e.g. tsdf-fusion/data/, and starts decoding the first frames.
+		/// </summary>
+		bool open(std::string folder) {
+			if (!folder.empty() && folder.back() != '/' && folder.back() != '\\') {
+				folder += "/";
+			}
+			// The decoders read the frame numbers and poses, also those of frames that were dropped from pending
+			{
+				std::unique_lock<std::mutex> lock(decodingMutex);
+				decodingFinished.wait(lock, [this]() { return decoding == 0; });
+			}
+			pending.clear();
+			framesFolder = folder + "rgbd-frames/";
+			frameNumbers.clear();
+			poses.clear();
+
+			if (!readMatrix<3, 3>(folder + "camera-intrinsics.txt", intrinsics)) {
+				std::cerr << "Could not read the intrinsics of the dataset " << folder << std::endl;
+				return false;
+			}
+
+			std::error_code error;
+			const std::string suffix = ".color.png";
+			for (auto& entry : std::filesystem::directory_iterator(framesFolder, error)) {
+				const std::string name = entry.path().filename().string();
+				if (name.size() > suffix.size() && name.compare(0, 6, "frame-") == 0 && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+					frameNumbers.emplace_back(std::atoi(name.c_str() + 6));
+				}
+			}
+			if (error || frameNumbers.empty()) {
+				std::cerr << "No frames in " << framesFolder << std::endl;
+				return false;
+			}
+			std::sort(frameNumbers.begin(), frameNumbers.end());
+
+			for (int frameNumber : frameNumbers) {
+				Eigen::Matrix4d pose;
+				if (!readMatrix<4, 4>(getFilename(frameNumber, ".pose.txt"), pose)) {
+					std::cerr << "Could not read the pose of frame " << frameNumber << std::endl;
+					return false;
+				}
+				poses.emplace_back(pose);
+			}
+
+			// The header is enough for the size, the first frame is decoded anyway
+			cv::Mat first = cv::imread(getFilename(frameNumbers[0], ".depth.png"), cv::IMREAD_ANYDEPTH);
+			if (first.empty()) {
+				std::cerr << "Could not read the first frame of " << framesFolder << std::endl;
+				return false;
+			}
+			width = first.cols;
+			height = first.rows;
+
+			schedule(0);
+			return true;
+		}
+
+		/// <summary>
+		/// Waits for frame index and starts decoding the ones after it, null if it could not be read.
+		/// </summary>
+		std::unique_ptr<DatasetFrame> readFrame(int index) {
+			if (index < 0 || index >= getNumFrames()) {
+				return nullptr;
+			}
+			schedule(index);
+			auto frame = pending[index].get();
+			pending.erase(index);
+			schedule(index + 1);
+			return frame;
+		}
+
+		int getNumFrames() const {
+			return (int)frameNumbers.size();
+		}
+
+		int getFrameNumber(int index) const {
+			return frameNumbers[index];
+		}
+
+		/// <summary>
+		/// The index of the frame with the frame number, or of the next one.
+		/// </summary>
+		int findFrame(int frameNumber) const {
+			return (int)(std::lower_bound(frameNumbers.begin(), frameNumbers.end(), frameNumber) - frameNumbers.begin());
+		}
+
+		/// <summary>
+		/// The ground truth camera to world transformation of frame index.
+		/// </summary>
+		const Eigen::Matrix4d& getPose(int index) const {
+			return poses[index];
+		}
+
+		const Eigen::Matrix3d& getIntrinsics() const {
+			return intrinsics;
+		}
+
+		int getWidth() const {
+			return width;
+		}
+
+		int getHeight() const {
+			return height;
+		}
+	};
+}
+
+#endif // !_TSDF_FUSION_DATASET_HEADER
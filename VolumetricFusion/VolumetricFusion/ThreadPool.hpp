@@ -0,0 +1,251 @@
+#pragma once
+
+#ifndef _THREAD_POOL_HEADER
+#define _THREAD_POOL_HEADER
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <exception>
+#include <iostream>
+
+namespace vc::utils {
+	/// <summary>
+	/// A fixed set of worker threads that live as long as the pool.
+	/// Replaces spawning one std::thread per row or layer in the hot loops.
+	/// Every worker has its own task queue. Tasks enqueued by a worker go to its queue and it takes the newest first,
+	/// while an idle worker steals the oldest task of another queue. So the tasks a stage or a parallelFor spawns
+	/// stay on the worker whose caches hold their data, unless another worker has nothing to do.
+	/// </summary>
+	class ThreadPool {
+	private:
+		struct TaskQueue {
+			std::mutex mutex;
+			std::deque<std::function<void()>> tasks;
+		};
+
+		std::vector<std::unique_ptr<TaskQueue>> queues;
+		std::vector<std::thread> workers;
+
+		// Tasks in all queues, only changed while holding mutex so no worker misses a wakeup
+		std::mutex mutex;
+		std::condition_variable taskAvailable;
+		size_t pendingTasks = 0;
+		bool stopped = false;
+		// Queue of the next task enqueued by a thread outside of the pool
+		std::atomic<unsigned int> nextQueue = 0;
+
+		// The pool and queue of the worker running on this thread
+		inline static thread_local ThreadPool* currentPool = nullptr;
+		inline static thread_local int currentQueue = -1;
+
+		bool takeTask(int worker, std::function<void()>& task) {
+			{
+				TaskQueue& own = *queues[worker];
+				std::lock_guard<std::mutex> lock(own.mutex);
+				if (!own.tasks.empty()) {
+					task = std::move(own.tasks.back());
+					own.tasks.pop_back();
+					return true;
+				}
+			}
+			for (size_t i = 1; i < queues.size(); i++) {
+				TaskQueue& victim = *queues[(worker + i) % queues.size()];
+				std::lock_guard<std::mutex> lock(victim.mutex);
+				if (!victim.tasks.empty()) {
+					task = std::move(victim.tasks.front());
+					victim.tasks.pop_front();
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void workerFunction(int worker) {
+			currentPool = this;
+			currentQueue = worker;
+			while (true) {
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					taskAvailable.wait(lock, [this]() { return stopped || pendingTasks > 0; });
+					if (stopped && pendingTasks == 0) {
+						return;
+					}
+				}
+
+				std::function<void()> task;
+				if (!takeTask(worker, task)) {
+					// Counted but not yet in a queue, or taken by a worker that did not count it down yet
+					std::this_thread::yield();
+					continue;
+				}
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					pendingTasks--;
+				}
+				// An escaping exception would terminate the program, parallelFor hands them to its caller instead
+				try {
+					task();
+				}
+				catch (const std::exception & e) {
+					std::cerr << "Error in thread pool task" << std::endl << e.what() << std::endl;
+				}
+				catch (...) {
+					std::cerr << "Unknown error in thread pool task" << std::endl;
+				}
+			}
+		}
+
+	public:
+		ThreadPool(int numThreads = std::max(1, (int)std::thread::hardware_concurrency())) {
+			for (int i = 0; i < numThreads; i++) {
+				queues.emplace_back(std::make_unique<TaskQueue>());
+			}
+			for (int i = 0; i < numThreads; i++) {
+				workers.emplace_back(&vc::utils::ThreadPool::workerFunction, this, i);
+			}
+		}
+
+		~ThreadPool() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopped = true;
+			}
+			taskAvailable.notify_all();
+			for (auto& worker : workers) {
+				worker.join();
+			}
+		}
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		int size() const {
+			return (int)workers.size();
+		}
+
+		/// <summary>
+		/// Whether the calling thread is a worker of this pool.
+		/// </summary>
+		bool isWorkerThread() const {
+			return currentPool == this;
+		}
+
+		void enqueue(std::function<void()> task) {
+			const int queue = isWorkerThread() ? currentQueue : (int)(nextQueue++ % queues.size());
+			{
+				std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+				queues[queue]->tasks.emplace_back(std::move(task));
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				pendingTasks++;
+			}
+			taskAvailable.notify_one();
+		}
+
+		/// <summary>
+		/// Calls lambda(i) for every i in [begin, end) and blocks until all calls returned.
+		/// The indices are handed out dynamically so uneven work per index balances itself.
+		/// The calling thread works along, which keeps nested calls from worker threads deadlock free.
+		/// The first exception thrown by lambda is rethrown here once all calls returned, the indices not started by then are skipped.
+		/// </summary>
+		template<typename F>
+		void parallelFor(int begin, int end, F&& lambda) {
+			if (end <= begin) {
+				return;
+			}
+
+			struct State {
+				std::atomic_int next;
+				int done = 0;
+				std::mutex mutex;
+				std::condition_variable finished;
+				// The first exception of lambda, set while holding mutex
+				std::exception_ptr error;
+				std::atomic_bool failed = false;
+			};
+			auto state = std::make_shared<State>();
+			state->next = begin;
+			const int count = end - begin;
+			auto* function = &lambda;
+
+			// Tasks that start after all indices are taken return without touching the lambda,
+			// so they may outlive this call.
+			auto work = [state, function, end]() {
+				int processed = 0;
+				for (int i = state->next++; i < end; i = state->next++) {
+					// Still counted after a failure, the caller waits for every index
+					processed++;
+					if (state->failed.load()) {
+						continue;
+					}
+					try {
+						(*function)(i);
+					}
+					catch (...) {
+						std::lock_guard<std::mutex> lock(state->mutex);
+						if (!state->error) {
+							state->error = std::current_exception();
+						}
+						state->failed = true;
+					}
+				}
+				if (processed > 0) {
+					std::lock_guard<std::mutex> lock(state->mutex);
+					state->done += processed;
+					state->finished.notify_all();
+				}
+			};
+
+			const int numTasks = std::min(size(), count - 1);
+			for (int t = 0; t < numTasks; t++) {
+				enqueue(work);
+			}
+			work();
+
+			std::unique_lock<std::mutex> lock(state->mutex);
+			state->finished.wait(lock, [&state, count]() { return state->done == count; });
+			if (state->error) {
+				std::rethrow_exception(state->error);
+			}
+		}
+
+		/// <summary>
+		/// Splits [begin, end) into one contiguous range per thread and calls lambda(rangeBegin, rangeEnd) for them in parallel.
+		/// For image filters that work on strips of rows, where a call per row would cost more than the row itself.
+		/// </summary>
+		template<typename F>
+		void parallelForRanges(int begin, int end, F&& lambda) {
+			const int count = end - begin;
+			if (count <= 0) {
+				return;
+			}
+			const int numRanges = std::min(size() + 1, count);
+			const int rangeSize = (count + numRanges - 1) / numRanges;
+			parallelFor(0, numRanges, [&](int i) {
+				const int rangeBegin = begin + i * rangeSize;
+				const int rangeEnd = std::min(end, rangeBegin + rangeSize);
+				if (rangeBegin < rangeEnd) {
+					lambda(rangeBegin, rangeEnd);
+				}
+			});
+		}
+	};
+
+	/// <summary>
+	/// The pool shared by all CPU stages of the program.
+	/// </summary>
+	ThreadPool& sharedThreadPool() {
+		static ThreadPool pool;
+		return pool;
+	}
+}
+
+#endif // !_THREAD_POOL_HEADER
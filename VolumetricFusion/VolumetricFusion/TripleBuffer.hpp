@@ -0,0 +1,65 @@
+#pragma once
+
+#ifndef _TRIPLE_BUFFER_HEADER
+#define _TRIPLE_BUFFER_HEADER
+
+#include <atomic>
+#include <cstdint>
+
+namespace vc::utils {
+	/// <summary>
+	/// Hands the newest value from one producer thread to one consumer thread without locks.
+	/// The producer fills the back slot and swaps it with the middle one, the consumer swaps the middle slot with its front slot.
+	/// Neither side ever waits, the consumer always sees a complete value and values the consumer missed are dropped.
+	/// </summary>
+	template <typename T>
+	class TripleBuffer {
+	private:
+		// Set in middle when the middle slot holds a value the consumer has not taken yet
+		static const uint8_t FRESH = 4;
+		static const uint8_t INDEX = 3;
+
+		T slots[3];
+		// Only touched by the producer
+		uint8_t back = 0;
+		// Index of the middle slot and FRESH, shared by both sides
+		std::atomic<uint8_t> middle = 1;
+		// Only touched by the consumer
+		uint8_t front = 2;
+
+	public:
+		/// <summary>
+		/// Producer: the slot to fill before publish(), it may still hold an old value.
+		/// </summary>
+		T& getBack() {
+			return slots[back];
+		}
+
+		/// <summary>
+		/// Producer: makes the back slot the newest value.
+		/// </summary>
+		void publish() {
+			back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+		}
+
+		/// <summary>
+		/// Consumer: takes the newest published value if there is one, returns whether the front slot changed.
+		/// </summary>
+		bool update() {
+			if (!(middle.load(std::memory_order_relaxed) & FRESH)) {
+				return false;
+			}
+			front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+			return true;
+		}
+
+		/// <summary>
+		/// Consumer: the value taken by the last update(), valid until the next update().
+		/// </summary>
+		const T& getFront() const {
+			return slots[front];
+		}
+	};
+}
+
+#endif // !_TRIPLE_BUFFER_HEADER
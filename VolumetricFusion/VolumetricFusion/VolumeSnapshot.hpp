@@ -0,0 +1,191 @@
+#pragma once
+
+#ifndef _VOLUME_SNAPSHOT_HEADER
+#define _VOLUME_SNAPSHOT_HEADER
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+#include <Eigen/Dense>
+#include "Structs.hpp"
+#include "MappedFile.hpp"
+
+namespace vc::fusion {
+	const char VOLUME_SNAPSHOT_MAGIC[8] = { 'V', 'F', 'V', 'O', 'L', 'U', 'M', 'E' };
+	// Increase on every change of VolumeSnapshotHeader or of the voxel layout
+	const uint32_t VOLUME_SNAPSHOT_VERSION = 1;
+	// The brick coordinates and the voxels start at multiples of this, so both can be used in place from the mapping
+	const uint64_t VOLUME_SNAPSHOT_ALIGNMENT = 64;
+
+	enum class VolumeLayout : uint32_t {
+		// sizeNormalized[0] * sizeNormalized[1] * sizeNormalized[2] voxels, x runs fastest
+		DENSE = 0,
+		// numBricks bricks of brickSize^3 voxels, brick i at brick coordinate i
+		BRICKS = 1
+	};
+
+	/// <summary>
+	/// The first 128 bytes of a volume snapshot, followed by the brick coordinates (int32 x, y, z, unused per brick)
+	/// and the voxels as vc::fusion::Voxel, all little endian.
+	/// </summary>
+	struct VolumeSnapshotHeader {
+		char magic[8] = { 'V', 'F', 'V', 'O', 'L', 'U', 'M', 'E' };
+		uint32_t version = VOLUME_SNAPSHOT_VERSION;
+		VolumeLayout layout = VolumeLayout::DENSE;
+		uint32_t voxelBytes = sizeof(Voxel);
+		// Voxels per side of a brick, 0 for dense volumes
+		uint32_t brickSize = 0;
+		// Voxels per dimension of a dense volume, the last one is unused
+		int32_t sizeNormalized[4] = { 0, 0, 0, 0 };
+		double origin[3] = { 0, 0, 0 };
+		double size[3] = { 0, 0, 0 };
+		float resolution = 0;
+		// The TSDF of the voxels is normalized with it
+		float truncationDistance = 0;
+		uint64_t numBricks = 0;
+		uint64_t numVoxels = 0;
+		// Byte offsets from the start of the file
+		uint64_t brickCoordinateOffset = 0;
+		uint64_t voxelOffset = 0;
+	};
+	static_assert(sizeof(VolumeSnapshotHeader) == 128, "The header is part of the file format");
+
+	/// <summary>
+	/// Writes header and data as a snapshot, the offsets and counts of the header are filled in here.
+	/// brickCoordinates holds numBricks coordinates and may be null for dense volumes.
+	/// </summary>
+	bool writeVolumeSnapshot(const std::string& filename, VolumeSnapshotHeader header, const Eigen::Vector3i* brickCoordinates, const Voxel* voxels, uint64_t numVoxels) {
+		auto align = [](uint64_t offset) {
+			return (offset + VOLUME_SNAPSHOT_ALIGNMENT - 1) / VOLUME_SNAPSHOT_ALIGNMENT * VOLUME_SNAPSHOT_ALIGNMENT;
+		};
+
+		std::vector<int32_t> coordinates;
+		if (brickCoordinates) {
+			coordinates.reserve(header.numBricks * 4);
+			for (uint64_t i = 0; i < header.numBricks; i++) {
+				coordinates.insert(coordinates.end(), { brickCoordinates[i][0], brickCoordinates[i][1], brickCoordinates[i][2], 0 });
+			}
+		}
+
+		header.numVoxels = numVoxels;
+		header.brickCoordinateOffset = align(sizeof(VolumeSnapshotHeader));
+		header.voxelOffset = align(header.brickCoordinateOffset + sizeof(int32_t) * coordinates.size());
+
+		std::ofstream file(filename, std::ios::binary);
+		if (!file) {
+			std::cerr << "Could not open " << filename << std::endl;
+			return false;
+		}
+
+		const char padding[VOLUME_SNAPSHOT_ALIGNMENT] = {};
+		file.write((const char*)&header, sizeof(header));
+		file.write(padding, header.brickCoordinateOffset - sizeof(header));
+		file.write((const char*)coordinates.data(), sizeof(int32_t) * coordinates.size());
+		file.write(padding, header.voxelOffset - header.brickCoordinateOffset - sizeof(int32_t) * coordinates.size());
+		file.write((const char*)voxels, sizeof(Voxel) * numVoxels);
+		file.close();
+
+		if (!file) {
+			std::cerr << "Could not write " << filename << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	/// <summary>
+	/// A snapshot mapped into memory, header, brick coordinates and voxels point straight into the mapping.
+	/// Nothing is parsed, open() only checks that the header describes this version and fits the file.
+	/// </summary>
+	class VolumeSnapshot {
+	private:
+		vc::utils::MappedFile file;
+		const VolumeSnapshotHeader* header = nullptr;
+
+		/// <summary>
+		/// product = a * b, false if that does not fit into 64 bits.
+		/// </summary>
+		static bool multiply(uint64_t a, uint64_t b, uint64_t& product) {
+			if (a != 0 && b > UINT64_MAX / a) {
+				return false;
+			}
+			product = a * b;
+			return true;
+		}
+
+	public:
+		bool open(const std::string& filename) {
+			header = nullptr;
+			if (!file.open(filename)) {
+				std::cerr << "Could not map " << filename << std::endl;
+				return false;
+			}
+
+			const VolumeSnapshotHeader* candidate = (const VolumeSnapshotHeader*)file.data();
+			if (file.size() < sizeof(VolumeSnapshotHeader) || std::memcmp(candidate->magic, VOLUME_SNAPSHOT_MAGIC, sizeof(VOLUME_SNAPSHOT_MAGIC)) != 0) {
+				std::cerr << filename << " is no volume snapshot" << std::endl;
+				return false;
+			}
+
+			if (candidate->version != VOLUME_SNAPSHOT_VERSION || candidate->voxelBytes != sizeof(Voxel)) {
+				std::cerr << filename << " has version " << candidate->version << ", expected " << VOLUME_SNAPSHOT_VERSION << std::endl;
+				return false;
+			}
+
+			// Every count and offset comes from the file, none of the products and sums may wrap around
+			uint64_t expectedVoxels = 0;
+			bool valid = false;
+			if (candidate->layout == VolumeLayout::DENSE) {
+				valid = candidate->sizeNormalized[0] >= 0 && candidate->sizeNormalized[1] >= 0 && candidate->sizeNormalized[2] >= 0 &&
+					multiply((uint64_t)candidate->sizeNormalized[0], (uint64_t)candidate->sizeNormalized[1], expectedVoxels) &&
+					multiply(expectedVoxels, (uint64_t)candidate->sizeNormalized[2], expectedVoxels);
+			}
+			else if (candidate->layout == VolumeLayout::BRICKS) {
+				valid = multiply(candidate->brickSize, candidate->brickSize, expectedVoxels) &&
+					multiply(expectedVoxels, candidate->brickSize, expectedVoxels) &&
+					multiply(expectedVoxels, candidate->numBricks, expectedVoxels);
+			}
+
+			// The data is used in place, it follows the header at aligned offsets like writeVolumeSnapshot() puts it
+			const uint64_t brickCoordinateOffset = candidate->brickCoordinateOffset;
+			const uint64_t voxelOffset = candidate->voxelOffset;
+			const bool fits = valid &&
+				candidate->numVoxels == expectedVoxels &&
+				brickCoordinateOffset >= sizeof(VolumeSnapshotHeader) && brickCoordinateOffset % VOLUME_SNAPSHOT_ALIGNMENT == 0 &&
+				voxelOffset >= brickCoordinateOffset && voxelOffset % VOLUME_SNAPSHOT_ALIGNMENT == 0 &&
+				voxelOffset <= file.size() &&
+				candidate->numBricks <= (voxelOffset - brickCoordinateOffset) / (sizeof(int32_t) * 4) &&
+				candidate->numVoxels <= (file.size() - voxelOffset) / sizeof(Voxel);
+			if (!fits) {
+				std::cerr << filename << " is truncated or corrupt" << std::endl;
+				return false;
+			}
+
+			header = candidate;
+			return true;
+		}
+
+		bool isOpen() const {
+			return header != nullptr;
+		}
+
+		const VolumeSnapshotHeader& getHeader() const {
+			return *header;
+		}
+
+		/// <summary>
+		/// Four int32 per brick: x, y, z and unused.
+		/// </summary>
+		const int32_t* getBrickCoordinates() const {
+			return (const int32_t*)(file.data() + header->brickCoordinateOffset);
+		}
+
+		const Voxel* getVoxels() const {
+			return (const Voxel*)(file.data() + header->voxelOffset);
+		}
+	};
+}
+
+#endif // !_VOLUME_SNAPSHOT_HEADER
@@ -9,45 +9,107 @@
 #include <vector>
 #include <VolumetricFusion\shader.hpp>
 #include <unordered_map>
+#include <memory>
+#include <mutex>
 #include "Utils.hpp"
 #include "Tables.hpp"
 #include "Structs.hpp"
-//#include "MarchingCubes.hpp"
+#include "CPUIntegration.hpp"
+#include "Mesh.hpp"
+#include "MarchingCubes.hpp"
+#include "VolumeSnapshot.hpp"
 
 namespace vc::fusion {
-	const int INVALID_TSDF_VALUE = 5;
 	const int VOXELGRID_SHADER_LAYOUT_X = 32;
 	const int MARCHING_CUBES_SHADER_LAYOUT_X = 16;
-	   
+	// Elements scanned by one work group of shader/prefixSum.comp
+	const int PREFIX_SUM_BLOCK_SIZE = 1024;
+	// Must match MAX_CAMERAS in shader/voxelgrid.comp
+	const int MAX_INTEGRATION_CAMERAS = 4;
+
+	/// <summary>
+	/// The counters the marching cubes shader leaves in its counter buffer, the mesh is drawn indirectly from them.
+	/// Mirrors CounterBuffer in shader/marchingCubes.comp.
+	/// </summary>
+	struct MeshCounters {
+		// DrawElementsIndirectCommand
+		GLuint drawCount = 0;
+		GLuint drawInstanceCount = 1;
+		GLuint drawFirstIndex = 0;
+		GLuint drawBaseVertex = 0;
+		GLuint drawBaseInstance = 0;
+
+		GLuint numVertices = 0;
+		GLuint numTriangles = 0;
+	};
+
+	/// <summary>
+	/// A bundle of frames on its way through the fusion stages of the CPU backend, mesh is set by the meshing stage.
+	/// </summary>
+	struct FusionWork {
+		std::vector<std::shared_ptr<vc::capture::CaptureDevice>> pipelines;
+		std::vector<vc::data::Frames> frames;
+		std::vector<Eigen::Matrix4d> relativeTransformations;
+		std::shared_ptr<Mesh> mesh;
+	};
+
+	// The fusion stages of the CPU backend, in this order
+	enum class FusionStage {
+		INTEGRATE,
+		MESH,
+		COUNT
+	};
+
 	class Voxelgrid {
 	protected:
 		GLuint vertexBuffer;
 		GLuint vertexVertexArray;
-		GLuint triangleBuffer;
-		GLuint triangleVertexArray;
+		GLuint meshVertexBuffer;
+		GLuint meshIndexBuffer;
+		GLuint meshVertexArray;
+		// Per voxel the class of its cell and the counts that the scan turns into offsets, see shader/marchingCubes.comp
+		GLuint cellBuffer;
+		GLuint offsetBuffer;
+		// The block sums of every level of the scan
+		std::vector<GLuint> blockSumBuffers;
 
 		vc::rendering::ComputeShader* marchingCubesComputeShader;
+		vc::rendering::ComputeShader* prefixSumComputeShader;
 		vc::rendering::ComputeShader* countTrianglesComputeShader;
 		vc::rendering::VertexFragmentShader* triangleShader;
 
-		GLuint depthTexture;
-		GLuint colorTexture;
+		GLuint depthTextures[MAX_INTEGRATION_CAMERAS];
+		GLuint colorTextures[MAX_INTEGRATION_CAMERAS];
 
 		vc::rendering::Shader* gridShader;
 		vc::rendering::Shader* tsdfComputeShader;
 		vc::rendering::Shader* voxelgridComputeShader;
 
-		//vc::fusion::Vertex* verts;
-		std::vector<vc::fusion::Triangle> triangles;
-		GLuint triangleCount = 0;
+		//vc::fusion::Voxel* verts;
+		// The CPU copy of the mesh for the export, a new one per copy as the exporter may still write the last one
+		std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>();
+		MeshExporter meshExporter;
+		std::string lastExportTimestamp;
+		int exportsInSameSecond = 0;
+		// The last uploaded mesh of the CPU backend, never changed afterwards so the export can share it
+		std::shared_ptr<Mesh> cpuMesh = std::make_shared<Mesh>();
+		// The size of the GPU mesh buffers, grown when marching cubes produced more
+		GLuint vertexCapacity = 100000;
+		GLuint triangleCapacity = 200000;
+		// What the GPU buffers are allocated with, 0 if they have to be allocated
+		GLuint allocatedVertexCapacity = 0;
+		GLuint allocatedTriangleCapacity = 0;
+		int allocatedGridPoints = 0;
 
 		GLuint edgeTable;
 		GLuint triTable;
-		GLuint atomicCounter;
+		// The MeshCounters of the last marching cubes run
+		GLuint counterBuffer;
 
 		int integratedFrames = 0;
 
-		std::map<int, std::vector<int>> integratedFramesPerPipeline;
+		bool hasOpenGL;
+		CPUIntegration cpuIntegration;
 
 	public:
 		float resolution;
@@ -56,31 +118,135 @@ namespace vc::fusion {
 		Eigen::Vector3d sizeHalf;
 		Eigen::Vector3d origin;
 
-		std::vector<Vertex> verts;
+		std::vector<Voxel> verts;
 		float truncationDistance;
 
+		IntegrationBackend integrationBackend = IntegrationBackend::GPU;
+		// Held while the voxels of the CPU backend are integrated or polygonised on other threads than the rendering,
+		// and while the grid is changed or uploaded meanwhile
+		std::mutex voxelMutex;
+
 		//std::vector<float> tsdf;
 		//std::vector<float> weights;
 
 		int num_gridPoints;
 		GLuint numTriangles = 0;
-		int numberOfTrianglesForExport = 0;
+		GLuint numVertices = 0;
 
 		int hashFunc(int x, int y, int z) {
 			//std::cout << z * sizeNormalized[1] * sizeNormalized[0] + y * sizeNormalized[0] + x << std::endl;
 			return z * sizeNormalized[1] * sizeNormalized[0] + y * sizeNormalized[0] + x;
 		}
 
-		Voxelgrid(const float resolution = 0.005f, const Eigen::Vector3d size = Eigen::Vector3d(1.0, 1.0, 1.0), const Eigen::Vector3d origin = Eigen::Vector3d(0.0, 0.0, 1.7), bool initializeShader = true)
+		Voxelgrid(const float resolution = 0.005f, const Eigen::Vector3d size = Eigen::Vector3d(1.0, 1.0, 1.0), const Eigen::Vector3d origin = Eigen::Vector3d(0.0, 0.0, 1.7), bool initializeShader = true) :
+			Voxelgrid(initializeShader)
+		{
+			reset(resolution, size, origin);
+		}
+
+		virtual ~Voxelgrid() {}
+
+	protected:
+		/// <summary>
+		/// Sets up OpenGL without allocating the dense grid, for subclasses that manage their own voxel storage.
+		/// </summary>
+		explicit Voxelgrid(bool initializeShader) :
+			hasOpenGL(initializeShader)
 		{
 			if (initializeShader) {
 				initializeOpenGL();
 			}
-			triangles.resize(200000);
-			reset(resolution, size, origin);
+			else {
+				// Headless, only the CPU can integrate
+				integrationBackend = IntegrationBackend::CPU;
+			}
 		}
 
-		void reset(const float resolution, const Eigen::Vector3d size, const Eigen::Vector3d origin) {
+		void setGridShaderUniforms(glm::mat4 model, glm::mat4 view, glm::mat4 projection) {
+			gridShader->use();
+
+			gridShader->setFloat("cube_radius", resolution * 0.1f);
+			gridShader->setVec3("size", size);
+			gridShader->setMat4("model", model);
+			gridShader->setMat4("view", view);
+			gridShader->setMat4("projection", projection);
+			gridShader->setMat4("coordinate_correction", vc::rendering::COORDINATE_CORRECTION);
+			gridShader->setFloat("truncationDistance", truncationDistance);
+			gridShader->setFloat("resolution", resolution);
+		}
+
+		IntegrationFrame getIntegrationFrame(const std::shared_ptr<vc::capture::CaptureDevice> pipeline, const vc::data::Frames& frames, Eigen::Matrix4d relativeTransformation) {
+			rs2::depth_frame depth_frame = frames.depth;
+			rs2::video_frame color_frame = frames.color;
+
+			IntegrationFrame frame;
+			frame.depth = (const uint16_t*)depth_frame.get_data();
+			frame.depthWidth = depth_frame.get_width();
+			frame.depthHeight = depth_frame.get_height();
+			frame.depthScale = pipeline->depth_camera->depthScale;
+			frame.color = (const uint8_t*)color_frame.get_data();
+			frame.colorWidth = color_frame.get_width();
+			frame.colorHeight = color_frame.get_height();
+			frame.worldToCamera = relativeTransformation.inverse().cast<float>();
+
+			// From the profiles of the frames, which know whether the depth was decimated or aligned to the color
+			const rs2::stream_profile depthProfile = depth_frame.get_profile();
+			const rs2::stream_profile colorProfile = color_frame.get_profile();
+			const rs2_intrinsics depthIntrinsics = depthProfile.as<rs2::video_stream_profile>().get_intrinsics();
+			const rs2_intrinsics colorIntrinsics = colorProfile.as<rs2::video_stream_profile>().get_intrinsics();
+			Eigen::Matrix3f colorProjection;
+			colorProjection <<
+				colorIntrinsics.fx, 0, colorIntrinsics.ppx,
+				0, colorIntrinsics.fy, colorIntrinsics.ppy,
+				0, 0, 1;
+			frame.world2CameraProjection <<
+				depthIntrinsics.fx, 0, depthIntrinsics.ppx,
+				0, depthIntrinsics.fy, depthIntrinsics.ppy,
+				0, 0, 1;
+
+			rs2_extrinsics depthToColor = { { 1, 0, 0, 0, 1, 0, 0, 0, 1 }, { 0, 0, 0 } };
+			try {
+				depthToColor = depthProfile.get_extrinsics_to(colorProfile);
+			}
+			catch (const rs2::error & e) {
+				// Aligned depth of an older librealsense, it shares the camera of the color
+			}
+			const Eigen::Matrix3f rotation = Eigen::Map<const Eigen::Matrix3f>(depthToColor.rotation);
+			frame.depthToColorProjection = colorProjection * rotation * frame.world2CameraProjection.inverse();
+			frame.depthToColorOffset = colorProjection * Eigen::Map<const Eigen::Vector3f>(depthToColor.translation);
+			frame.maxDepth = pipeline->thresholdDistance;
+			return frame;
+		}
+
+		/// <summary>
+		/// The frames taken by the main loop for each pipeline.
+		/// </summary>
+		std::vector<vc::data::Frames> getCurrentFrames(const std::vector<std::shared_ptr<vc::capture::CaptureDevice>>& pipelines) {
+			std::vector<vc::data::Frames> frames;
+			for (auto& pipeline : pipelines) {
+				frames.emplace_back(pipeline->data->getFrames());
+			}
+			return frames;
+		}
+
+		/// <summary>
+		/// frames[i] of pipelines[i] for integration, pipelines without a frame are skipped.
+		/// </summary>
+		std::vector<IntegrationFrame> getIntegrationFrames(const std::vector<std::shared_ptr<vc::capture::CaptureDevice>>& pipelines, const std::vector<vc::data::Frames>& frames, const std::vector<Eigen::Matrix4d>& relativeTransformations) {
+			std::vector<IntegrationFrame> integrationFrames;
+			for (int i = 0; i < pipelines.size(); i++) {
+				try {
+					integrationFrames.emplace_back(getIntegrationFrame(pipelines[i], frames[i], relativeTransformations[i]));
+				}
+				catch (rs2::error & e) {
+					continue;
+				}
+			}
+			return integrationFrames;
+		}
+
+	public:
+		virtual void reset(const float resolution, const Eigen::Vector3d size, const Eigen::Vector3d origin) {
 			this->resolution = resolution;
 			this->origin = origin;
 			this->size = size;
@@ -104,118 +270,170 @@ namespace vc::fusion {
 
 			glGenVertexArrays(1, &vertexVertexArray);
 			glGenBuffers(1, &vertexBuffer);
-			glGenTextures(1, &depthTexture);
-			glGenTextures(1, &colorTexture);
-
-			glBindTexture(GL_TEXTURE_2D, depthTexture); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
-				// set the texture wrapping parameters
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);	// set texture wrapping to GL_REPEAT (default wrapping method)
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-			// set texture filtering parameters
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-			glBindTexture(GL_TEXTURE_2D, colorTexture); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
-				// set the texture wrapping parameters
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);	// set texture wrapping to GL_REPEAT (default wrapping method)
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-			// set texture filtering parameters
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glGenTextures(MAX_INTEGRATION_CAMERAS, depthTextures);
+			glGenTextures(MAX_INTEGRATION_CAMERAS, colorTextures);
+
+			for (int i = 0; i < MAX_INTEGRATION_CAMERAS; i++) {
+				glBindTexture(GL_TEXTURE_2D, depthTextures[i]); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
+					// set the texture wrapping parameters
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);	// set texture wrapping to GL_REPEAT (default wrapping method)
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+				// set texture filtering parameters
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+				glBindTexture(GL_TEXTURE_2D, colorTextures[i]); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
+					// set the texture wrapping parameters
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);	// set texture wrapping to GL_REPEAT (default wrapping method)
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+				// set texture filtering parameters
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			}
+
+			// Depth frames use the texture units 0 to 3, color frames 4 to 7.
+			// Every slot gets its own unit, also the unused ones, a sampler2D and a usampler2D must never share one.
+			voxelgridComputeShader->use();
+			for (int i = 0; i < MAX_INTEGRATION_CAMERAS; i++) {
+				const std::string camera = "[" + std::to_string(i) + "]";
+				voxelgridComputeShader->setInt("depthFrame" + camera, i);
+				voxelgridComputeShader->setInt("colorFrame" + camera, MAX_INTEGRATION_CAMERAS + i);
+			}
 
 			//setTSDF();
 		}
 
 		void initializeMarchingCubes() {
 			marchingCubesComputeShader = new vc::rendering::ComputeShader("shader/marchingCubes.comp");
+			prefixSumComputeShader = new vc::rendering::ComputeShader("shader/prefixSum.comp");
 			countTrianglesComputeShader = new vc::rendering::ComputeShader("shader/countTriangles.comp");
 			triangleShader = new vc::rendering::VertexFragmentShader("shader/mesh.vert", "shader/mesh.frag");
 
-			glGenVertexArrays(1, &triangleVertexArray);
+			glGenVertexArrays(1, &meshVertexArray);
 			glGenBuffers(1, &vertexBuffer);
-			glGenBuffers(1, &triangleBuffer);
+			glGenBuffers(1, &meshVertexBuffer);
+			glGenBuffers(1, &meshIndexBuffer);
+			glGenBuffers(1, &cellBuffer);
+			glGenBuffers(1, &offsetBuffer);
 			glGenBuffers(1, &edgeTable);
 			glGenBuffers(1, &triTable);
-			glGenBuffers(1, &atomicCounter);
+			glGenBuffers(1, &counterBuffer);
+
+			writeMeshCounters(0, 0);
 		}
 
 		void setVoxelgridComputeShader() {
 			glBindVertexArray(vertexVertexArray);
 			glBindBuffer(GL_SHADER_STORAGE_BUFFER, vertexBuffer);
-			glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Vertex) * num_gridPoints, verts.data(), GL_DYNAMIC_COPY);
+			glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Voxel) * num_gridPoints, verts.data(), GL_DYNAMIC_COPY);
 			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, vertexBuffer);
 		}
 
-		void zeroTriangleCounter() {
-			GLuint tmp_numTriangles[1] = { 0 };
-			glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, atomicCounter);
-			glBufferData(GL_ATOMIC_COUNTER_BUFFER, sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
-			glBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(GLuint), tmp_numTriangles);
-			glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 4, atomicCounter);
-			glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+		void writeMeshCounters(GLuint numVertices, GLuint numTriangles) {
+			MeshCounters counters;
+			counters.drawCount = numTriangles * 3;
+			counters.numVertices = numVertices;
+			counters.numTriangles = numTriangles;
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffer);
+			glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(MeshCounters), &counters, GL_DYNAMIC_COPY);
 		}
 
-		void resetVoxelgridBuffer() {
-			verts = std::vector<Vertex>(num_gridPoints);
+		MeshCounters readMeshCounters() {
+			MeshCounters counters;
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffer);
+			glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(MeshCounters), &counters);
+			return counters;
+		}
 
-			setVoxelgridComputeShader();
+		/// <summary>
+		/// Exclusive prefix sum over the numElements uvec2 of buffer, in place.
+		/// Every block is scanned on its own, then the block sums are scanned recursively and added back.
+		/// Afterwards blockSumBuffers[level] of the last level holds the total.
+		/// Returns the buffer with the total.
+		/// </summary>
+		GLuint scanOffsets(GLuint buffer, int numElements, int level = 0) {
+			const int numBlocks = (numElements + PREFIX_SUM_BLOCK_SIZE - 1) / PREFIX_SUM_BLOCK_SIZE;
+			if (blockSumBuffers.size() <= level) {
+				blockSumBuffers.emplace_back();
+				glGenBuffers(1, &blockSumBuffers.back());
+			}
 
-			voxelgridComputeShader->use();
-			voxelgridComputeShader->setInt("INVALID_TSDF_VALUE", INVALID_TSDF_VALUE);
-			voxelgridComputeShader->setFloat("resolution", resolution);
-			voxelgridComputeShader->setVec3("sizeHalf", sizeHalf);
-			voxelgridComputeShader->setVec3i("sizeNormalized", sizeNormalized);
-			voxelgridComputeShader->setVec3("origin", origin);
-			voxelgridComputeShader->setBool("setPosition", true);
+			GLuint blockSums = blockSumBuffers[level];
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, blockSums);
+			glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * 2 * numBlocks, nullptr, GL_DYNAMIC_COPY);
 
-			glDispatchCompute(num_gridPoints / VOXELGRID_SHADER_LAYOUT_X, 1, 1);
+			prefixSumComputeShader->use();
+			prefixSumComputeShader->setInt("numElements", numElements);
+			prefixSumComputeShader->setInt("pass", 0);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, buffer);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, blockSums);
+			glDispatchCompute(numBlocks, 1, 1);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
-			glMemoryBarrier(GL_ALL_BARRIER_BITS);
+			if (numBlocks == 1) {
+				return blockSums;
+			}
 
-			glBindBuffer(GL_SHADER_STORAGE_BUFFER, vertexBuffer);
-			glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(Vertex) * num_gridPoints, verts.data());
+			const GLuint total = scanOffsets(blockSums, numBlocks, level + 1);
+
+			prefixSumComputeShader->use();
+			prefixSumComputeShader->setInt("numElements", numElements);
+			prefixSumComputeShader->setInt("pass", 1);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, buffer);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, blockSums);
+			glDispatchCompute(numBlocks, 1, 1);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+			return total;
+		}
+
+		virtual void resetVoxelgridBuffer() {
+			// Default constructed voxels are unobserved, the positions follow from the indices
+			verts = std::vector<Voxel>(num_gridPoints);
+
+			if (!hasOpenGL) {
+				return;
+			}
+
+			setVoxelgridComputeShader();
 
 			//printVerts();
 		}
 
-		void renderGrid(glm::mat4 model, glm::mat4 view, glm::mat4 projection) {
+		virtual void renderGrid(glm::mat4 model, glm::mat4 view, glm::mat4 projection) {
 			//glBindBuffer(GL_VERTEX_ARRAY, vertexBuffer);
-			//glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(Vertex) * num_gridPoints, verts.data());
+			//glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(Voxel) * num_gridPoints, verts.data());
 
 			//printVerts();
-			gridShader->use();
-
-			gridShader->setFloat("cube_radius", resolution * 0.1f);
-			gridShader->setVec3("size", size);
-			gridShader->setMat4("model", model);
-			gridShader->setMat4("view", view);
-			gridShader->setMat4("projection", projection);
-			gridShader->setMat4("coordinate_correction", vc::rendering::COORDINATE_CORRECTION);
-			gridShader->setFloat("truncationDistance", truncationDistance);
+			setGridShaderUniforms(model, view, projection);
+			gridShader->setBool("sparse", false);
+			gridShader->setVec3("sizeHalf", sizeHalf);
+			gridShader->setVec3i("sizeNormalized", sizeNormalized);
+			gridShader->setVec3("origin", origin);
 
 			glBindVertexArray(vertexVertexArray);
 			glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-			//glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * num_gridPoints, verts.data(), GL_DYNAMIC_DRAW);
+			//glBufferData(GL_ARRAY_BUFFER, sizeof(Voxel) * num_gridPoints, verts.data(), GL_DYNAMIC_DRAW);
 
-			glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0); // Vertex Attrib. 0
+			// The packed voxel as two uints, the position is computed from gl_VertexID
+			glVertexAttribIPointer(0, 2, GL_UNSIGNED_INT, sizeof(Voxel), (void*)0); // Vertex Attrib. 0
 			glEnableVertexAttribArray(0);
-			glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)16); // Vertex Attrib. 1
-			glEnableVertexAttribArray(1);
 
 			glDrawArrays(GL_POINTS, 0, num_gridPoints);
 			glBindVertexArray(0);
 		}
 
 		void renderMarchingCubes(glm::mat4 model, glm::mat4 view, glm::mat4 projection, bool wireframeMode = false, bool useNormals = true) {
-			glBindVertexArray(triangleVertexArray);
-			glBindBuffer(GL_ARRAY_BUFFER, triangleBuffer);
-			//glBufferData(GL_ARRAY_BUFFER, sizeof(Triangle) * triangles.size(), triangles.data(), GL_DYNAMIC_DRAW);
-			glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 12 * sizeof(float), (void*)0);
+			glBindVertexArray(meshVertexArray);
+			glBindBuffer(GL_ARRAY_BUFFER, meshVertexBuffer);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, pos));
 			glEnableVertexAttribArray(0);
-			glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 12 * sizeof(float), (void*)(4 * sizeof(float)));
+			glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, color));
 			glEnableVertexAttribArray(1);
-			glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, 12 * sizeof(float), (void*)(8 * sizeof(float)));
+			glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, normal));
 			glEnableVertexAttribArray(2);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIndexBuffer);
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, counterBuffer);
 
 			triangleShader->use();
 			triangleShader->setBool("useNormals", useNormals);
@@ -226,7 +444,8 @@ namespace vc::fusion {
 			if (wireframeMode) {
 				glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 			}
-			glDrawArrays(GL_TRIANGLES, 0, triangles.size() * 3);
+			// The count comes from the counters on the GPU, nothing has to wait for marching cubes
+			glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, 0);
 			glBindVertexArray(0);
 			glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 		}
@@ -236,11 +455,8 @@ namespace vc::fusion {
 				//if (std::abs(verts[i].pos[0]) < resolution * 0.9f && std::abs(verts[i].pos[1]) < resolution * 0.9f)
 					//if (verts[i].pos[2] > 0 ) 
 				{
-					for (int j = 0; j < 4; j++) {
-						std::cout <<
-							verts[i].pos[j] << " | " << verts[i].tsdf[j] << " | " << verts[i].color[j] << std::endl;
-					}
-					std::cout << std::endl;
+					std::cout <<
+						verts[i].getTsdf() << " | " << verts[i].weight << " | " << vc::utils::toString(verts[i].getColor()) << std::endl;
 				}
 			}
 			std::cout << "";
@@ -258,67 +474,142 @@ namespace vc::fusion {
 			this->truncationDistance = truncationDistance;
 		}
 
-		void computeTSDF(const std::shared_ptr<vc::capture::CaptureDevice> pipeline, Eigen::Matrix4d relativeTransformation, bool clearAsFirstFrame = false) try {
-			glm::mat3 world2CameraProjection = pipeline->depth_camera->world2cam_glm;
-			glm::mat3 colorWorld2CameraProjection = pipeline->rgb_camera->world2cam_glm;
+		/// <summary>
+		/// Integrates up to MAX_INTEGRATION_CAMERAS views with one dispatch.
+		/// Each invocation reads its voxel once, folds in all views and writes it back once.
+		/// Only the union of the frustum bounds of the views is dispatched.
+		/// </summary>
+		void computeTSDF(const std::vector<std::shared_ptr<vc::capture::CaptureDevice>>& pipelines, const std::vector<vc::data::Frames>& frames, const std::vector<Eigen::Matrix4d>& relativeTransformations, bool clearAsFirstFrame = false) {
+			voxelgridComputeShader->use();
 
-			rs2::depth_frame depth_frame = pipeline->data->filteredDepthFrames;
-			int depthWidth = depth_frame.as<rs2::video_frame>().get_width();
-			int	depthHeight = depth_frame.as<rs2::video_frame>().get_height();
+			const GridDescription grid = getGridDescription();
+			VoxelRange dispatchBounds;
 
-			rs2::frame color_frame = pipeline->data->filteredColorFrames;
-			int colorWidth = color_frame.as<rs2::video_frame>().get_width();
-			int	colorHeight = color_frame.as<rs2::video_frame>().get_height();
+			int numCameras = 0;
+			for (int i = 0; i < pipelines.size() && numCameras < MAX_INTEGRATION_CAMERAS; i++) {
+				try {
+					const IntegrationFrame integrationFrame = getIntegrationFrame(pipelines[i], frames[i], relativeTransformations[i]);
+					const VoxelRange bounds = getFrustumBounds(integrationFrame, grid);
+					if (bounds.isEmpty()) {
+						continue;
+					}
+					dispatchBounds.extend(bounds);
+
+					rs2::depth_frame depth_frame = frames[i].depth;
+					int depthWidth = depth_frame.as<rs2::video_frame>().get_width();
+					int	depthHeight = depth_frame.as<rs2::video_frame>().get_height();
+
+					rs2::frame color_frame = frames[i].color;
+					int colorWidth = color_frame.as<rs2::video_frame>().get_width();
+					int	colorHeight = color_frame.as<rs2::video_frame>().get_height();
+
+					const std::string camera = "[" + std::to_string(numCameras) + "]";
+					voxelgridComputeShader->setMat3("world2CameraProjection" + camera, Eigen::Matrix3d(integrationFrame.world2CameraProjection.cast<double>()));
+					voxelgridComputeShader->setMat3("depthToColorProjection" + camera, Eigen::Matrix3d(integrationFrame.depthToColorProjection.cast<double>()));
+					voxelgridComputeShader->setVec3("depthToColorOffset" + camera, Eigen::Vector3d(integrationFrame.depthToColorOffset.cast<double>()));
+					voxelgridComputeShader->setMat4("relativeTransformation" + camera, relativeTransformations[i].inverse());
+					voxelgridComputeShader->setFloat("depthScale" + camera, pipelines[i]->depth_camera->depthScale);
+					voxelgridComputeShader->setVec2("depthResolution" + camera, depthWidth, depthHeight);
+					voxelgridComputeShader->setVec2("colorResolution" + camera, colorWidth, colorHeight);
+					voxelgridComputeShader->setVec3i("boundsMin" + camera, bounds.min);
+					voxelgridComputeShader->setVec3i("boundsMax" + camera, bounds.max);
+
+					// The units of the samplers are set in initializeVoxelgrid()
+					glActiveTexture(GL_TEXTURE0 + numCameras);
+					glBindTexture(GL_TEXTURE_2D, depthTextures[numCameras]);
+					glTexImage2D(GL_TEXTURE_2D, 0, GL_R16UI, depthWidth, depthHeight, 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, depth_frame.get_data());
+
+					glActiveTexture(GL_TEXTURE0 + MAX_INTEGRATION_CAMERAS + numCameras);
+					glBindTexture(GL_TEXTURE_2D, colorTextures[numCameras]);
+					glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, colorWidth, colorHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, color_frame.get_data());
+
+					numCameras++;
+				}
+				catch (rs2::error & e) {
+					continue;
+				}
+			}
+
+			if (numCameras == 0 && !clearAsFirstFrame) {
+				return;
+			}
 
 			glBindVertexArray(vertexVertexArray);
 			glBindBuffer(GL_SHADER_STORAGE_BUFFER, vertexBuffer);
-			//glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Vertex)* num_gridPoints, verts.data(), GL_DYNAMIC_COPY);
+			//glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Voxel)* num_gridPoints, verts.data(), GL_DYNAMIC_COPY);
 			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, vertexBuffer);
 
-			voxelgridComputeShader->use();
-			voxelgridComputeShader->setInt("INVALID_TSDF_VALUE", INVALID_TSDF_VALUE);
-			voxelgridComputeShader->setBool("setPosition", false);
-			voxelgridComputeShader->setBool("clearAsFirstFrame", clearAsFirstFrame);
-
-			voxelgridComputeShader->setMat3("world2CameraProjection", world2CameraProjection);
-			voxelgridComputeShader->setMat4("relativeTransformation", relativeTransformation.inverse());
-			voxelgridComputeShader->setMat3("colorWorld2CameraProjection", colorWorld2CameraProjection);
-			voxelgridComputeShader->setFloat("depthScale", pipeline->depth_camera->depthScale);
-			voxelgridComputeShader->setVec2("depthResolution", depthWidth, depthHeight);
-			voxelgridComputeShader->setVec2("colorResolution", colorWidth, colorHeight);
-			voxelgridComputeShader->setFloat("truncationDistance", truncationDistance);
+			if (clearAsFirstFrame) {
+				// Voxels outside of the dispatched bounds have to be cleared as well
+				glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_RG32UI, GL_RG_INTEGER, GL_UNSIGNED_INT, nullptr);
+			}
 
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, depthTexture);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_R16UI, depthWidth, depthHeight, 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, depth_frame.get_data());
-			voxelgridComputeShader->setInt("depthFrame", 0);
+			if (dispatchBounds.isEmpty()) {
+				glMemoryBarrier(GL_ALL_BARRIER_BITS);
+				return;
+			}
 
-			glActiveTexture(GL_TEXTURE1);
-			glBindTexture(GL_TEXTURE_2D, colorTexture);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, colorWidth, colorHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, color_frame.get_data());
-			voxelgridComputeShader->setInt("colorFrame", 1);
+			voxelgridComputeShader->setInt("numCameras", numCameras);
+			voxelgridComputeShader->setVec3i("dispatchMin", dispatchBounds.min);
+			voxelgridComputeShader->setVec3i("dispatchSize", dispatchBounds.max - dispatchBounds.min);
+			voxelgridComputeShader->setFloat("resolution", resolution);
+			voxelgridComputeShader->setVec3("sizeHalf", sizeHalf);
+			voxelgridComputeShader->setVec3i("sizeNormalized", sizeNormalized);
+			voxelgridComputeShader->setVec3("origin", origin);
+			voxelgridComputeShader->setFloat("truncationDistance", truncationDistance);
 
-			glDispatchCompute(num_gridPoints / MARCHING_CUBES_SHADER_LAYOUT_X , 1, 1);
+			glDispatchCompute((dispatchBounds.numVoxels() + VOXELGRID_SHADER_LAYOUT_X - 1) / VOXELGRID_SHADER_LAYOUT_X, 1, 1);
 
 			glMemoryBarrier(GL_ALL_BARRIER_BITS);
 		}
-		catch (rs2::error & e) {
-			return;
-		}
 
+		/// <summary>
+		/// Marching cubes as a stream compaction: classify every cell once, scan the vertex and triangle counts
+		/// and write the vertices and triangles of the active cells at their offsets.
+		/// The GPU never waits for the CPU in between, the mesh is drawn indirectly from the counters it leaves.
+		/// The counters are read back on the next run, by then long finished, and the buffers grow if they overflowed.
+		/// </summary>
+		virtual void computeMarchingCubes(glm::vec3 cameraPos) {
+			if (integrationBackend == IntegrationBackend::CPU) {
+				computeMarchingCubesCPU();
+				return;
+			}
+
+			if (allocatedVertexCapacity > 0) {
+				const MeshCounters last = readMeshCounters();
+				if (last.numVertices > vertexCapacity || last.numTriangles > triangleCapacity) {
+					// Some headroom so a growing mesh does not reallocate every frame
+					vertexCapacity = std::max(vertexCapacity, last.numVertices + last.numVertices / 2);
+					triangleCapacity = std::max(triangleCapacity, last.numTriangles + last.numTriangles / 2);
+				}
+			}
+
+			if (allocatedVertexCapacity != vertexCapacity || allocatedTriangleCapacity != triangleCapacity) {
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, meshVertexBuffer);
+				glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(MeshVertex) * vertexCapacity, nullptr, GL_DYNAMIC_COPY);
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, meshIndexBuffer);
+				glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * 3 * triangleCapacity, nullptr, GL_DYNAMIC_COPY);
+				allocatedVertexCapacity = vertexCapacity;
+				allocatedTriangleCapacity = triangleCapacity;
+			}
+
+			if (allocatedGridPoints != num_gridPoints) {
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, cellBuffer);
+				glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * num_gridPoints, nullptr, GL_DYNAMIC_COPY);
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, offsetBuffer);
+				glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * 2 * num_gridPoints, nullptr, GL_DYNAMIC_COPY);
+				allocatedGridPoints = num_gridPoints;
+			}
 
-		void computeMarchingCubes(glm::vec3 cameraPos) {
 			marchingCubesComputeShader->use();
 			marchingCubesComputeShader->setFloat("resolution", resolution);
 			marchingCubesComputeShader->setVec3("cameraPos", cameraPos);
 			marchingCubesComputeShader->setVec3i("sizeNormalized", sizeNormalized);
+			marchingCubesComputeShader->setVec3("sizeHalf", sizeHalf);
+			marchingCubesComputeShader->setVec3("origin", origin);
 			marchingCubesComputeShader->setFloat("isolevel", 0.0f);
-			marchingCubesComputeShader->setInt("INVALID_TSDF_VALUE", vc::fusion::INVALID_TSDF_VALUE);
-			marchingCubesComputeShader->setBool("onlyCount", true);
-
-			//glBindBuffer(GL_SHADER_STORAGE_BUFFER, vertexBuffer);
-			//glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Vertex) * num_gridPoints, verts.data(), GL_DYNAMIC_COPY);
-			//glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, vertexBuffer);
+			marchingCubesComputeShader->setInt("vertexCapacity", vertexCapacity);
+			marchingCubesComputeShader->setInt("triangleCapacity", triangleCapacity);
 
 			glBindBuffer(GL_SHADER_STORAGE_BUFFER, edgeTable);
 			glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(vc::fusion::edgeTable), vc::fusion::edgeTable, GL_DYNAMIC_COPY);
@@ -328,309 +619,321 @@ namespace vc::fusion {
 			glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(vc::fusion::triTable), vc::fusion::triTable, GL_DYNAMIC_COPY);
 			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, triTable);
 
-			zeroTriangleCounter();
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, vertexBuffer);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, cellBuffer);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, offsetBuffer);
 
-			glDispatchCompute(num_gridPoints / MARCHING_CUBES_SHADER_LAYOUT_X, 1, 1);
-			glMemoryBarrier(GL_ALL_BARRIER_BITS);
+			const GLuint numGroups = (num_gridPoints + MARCHING_CUBES_SHADER_LAYOUT_X - 1) / MARCHING_CUBES_SHADER_LAYOUT_X;
 
-			GLuint userCounters[1];
-			glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, atomicCounter);
-			glGetBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(GLuint), userCounters);
-			glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
-			numTriangles = userCounters[0];
+			marchingCubesComputeShader->setInt("pass", 0);
+			glDispatchCompute(numGroups, 1, 1);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
-			//std::cout << vc::utils::toString("Calculated numTriangles", numTriangles);
+			// The scan rebinds 0 and 1
+			const GLuint totalBuffer = scanOffsets(offsetBuffer, num_gridPoints);
 
-			if (numTriangles > triangles.size()) {
-				triangles.resize(numTriangles);
-			}
+			marchingCubesComputeShader->use();
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, vertexBuffer);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, meshVertexBuffer);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, counterBuffer);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, meshIndexBuffer);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, totalBuffer);
 
-			marchingCubesComputeShader->setBool("onlyCount", false);
-			zeroTriangleCounter();
+			marchingCubesComputeShader->setInt("pass", 1);
+			glDispatchCompute(numGroups, 1, 1);
+			glMemoryBarrier(GL_ALL_BARRIER_BITS);
+		}
 
-			glBindBuffer(GL_SHADER_STORAGE_BUFFER, triangleBuffer);
-			glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Triangle) * numTriangles, triangles.data(), GL_DYNAMIC_COPY);
-			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, triangleBuffer);
+		/// <summary>
+		/// The same compaction on the CPU copy of the grid, with the z slices spread over the thread pool.
+		/// </summary>
+		void computeMarchingCubesCPU() {
+			uploadMeshCPU(polygoniseCPU());
+		}
 
-			glDispatchCompute(num_gridPoints / MARCHING_CUBES_SHADER_LAYOUT_X, 1, 1);
-			glMemoryBarrier(GL_ALL_BARRIER_BITS);
+		/// <summary>
+		/// Runs marching cubes over the voxels of the CPU backend into a new mesh, without OpenGL.
+		/// </summary>
+		std::shared_ptr<Mesh> polygoniseCPU() {
+			auto getVoxel = [this](int x, int y, int z) -> const Voxel* {
+				if (x < 0 || y < 0 || z < 0 || x >= sizeNormalized[0] || y >= sizeNormalized[1] || z >= sizeNormalized[2]) {
+					return nullptr;
+				}
+				const Voxel* voxel = &verts[hashFunc(x, y, z)];
+				return voxel->isValid() ? voxel : nullptr;
+			};
 
-			//glBindBuffer(GL_SHADER_STORAGE_BUFFER, triangleBuffer);
-			//glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(Triangle) * numTriangles, triangles.data());
+			const Eigen::Vector3d firstVoxelPosition = origin - sizeHalf;
 
+			auto polygonised = std::make_shared<Mesh>();
+			polygonise(getVoxel, sizeNormalized - Eigen::Vector3i::Ones(), glm::vec3(firstVoxelPosition[0], firstVoxelPosition[1], firstVoxelPosition[2]), resolution, *polygonised, 0.0f, &vc::utils::sharedThreadPool());
+			return polygonised;
+		}
 
-			//double maxAngle = 0;
-			//for (int i = 0; i < 100 && i < numTriangles; i++)
-			//{
-			//    //std::cout << vc::utils::toString(std::to_string(i), &triangles[i]);
-			////    //for (int j = 0; j < 100 && j < numTriangles; j++)
-			////    //{
-			////    //    if (i != j && vc::utils::areEqual(&triangles[i], &triangles[j])) {
-			////    //        std::cout << vc::utils::asHeader("Overlap detected");
-			////    //        std::cout << vc::utils::toString(std::to_string(i), &triangles[i]);
-			////    //        std::cout << vc::utils::toString(std::to_string(j), &triangles[j]);
-			////    //    }
-			////    //}
+		/// <summary>
+		/// Makes a mesh of polygoniseCPU() the one rendered and exported.
+		/// </summary>
+		void uploadMeshCPU(std::shared_ptr<Mesh> polygonised) {
+			cpuMesh = polygonised;
+			numVertices = (GLuint)cpuMesh->vertices.size();
+			numTriangles = (GLuint)cpuMesh->numTriangles();
 
-			//	float angle = std::abs(triangles[i].pos0.x);
-			//	if (angle > maxAngle) {
-			//		maxAngle = angle;
-			//	}
-			//}
+			if (!hasOpenGL) {
+				return;
+			}
 
-			//std::cout << std::endl;
+			// The element array buffer binding is part of the vertex array
+			glBindVertexArray(meshVertexArray);
+			glBindBuffer(GL_ARRAY_BUFFER, meshVertexBuffer);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(MeshVertex) * cpuMesh->vertices.size(), cpuMesh->vertices.data(), GL_DYNAMIC_DRAW);
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIndexBuffer);
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * cpuMesh->indices.size(), cpuMesh->indices.data(), GL_DYNAMIC_DRAW);
+			glBindVertexArray(0);
 
-			//exportToPly();
-		}
+			writeMeshCounters(numVertices, numTriangles);
 
-		virtual void integrateFrameGPU(const std::shared_ptr<vc::capture::CaptureDevice> pipeline, Eigen::Matrix4d relativeTransformation, bool clearAsFirstFrame = false) try {
-			computeTSDF(pipeline, relativeTransformation, clearAsFirstFrame);
+			// The GPU backend has to allocate its buffers again
+			allocatedVertexCapacity = 0;
+			allocatedTriangleCapacity = 0;
 		}
-		catch (rs2::error & e) {
-			return;
+
+		virtual void integrateFrameGPU(const std::shared_ptr<vc::capture::CaptureDevice> pipeline, Eigen::Matrix4d relativeTransformation, bool clearAsFirstFrame = false) {
+			integrateFramesGPU({ pipeline }, { pipeline->data->getFrames() }, { relativeTransformation }, clearAsFirstFrame);
 		}
 
-		void integrateFramesCPU(std::vector<std::shared_ptr<vc::capture::CaptureDevice>> pipelines, std::vector<Eigen::Matrix4d> relativeTransformations) {
-			for (int i = 0; i < pipelines.size(); i++) {
-				//continue;
-				integrateFrameCPU(pipelines[i], relativeTransformations[i], i, pipelines[i]->data->frameId);
+		virtual void integrateFramesGPU(const std::vector<std::shared_ptr<vc::capture::CaptureDevice>>& pipelines, const std::vector<vc::data::Frames>& frames, const std::vector<Eigen::Matrix4d>& relativeTransformations, bool clearAsFirstFrame = true) {
+			// More cameras than the shader has slots for are integrated in batches
+			for (int first = 0; first < pipelines.size() || (first == 0 && clearAsFirstFrame); first += MAX_INTEGRATION_CAMERAS) {
+				const int last = std::min((int)pipelines.size(), first + MAX_INTEGRATION_CAMERAS);
+				computeTSDF(
+					std::vector<std::shared_ptr<vc::capture::CaptureDevice>>(pipelines.begin() + first, pipelines.begin() + last),
+					std::vector<vc::data::Frames>(frames.begin() + first, frames.begin() + last),
+					std::vector<Eigen::Matrix4d>(relativeTransformations.begin() + first, relativeTransformations.begin() + last),
+					clearAsFirstFrame && first == 0
+				);
 			}
 		}
 
-		void integrateFrameCPU(const std::shared_ptr<vc::capture::CaptureDevice> pipeline, Eigen::Matrix4d relativeTransformation, const int pipelineId, const int frameId) {
-			std::cout << "Integrating " << pipelineId << " - Frame: " << frameId << std::endl;
+		virtual void integrateFramesCPU(const std::vector<std::shared_ptr<vc::capture::CaptureDevice>>& pipelines, const std::vector<vc::data::Frames>& frames, const std::vector<Eigen::Matrix4d>& relativeTransformations, bool clearAsFirstFrame = true) {
+			integrateVoxelsCPU(pipelines, frames, relativeTransformations, clearAsFirstFrame);
 
-			//if (integratedFramesPerPipeline.count(pipelineId) <= 0) {
-			//	integratedFramesPerPipeline[pipelineId] = std::vector<int>();
-			//}
-			//else {
-			//	if (std::find(integratedFramesPerPipeline[pipelineId].begin(), integratedFramesPerPipeline[pipelineId].end(), frameId) != integratedFramesPerPipeline[pipelineId].end()) {
-			//		std::cout << "Already integrated." << std::endl << std::endl;
-			//		return;
-			//	}
-			//}
+			uploadVoxelgridBuffer();
+		}
 
+		/// <summary>
+		/// Whether integrateVoxelsCPU() and polygoniseCPU() are all the fusion needs, so it can run on other threads
+		/// than the rendering while holding voxelMutex.
+		/// </summary>
+		virtual bool canFuseAsynchronously() {
+			return integrationBackend == IntegrationBackend::CPU;
+		}
 
+		/// <summary>
+		/// The CPU integration without the upload to OpenGL, so it can run on another thread than the rendering.
+		/// </summary>
+		void integrateVoxelsCPU(const std::vector<std::shared_ptr<vc::capture::CaptureDevice>>& pipelines, const std::vector<vc::data::Frames>& frames, const std::vector<Eigen::Matrix4d>& relativeTransformations, bool clearAsFirstFrame = true) {
+			cpuIntegration.integrate(verts, getGridDescription(), getIntegrationFrames(pipelines, frames, relativeTransformations), clearAsFirstFrame);
+		}
+
+		virtual void integrateFrameCPU(const std::shared_ptr<vc::capture::CaptureDevice> pipeline, Eigen::Matrix4d relativeTransformation, bool clearAsFirstFrame = false) try {
+			IntegrationFrame frame = getIntegrationFrame(pipeline, pipeline->data->getFrames(), relativeTransformation);
+			cpuIntegration.integrate(verts, getGridDescription(), frame, clearAsFirstFrame);
+
+			uploadVoxelgridBuffer();
+		}
+		catch (rs2::error & e) {
 			return;
+		}
 
-			Eigen::Matrix3d world2CameraProjection = pipeline->depth_camera->world2cam;
-			rs2::depth_frame* depth_frame;
-			int depth_width;
-			int depth_height;
+		/// <summary>
+		/// Integrates the current frame of the pipeline with the selected backend.
+		/// </summary>
+		void integrateFrame(const std::shared_ptr<vc::capture::CaptureDevice> pipeline, Eigen::Matrix4d relativeTransformation, bool clearAsFirstFrame = false) {
+			if (integrationBackend == IntegrationBackend::CPU) {
+				integrateFrameCPU(pipeline, relativeTransformation, clearAsFirstFrame);
+			}
+			else {
+				integrateFrameGPU(pipeline, relativeTransformation, clearAsFirstFrame);
+			}
+		}
 
-			try {
-				depth_frame = (rs2::depth_frame*) & (pipeline->data->filteredDepthFrames);
-				depth_width = depth_frame->as<rs2::video_frame>().get_width();
-				depth_height = depth_frame->as<rs2::video_frame>().get_height();
+		/// <summary>
+		/// Integrates frames[i] of every pipelines[i] in a single pass over the grid with the selected backend.
+		/// The frame of pipelines[i] is placed with relativeTransformations[i].
+		/// </summary>
+		void integrateFrames(const std::vector<std::shared_ptr<vc::capture::CaptureDevice>>& pipelines, const std::vector<vc::data::Frames>& frames, const std::vector<Eigen::Matrix4d>& relativeTransformations, bool clearAsFirstFrame = true) {
+			if (integrationBackend == IntegrationBackend::CPU) {
+				integrateFramesCPU(pipelines, frames, relativeTransformations, clearAsFirstFrame);
 			}
-			catch (rs2::error & e) {
-				return;
+			else {
+				integrateFramesGPU(pipelines, frames, relativeTransformations, clearAsFirstFrame);
 			}
+		}
 
-			integratedFramesPerPipeline[pipelineId].push_back(frameId);
+		/// <summary>
+		/// Integrates the current frames of all pipelines, see integrateFrames above.
+		/// </summary>
+		void integrateFrames(const std::vector<std::shared_ptr<vc::capture::CaptureDevice>>& pipelines, const std::vector<Eigen::Matrix4d>& relativeTransformations, bool clearAsFirstFrame = true) {
+			integrateFrames(pipelines, getCurrentFrames(pipelines), relativeTransformations, clearAsFirstFrame);
+		}
 
-			std::vector<std::thread> threads;
-			for (int z = 0; z < sizeNormalized[2]; z++)
-			{
-				int yy = 0;
-				for (int y = 0; y < sizeNormalized[1]; y++)
-				{
+		virtual void setIntegrationBackend(IntegrationBackend backend) {
+			if (!hasOpenGL) {
+				integrationBackend = IntegrationBackend::CPU;
+				return;
+			}
 
-					threads.emplace_back(std::thread([&, y, z]() {
-						for (int x = 0; x < sizeNormalized[0]; x++)
-						{
-							GLfloat* tsdf;
-							std::stringstream ss;
-							Eigen::Vector3d voxelPosition = getVoxelPosition(x, y, z);
-
-							int hash = this->hashFunc(x, y, z);
-
-							ss << NAME_AND_VALUE(hash);
-							ss << NAME_AND_VALUE(voxelPosition);
-
-							Eigen::Vector3d projectedVoxelCenter = world2CameraProjection * voxelPosition;
-							ss << NAME_AND_VALUE(projectedVoxelCenter);
-
-							float z = projectedVoxelCenter[2];
-
-							if (z <= 0) {
-								tsdf = new GLfloat[4]{ (GLfloat)hash, INVALID_TSDF_VALUE,-3,-3 };
-								ss << vc::utils::asHeader("Invalid because z <= 0");
-							}
-							else {
-								Eigen::Vector2d pixelCoordinate = Eigen::Vector2d(projectedVoxelCenter[0], projectedVoxelCenter[1]) / z;
-								ss << NAME_AND_VALUE(pixelCoordinate);
-
-								//pixelCoordinate += Eigen::Vector2d(depth_width, depth_height);
-								pixelCoordinate /= 2.0f;
-
-								ss << NAME_AND_VALUE(pixelCoordinate);
-
-								if (pixelCoordinate[0] < 0 || pixelCoordinate[1] < 0 ||
-									pixelCoordinate[0] >= depth_width || pixelCoordinate[1] >= depth_height) {
-									tsdf = new GLfloat[4]{ (GLfloat)hash, INVALID_TSDF_VALUE,-2,-2 };
-									ss << vc::utils::asHeader("Invalid because pixel not in image");
-								}
-								else {
-									try {
-										float real_depth = depth_frame->get_distance(pixelCoordinate[0], pixelCoordinate[1]);
-										ss << NAME_AND_VALUE(z);
-										ss << NAME_AND_VALUE(real_depth);
-
-										if (real_depth <= 0) {
-											tsdf = new GLfloat[4]{ (GLfloat)hash, INVALID_TSDF_VALUE, -1, -1 };
-											ss << vc::utils::asHeader("Invalid because no value in depth image");
-										}
-										else {
-											float tsdf_value = real_depth - z;
-											tsdf_value *= -1;
-
-											ss << NAME_AND_VALUE(tsdf_value);
-
-											float clamped_tsdf_value = std::clamp(tsdf_value, -1.0f, 1.0f);
-
-											ss << NAME_AND_VALUE(clamped_tsdf_value);
-
-											tsdf = new GLfloat[4]{ (GLfloat)hash, clamped_tsdf_value, 0, 0 };
-
-											//float old_tsdf = tsdf[hash];
-											//int old_weight = weights[hash];
-											//weights[hash] += 1;
-											//tsdf[hash] = (old_tsdf * old_weight + clamped_tsdf_value) / weights[hash];
-											//isSet[hash] = 7;
-										}
-									}
-									catch (rs2::error&) {
-										std::cout << "error in retrieving depth" << std::endl;
-									}
-								}
-
-							}
-
-							verts[hash] = Vertex();
-							//verts[hash].pos = new GLfloat[4]{ voxelPosition[0], voxelPosition[1], voxelPosition[2], 1.0f };
-							//verts[hash].tsdf = tsdf;
-						};
-						//if (voxelPosition[0] == 0 && voxelPosition[1] == 0) {
-						//	std::cout << ss.str();
-						//	std::cout << std::endl;
-						//}
-					}));
-					if (yy++ >= vc::utils::NUM_THREADS) {
-						for (auto& thread : threads)
-						{
-							thread.join();
-						}
-						threads = std::vector<std::thread>();
-						yy = 0;
-					}
-				}
-				std::cout << "Calculated TSDF layer " << z << std::endl;
+			if (backend == IntegrationBackend::CPU && integrationBackend == IntegrationBackend::GPU) {
+				// The GPU integrated into the shader storage buffer only
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, vertexBuffer);
+				glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(Voxel) * num_gridPoints, verts.data());
+			}
+			if (backend == IntegrationBackend::GPU && integrationBackend == IntegrationBackend::CPU) {
+				// Integrations off the render thread leave the upload to it, which may not have happened yet
+				uploadVoxelgridBuffer();
 			}
+			integrationBackend = backend;
+		}
 
-			for (auto& thread : threads)
-			{
-				thread.join();
+		VolumeSnapshotHeader getSnapshotHeader() {
+			VolumeSnapshotHeader header;
+			for (int i = 0; i < 3; i++) {
+				header.origin[i] = origin[i];
+				header.size[i] = size[i];
 			}
+			header.resolution = resolution;
+			header.truncationDistance = truncationDistance;
+			return header;
+		}
 
-			//vc::utils::sleepFor("", 1000);
+		void setSnapshotGrid(const VolumeSnapshotHeader& header) {
+			resolution = header.resolution;
+			origin = Eigen::Vector3d(header.origin[0], header.origin[1], header.origin[2]);
+			size = Eigen::Vector3d(header.size[0], header.size[1], header.size[2]);
+			sizeHalf = size / 2.0f;
+			truncationDistance = header.truncationDistance;
+		}
+
+		GridDescription getGridDescription() {
+			GridDescription grid;
+			grid.sizeNormalized = sizeNormalized;
+			grid.minCorner = (origin - sizeHalf).cast<float>();
+			grid.resolution = resolution;
+			grid.truncationDistance = truncationDistance;
+			return grid;
+		}
+
+		void uploadVoxelgridBuffer() {
+			if (!hasOpenGL) {
+				return;
+			}
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, vertexBuffer);
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(Voxel) * num_gridPoints, verts.data());
 		}
 
 		bool getGridCell(int x, int y, int z, vc::fusion::GridCell* cell) {
-			cell->verts[0] = verts[hashFunc(x, y, z + 1)];
-			cell->verts[1] = verts[hashFunc(x + 1, y, z + 1)];
-			cell->verts[2] = verts[hashFunc(x + 1, y, z)];
-			cell->verts[3] = verts[hashFunc(x, y, z)];
-								   
-			cell->verts[4] = verts[hashFunc(x, y + 1, z + 1)];
-			cell->verts[5] = verts[hashFunc(x + 1, y + 1, z + 1)];
-			cell->verts[6] = verts[hashFunc(x + 1, y + 1, z)];
-			cell->verts[7] = verts[hashFunc(x, y + 1, z)];
+			const int corners[8][3] = {
+				{ x, y, z + 1 }, { x + 1, y, z + 1 }, { x + 1, y, z }, { x, y, z },
+				{ x, y + 1, z + 1 }, { x + 1, y + 1, z + 1 }, { x + 1, y + 1, z }, { x, y + 1, z }
+			};
+
+			for (int i = 0; i < 8; i++) {
+				cell->verts[i] = verts[hashFunc(corners[i][0], corners[i][1], corners[i][2])];
+				Eigen::Vector3d position = getVoxelPosition(corners[i][0], corners[i][1], corners[i][2]);
+				cell->pos[i] = glm::vec4(position[0], position[1], position[2], 1.0f);
+			}
 
 			return true;
 		}
 
-		void copyTrianglesToCPU() {
-			glBindBuffer(GL_SHADER_STORAGE_BUFFER, triangleBuffer);
-			glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(Triangle) * numTriangles, triangles.data());
+		virtual void copyMeshToCPU() {
+			if (integrationBackend == IntegrationBackend::CPU) {
+				mesh = cpuMesh;
+				return;
+			}
+
+			// Whatever did not fit into the buffers is lost until the next run
+			const MeshCounters counters = readMeshCounters();
+			numVertices = std::min(counters.numVertices, allocatedVertexCapacity);
+			numTriangles = counters.numVertices <= allocatedVertexCapacity ? std::min(counters.numTriangles, allocatedTriangleCapacity) : 0;
+
+			auto snapshot = std::make_shared<Mesh>();
+			snapshot->vertices.resize(numVertices);
+			snapshot->indices.resize((size_t)numTriangles * 3);
 
-			numberOfTrianglesForExport = numTriangles;
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, meshVertexBuffer);
+			glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(MeshVertex) * snapshot->vertices.size(), snapshot->vertices.data());
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, meshIndexBuffer);
+			glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint) * snapshot->indices.size(), snapshot->indices.data());
+			mesh = snapshot;
 		}
 
-		void exportToPly() {
-			std::stringstream filename;
-			filename << "plys/";
+		/// <summary>
+		/// Queues the last copied mesh for writing to plys/, false if too many exports are still running.
+		/// </summary>
+		bool exportToPly() {
 			char mbstr[100];
 			std::time_t t = std::time(NULL);
 			std::strftime(mbstr, 100, "%F-%H-%M-%S", std::localtime(&t));
-			filename << mbstr;
-			filename << ".ply";
 
-			std::ofstream ply_file;
-			ply_file.open(filename.str());
-
-			ply_file << "ply\n";
-			ply_file << "format ascii 1.0\n";
-
-			ply_file << "comment Test comment\n";
+			// Several snapshots within a second are numbered
+			std::string name = mbstr;
+			if (name == lastExportTimestamp) {
+				name += "-" + std::to_string(++exportsInSameSecond);
+			}
+			else {
+				lastExportTimestamp = name;
+				exportsInSameSecond = 0;
+			}
 
-			ply_file << "element vertex " << numberOfTrianglesForExport * 3 << "\n";
-			ply_file << "property float x\n";
-			ply_file << "property float y\n";
-			ply_file << "property float z\n";
+			return meshExporter.enqueue(mesh, "plys/" + name + ".ply");
+		}
 
-			ply_file << "property uchar red\n";
-			ply_file << "property uchar green\n";
-			ply_file << "property uchar blue\n";
+		int getPendingExports() const {
+			return meshExporter.getPending();
+		}
 
+		/// <summary>
+		/// Writes the voxels with the grid description to a snapshot that loadSnapshot restores.
+		/// </summary>
+		virtual bool saveSnapshot(const std::string& filename) {
+			if (hasOpenGL && integrationBackend == IntegrationBackend::GPU) {
+				// The GPU integrated into the shader storage buffer only
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, vertexBuffer);
+				glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(Voxel) * num_gridPoints, verts.data());
+			}
 
-			ply_file << "element face " << numberOfTrianglesForExport << "\n";
-			ply_file << "property list uchar int vertex_indices\n";
-			ply_file << "end_header\n";
+			VolumeSnapshotHeader header = getSnapshotHeader();
+			header.layout = VolumeLayout::DENSE;
+			for (int i = 0; i < 3; i++) {
+				header.sizeNormalized[i] = sizeNormalized[i];
+			}
+			return writeVolumeSnapshot(filename, header, nullptr, verts.data(), verts.size());
+		}
 
-			for (int i = 0; i < numberOfTrianglesForExport; i++) {
-				auto triangle = triangles[i];
-				if (vc::utils::isValid(triangle.pos0) && vc::utils::isValid(triangle.pos1) && vc::utils::isValid(triangle.pos2)) {
-					for (int i = 0; i < 3; i++)
-					{
-						ply_file << triangle.pos0[i] << " ";
-					}
-					for (int i = 0; i < 3; i++)
-					{
-						ply_file << int(triangle.color0[i] * 255) << " ";
-					}
-					ply_file << "\n";
-					for (int i = 0; i < 3; i++)
-					{
-						ply_file << triangle.pos1[i] << " ";
-					}
-					for (int i = 0; i < 3; i++)
-					{
-						ply_file << int(triangle.color1[i] * 255) << " ";
-					}
-					ply_file << "\n";
-					for (int i = 0; i < 3; i++)
-					{
-						ply_file << triangle.pos2[i] << " ";
-					}
-					for (int i = 0; i < 3; i++)
-					{
-						ply_file << int(triangle.color2[i] * 255) << " ";
-					}
-					ply_file << "\n";
-				}
-				else {
-					std::cout << "error with triangle " << i << std::endl;
-				}
+		/// <summary>
+		/// Replaces grid and voxels with a snapshot, the voxels are copied in one piece from the mapped file.
+		/// </summary>
+		virtual bool loadSnapshot(const std::string& filename) {
+			VolumeSnapshot snapshot;
+			if (!snapshot.open(filename)) {
+				return false;
 			}
 
-			for (int i = 0; i < numberOfTrianglesForExport; i++) {
-				ply_file << 3 << " " << i * 3 + 0 << " " << i * 3 + 1 << " " << i * 3 + 2 << "\n";
+			const VolumeSnapshotHeader& header = snapshot.getHeader();
+			if (header.layout != VolumeLayout::DENSE) {
+				std::cerr << filename << " holds bricks, load it into a SparseVoxelgrid" << std::endl;
+				return false;
 			}
 
-			ply_file.close();
+			setSnapshotGrid(header);
+			sizeNormalized = Eigen::Vector3i(header.sizeNormalized[0], header.sizeNormalized[1], header.sizeNormalized[2]);
+			num_gridPoints = sizeNormalized.prod();
+			resetVoxelgridBuffer();
 
-			std::cout << "Written ply" << std::endl;
+			std::memcpy(verts.data(), snapshot.getVoxels(), sizeof(Voxel) * num_gridPoints);
+			uploadVoxelgridBuffer();
+			return true;
 		}
 	};
 
@@ -638,16 +941,16 @@ namespace vc::fusion {
 	public:
 		SingleCellMockVoxelGrid() : Voxelgrid(1.0, Eigen::Vector3d(1.0, 1.0, 1.0), Eigen::Vector3d::Zero(), true)
 		{
-			float value = 0.5f * truncationDistance;
+			float value = 0.5f;
 
 			for (int i = 0; i < 8; i++)
 			{
-				verts[i].tsdf.y = value;
-				verts[i].color = glm::vec4(i % 3 == 0, (i + 1) % 3 == 0, (i + 2) % 3 == 0, 1);
-				verts[i].tsdf.z = 1;
+				verts[i].setTsdf(value);
+				verts[i].setColor(glm::vec4(i % 3 == 0, (i + 1) % 3 == 0, (i + 2) % 3 == 0, 1));
+				verts[i].weight = 1;
 			}
 
-			verts[0].tsdf.y = -value;
+			verts[0].setTsdf(-value);
 			setVoxelgridComputeShader();
 		}
 		
@@ -658,32 +961,35 @@ namespace vc::fusion {
 			return;
 		}
 
+		void integrateFrameCPU(const std::shared_ptr<vc::capture::CaptureDevice> pipeline, Eigen::Matrix4d relativeTransformation, bool clearAsFirstFrame = false) {
+		}
+
 	};
 
 	class FourCellMockVoxelGrid : public Voxelgrid {
 	public:
 		FourCellMockVoxelGrid() : Voxelgrid(1.0, Eigen::Vector3d(2.0, 2.0, 2.0), Eigen::Vector3d::Identity(), true)
 		{
-			float value = 0.5f * truncationDistance;
+			float value = 0.5f;
 
 			for (int i = 0; i < 27; i++)
 			{
-				verts[i].tsdf.z = 1;
-				verts[i].tsdf.y = value;
-				verts[i].color = glm::vec4(i % 3 == 0, (i + 1) % 3 == 0, (i + 2) % 3 == 0, 1);
+				verts[i].weight = 1;
+				verts[i].setTsdf(value);
+				verts[i].setColor(glm::vec4(i % 3 == 0, (i + 1) % 3 == 0, (i + 2) % 3 == 0, 1));
 			}
 
-			//verts[0].tsdf.y = -value;
+			//verts[0].setTsdf(-value);
 
-			verts[4].tsdf.y = -value;
+			verts[4].setTsdf(-value);
 
-			verts[1 + 9].tsdf.y = -value;
-			verts[3 + 9].tsdf.y = -value;
-			verts[5 + 9].tsdf.y = -value;
-			verts[7 + 9].tsdf.y = -value;
+			verts[1 + 9].setTsdf(-value);
+			verts[3 + 9].setTsdf(-value);
+			verts[5 + 9].setTsdf(-value);
+			verts[7 + 9].setTsdf(-value);
 
-			verts[4 + 9 + 9].tsdf.y = -value;
-			//verts[8 + 9 + 9].tsdf.y = -value;
+			verts[4 + 9 + 9].setTsdf(-value);
+			//verts[8 + 9 + 9].setTsdf(-value);
 			setVoxelgridComputeShader();
 		}
 		
@@ -692,6 +998,9 @@ namespace vc::fusion {
 		catch (rs2::error & e) {
 			return;
 		}
+
+		void integrateFrameCPU(const std::shared_ptr<vc::capture::CaptureDevice> pipeline, Eigen::Matrix4d relativeTransformation, bool clearAsFirstFrame = false) {
+		}
 	};
 
 }
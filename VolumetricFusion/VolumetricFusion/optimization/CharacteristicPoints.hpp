@@ -118,11 +118,11 @@ namespace vc::optimization {
 
     class CharacteristicPoints : public ACharacteristicPoints {
     private:
-        rs2::depth_frame* depth_frame;
+        rs2::depth_frame depth_frame = rs2::frame();
         int depth_width;
         int depth_height;
 
-        rs2::frame* color_frame;
+        rs2::frame color_frame;
         int color_width;
         int color_height;
 
@@ -143,8 +143,10 @@ namespace vc::optimization {
                 return;
             }
 
-            std::vector<int> ids = pipeline->chArUco->ids;
-            std::vector<std::vector<cv::Point2f>> markerCorners = pipeline->chArUco->markerCorners;
+            // Detected in the frames of setPipelineStuff(), they stay unchanged until its next call
+            const vc::data::Frames& frames = pipeline->data->getFrames(vc::data::FrameConsumer::CALIBRATION);
+            const std::vector<int>& ids = frames.markerIds;
+            const std::vector<std::vector<cv::Point2f>>& markerCorners = frames.markerCorners;
                         
             for (int j = 0; j < ids.size(); j++)
             {
@@ -192,10 +194,10 @@ namespace vc::optimization {
             float dx = x - x_lower;
             float dy = y - y_lower;
 
-            float distance = depth_frame->get_distance(x_lower, y_lower) * dx * dy;
-             distance += depth_frame->get_distance(x_lower, y_upper) * dx * (1 - dy);
-             distance += depth_frame->get_distance(x_upper, y_lower) * (1 - dx ) * dy;
-             distance += depth_frame->get_distance(x_upper, y_upper) * (1 - dx) * (1 - dy);
+            float distance = depth_frame.get_distance(x_lower, y_lower) * dx * dy;
+             distance += depth_frame.get_distance(x_lower, y_upper) * dx * (1 - dy);
+             distance += depth_frame.get_distance(x_upper, y_lower) * (1 - dx ) * dy;
+             distance += depth_frame.get_distance(x_upper, y_upper) * (1 - dx) * (1 - dy);
 
             return distance;
         }
@@ -211,7 +213,7 @@ namespace vc::optimization {
                 float depth = bilinearInterpolate(x, y);
 
                 point = cam2World * point;
-                point *= depth_frame->get_distance(x, y);
+                point *= depth_frame.get_distance(x, y);
 
 
                 Eigen::Vector4d v(point[0], point[1], point[2], 1.0f);
@@ -224,15 +226,19 @@ namespace vc::optimization {
 
         bool setPipelineStuff(std::shared_ptr<vc::capture::CaptureDevice> pipe) {
             try {
-                depth_frame = (rs2::depth_frame*) & pipe->data->filteredDepthFrames;
-                depth_width = depth_frame->as<rs2::video_frame>().get_width();
-                depth_height = depth_frame->as<rs2::video_frame>().get_height();
-
-                color_frame = &pipe->data->filteredColorFrames;
-                color_width = color_frame->as<rs2::video_frame>().get_width();
-                color_height = color_frame->as<rs2::video_frame>().get_height();
-
-                cam2World = pipe->depth_camera->cam2world;
+                // Depth and color of the same frameset, kept alive until the next pipeline is set
+                pipe->data->updateFrames(vc::data::FrameConsumer::CALIBRATION);
+                const vc::data::Frames& frames = pipe->data->getFrames(vc::data::FrameConsumer::CALIBRATION);
+                depth_frame = frames.depth;
+                depth_width = depth_frame.as<rs2::video_frame>().get_width();
+                depth_height = depth_frame.as<rs2::video_frame>().get_height();
+
+                color_frame = frames.color;
+                color_width = color_frame.as<rs2::video_frame>().get_width();
+                color_height = color_frame.as<rs2::video_frame>().get_height();
+
+                // Of the frame, the filters may have aligned or downsampled the depth
+                cam2World = vc::camera::PinholeCamera(depth_frame.get_profile().as<rs2::video_stream_profile>().get_intrinsics()).cam2world;
 
                 color2DepthWidth = 1.0f * depth_width / color_width;
                 color2DepthHeight = 1.0f * depth_height / color_height;
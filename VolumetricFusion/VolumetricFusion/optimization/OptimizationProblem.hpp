@@ -168,7 +168,8 @@ namespace vc::optimization {
         bool checkForAllMarkers(std::vector<std::shared_ptr<vc::capture::CaptureDevice>> pipelines) {
             for (auto& pipeline : pipelines)
             {
-                if (!pipeline->chArUco->hasMarkersDetected) {
+                // Of the frames the calibration took last
+                if (pipeline->data->getFrames(vc::data::FrameConsumer::CALIBRATION).markerIds.empty()) {
                     return false;
                 }
             }
@@ -1,6 +1,6 @@
 #version 330 core
-layout (location = 0) in vec4 aPos;
-layout (location = 1) in vec4 tsdf;
+// Mirrors vc::fusion::Voxel: int16 tsdf | uint16 weight, RGB8 color
+layout (location = 0) in uvec2 voxel;
 
 uniform mat4 model;
 uniform mat4 view;
@@ -8,33 +8,62 @@ uniform mat4 projection;
 uniform mat4 coordinate_correction;
 
 uniform float truncationDistance;
+uniform float resolution;
+uniform vec3 sizeHalf;
+uniform ivec3 sizeNormalized;
+uniform vec3 origin;
+
+// The sparse grid draws its brick pool, voxel i lies in brick i / 512
+uniform bool sparse;
+uniform isamplerBuffer brickCoordinates;
+const int BRICK_SIZE = 8;
 
 out VS_OUT {
     vec4 color;
 } vs_out;
 
+vec4 unhash(int hash){
+    int x = hash % sizeNormalized.x;
+    int y = (hash / sizeNormalized.x) % sizeNormalized.y;
+    int z = hash / (sizeNormalized.x * sizeNormalized.y);
+
+    return vec4(vec3(x, y, z) * resolution - sizeHalf + origin, 1);
+}
+
+vec4 unhashSparse(int index){
+    int brickVolume = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+    int local = index % brickVolume;
+    ivec3 voxel = texelFetch(brickCoordinates, index / brickVolume).xyz * BRICK_SIZE
+        + ivec3(local % BRICK_SIZE, (local / BRICK_SIZE) % BRICK_SIZE, local / (BRICK_SIZE * BRICK_SIZE));
+
+    return vec4(vec3(voxel) * resolution, 1);
+}
+
 void main()
 {    
+    uint weight = voxel.x >> 16;
+    // Sign extend the lower half
+    float t = float(int(voxel.x << 16) >> 16) / 32767.0;
+
 // Blue: invalid point
-    if(tsdf.z <= 0){
+    if(weight == 0u){
         vs_out.color = vec4(0.0, 0.0, 0.0, -1.0);
         gl_Position = vec4(-10.0, 0.0, 0.0, 0.0);
 //        vs_out.color = vec4(0.0, 0.0, 1, .5);
         return;
     }
 
-    gl_Position = projection * view * model * aPos;
+    vec4 position = sparse ? unhashSparse(gl_VertexID) : unhash(gl_VertexID);
+    gl_Position = projection * view * model * position;
     gl_Position *= coordinate_correction;
     
-    float t = tsdf.y;
-    
     if(t < 0) {
         // Red: Behind poindcloud
-        vs_out.color = vec4(0.0f, (truncationDistance + t) / truncationDistance, 0.0f, 1.0f + t);
+        vs_out.color = vec4(0.0f, 1.0f + t, 0.0f, 1.0f + t * truncationDistance);
     } 
     else
     {
         // Green: Infront of pointcloud
-        vs_out.color = vec4((truncationDistance - t) / truncationDistance, 0.0f, 0.0f, 1.0f - t);
+        vs_out.color = vec4(1.0f - t, 0.0f, 0.0f, 1.0f - t * truncationDistance);
     }
 }